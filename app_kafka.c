@@ -1,6 +1,6 @@
 /*! \file
  *
- * \brief Kafka produce dialplan application
+ * \brief Kafka produce dialplan application and queue depth function
  *
  * \author Max Nesterov <braams@braams.ru>
  *
@@ -10,22 +10,422 @@
 #define AST_MODULE "app_kafka"
 
 #include <asterisk.h>
+#include <ctype.h>
 #include <stdio.h>
 
 #include <asterisk/module.h>
 #include <asterisk/app.h>
+#include <asterisk/astobj2.h>
+#include <asterisk/channel.h>
+#include <asterisk/config.h>
+#include <asterisk/pbx.h>
+#include <asterisk/strings.h>
+#include <asterisk/threadstorage.h>
 #include "res_kafka.h"
 
+#define CONF_FILE "app_kafka.conf"
+#define TEMPLATE_BUCKETS 31
+#define TEMPLATE_BUFFER_INIT_SIZE 512
+#define HEADERS_CATEGORY_PREFIX "headers:"
+
 static const char app[] = "KafkaProduce";
 static const char synopsis[] = "Produce message to Kafka";
 static const char descrip[] =
         "KafkaProduce():  Produce message to Kafka\n"
         "Syntax:\n"
-        "  KafkaProduce(<topic>,<message>)\n";
+        "  KafkaProduce(<topic>,<message>)\n"
+        "  KafkaProduce(<topic>,@<template>[,<header>=<value>[&<header>=<value>...]])\n"
+        "The second form produces a template of the [templates] section of " CONF_FILE ",\n"
+        "its ${...} are read from the channel and escaped as JSON. The message gets the\n"
+        "headers of the [headers:<template>] section and the ones given here.\n";
+
+enum segment_type {
+    /*! Template text as is */
+    SEGMENT_LITERAL,
+    /*! ${NAME}, a channel or builtin variable */
+    SEGMENT_VARIABLE,
+    /*! ${FUNC(args)}, a dialplan function */
+    SEGMENT_FUNCTION,
+    /*! Anything else, e.g. ${EXTEN:1} or nested ${...}, left to the dialplan substitution */
+    SEGMENT_EXPRESSION,
+};
+
+struct template_segment {
+    enum segment_type type;
+    /*! The slot is inside a JSON string literal, its value is escaped without quotes */
+    int quoted;
+    /*! Literal text, not NUL terminated, or the variable, function or ${...} expression */
+    const char *text;
+    size_t len;
+};
+
+/*! \brief A template compiled into literal segments and slots */
+struct kafka_template {
+    struct template_segment *segments;
+    size_t count;
+    /*! Copy of the template, the literal segments point into it */
+    char *source;
+    /*! Header value, the slots are written as is instead of as JSON */
+    int raw;
+    /*! Headers of the message, templates named after the header */
+    struct kafka_template *headers[AST_KAFKA_MAX_HEADERS];
+    size_t header_count;
+    char name[0];
+};
+
+static struct ao2_container *templates;
+
+AO2_STRING_FIELD_HASH_FN(kafka_template, name)
+AO2_STRING_FIELD_CMP_FN(kafka_template, name)
+
+AST_THREADSTORAGE(template_buf);
+AST_THREADSTORAGE(header_buf_storage);
+
+static void template_destructor(void *obj) {
+    struct kafka_template *tmpl = obj;
+    size_t i;
+
+    for (i = 0; i < tmpl->count; i++) {
+        if (tmpl->segments[i].type != SEGMENT_LITERAL) {
+            ast_free((char *) tmpl->segments[i].text);
+        }
+    }
+    ast_free(tmpl->segments);
+    ast_free(tmpl->source);
+    for (i = 0; i < tmpl->header_count; i++) {
+        ao2_ref(tmpl->headers[i], -1);
+    }
+}
+
+static struct template_segment *template_add(struct kafka_template *tmpl, size_t *size) {
+    struct template_segment *segments;
+
+    if (tmpl->count == *size) {
+        segments = ast_realloc(tmpl->segments, (*size * 2) * sizeof(*segments));
+        if (!segments) {
+            return NULL;
+        }
+        tmpl->segments = segments;
+        *size *= 2;
+    }
+    return memset(&tmpl->segments[tmpl->count++], 0, sizeof(*tmpl->segments));
+}
+
+static int template_add_literal(struct kafka_template *tmpl, size_t *size, const char *text, size_t len) {
+    struct template_segment *segment;
+
+    if (!len) {
+        return 0;
+    }
+    if (!(segment = template_add(tmpl, size))) {
+        return -1;
+    }
+    segment->type = SEGMENT_LITERAL;
+    segment->text = text;
+    segment->len = len;
+    return 0;
+}
+
+/*! \brief Add the slot of ${<expr>}, \a expr is \a len characters long */
+static int template_add_slot(struct kafka_template *tmpl, size_t *size, const char *expr, size_t len, int quoted) {
+    struct template_segment *segment;
+    const char *paren = memchr(expr, '(', len);
+
+    if (!(segment = template_add(tmpl, size))) {
+        return -1;
+    }
+    segment->quoted = quoted;
+    if (memchr(expr, '$', len) || memchr(expr, ':', len) || (paren && expr[len - 1] != ')')) {
+        /* The whole ${...} goes to pbx_substitute_variables_helper() */
+        segment->type = SEGMENT_EXPRESSION;
+        segment->text = ast_strndup(expr - 2, len + 3);
+    } else {
+        segment->type = paren ? SEGMENT_FUNCTION : SEGMENT_VARIABLE;
+        segment->text = ast_strndup(expr, len);
+    }
+    if (!segment->text) {
+        tmpl->count--;
+        return -1;
+    }
+    segment->len = strlen(segment->text);
+    return 0;
+}
+
+/*!
+ * \brief Compile a template into literal segments and ${...} slots
+ *
+ * The template is scanned once for JSON string literals, so a slot knows
+ * whether its value is escaped inside quotes or written as a bare value.
+ * A raw template, the value of a header, has no JSON at all.
+ */
+static struct kafka_template *template_compile(const char *name, const char *source, int raw) {
+    struct kafka_template *tmpl;
+    size_t size = 8;
+    const char *p, *literal, *end;
+    int in_string = 0;
+    int depth;
+
+    tmpl = ao2_alloc_options(sizeof(*tmpl) + strlen(name) + 1, template_destructor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+    if (!tmpl) {
+        return NULL;
+    }
+    strcpy(tmpl->name, name); /* Safe */
+    tmpl->raw = raw;
+    if (!(tmpl->source = ast_strdup(source)) || !(tmpl->segments = ast_calloc(size, sizeof(*tmpl->segments)))) {
+        ao2_ref(tmpl, -1);
+        return NULL;
+    }
+
+    p = literal = tmpl->source;
+    while (*p) {
+        if (p[0] == '$' && p[1] == '{') {
+            /* Find the closing brace of the slot, nested ${...} included */
+            for (end = p + 2, depth = 1; *end && depth; end++) {
+                if (end[0] == '$' && end[1] == '{') {
+                    depth++;
+                    end++;
+                } else if (*end == '}') {
+                    depth--;
+                }
+            }
+            if (depth || end - p == 3) {
+                ast_log(LOG_ERROR, "Template %s: invalid ${...} at offset %d\n", name, (int) (p - tmpl->source));
+                ao2_ref(tmpl, -1);
+                return NULL;
+            }
+            if (template_add_literal(tmpl, &size, literal, p - literal)
+                || template_add_slot(tmpl, &size, p + 2, end - p - 3, in_string)) {
+                ao2_ref(tmpl, -1);
+                return NULL;
+            }
+            p = literal = end;
+        } else if (in_string && *p == '\\' && p[1]) {
+            p += 2;
+        } else {
+            if (*p == '"' && !raw) {
+                in_string = !in_string;
+            }
+            p++;
+        }
+    }
+    if (in_string) {
+        ast_log(LOG_WARNING, "Template %s: unterminated JSON string\n", name);
+    }
+    if (template_add_literal(tmpl, &size, literal, p - literal)) {
+        ao2_ref(tmpl, -1);
+        return NULL;
+    }
+    return tmpl;
+}
+
+/*! \brief A bare value is written as is when it is a JSON number, true, false or null */
+static int is_json_scalar(const char *value) {
+    const char *p = value;
+
+    if (!strcmp(value, "true") || !strcmp(value, "false") || !strcmp(value, "null")) {
+        return 1;
+    }
+    if (*p == '-') {
+        p++;
+    }
+    if (*p == '0') {
+        p++;
+    } else if (isdigit((unsigned char) *p)) {
+        while (isdigit((unsigned char) *p)) {
+            p++;
+        }
+    } else {
+        return 0;
+    }
+    if (*p == '.') {
+        if (!isdigit((unsigned char) *++p)) {
+            return 0;
+        }
+        while (isdigit((unsigned char) *p)) {
+            p++;
+        }
+    }
+    if (*p == 'e' || *p == 'E') {
+        p++;
+        if (*p == '+' || *p == '-') {
+            p++;
+        }
+        if (!isdigit((unsigned char) *p)) {
+            return 0;
+        }
+        while (isdigit((unsigned char) *p)) {
+            p++;
+        }
+    }
+    return !*p;
+}
+
+static void append_value(struct ast_str **buf, const struct kafka_template *tmpl,
+                         const struct template_segment *segment, const char *value) {
+    if (tmpl->raw) {
+        ast_str_append(buf, 0, "%s", S_OR(value, ""));
+    } else if (segment->quoted) {
+        if (ast_kafka_json_append_escaped(buf, S_OR(value, ""))) {
+            ast_debug(1, "Value of ${%s} is not valid UTF-8, left out\n", segment->text);
+        }
+    } else if (ast_strlen_zero(value)) {
+        ast_str_append_substr(buf, 0, "null", 4);
+    } else if (is_json_scalar(value)) {
+        ast_str_append(buf, 0, "%s", value);
+    } else if (ast_kafka_json_append_string(buf, value)) {
+        ast_str_append_substr(buf, 0, "null", 4);
+    }
+}
+
+/*!
+ * \brief Render a template for a channel in one pass, appended to \a buf
+ *
+ * Consecutive variables are read under a single channel lock, functions
+ * and expressions run unlocked as they may lock other channels.
+ */
+static void template_render(const struct kafka_template *tmpl, struct ast_channel *chan, struct ast_str **buf) {
+    const struct template_segment *segment;
+    char workspace[VAR_BUF_SIZE];
+    char *value;
+    int locked = 0;
+    size_t i;
+
+    for (i = 0; i < tmpl->count; i++) {
+        segment = &tmpl->segments[i];
+        if (segment->type == SEGMENT_LITERAL) {
+            ast_str_append_substr(buf, 0, segment->text, segment->len);
+            continue;
+        }
+        if (segment->type == SEGMENT_VARIABLE && !locked) {
+            ast_channel_lock(chan);
+            locked = 1;
+        } else if (segment->type != SEGMENT_VARIABLE && locked) {
+            ast_channel_unlock(chan);
+            locked = 0;
+        }
+        value = workspace;
+        workspace[0] = '\0';
+        switch (segment->type) {
+            case SEGMENT_VARIABLE:
+                value = NULL;
+                pbx_retrieve_variable(chan, segment->text, &value, workspace, sizeof(workspace), NULL);
+                break;
+            case SEGMENT_FUNCTION:
+                if (ast_func_read(chan, segment->text, workspace, sizeof(workspace))) {
+                    workspace[0] = '\0';
+                }
+                break;
+            case SEGMENT_EXPRESSION:
+                pbx_substitute_variables_helper(chan, segment->text, workspace, sizeof(workspace) - 1);
+                break;
+            case SEGMENT_LITERAL:
+                break;
+        }
+        append_value(buf, tmpl, segment, value);
+    }
+    if (locked) {
+        ast_channel_unlock(chan);
+    }
+}
+
+/*!
+ * \brief Add the <header>=<value>[&<header>=<value>...] of the application to the template headers
+ * \return number of headers
+ */
+static size_t parse_headers(char *list, struct ast_kafka_header *headers, size_t count) {
+    char *item, *value;
+
+    while ((item = ast_strsep(&list, '&', AST_STRSEP_STRIP))) {
+        if (ast_strlen_zero(item)) {
+            continue;
+        }
+        if (count == AST_KAFKA_MAX_HEADERS) {
+            ast_log(LOG_WARNING, "More than %d headers, '%s' and the following are left out\n",
+                    AST_KAFKA_MAX_HEADERS, item);
+            break;
+        }
+        value = strchr(item, '=');
+        if (value) {
+            *value++ = '\0';
+        }
+        headers[count].name = ast_strip(item);
+        headers[count].value = value;
+        headers[count].len = value ? strlen(value) : 0;
+        count++;
+    }
+    return count;
+}
+
+/*! \brief Rate limit and sampling of the topic, dialplan messages are the first to go during a flood */
+static int dialplan_admit(struct ast_channel *chan, struct ast_kafka_topic *topic) {
+    int res;
+
+    ast_channel_lock(chan);
+    res = ast_kafka_topic_admit(topic, ast_channel_linkedid(chan), AST_KAFKA_PRIORITY_LOW);
+    ast_channel_unlock(chan);
+    return res;
+}
+
+static int produce_template(struct ast_channel *chan, const char *topic_name, const char *name, char *header_list) {
+    struct kafka_template *tmpl;
+    struct ast_kafka_topic *topic;
+    struct ast_kafka_header headers[AST_KAFKA_MAX_HEADERS];
+    size_t ends[AST_KAFKA_MAX_HEADERS];
+    struct ast_str *buf, *header_buf = NULL;
+    size_t i, count;
+
+    tmpl = ao2_find(templates, name, OBJ_SEARCH_KEY);
+    if (!tmpl) {
+        ast_log(LOG_ERROR, "Unknown template '%s'\n", name);
+        return -1;
+    }
+    /* A dropped message is not rendered at all */
+    topic = ast_kafka_topic_get(topic_name);
+    if (!topic || dialplan_admit(chan, topic)) {
+        ao2_cleanup(topic);
+        ao2_ref(tmpl, -1);
+        return 0;
+    }
+    if (!(buf = ast_str_thread_get(&template_buf, TEMPLATE_BUFFER_INIT_SIZE))
+        || (tmpl->header_count && !(header_buf = ast_str_thread_get(&header_buf_storage,
+                                                                        TEMPLATE_BUFFER_INIT_SIZE)))) {
+        ao2_ref(topic, -1);
+        ao2_ref(tmpl, -1);
+        return -1;
+    }
+    ast_str_reset(buf);
+    template_render(tmpl, chan, &buf);
+    /* Header values go one after the other into one buffer, which may move until the last one is done */
+    if (header_buf) {
+        ast_str_reset(header_buf);
+        for (i = 0; i < tmpl->header_count; i++) {
+            template_render(tmpl->headers[i], chan, &header_buf);
+            ends[i] = ast_str_strlen(header_buf);
+        }
+    }
+    for (count = 0, i = 0; i < tmpl->header_count; i++) {
+        headers[count].name = tmpl->headers[i]->name;
+        headers[count].value = ast_str_buffer(header_buf) + (i ? ends[i - 1] : 0);
+        headers[count].len = ends[i] - (i ? ends[i - 1] : 0);
+        /* Headers with an empty value are left out */
+        if (headers[count].len) {
+            count++;
+        }
+    }
+    if (header_list) {
+        count = parse_headers(header_list, headers, count);
+    }
 
+    ast_kafka_topic_produce_headers(topic, NULL, 0, headers, count, ast_str_buffer(buf), ast_str_strlen(buf),
+                                    AST_KAFKA_F_COPY);
+    ao2_ref(topic, -1);
+    ao2_ref(tmpl, -1);
+    return 0;
+}
 
 static int exec(struct ast_channel *chan, const char *data) {
-    char *parse;
+    struct ast_kafka_topic *topic;
+    char *parse, *header_list;
     AST_DECLARE_APP_ARGS(args,
                          AST_APP_ARG(topic);
     AST_APP_ARG(message);
@@ -41,17 +441,173 @@ static int exec(struct ast_channel *chan, const char *data) {
         ast_log(LOG_ERROR, "message is required\n");
         return -1;
     }
-    ast_log(LOG_NOTICE, "KafkaProduce %s %s\n", args.topic, args.message);
-    ast_kafka_produce(args.topic, args.message);
+    if (args.message[0] == '@') {
+        /* Only the template form takes headers, an inline message may contain commas */
+        header_list = strchr(args.message, ',');
+        if (header_list) {
+            *header_list++ = '\0';
+        }
+        return produce_template(chan, args.topic, ast_strip(args.message + 1), header_list);
+    }
+    ast_debug(1, "KafkaProduce %s %s\n", args.topic, args.message);
+    topic = ast_kafka_topic_get(args.topic);
+    if (topic && !dialplan_admit(chan, topic)) {
+        ast_kafka_topic_produce(topic, NULL, 0, args.message, strlen(args.message), AST_KAFKA_F_COPY);
+    }
+    ao2_cleanup(topic);
+    return 0;
+}
+
+/*! \brief Compile the [headers:<template>] sections into the headers of their templates */
+static int load_template_headers(struct ast_config *cfg, struct ao2_container *compiled) {
+    const char *cat = NULL;
+    struct ast_variable *v;
+    struct kafka_template *tmpl, *header;
+    int res = 0;
+
+    while (!res && (cat = ast_category_browse(cfg, cat))) {
+        if (strncasecmp(cat, HEADERS_CATEGORY_PREFIX, strlen(HEADERS_CATEGORY_PREFIX))) {
+            continue;
+        }
+        tmpl = ao2_find(compiled, cat + strlen(HEADERS_CATEGORY_PREFIX), OBJ_SEARCH_KEY | OBJ_NOLOCK);
+        if (!tmpl) {
+            ast_log(LOG_ERROR, "Headers of unknown template '%s'\n", cat + strlen(HEADERS_CATEGORY_PREFIX));
+            return -1;
+        }
+        for (v = ast_variable_browse(cfg, cat); v; v = v->next) {
+            if (tmpl->header_count == AST_KAFKA_MAX_HEADERS) {
+                ast_log(LOG_ERROR, "Template %s: more than %d headers\n", tmpl->name, AST_KAFKA_MAX_HEADERS);
+                res = -1;
+                break;
+            }
+            if (!(header = template_compile(v->name, v->value, 1))) {
+                res = -1;
+                break;
+            }
+            tmpl->headers[tmpl->header_count++] = header;
+        }
+        ao2_ref(tmpl, -1);
+    }
+    return res;
+}
+
+/*!
+ * \brief Compile the templates of the config file
+ *
+ * The new set replaces the old one at once, a template being rendered
+ * keeps its reference until it is done.
+ */
+static int load_templates(int reload) {
+    struct ast_flags config_flags = {reload ? CONFIG_FLAG_FILEUNCHANGED : 0};
+    struct ast_config *cfg;
+    struct ast_variable *v;
+    struct ao2_container *compiled;
+    struct kafka_template *tmpl;
+    int res = 0;
+
+    cfg = ast_config_load(CONF_FILE, config_flags);
+    if (cfg == CONFIG_STATUS_FILEUNCHANGED) {
+        return 0;
+    }
+    if (cfg == CONFIG_STATUS_FILEINVALID) {
+        ast_log(LOG_ERROR, "Config file '%s' is invalid\n", CONF_FILE);
+        return -1;
+    }
+    compiled = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_NOLOCK, 0, TEMPLATE_BUCKETS, kafka_template_hash_fn,
+                                        NULL, kafka_template_cmp_fn);
+    if (!compiled) {
+        ast_config_destroy(cfg);
+        return -1;
+    }
+    /* No config file means no templates */
+    for (v = cfg ? ast_variable_browse(cfg, "templates") : NULL; v && !res; v = v->next) {
+        tmpl = template_compile(v->name, v->value, 0);
+        if (!tmpl) {
+            res = -1;
+            break;
+        }
+        ao2_link(compiled, tmpl);
+        ao2_ref(tmpl, -1);
+    }
+    if (cfg && !res) {
+        res = load_template_headers(cfg, compiled);
+    }
+    if (cfg) {
+        ast_config_destroy(cfg);
+    }
+    if (res) {
+        /* A broken template keeps the previous set */
+        ao2_ref(compiled, -1);
+        return -1;
+    }
+
+    ao2_lock(templates);
+    ao2_callback(templates, OBJ_NODATA | OBJ_MULTIPLE | OBJ_UNLINK | OBJ_NOLOCK, NULL, NULL);
+    ao2_container_dup(templates, compiled, OBJ_NOLOCK);
+    ao2_unlock(templates);
+    ast_debug(1, "Compiled %d template(s)\n", ao2_container_count(compiled));
+    ao2_ref(compiled, -1);
+    return 0;
+}
 
+/*!
+ * \brief KAFKA_QUEUE([depth|max|percent|dropped])
+ *
+ * Messages waiting for delivery, the queue capacity, the fill level in
+ * percent or the number of messages dropped because the queue was full,
+ * so the dialplan can refuse calls before CDRs are lost.
+ */
+static int kafka_queue_read(struct ast_channel *chan, const char *cmd, char *data, char *buf, size_t len) {
+    struct ast_kafka_queue_info info;
+
+    ast_kafka_queue_get_info(&info);
+    if (ast_strlen_zero(data) || !strcasecmp(data, "depth")) {
+        snprintf(buf, len, "%d", info.depth);
+    } else if (!strcasecmp(data, "max")) {
+        snprintf(buf, len, "%d", info.max);
+    } else if (!strcasecmp(data, "percent")) {
+        snprintf(buf, len, "%d", info.max > 0 ? (int) (100LL * info.depth / info.max) : 0);
+    } else if (!strcasecmp(data, "dropped")) {
+        snprintf(buf, len, "%u", info.dropped);
+    } else {
+        ast_log(LOG_ERROR, "Unknown KAFKA_QUEUE() field '%s'\n", data);
+        return -1;
+    }
+    return 0;
 }
 
+static struct ast_custom_function kafka_queue_function = {
+    .name = "KAFKA_QUEUE",
+    .read = kafka_queue_read,
+};
+
 static int load_module(void) {
-    return ast_register_application(app, exec, synopsis, descrip);
+    int res;
+
+    templates = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, TEMPLATE_BUCKETS, kafka_template_hash_fn,
+                                         NULL, kafka_template_cmp_fn);
+    if (!templates || load_templates(0)) {
+        ao2_cleanup(templates);
+        templates = NULL;
+        return AST_MODULE_LOAD_DECLINE;
+    }
+    res = ast_register_application(app, exec, synopsis, descrip);
+    res |= ast_custom_function_register(&kafka_queue_function);
+    return res ? AST_MODULE_LOAD_DECLINE : AST_MODULE_LOAD_SUCCESS;
 }
 
 static int unload_module(void) {
-    return ast_unregister_application(app);
+    int res;
+
+    res = ast_unregister_application(app);
+    res |= ast_custom_function_unregister(&kafka_queue_function);
+    ao2_cleanup(templates);
+    templates = NULL;
+    return res;
+}
+
+static int reload_module(void) {
+    return load_templates(1) ? AST_MODULE_LOAD_DECLINE : AST_MODULE_LOAD_SUCCESS;
 }
 
 
@@ -59,6 +615,7 @@ AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_LOAD_ORDER, "Kafka Support",
     .support_level = AST_MODULE_SUPPORT_EXTENDED,
     .load = load_module,
     .unload = unload_module,
+    .reload = reload_module,
     .load_pri = AST_MODPRI_DEFAULT,
     .requires = "res_kafka",
 );
\ No newline at end of file
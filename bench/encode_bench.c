@@ -0,0 +1,124 @@
+/*! \file
+ *
+ * \brief Record encoder benchmark
+ *
+ * Encodes the same CDR in every format and reports the cost and the
+ * size of one record. Built against the shim, no Asterisk or broker
+ * is needed.
+ *
+ * \author Max Nesterov <braams@braams.ru>
+ *
+ */
+
+/* The field table is static, so the module is compiled in */
+#include "../cdr_kafka.c"
+
+#define DEFAULT_ITERATIONS 1000000
+
+struct ast_kafka_topic *ast_kafka_topic_get(const char *topic_name) {
+    return NULL;
+}
+
+struct ast_kafka_topic *ast_kafka_cluster_topic_get(const char *cluster_name, const char *topic_name) {
+    return NULL;
+}
+
+int ast_kafka_topic_produce(struct ast_kafka_topic *t, const void *key, size_t key_len, void *payload, size_t len, int flags) {
+    if (flags & AST_KAFKA_F_FREE) {
+        ast_free(payload);
+    }
+    return 0;
+}
+
+int ast_kafka_topic_produce_headers(struct ast_kafka_topic *t, const void *key, size_t key_len,
+                                    const struct ast_kafka_header *headers, size_t header_count,
+                                    void *payload, size_t len, int flags) {
+    return ast_kafka_topic_produce(t, key, key_len, payload, len, flags);
+}
+
+void ast_kafka_batch_config_init(struct ast_kafka_batch_config *config) {
+    memset(config, 0, sizeof(*config));
+}
+
+int ast_kafka_batch_config_set(struct ast_kafka_batch_config *config, const char *name, const char *value) {
+    return 1;
+}
+
+struct ast_kafka_batch *ast_kafka_batch_create(struct ast_kafka_topic *topic,
+                                               const struct ast_kafka_batch_config *config,
+                                               const struct ast_kafka_header *headers, size_t header_count) {
+    return NULL;
+}
+
+int ast_kafka_batch_add(struct ast_kafka_batch *batch, const void *key, size_t key_len, const void *record,
+                        size_t len) {
+    return 0;
+}
+
+void ast_kafka_batch_destroy(struct ast_kafka_batch *batch) {
+}
+
+static void fill_cdr(struct ast_cdr *cdr) {
+    memset(cdr, 0, sizeof(*cdr));
+    ast_copy_string(cdr->clid, "\"Alice\" <1001>", sizeof(cdr->clid));
+    ast_copy_string(cdr->src, "1001", sizeof(cdr->src));
+    ast_copy_string(cdr->dst, "74951234567", sizeof(cdr->dst));
+    ast_copy_string(cdr->dcontext, "outbound", sizeof(cdr->dcontext));
+    ast_copy_string(cdr->channel, "PJSIP/1001-0000002a", sizeof(cdr->channel));
+    ast_copy_string(cdr->dstchannel, "PJSIP/trunk-0000002b", sizeof(cdr->dstchannel));
+    ast_copy_string(cdr->lastapp, "Dial", sizeof(cdr->lastapp));
+    ast_copy_string(cdr->lastdata, "PJSIP/74951234567@trunk,60,tT", sizeof(cdr->lastdata));
+    cdr->start.tv_sec = 1700000000;
+    cdr->start.tv_usec = 123456;
+    cdr->answer.tv_sec = 1700000004;
+    cdr->answer.tv_usec = 654321;
+    cdr->end.tv_sec = 1700000065;
+    cdr->duration = 65;
+    cdr->billsec = 61;
+    cdr->disposition = 16;
+    cdr->amaflags = 3;
+    ast_copy_string(cdr->accountcode, "acme", sizeof(cdr->accountcode));
+    ast_copy_string(cdr->uniqueid, "1700000000.42", sizeof(cdr->uniqueid));
+    ast_copy_string(cdr->linkedid, "1700000000.42", sizeof(cdr->linkedid));
+    cdr->sequence = 42;
+}
+
+static double elapsed_ns(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = argc > 1 ? atol(argv[1]) : DEFAULT_ITERATIONS;
+    const char *date_format = argc > 2 ? argv[2] : AST_KAFKA_DEFAULT_DATEFORMAT;
+    struct ast_cdr cdr;
+    struct ast_str *buf;
+    struct timespec start, end;
+    enum ast_kafka_format f;
+    long i;
+
+    if (iterations <= 0) {
+        fprintf(stderr, "usage: %s [iterations] [dateformat]\n", argv[0]);
+        return 1;
+    }
+
+    fill_cdr(&cdr);
+    if (!(timefmt = ast_kafka_timefmt_create(date_format, NULL, 0)) || !(buf = ast_str_create(CDR_BUFFER_INIT_SIZE))) {
+        return 1;
+    }
+
+    printf("%-10s %12s %12s\n", "format", "ns/record", "bytes");
+    for (f = AST_KAFKA_FORMAT_JSON; f <= AST_KAFKA_FORMAT_PROTOBUF; f++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < iterations; i++) {
+            ast_str_reset(buf);
+            ast_kafka_encode_record(&buf, f, cdr_fields, ARRAY_LEN(cdr_fields), &cdr, timefmt);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("%-10s %12.1f %12zu\n", ast_kafka_format_name(f), elapsed_ns(&start, &end) / iterations,
+            ast_str_strlen(buf));
+    }
+
+    ast_free(buf);
+    ast_kafka_timefmt_destroy(timefmt);
+    return 0;
+}
@@ -0,0 +1,335 @@
+/*! \file
+ *
+ * \brief Producer throughput and latency benchmark
+ *
+ * Loads res_kafka and cdr_kafka or cel_kafka against the thin Asterisk shim,
+ * with librdkafka talking to its built-in mock cluster (test.mock.num.brokers),
+ * so neither Asterisk nor a broker is needed. Synthetic records are fed to the
+ * backend at a given rate and the result is printed as a JSON object.
+ *
+ * \author Max Nesterov <braams@braams.ru>
+ *
+ */
+
+#define _GNU_SOURCE
+#include "asterisk.h"
+#include "asterisk/manager.h"
+#include "res_kafka.h"
+#include "records.h"
+#include <getopt.h>
+#include <inttypes.h>
+#include <sys/resource.h>
+
+#define DEFAULT_RECORDS 100000
+#define DEFAULT_BROKERS 3
+#define BENCH_TOPIC "bench"
+#define MAX_THREADS 64
+/*! \brief How long to wait for the delivery reports of the last records */
+#define DEFAULT_DRAIN_SECONDS 30
+
+extern int shim_log_level;
+extern const struct ast_module_info __internal_res_kafka_self_info;
+extern const struct ast_module_info __internal_cdr_kafka_self_info;
+extern const struct ast_module_info __internal_cel_kafka_self_info;
+
+static const char *type = "cdr";
+static long records = DEFAULT_RECORDS;
+/*! \brief Records per second of all threads, 0 for as fast as possible */
+static long rate;
+/*! \brief Length of the padded field, the userfield of a CDR or the extra field of a CEL event */
+static size_t pad_size;
+static int threads = 1;
+
+/* Allocation counter, malloc() and friends are wrapped for the whole process */
+static uint64_t allocations;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+#define HAVE_ALLOC_COUNTER 1
+#else
+#define HAVE_ALLOC_COUNTER 0
+#endif
+
+/*! \brief The KafkaMetrics event of the benchmark topic */
+struct bench_metrics {
+    uint64_t enqueued;
+    uint64_t delivered;
+    /*! Records of the delivered messages, more than the messages with batching */
+    uint64_t records;
+    uint64_t failed;
+    uint64_t dropped;
+    uint64_t bytes;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+};
+
+static uint64_t event_value(const char *event, const char *name) {
+    const char *line = event;
+    size_t len = strlen(name);
+
+    while ((line = strstr(line, "\r\n"))) {
+        line += 2;
+        if (!strncmp(line, name, len) && line[len] == ':') {
+            return strtoull(line + len + 1, NULL, 10);
+        }
+    }
+    return 0;
+}
+
+/*! \brief Read the metrics the way an AMI client does */
+static int metrics_get(struct bench_metrics *m) {
+    struct ast_variable topic = {"Topic", BENCH_TOPIC, NULL};
+    struct ast_str *out;
+    const char *event;
+
+    if (!(out = shim_manager_action("KafkaMetrics", &topic))) {
+        return -1;
+    }
+    if (!(event = strstr(ast_str_buffer(out), "Event: KafkaMetrics\r\n"))) {
+        ast_free(out);
+        return -1;
+    }
+    m->enqueued = event_value(event, "Enqueued");
+    m->delivered = event_value(event, "Delivered");
+    m->records = event_value(event, "Records");
+    m->failed = event_value(event, "Failed");
+    m->dropped = event_value(event, "Dropped");
+    m->bytes = event_value(event, "Bytes");
+    m->p50 = event_value(event, "LatencyP50");
+    m->p99 = event_value(event, "LatencyP99");
+    m->p999 = event_value(event, "LatencyP999");
+    m->max = event_value(event, "LatencyMax");
+    ast_free(out);
+    return 0;
+}
+
+static void *generator(void *data) {
+    long index = (long) data;
+    long count = records / threads + (index < records % threads);
+    int64_t interval_ns = rate ? (int64_t) threads * 1000000000 / rate : 0;
+    struct timespec next;
+    struct ast_cdr cdr;
+    struct ast_event event;
+    struct bench_cel_strings strings;
+    long i, seq;
+
+    if (!(strings.extra = ast_malloc(pad_size + 1))) {
+        return NULL;
+    }
+    bench_fill_cdr(&cdr, pad_size, index);
+    bench_fill_cel(&event, &strings, pad_size, index);
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (i = 0; i < count; i++) {
+        seq = i * threads + index;
+        if (!strcmp(type, "cdr")) {
+            bench_next_cdr(&cdr, seq);
+            shim_cdr_backend(&cdr);
+        } else {
+            bench_next_cel(&event, &strings, seq);
+            shim_cel_backend(&event);
+        }
+        if (interval_ns) {
+            next.tv_nsec += interval_ns;
+            next.tv_sec += next.tv_nsec / 1000000000;
+            next.tv_nsec %= 1000000000;
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        }
+    }
+    ast_free(strings.extra);
+    return NULL;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu_seconds(void) {
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -t cdr|cel        record type (cdr)\n"
+            "  -f format         json, rowbinary, msgpack or protobuf (json)\n"
+            "  -n records        records to produce (%d)\n"
+            "  -r rate           records per second, 0 for as fast as possible (0)\n"
+            "  -s size           length of the CDR userfield (up to 255) or the CEL extra field (0)\n"
+            "  -w threads        generator threads (1)\n"
+            "  -b brokers        brokers of the mock cluster (%d)\n"
+            "  -p producers      producer instances (1)\n"
+            "  -k key            message key, a column or var:<name> (none)\n"
+            "  -B records        records per batched message, 0 for a message per record (0)\n"
+            "  -o name=value     librdkafka option of the [producer] section, repeatable\n"
+            "  -d seconds        wait for the last delivery reports (%d)\n"
+            "  -v                log notices of the modules\n",
+            prog, DEFAULT_RECORDS, DEFAULT_BROKERS, DEFAULT_DRAIN_SECONDS);
+}
+
+int main(int argc, char *argv[]) {
+    const struct ast_module_info *backend;
+    const char *format = "json";
+    const char *key = NULL;
+    const char *batch_records = NULL;
+    const char *conf_file;
+    int brokers = DEFAULT_BROKERS;
+    char num[16];
+    char *value;
+    pthread_t workers[MAX_THREADS];
+    struct bench_metrics m = {0};
+    int drain_seconds = DEFAULT_DRAIN_SECONDS;
+    double start, produced, end, cpu;
+    uint64_t allocs;
+    int opt, i;
+
+    shim_config_set("res_kafka.conf", "general", "producers", "1");
+    /* The stats JSON would be parsed on the poll threads and charged to the records */
+    shim_config_set("res_kafka.conf", "producer", "statistics.interval.ms", "0");
+    while ((opt = getopt(argc, argv, "t:f:n:r:s:w:b:p:k:B:o:d:vh")) != -1) {
+        switch (opt) {
+            case 't':
+                type = optarg;
+                break;
+            case 'f':
+                format = optarg;
+                break;
+            case 'n':
+                records = atol(optarg);
+                break;
+            case 'r':
+                rate = atol(optarg);
+                break;
+            case 's':
+                pad_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'w':
+                threads = atoi(optarg);
+                break;
+            case 'b':
+                brokers = atoi(optarg);
+                break;
+            case 'p':
+                shim_config_set("res_kafka.conf", "general", "producers", optarg);
+                break;
+            case 'k':
+                key = optarg;
+                break;
+            case 'B':
+                batch_records = optarg;
+                break;
+            case 'o':
+                if (!(value = strchr(optarg, '='))) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                *value++ = '\0';
+                shim_config_set("res_kafka.conf", "producer", optarg, value);
+                break;
+            case 'd':
+                drain_seconds = atoi(optarg);
+                break;
+            case 'v':
+                shim_log_level = __LOG_NOTICE;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (records <= 0 || rate < 0 || threads <= 0 || threads > MAX_THREADS || brokers <= 0
+        || (strcmp(type, "cdr") && strcmp(type, "cel"))) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    snprintf(num, sizeof(num), "%d", brokers);
+    shim_config_set("res_kafka.conf", "producer", "test.mock.num.brokers", num);
+    backend = !strcmp(type, "cdr") ? &__internal_cdr_kafka_self_info : &__internal_cel_kafka_self_info;
+    conf_file = !strcmp(type, "cdr") ? "cdr_kafka.conf" : "cel_kafka.conf";
+    shim_config_set(conf_file, "general", "enabled", "yes");
+    shim_config_set(conf_file, "general", "topic", BENCH_TOPIC);
+    shim_config_set(conf_file, "general", "format", format);
+    if (key) {
+        shim_config_set(conf_file, "general", "key", key);
+    }
+    if (batch_records) {
+        shim_config_set(conf_file, "general", "batch_records", batch_records);
+    }
+
+    if (__internal_res_kafka_self_info.load() != AST_MODULE_LOAD_SUCCESS) {
+        fprintf(stderr, "res_kafka declined to load\n");
+        return 1;
+    }
+    if (backend->load() != AST_MODULE_LOAD_SUCCESS) {
+        fprintf(stderr, "%s declined to load\n", backend->name);
+        __internal_res_kafka_self_info.unload();
+        return 1;
+    }
+
+    allocs = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+    cpu = cpu_seconds();
+    start = now_seconds();
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i], NULL, generator, (void *) (long) i)) {
+            threads = i;
+            break;
+        }
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    produced = now_seconds();
+    /* Done once every record got its delivery report or was dropped, a batch counts once when it fails */
+    while (!metrics_get(&m) && m.records + m.failed + m.dropped < (uint64_t) records
+           && now_seconds() - produced < drain_seconds) {
+        usleep(1000);
+    }
+    end = now_seconds();
+    cpu = cpu_seconds() - cpu;
+    allocs = __atomic_load_n(&allocations, __ATOMIC_RELAXED) - allocs;
+
+    backend->unload();
+    __internal_res_kafka_self_info.unload();
+
+    printf("{\"type\":\"%s\",\"format\":\"%s\",\"records\":%ld,\"rate\":%ld,\"size\":%zu,\"threads\":%d,"
+           "\"brokers\":%d,\"seconds\":%.3f,\"produce_seconds\":%.3f,"
+           "\"enqueued\":%" PRIu64 ",\"delivered\":%" PRIu64 ",\"delivered_records\":%" PRIu64 ","
+           "\"failed\":%" PRIu64 ",\"dropped\":%" PRIu64 ","
+           "\"msgs_per_s\":%.0f,\"records_per_s\":%.0f,\"bytes_per_s\":%.0f,\"cpu_us_per_record\":%.2f,",
+           type, format, records, rate, pad_size, threads, brokers, end - start, produced - start,
+           m.enqueued, m.delivered, m.records, m.failed, m.dropped,
+           m.delivered / (end - start), m.records / (end - start), m.bytes / (end - start), cpu * 1e6 / records);
+    if (HAVE_ALLOC_COUNTER) {
+        printf("\"allocs_per_record\":%.2f,", (double) allocs / records);
+    } else {
+        printf("\"allocs_per_record\":null,");
+    }
+    printf("\"latency_us\":{\"p50\":%" PRIu64 ",\"p99\":%" PRIu64 ",\"p999\":%" PRIu64 ",\"max\":%" PRIu64 "}}\n",
+           m.p50, m.p99, m.p999, m.max);
+    return m.delivered ? 0 : 1;
+}
@@ -0,0 +1,85 @@
+/*! \file
+ *
+ * \brief Synthetic CDRs and CEL events of the benchmarks
+ *
+ * A template is filled once, then only the timestamps and the ids change
+ * from one record to the next, so the generators cost next to nothing.
+ *
+ * \author Max Nesterov <braams@braams.ru>
+ *
+ */
+
+#include "records.h"
+
+static void fill_pad(char *pad, size_t size, long seq) {
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        pad[i] = 'a' + (seq + i) % 26;
+    }
+    pad[size] = '\0';
+}
+
+void bench_fill_cdr(struct ast_cdr *cdr, size_t pad_size, long seq) {
+    memset(cdr, 0, sizeof(*cdr));
+    ast_copy_string(cdr->clid, "\"Alice\" <74951234567>", sizeof(cdr->clid));
+    ast_copy_string(cdr->src, "74951234567", sizeof(cdr->src));
+    ast_copy_string(cdr->dst, "74957654321", sizeof(cdr->dst));
+    ast_copy_string(cdr->dcontext, "from-internal", sizeof(cdr->dcontext));
+    ast_copy_string(cdr->channel, "PJSIP/alice-0000002a", sizeof(cdr->channel));
+    ast_copy_string(cdr->dstchannel, "PJSIP/trunk-0000002b", sizeof(cdr->dstchannel));
+    ast_copy_string(cdr->lastapp, "Dial", sizeof(cdr->lastapp));
+    ast_copy_string(cdr->lastdata, "PJSIP/74951234567@trunk,60,tT", sizeof(cdr->lastdata));
+    cdr->duration = 65;
+    cdr->billsec = 61;
+    cdr->disposition = 16;
+    cdr->amaflags = 3;
+    ast_copy_string(cdr->accountcode, "acme", sizeof(cdr->accountcode));
+    fill_pad(cdr->userfield, MIN(pad_size, sizeof(cdr->userfield) - 1), seq);
+}
+
+void bench_next_cdr(struct ast_cdr *cdr, long seq) {
+    cdr->end = ast_tvnow();
+    cdr->start = cdr->end;
+    cdr->start.tv_sec -= cdr->duration;
+    cdr->answer = cdr->end;
+    cdr->answer.tv_sec -= cdr->billsec;
+    snprintf(cdr->uniqueid, sizeof(cdr->uniqueid), "1700000000.%ld", seq);
+    memcpy(cdr->linkedid, cdr->uniqueid, sizeof(cdr->linkedid));
+    cdr->sequence = seq;
+}
+
+void bench_fill_cel(struct ast_event *event, struct bench_cel_strings *strings, size_t pad_size, long seq) {
+    struct ast_cel_event_record *r = &event->record;
+
+    fill_pad(strings->extra, pad_size, seq);
+    memset(r, 0, sizeof(*r));
+    r->user_defined_name = "";
+    r->caller_id_name = "Alice";
+    r->caller_id_num = "74951234567";
+    r->caller_id_ani = "74951234567";
+    r->caller_id_rdnis = "";
+    r->caller_id_dnid = "74957654321";
+    r->extension = "74957654321";
+    r->context = "from-internal";
+    r->channel_name = "PJSIP/alice-0000002a";
+    r->application_name = "Dial";
+    r->application_data = "PJSIP/74951234567@trunk,60,tT";
+    r->account_code = "acme";
+    r->peer_account = "";
+    r->unique_id = strings->unique_id;
+    r->linked_id = strings->unique_id;
+    r->amaflag = 3;
+    r->user_field = "";
+    r->peer = "PJSIP/trunk-0000002b";
+    r->extra = strings->extra;
+}
+
+void bench_next_cel(struct ast_event *event, struct bench_cel_strings *strings, long seq) {
+    struct ast_cel_event_record *r = &event->record;
+
+    r->event_type = AST_CEL_CHANNEL_START + seq % (AST_CEL_LOCAL_OPTIMIZE - AST_CEL_CHANNEL_START + 1);
+    r->event_name = ast_cel_get_type_name(r->event_type);
+    r->event_time = ast_tvnow();
+    snprintf(strings->unique_id, sizeof(strings->unique_id), "1700000000.%ld", seq / BENCH_CEL_EVENTS_PER_CALL);
+}
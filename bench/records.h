@@ -0,0 +1,41 @@
+//
+// Synthetic CDRs and CEL events of the benchmarks
+//
+
+#ifndef ASTERISK_KAFKA_BENCH_RECORDS_H
+#define ASTERISK_KAFKA_BENCH_RECORDS_H
+
+#include "asterisk.h"
+#include "asterisk/cdr.h"
+#include "asterisk/cel.h"
+
+/*! \brief CEL events of a call, the events of a call share their uniqueid */
+#define BENCH_CEL_EVENTS_PER_CALL 8
+
+/*! \brief The strings of a CEL event live here */
+struct bench_cel_strings {
+    char unique_id[AST_MAX_UNIQUEID];
+    /*! pad_size + 1 bytes, allocated by the caller */
+    char *extra;
+};
+
+/*!
+ * \brief A CDR template, the fields which differ per call are set by bench_next_cdr()
+ *
+ * \param pad_size Length of the userfield, up to 255
+ */
+void bench_fill_cdr(struct ast_cdr *cdr, size_t pad_size, long seq);
+
+void bench_next_cdr(struct ast_cdr *cdr, long seq);
+
+/*!
+ * \brief A CEL event template, the fields which differ per event are set by bench_next_cel()
+ *
+ * \param pad_size Length of the extra field
+ */
+void bench_fill_cel(struct ast_event *event, struct bench_cel_strings *strings, size_t pad_size, long seq);
+
+/*! \brief Events of all types, as a call produces them, the call of event \a seq is seq / BENCH_CEL_EVENTS_PER_CALL */
+void bench_next_cel(struct ast_event *event, struct bench_cel_strings *strings, long seq);
+
+#endif //ASTERISK_KAFKA_BENCH_RECORDS_H
@@ -0,0 +1,381 @@
+/*! \file
+ *
+ * \brief Thin Asterisk shim for the benchmarks
+ *
+ * Just enough of the Asterisk API to build the kafka modules as a
+ * standalone program. Only the parts used by the modules are provided,
+ * see shim.c for the implementation.
+ *
+ * \author Max Nesterov <braams@braams.ru>
+ *
+ */
+
+#ifndef ASTERISK_KAFKA_SHIM_H
+#define ASTERISK_KAFKA_SHIM_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/* logger */
+#define __LOG_DEBUG    0
+#define __LOG_NOTICE   2
+#define __LOG_WARNING  3
+#define __LOG_ERROR    4
+#define LOG_DEBUG      __LOG_DEBUG, __FILE__, __LINE__, __func__
+#define LOG_NOTICE     __LOG_NOTICE, __FILE__, __LINE__, __func__
+#define LOG_WARNING    __LOG_WARNING, __FILE__, __LINE__, __func__
+#define LOG_ERROR      __LOG_ERROR, __FILE__, __LINE__, __func__
+
+void ast_log(int level, const char *file, int line, const char *function, const char *fmt, ...)
+    __attribute__((format(printf, 5, 6)));
+
+#define ast_debug(level, ...) ast_log(LOG_DEBUG, __VA_ARGS__)
+#define ast_verb(level, ...) ast_log(LOG_DEBUG, __VA_ARGS__)
+#define ast_assert(a)
+
+/* utils */
+#define ARRAY_LEN(a) (size_t) (sizeof(a) / sizeof(0[a]))
+#ifndef MIN
+#define MIN(a, b) ({ typeof(a) __a = (a); typeof(b) __b = (b); ((__a > __b) ? __b : __a);})
+#endif
+#ifndef MAX
+#define MAX(a, b) ({ typeof(a) __a = (a); typeof(b) __b = (b); ((__a < __b) ? __b : __a);})
+#endif
+#define S_OR(a, b) ({typeof(&((a)[0])) __x = (a); ast_strlen_zero(__x) ? (b) : __x;})
+#define AST_PTHREADT_NULL (pthread_t) -1
+#define AST_MAX_EXTENSION 80
+#define AST_MAX_CONTEXT 80
+#define AST_MAX_ACCOUNT_CODE 80
+#define AST_MAX_UNIQUEID 150
+#define AST_MAX_USER_FIELD 256
+#define AST_ISO8601_LEN 29
+
+void *ast_malloc(size_t len);
+void *ast_calloc(size_t num, size_t len);
+void *ast_realloc(void *p, size_t len);
+char *ast_strdup(const char *str);
+char *ast_strndup(const char *str, size_t len);
+void ast_free(void *p);
+#define ast_strdupa(s) ({ const char *__s = (s); size_t __len = strlen(__s) + 1; \
+    char *__new = __builtin_alloca(__len); memcpy(__new, __s, __len); __new; })
+#define ast_alloca(size) __builtin_alloca(size)
+int ast_asprintf(char **ret, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static inline int ast_strlen_zero(const char *s) {
+    return (!s || (*s == '\0'));
+}
+
+int ast_true(const char *val);
+int ast_false(const char *val);
+char *ast_strip(char *s);
+void ast_copy_string(char *dst, const char *src, size_t size);
+#define AST_STRSEP_STRIP (1 << 0)
+#define AST_STRSEP_TRIM (1 << 1)
+/*! \brief strsep(), quotes and escapes are not handled */
+char *ast_strsep(char **s, const char sep, uint32_t flags);
+
+static inline int ast_str_hash(const char *str) {
+    int hash = 5381;
+
+    while (*str) {
+        hash = hash * 33 ^ (unsigned char) *str++;
+    }
+    return abs(hash);
+}
+
+/*! \brief Current thread id, as Asterisk gets it */
+int ast_get_tid(void);
+int ast_mkdir(const char *path, int mode);
+
+/* paths */
+extern const char *ast_config_AST_SPOOL_DIR;
+extern const char *ast_config_AST_SYSTEM_NAME;
+
+static inline int ast_tvzero(const struct timeval t) {
+    return (t.tv_sec == 0 && t.tv_usec == 0);
+}
+
+struct timeval ast_tvnow(void);
+int64_t ast_tvdiff_ms(struct timeval end, struct timeval start);
+int64_t ast_tvdiff_us(struct timeval end, struct timeval start);
+struct timeval ast_tvadd(struct timeval a, struct timeval b);
+static inline struct timeval ast_tv(time_t sec, long usec) {
+    struct timeval t = {sec, usec};
+    return t;
+}
+int ast_tvcmp(struct timeval a, struct timeval b);
+
+static inline struct timeval ast_samp2tv(unsigned int nsamp, unsigned int rate) {
+    return (struct timeval) {nsamp / rate, (nsamp % rate) * (1000000 / rate)};
+}
+
+/* lock */
+typedef pthread_mutex_t ast_mutex_t;
+typedef pthread_rwlock_t ast_rwlock_t;
+typedef pthread_cond_t ast_cond_t;
+#define AST_MUTEX_DEFINE_STATIC(m) static ast_mutex_t m = PTHREAD_MUTEX_INITIALIZER
+#define AST_RWLOCK_DEFINE_STATIC(l) static ast_rwlock_t l = PTHREAD_RWLOCK_INITIALIZER
+#define ast_mutex_init(m) pthread_mutex_init(m, NULL)
+#define ast_mutex_destroy pthread_mutex_destroy
+#define ast_mutex_lock pthread_mutex_lock
+#define ast_mutex_unlock pthread_mutex_unlock
+#define ast_cond_init pthread_cond_init
+#define ast_cond_destroy pthread_cond_destroy
+#define ast_cond_signal pthread_cond_signal
+#define ast_cond_broadcast pthread_cond_broadcast
+#define ast_cond_wait pthread_cond_wait
+#define ast_cond_timedwait pthread_cond_timedwait
+#define ast_rwlock_init(l) pthread_rwlock_init(l, NULL)
+#define ast_rwlock_destroy pthread_rwlock_destroy
+#define ast_rwlock_rdlock pthread_rwlock_rdlock
+#define ast_rwlock_tryrdlock pthread_rwlock_tryrdlock
+#define ast_rwlock_wrlock pthread_rwlock_wrlock
+#define ast_rwlock_unlock pthread_rwlock_unlock
+#define ast_atomic_fetch_add(ptr, val, memorder) __atomic_fetch_add((ptr), (val), (memorder))
+#define ast_atomic_add_fetch(ptr, val, memorder) __atomic_add_fetch((ptr), (val), (memorder))
+#define ast_atomic_fetch_sub(ptr, val, memorder) __atomic_fetch_sub((ptr), (val), (memorder))
+#define ast_atomic_sub_fetch(ptr, val, memorder) __atomic_sub_fetch((ptr), (val), (memorder))
+
+static inline int ast_atomic_fetchadd_int(volatile int *p, int v) {
+    return __sync_fetch_and_add(p, v);
+}
+
+static inline int ast_atomic_dec_and_test(volatile int *p) {
+    return __sync_sub_and_fetch(p, 1) == 0;
+}
+
+int ast_pthread_create_background(pthread_t *thread, void *attr, void *(*start_routine)(void *), void *data);
+int ast_pthread_create_detached_background(pthread_t *thread, void *attr, void *(*start_routine)(void *), void *data);
+
+/* threadstorage */
+struct ast_threadstorage {
+    volatile int init;
+    pthread_key_t key;
+};
+#define AST_THREADSTORAGE(name) static struct ast_threadstorage name = { 0, 0 }
+void *ast_threadstorage_get(struct ast_threadstorage *ts, size_t init_size);
+
+/* strings */
+struct ast_str {
+    size_t __AST_STR_LEN;
+    size_t __AST_STR_USED;
+    /*! The thread storage slot holding this string, moved along on reallocation */
+    struct ast_str **__AST_STR_TS;
+    char __AST_STR_STR[0];
+};
+struct ast_str *ast_str_create(size_t init_len);
+struct ast_str *ast_str_thread_get(struct ast_threadstorage *ts, size_t init_len);
+int ast_str_make_space(struct ast_str **buf, size_t new_len);
+int ast_str_set(struct ast_str **buf, ssize_t max_len, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+int ast_str_append(struct ast_str **buf, ssize_t max_len, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+char *ast_str_append_substr(struct ast_str **buf, ssize_t maxlen, const char *src, size_t maxsrc);
+char *ast_str_set_substr(struct ast_str **buf, ssize_t maxlen, const char *src, size_t maxsrc);
+char *ast_str_truncate(struct ast_str *buf, ssize_t len);
+
+static inline char *ast_str_buffer(const struct ast_str *buf) {
+    return (char *) buf->__AST_STR_STR;
+}
+
+static inline size_t ast_str_strlen(const struct ast_str *buf) {
+    return buf->__AST_STR_USED;
+}
+
+static inline size_t ast_str_size(const struct ast_str *buf) {
+    return buf->__AST_STR_LEN;
+}
+
+static inline void ast_str_reset(struct ast_str *buf) {
+    buf->__AST_STR_USED = 0;
+    buf->__AST_STR_STR[0] = '\0';
+}
+
+/* localtime */
+struct ast_tm {
+    int tm_sec;
+    int tm_min;
+    int tm_hour;
+    int tm_mday;
+    int tm_mon;
+    int tm_year;
+    int tm_wday;
+    int tm_yday;
+    int tm_isdst;
+    long tm_gmtoff;
+    char *tm_zone;
+    int tm_usec;
+};
+/*! \brief The zone is ignored, the process timezone is used */
+struct ast_tm *ast_localtime(const struct timeval *timep, struct ast_tm *p_tm, const char *zone);
+/*! \brief strftime(), without the %q extension */
+int ast_strftime(char *buf, size_t len, const char *format, const struct ast_tm *tm);
+
+/* json, the trees are not built by the benchmarks, all constructors return NULL */
+struct ast_json;
+struct ast_json *ast_json_object_create(void);
+struct ast_json *ast_json_string_create(const char *value);
+struct ast_json *ast_json_integer_create(long long value);
+struct ast_json *ast_json_null(void);
+int ast_json_object_set(struct ast_json *object, const char *key, struct ast_json *value);
+char *ast_json_dump_string(struct ast_json *root);
+void ast_json_unref(struct ast_json *value);
+void ast_json_free(void *p);
+enum ast_json_encoding_format {
+    AST_JSON_COMPACT,
+    AST_JSON_PRETTY,
+};
+struct ast_json *ast_json_load_buf(const char *buffer, size_t buflen, void *error);
+char *ast_json_dump_string_format(struct ast_json *root, enum ast_json_encoding_format format);
+
+/* astobj2, the objects are locked with recursive mutexes as in Asterisk */
+typedef void (*ao2_destructor_fn)(void *vdoomed);
+#define AO2_ALLOC_OPT_LOCK_MUTEX 0
+#define AO2_ALLOC_OPT_LOCK_RWLOCK 1
+#define AO2_ALLOC_OPT_LOCK_NOLOCK 2
+void *ao2_alloc_options(size_t data_size, ao2_destructor_fn destructor_fn, unsigned int options);
+#define ao2_alloc(size, destructor) ao2_alloc_options(size, destructor, AO2_ALLOC_OPT_LOCK_MUTEX)
+int ao2_ref(void *o, int delta);
+void ao2_cleanup(void *obj);
+int ao2_lock(void *obj);
+int ao2_unlock(void *obj);
+#define ao2_bump(obj) ({ typeof(obj) __obj = (obj); ao2_ref(__obj, +1); __obj; })
+
+/* astobj2 containers, a list whatever the type, the hash function is not used */
+enum search_flags {
+    OBJ_UNLINK = (1 << 0),
+    OBJ_NODATA = (1 << 1),
+    OBJ_MULTIPLE = (1 << 2),
+    OBJ_NOLOCK = (1 << 4),
+    OBJ_SEARCH_OBJECT = (1 << 5),
+    OBJ_SEARCH_KEY = (2 << 5),
+    OBJ_SEARCH_PARTIAL_KEY = (4 << 5),
+    OBJ_SEARCH_MASK = (0x07 << 5),
+};
+#define CMP_MATCH 0x1
+#define CMP_STOP 0x2
+typedef int (ao2_callback_fn)(void *obj, void *arg, int flags);
+typedef int (ao2_hash_fn)(const void *obj, int flags);
+typedef int (ao2_sort_fn)(const void *obj_left, const void *obj_right, int flags);
+struct ao2_container;
+/*! \brief The iterators work on a snapshot of the container */
+struct ao2_iterator {
+    void **objs;
+    size_t count;
+    size_t pos;
+    int flags;
+};
+struct ao2_container *ao2_container_alloc_hash(unsigned int ao2_options, unsigned int container_options,
+    unsigned int n_buckets, ao2_hash_fn *hash_fn, ao2_sort_fn *sort_fn, ao2_callback_fn *cmp_fn);
+struct ao2_container *ao2_container_alloc_list(unsigned int ao2_options, unsigned int container_options,
+    ao2_sort_fn *sort_fn, ao2_callback_fn *cmp_fn);
+int ao2_container_count(struct ao2_container *c);
+int ao2_link_flags(struct ao2_container *c, void *obj, int flags);
+#define ao2_link(c, obj) ao2_link_flags(c, obj, 0)
+void *ao2_unlink_flags(struct ao2_container *c, void *obj, int flags);
+#define ao2_unlink(c, obj) ao2_unlink_flags(c, obj, 0)
+/*! \brief With OBJ_MULTIPLE the matches are returned as an allocated iterator */
+void *ao2_callback(struct ao2_container *c, int flags, ao2_callback_fn *cb_fn, void *arg);
+void *ao2_find(struct ao2_container *c, const void *arg, int flags);
+struct ao2_iterator ao2_iterator_init(struct ao2_container *c, int flags);
+void *ao2_iterator_next(struct ao2_iterator *iter);
+void ao2_iterator_destroy(struct ao2_iterator *iter);
+
+#define AO2_STRING_FIELD_HASH_FN(stype, field) \
+static int stype ## _hash_fn(const void *obj, const int flags) \
+{ \
+    const struct stype *object = obj; \
+    const char *key = (flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_KEY ? obj : object->field; \
+    return ast_str_hash(key); \
+}
+
+#define AO2_STRING_FIELD_CMP_FN(stype, field) \
+static int stype ## _cmp_fn(void *obj, void *arg, int flags) \
+{ \
+    const struct stype *object_left = obj, *object_right = arg; \
+    const char *right_key = (flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_KEY ? arg : object_right->field; \
+    return strcmp(object_left->field, right_key) ? 0 : CMP_MATCH; \
+}
+
+/* config */
+struct ast_flags {
+    unsigned int flags;
+};
+struct ast_variable {
+    const char *name;
+    const char *value;
+    struct ast_variable *next;
+};
+/*! \brief An in-memory configuration, see shim_config_set() */
+struct ast_config;
+#define CONFIG_STATUS_FILEMISSING (void *) 0
+#define CONFIG_STATUS_FILEUNCHANGED (void *) -1
+#define CONFIG_STATUS_FILEINVALID (void *) -2
+#define CONFIG_FLAG_FILEUNCHANGED (1 << 1)
+/*! \brief Files without a shim_config_set() option are missing */
+struct ast_config *ast_config_load(const char *filename, struct ast_flags flags);
+void ast_config_destroy(struct ast_config *cfg);
+char *ast_category_browse(struct ast_config *config, const char *prev_name);
+struct ast_variable *ast_variable_browse(const struct ast_config *config, const char *category);
+const char *ast_variable_retrieve(struct ast_config *config, const char *category, const char *variable);
+struct ast_variable *ast_variable_new(const char *name, const char *value, const char *filename);
+void ast_variables_destroy(struct ast_variable *var);
+void ast_variable_list_append(struct ast_variable **head, struct ast_variable *new_var);
+/*! \brief Add an option to the configuration returned by ast_config_load() for \a filename */
+int shim_config_set(const char *filename, const char *category, const char *name, const char *value);
+
+/* module */
+struct ast_module;
+enum ast_module_load_result {
+    AST_MODULE_LOAD_SUCCESS = 0,
+    AST_MODULE_LOAD_DECLINE = 1,
+    AST_MODULE_LOAD_SKIP = 2,
+    AST_MODULE_LOAD_PRIORITY = 3,
+    AST_MODULE_LOAD_FAILURE = -1,
+};
+#define ASTERISK_GPL_KEY "This paragraph is copyright (c) 2006 by Digium, Inc."
+#define AST_MODFLAG_DEFAULT 0
+#define AST_MODFLAG_GLOBAL_SYMBOLS (1 << 0)
+#define AST_MODFLAG_LOAD_ORDER (1 << 1)
+#define AST_MODULE_SUPPORT_EXTENDED 2
+#define AST_MODPRI_REALTIME_DRIVER 5
+#define AST_MODPRI_CDR_DRIVER 40
+#define AST_MODPRI_CHANNEL_DEPEND 50
+#define AST_MODPRI_APP_DEPEND 50
+#define AST_MODPRI_DEFAULT 128
+struct ast_module_info {
+    const char *name;
+    int (*load)(void);
+    int (*reload)(void);
+    int (*unload)(void);
+    const char *description;
+    const char *key;
+    unsigned int flags;
+    int load_pri;
+    int support_level;
+    const char *requires;
+    const char *optional_modules;
+};
+#define SHIM_MODULE_INFO_SYM2(sym) sym ## _info
+/*! \brief Module info of AST_MODULE_SELF_SYM, e.g. __internal_res_kafka_self_info */
+#define SHIM_MODULE_INFO_SYM(sym) SHIM_MODULE_INFO_SYM2(sym)
+/*! \brief The callbacks are exposed as SHIM_MODULE_INFO_SYM(AST_MODULE_SELF_SYM), loading is up to the program */
+#define AST_MODULE_INFO(keystr, flags_to_set, desc, fields...) \
+    const struct ast_module_info SHIM_MODULE_INFO_SYM(AST_MODULE_SELF_SYM) = { \
+        .name = AST_MODULE, \
+        .key = keystr, \
+        .flags = flags_to_set, \
+        .description = desc, \
+        fields \
+    }
+
+#endif //ASTERISK_KAFKA_SHIM_H
@@ -0,0 +1,45 @@
+#include "../asterisk.h"
+#include "chanvars.h"
+
+#ifndef SHIM_CDR_H
+#define SHIM_CDR_H
+
+/*! \brief struct ast_cdr as of Asterisk 16 */
+struct ast_cdr {
+    char clid[AST_MAX_EXTENSION];
+    char src[AST_MAX_EXTENSION];
+    char dst[AST_MAX_EXTENSION];
+    char dcontext[AST_MAX_EXTENSION];
+    char channel[AST_MAX_EXTENSION];
+    char dstchannel[AST_MAX_EXTENSION];
+    char lastapp[AST_MAX_EXTENSION];
+    char lastdata[AST_MAX_EXTENSION];
+    struct timeval start;
+    struct timeval answer;
+    struct timeval end;
+    long int duration;
+    long int billsec;
+    long int disposition;
+    long int amaflags;
+    char accountcode[AST_MAX_ACCOUNT_CODE];
+    char peeraccount[AST_MAX_ACCOUNT_CODE];
+    unsigned int flags;
+    char uniqueid[AST_MAX_UNIQUEID];
+    char linkedid[AST_MAX_UNIQUEID];
+    char userfield[AST_MAX_USER_FIELD];
+    int sequence;
+    struct varshead varshead;
+    struct ast_cdr *next;
+};
+
+typedef int (*ast_cdrbe)(struct ast_cdr *cdr);
+int ast_cdr_register(const char *name, const char *desc, ast_cdrbe be);
+int ast_cdr_unregister(const char *name);
+
+#define AST_CDR_FLAG_DISABLE_ALL (1 << 4)
+int ast_cdr_set_property(const char *channel_name, int option);
+
+/*! \brief Backend of the last ast_cdr_register(), NULL if none */
+extern ast_cdrbe shim_cdr_backend;
+
+#endif
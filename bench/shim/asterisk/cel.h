@@ -0,0 +1,77 @@
+#include "../asterisk.h"
+
+#ifndef SHIM_CEL_H
+#define SHIM_CEL_H
+
+/*! \brief enum ast_cel_event_type as of Asterisk 16 */
+enum ast_cel_event_type {
+    AST_CEL_INVALID_VALUE = -1,
+    AST_CEL_ALL = 0,
+    AST_CEL_CHANNEL_START = 1,
+    AST_CEL_CHANNEL_END = 2,
+    AST_CEL_HANGUP = 3,
+    AST_CEL_ANSWER = 4,
+    AST_CEL_APP_START = 5,
+    AST_CEL_APP_END = 6,
+    AST_CEL_PARK_START = 7,
+    AST_CEL_PARK_END = 8,
+    AST_CEL_USER_DEFINED = 9,
+    AST_CEL_BRIDGE_ENTER = 10,
+    AST_CEL_BRIDGE_EXIT = 11,
+    AST_CEL_BLINDTRANSFER = 12,
+    AST_CEL_ATTENDEDTRANSFER = 13,
+    AST_CEL_PICKUP = 14,
+    AST_CEL_FORWARD = 15,
+    AST_CEL_LINKEDID_END = 16,
+    AST_CEL_LOCAL_OPTIMIZE = 17,
+};
+
+#define AST_CEL_EVENT_RECORD_VERSION 2
+
+struct ast_cel_event_record {
+    uint32_t version;
+    enum ast_cel_event_type event_type;
+    struct timeval event_time;
+    const char *event_name;
+    const char *user_defined_name;
+    const char *caller_id_name;
+    const char *caller_id_num;
+    const char *caller_id_ani;
+    const char *caller_id_rdnis;
+    const char *caller_id_dnid;
+    const char *extension;
+    const char *context;
+    const char *channel_name;
+    const char *application_name;
+    const char *application_data;
+    const char *account_code;
+    const char *peer_account;
+    const char *unique_id;
+    const char *linked_id;
+    unsigned int amaflag;
+    const char *user_field;
+    const char *peer;
+    const char *extra;
+};
+
+enum ast_event_ie_type {
+    AST_EVENT_IE_CEL_EVENT_TYPE = 0x0016,
+};
+
+/*! \brief A CEL event is the record it fills, the version is ignored */
+struct ast_event {
+    struct ast_cel_event_record record;
+};
+
+typedef void (*ast_cel_backend_cb)(struct ast_event *event);
+int ast_cel_backend_register(const char *name, ast_cel_backend_cb backend_callback);
+int ast_cel_backend_unregister(const char *name);
+int ast_cel_fill_record(const struct ast_event *event, struct ast_cel_event_record *r);
+enum ast_cel_event_type ast_cel_str_to_event_type(const char *name);
+const char *ast_cel_get_type_name(enum ast_cel_event_type type);
+uint32_t ast_event_get_ie_uint(const struct ast_event *event, enum ast_event_ie_type ie_type);
+
+/*! \brief Backend of the last ast_cel_backend_register(), NULL if none */
+extern ast_cel_backend_cb shim_cel_backend;
+
+#endif
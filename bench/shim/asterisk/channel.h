@@ -0,0 +1,31 @@
+#include "../asterisk.h"
+
+#ifndef SHIM_CHANNEL_H
+#define SHIM_CHANNEL_H
+
+/*! \brief There are no channels, every lookup fails */
+struct ast_channel;
+
+enum ast_channel_state {
+    AST_STATE_DOWN,
+    AST_STATE_UP = 6,
+};
+
+struct ast_channel_tech {
+    const char *type;
+    const char *description;
+};
+
+struct ast_channel *ast_channel_get_by_name(const char *name);
+struct ast_channel *ast_channel_alloc(int needqueue, enum ast_channel_state state, const char *cid_num,
+                                      const char *cid_name, const char *acctcode, const char *exten,
+                                      const char *context, const void *assignedids, const void *requestor,
+                                      int amaflag, const char *name_fmt, ...);
+void ast_channel_tech_set(struct ast_channel *chan, const struct ast_channel_tech *tech);
+const char *ast_channel_name(const struct ast_channel *chan);
+void ast_hangup(struct ast_channel *chan);
+#define ast_channel_lock(chan) ao2_lock(chan)
+#define ast_channel_unlock(chan) ao2_unlock(chan)
+#define ast_channel_unref(chan) ({ ao2_cleanup(chan); (struct ast_channel *) NULL; })
+
+#endif
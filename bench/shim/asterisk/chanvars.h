@@ -0,0 +1,28 @@
+#include "../asterisk.h"
+#include "linkedlists.h"
+
+#ifndef SHIM_CHANVARS_H
+#define SHIM_CHANVARS_H
+
+struct ast_var_t {
+    struct {
+        struct ast_var_t *next;
+    } entries;
+    char *value;
+    char name[0];
+};
+
+struct varshead {
+    struct ast_var_t *first;
+    struct ast_var_t *last;
+};
+
+static inline const char *ast_var_name(const struct ast_var_t *var) {
+    return var->name;
+}
+
+static inline const char *ast_var_value(const struct ast_var_t *var) {
+    return var->value;
+}
+
+#endif
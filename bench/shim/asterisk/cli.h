@@ -0,0 +1,42 @@
+#include "../asterisk.h"
+
+#ifndef SHIM_CLI_H
+#define SHIM_CLI_H
+
+#define CLI_SUCCESS (char *) "0"
+#define CLI_SHOWUSAGE (char *) "1"
+#define CLI_FAILURE (char *) "2"
+
+enum ast_cli_command {
+    CLI_INIT = -2,
+    CLI_GENERATE = -3,
+};
+
+struct ast_cli_args {
+    const int fd;
+    const int argc;
+    const char * const *argv;
+    const char *line;
+    const char *word;
+    const int pos;
+    int n;
+};
+
+struct ast_cli_entry;
+typedef char *(*cli_fn)(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a);
+
+/*! \brief The commands are not registered anywhere, the benchmarks have no console */
+struct ast_cli_entry {
+    const char *summary;
+    const char *usage;
+    const char *command;
+    cli_fn handler;
+};
+
+#define AST_CLI_DEFINE(fn, txt, ...) { .handler = fn, .summary = txt, ## __VA_ARGS__ }
+
+int ast_cli_register(struct ast_cli_entry *e);
+int ast_cli_unregister(struct ast_cli_entry *e);
+void ast_cli(int fd, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#endif
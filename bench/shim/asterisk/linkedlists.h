@@ -0,0 +1,69 @@
+#include "../asterisk.h"
+
+#ifndef SHIM_LINKEDLISTS_H
+#define SHIM_LINKEDLISTS_H
+
+#define AST_LIST_HEAD_NOLOCK(name, type) \
+struct name { \
+    struct type *first; \
+    struct type *last; \
+}
+#define AST_LIST_HEAD_NOLOCK_STATIC(name, type) \
+struct name { \
+    struct type *first; \
+    struct type *last; \
+} name = { NULL, NULL }
+#define AST_LIST_ENTRY(type) \
+struct { \
+    struct type *next; \
+}
+#define AST_LIST_FIRST(head) ((head)->first)
+#define AST_LIST_NEXT(elm, field) ((elm)->field.next)
+#define AST_LIST_EMPTY(head) (AST_LIST_FIRST(head) == NULL)
+#define AST_LIST_TRAVERSE(head, var, field) for ((var) = (head)->first; (var); (var) = (var)->field.next)
+
+#define AST_LIST_INSERT_TAIL(head, elm, field) do { \
+    if (!(head)->first) { \
+        (head)->first = (elm); \
+        (head)->last = (elm); \
+    } else { \
+        (head)->last->field.next = (elm); \
+        (head)->last = (elm); \
+    } \
+} while (0)
+
+#define AST_LIST_REMOVE_HEAD(head, field) ({ \
+    typeof((head)->first) __cur = (head)->first; \
+    if (__cur) { \
+        (head)->first = __cur->field.next; \
+        __cur->field.next = NULL; \
+        if ((head)->last == __cur) { \
+            (head)->last = NULL; \
+        } \
+    } \
+    __cur; \
+})
+
+#define AST_LIST_REMOVE(head, elm, field) ({ \
+    typeof(elm) __elm = (elm); \
+    typeof(elm) __prev = NULL; \
+    typeof(elm) __cur = (head)->first; \
+    while (__cur && __cur != __elm) { \
+        __prev = __cur; \
+        __cur = __cur->field.next; \
+    } \
+    if (__cur) { \
+        if (__prev) { \
+            __prev->field.next = __cur->field.next; \
+        } else { \
+            (head)->first = __cur->field.next; \
+        } \
+        if ((head)->last == __cur) { \
+            (head)->last = __prev; \
+        } \
+        __cur->field.next = NULL; \
+    } \
+    __cur; \
+})
+
+#endif
@@ -0,0 +1,37 @@
+#include "../asterisk.h"
+
+#ifndef SHIM_MANAGER_H
+#define SHIM_MANAGER_H
+
+#define EVENT_FLAG_SYSTEM (1 << 0)
+#define EVENT_FLAG_REPORTING (1 << 9)
+
+/*! \brief Session of shim_manager_action(), the response is collected in \a out */
+struct mansession {
+    struct ast_str *out;
+};
+
+/*! \brief Request headers of shim_manager_action() */
+struct message {
+    const struct ast_variable *headers;
+};
+
+int ast_manager_register(const char *action, int authority,
+    int (*func)(struct mansession *s, const struct message *m), const char *synopsis);
+int ast_manager_unregister(const char *action);
+const char *astman_get_header(const struct message *m, char *var);
+void astman_append(struct mansession *s, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void astman_send_error(struct mansession *s, const struct message *m, char *error);
+void astman_send_listack(struct mansession *s, const struct message *m, char *msg, char *listflag);
+void astman_send_list_complete_start(struct mansession *s, const struct message *m, const char *event_name, int count);
+void astman_send_list_complete_end(struct mansession *s);
+
+/*!
+ * \brief Run a registered action as if it came from an AMI client
+ *
+ * \return the response and events in AMI wire format, ast_free() it,
+ *         NULL when the action is not registered
+ */
+struct ast_str *shim_manager_action(const char *action, const struct ast_variable *headers);
+
+#endif
@@ -0,0 +1 @@
+#include "../asterisk.h"
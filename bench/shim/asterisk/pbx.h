@@ -0,0 +1,15 @@
+#include "../asterisk.h"
+#include "channel.h"
+
+#ifndef SHIM_PBX_H
+#define SHIM_PBX_H
+
+struct ast_pbx_args {
+    unsigned int no_hangup_chan:1;
+};
+
+const char *pbx_builtin_getvar_helper(struct ast_channel *chan, const char *name);
+int pbx_builtin_setvar_helper(struct ast_channel *chan, const char *name, const char *value);
+int ast_pbx_run_args(struct ast_channel *chan, struct ast_pbx_args *args);
+
+#endif
@@ -0,0 +1,1012 @@
+/*! \file
+ *
+ * \brief Thin Asterisk shim for the benchmarks
+ *
+ * \author Max Nesterov <braams@braams.ru>
+ *
+ */
+
+#define _GNU_SOURCE
+#include "asterisk.h"
+#include "asterisk/cdr.h"
+#include "asterisk/cel.h"
+#include "asterisk/channel.h"
+#include "asterisk/cli.h"
+#include "asterisk/manager.h"
+#include "asterisk/pbx.h"
+#include <ctype.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+static const char *level_names[] = {"DEBUG", "", "NOTICE", "WARNING", "ERROR"};
+
+int shim_log_level = __LOG_WARNING;
+
+void ast_log(int level, const char *file, int line, const char *function, const char *fmt, ...) {
+    va_list ap;
+
+    if (level < shim_log_level) {
+        return;
+    }
+    fprintf(stderr, "[%s] %s:%d %s: ", level_names[level], file, line, function);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+void *ast_malloc(size_t len) {
+    return malloc(len);
+}
+
+void *ast_calloc(size_t num, size_t len) {
+    return calloc(num, len);
+}
+
+void *ast_realloc(void *p, size_t len) {
+    return realloc(p, len);
+}
+
+char *ast_strdup(const char *str) {
+    return str ? strdup(str) : NULL;
+}
+
+char *ast_strndup(const char *str, size_t len) {
+    return str ? strndup(str, len) : NULL;
+}
+
+void ast_free(void *p) {
+    free(p);
+}
+
+int ast_true(const char *s) {
+    if (ast_strlen_zero(s)) {
+        return 0;
+    }
+    return !strcasecmp(s, "yes") || !strcasecmp(s, "true") || !strcasecmp(s, "y")
+        || !strcasecmp(s, "t") || !strcasecmp(s, "1") || !strcasecmp(s, "on");
+}
+
+int ast_false(const char *s) {
+    if (ast_strlen_zero(s)) {
+        return 0;
+    }
+    return !strcasecmp(s, "no") || !strcasecmp(s, "false") || !strcasecmp(s, "n")
+        || !strcasecmp(s, "f") || !strcasecmp(s, "0") || !strcasecmp(s, "off");
+}
+
+char *ast_strip(char *s) {
+    char *end;
+
+    if (!s) {
+        return NULL;
+    }
+    while (*s && isspace((unsigned char) *s)) {
+        s++;
+    }
+    end = s + strlen(s);
+    while (end > s && isspace((unsigned char) end[-1])) {
+        *--end = '\0';
+    }
+    return s;
+}
+
+int ast_asprintf(char **ret, const char *fmt, ...) {
+    int res;
+    va_list ap;
+
+    va_start(ap, fmt);
+    res = vasprintf(ret, fmt, ap);
+    va_end(ap);
+    return res;
+}
+
+char *ast_strsep(char **iss, const char sep, uint32_t flags) {
+    char *st = *iss;
+    char *end;
+
+    if (!st) {
+        return NULL;
+    }
+    if ((end = strchr(st, sep))) {
+        *end = '\0';
+        *iss = end + 1;
+    } else {
+        *iss = NULL;
+    }
+    return (flags & (AST_STRSEP_STRIP | AST_STRSEP_TRIM)) ? ast_strip(st) : st;
+}
+
+int ast_get_tid(void) {
+    return syscall(SYS_gettid);
+}
+
+int ast_mkdir(const char *path, int mode) {
+    char *copy = ast_strdupa(path);
+    char *slash = copy;
+
+    while ((slash = strchr(slash + 1, '/'))) {
+        *slash = '\0';
+        if (mkdir(copy, mode) && errno != EEXIST) {
+            return errno;
+        }
+        *slash = '/';
+    }
+    if (mkdir(copy, mode) && errno != EEXIST) {
+        return errno;
+    }
+    return 0;
+}
+
+const char *ast_config_AST_SPOOL_DIR = "/tmp";
+const char *ast_config_AST_SYSTEM_NAME = "bench";
+
+void ast_copy_string(char *dst, const char *src, size_t size) {
+    if (!size) {
+        return;
+    }
+    strncpy(dst, src, size - 1);
+    dst[size - 1] = '\0';
+}
+
+struct timeval ast_tvnow(void) {
+    struct timeval t;
+
+    gettimeofday(&t, NULL);
+    return t;
+}
+
+int64_t ast_tvdiff_us(struct timeval end, struct timeval start) {
+    return (end.tv_sec - start.tv_sec) * (int64_t) 1000000 + (end.tv_usec - start.tv_usec);
+}
+
+int64_t ast_tvdiff_ms(struct timeval end, struct timeval start) {
+    return ast_tvdiff_us(end, start) / 1000;
+}
+
+struct timeval ast_tvadd(struct timeval a, struct timeval b) {
+    a.tv_sec += b.tv_sec;
+    a.tv_usec += b.tv_usec;
+    if (a.tv_usec >= 1000000) {
+        a.tv_sec++;
+        a.tv_usec -= 1000000;
+    }
+    return a;
+}
+
+int ast_tvcmp(struct timeval a, struct timeval b) {
+    if (a.tv_sec != b.tv_sec) {
+        return a.tv_sec < b.tv_sec ? -1 : 1;
+    }
+    if (a.tv_usec != b.tv_usec) {
+        return a.tv_usec < b.tv_usec ? -1 : 1;
+    }
+    return 0;
+}
+
+int ast_pthread_create_background(pthread_t *thread, void *attr, void *(*start_routine)(void *), void *data) {
+    return pthread_create(thread, attr, start_routine, data);
+}
+
+int ast_pthread_create_detached_background(pthread_t *thread, void *attr, void *(*start_routine)(void *), void *data) {
+    int res;
+
+    res = pthread_create(thread, attr, start_routine, data);
+    if (!res) {
+        pthread_detach(*thread);
+    }
+    return res;
+}
+
+/* threadstorage */
+
+void *ast_threadstorage_get(struct ast_threadstorage *ts, size_t init_size) {
+    static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+    void *buf;
+
+    if (!__atomic_load_n(&ts->init, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&init_lock);
+        if (!ts->init) {
+            pthread_key_create(&ts->key, free);
+            __atomic_store_n(&ts->init, 1, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&init_lock);
+    }
+
+    if (!(buf = pthread_getspecific(ts->key))) {
+        if (!(buf = calloc(1, init_size))) {
+            return NULL;
+        }
+        pthread_setspecific(ts->key, buf);
+    }
+    return buf;
+}
+
+/* strings */
+
+struct ast_str *ast_str_create(size_t init_len) {
+    struct ast_str *buf;
+
+    if (!(buf = calloc(1, sizeof(*buf) + init_len))) {
+        return NULL;
+    }
+    buf->__AST_STR_LEN = init_len;
+    return buf;
+}
+
+/*! \brief The thread storage holds a pointer to the string, the string is leaked on thread exit */
+struct ast_str *ast_str_thread_get(struct ast_threadstorage *ts, size_t init_len) {
+    struct ast_str **holder;
+
+    if (!(holder = ast_threadstorage_get(ts, sizeof(*holder)))) {
+        return NULL;
+    }
+    if (!*holder) {
+        if (!(*holder = ast_str_create(init_len))) {
+            return NULL;
+        }
+        (*holder)->__AST_STR_TS = holder;
+    }
+    return *holder;
+}
+
+int ast_str_make_space(struct ast_str **buf, size_t new_len) {
+    struct ast_str *grown;
+
+    if (new_len <= (*buf)->__AST_STR_LEN) {
+        return 0;
+    }
+    if (!(grown = realloc(*buf, sizeof(*grown) + new_len))) {
+        return -1;
+    }
+    *buf = grown;
+    (*buf)->__AST_STR_LEN = new_len;
+    if ((*buf)->__AST_STR_TS) {
+        *(*buf)->__AST_STR_TS = *buf;
+    }
+    return 0;
+}
+
+static int str_vappend(struct ast_str **buf, ssize_t max_len, int append, const char *fmt, va_list ap) {
+    size_t offset = append ? (*buf)->__AST_STR_USED : 0;
+    int res;
+    va_list aq;
+
+    for (;;) {
+        va_copy(aq, ap);
+        res = vsnprintf((*buf)->__AST_STR_STR + offset, (*buf)->__AST_STR_LEN - offset, fmt, aq);
+        va_end(aq);
+        if (res < 0) {
+            return res;
+        }
+        if (offset + res < (*buf)->__AST_STR_LEN) {
+            break;
+        }
+        if (max_len > 0 || ast_str_make_space(buf, (offset + res + 1) * 2)) {
+            (*buf)->__AST_STR_USED = (*buf)->__AST_STR_LEN - 1;
+            return res;
+        }
+    }
+    (*buf)->__AST_STR_USED = offset + res;
+    return res;
+}
+
+int ast_str_set(struct ast_str **buf, ssize_t max_len, const char *fmt, ...) {
+    int res;
+    va_list ap;
+
+    va_start(ap, fmt);
+    res = str_vappend(buf, max_len, 0, fmt, ap);
+    va_end(ap);
+    return res;
+}
+
+int ast_str_append(struct ast_str **buf, ssize_t max_len, const char *fmt, ...) {
+    int res;
+    va_list ap;
+
+    va_start(ap, fmt);
+    res = str_vappend(buf, max_len, 1, fmt, ap);
+    va_end(ap);
+    return res;
+}
+
+char *ast_str_append_substr(struct ast_str **buf, ssize_t maxlen, const char *src, size_t maxsrc) {
+    size_t len = strnlen(src, maxsrc);
+    size_t used = (*buf)->__AST_STR_USED;
+
+    if (ast_str_make_space(buf, used + len + 1)) {
+        return NULL;
+    }
+    memcpy((*buf)->__AST_STR_STR + used, src, len);
+    (*buf)->__AST_STR_USED = used + len;
+    (*buf)->__AST_STR_STR[used + len] = '\0';
+    return (*buf)->__AST_STR_STR;
+}
+
+char *ast_str_set_substr(struct ast_str **buf, ssize_t maxlen, const char *src, size_t maxsrc) {
+    ast_str_reset(*buf);
+    return ast_str_append_substr(buf, maxlen, src, maxsrc);
+}
+
+char *ast_str_truncate(struct ast_str *buf, ssize_t len) {
+    if (len < 0) {
+        len = (ssize_t) buf->__AST_STR_USED + len;
+        if (len < 0) {
+            len = 0;
+        }
+    }
+    if ((size_t) len < buf->__AST_STR_LEN) {
+        buf->__AST_STR_USED = len;
+        buf->__AST_STR_STR[len] = '\0';
+    }
+    return buf->__AST_STR_STR;
+}
+
+/* localtime */
+
+struct ast_tm *ast_localtime(const struct timeval *timep, struct ast_tm *p_tm, const char *zone) {
+    struct tm tm;
+    time_t sec = timep->tv_sec;
+
+    localtime_r(&sec, &tm);
+    memset(p_tm, 0, sizeof(*p_tm));
+    p_tm->tm_sec = tm.tm_sec;
+    p_tm->tm_min = tm.tm_min;
+    p_tm->tm_hour = tm.tm_hour;
+    p_tm->tm_mday = tm.tm_mday;
+    p_tm->tm_mon = tm.tm_mon;
+    p_tm->tm_year = tm.tm_year;
+    p_tm->tm_wday = tm.tm_wday;
+    p_tm->tm_yday = tm.tm_yday;
+    p_tm->tm_isdst = tm.tm_isdst;
+    p_tm->tm_gmtoff = tm.tm_gmtoff;
+    p_tm->tm_usec = timep->tv_usec;
+    return p_tm;
+}
+
+int ast_strftime(char *buf, size_t len, const char *format, const struct ast_tm *ast_tm) {
+    struct tm tm = {
+        .tm_sec = ast_tm->tm_sec,
+        .tm_min = ast_tm->tm_min,
+        .tm_hour = ast_tm->tm_hour,
+        .tm_mday = ast_tm->tm_mday,
+        .tm_mon = ast_tm->tm_mon,
+        .tm_year = ast_tm->tm_year,
+        .tm_wday = ast_tm->tm_wday,
+        .tm_yday = ast_tm->tm_yday,
+        .tm_isdst = ast_tm->tm_isdst,
+        .tm_gmtoff = ast_tm->tm_gmtoff,
+    };
+
+    return strftime(buf, len, format, &tm);
+}
+
+/* json */
+
+struct ast_json *ast_json_object_create(void) {
+    return NULL;
+}
+
+struct ast_json *ast_json_string_create(const char *value) {
+    return NULL;
+}
+
+struct ast_json *ast_json_integer_create(long long value) {
+    return NULL;
+}
+
+struct ast_json *ast_json_null(void) {
+    return NULL;
+}
+
+int ast_json_object_set(struct ast_json *object, const char *key, struct ast_json *value) {
+    return -1;
+}
+
+char *ast_json_dump_string(struct ast_json *root) {
+    return NULL;
+}
+
+void ast_json_unref(struct ast_json *value) {
+}
+
+void ast_json_free(void *p) {
+    free(p);
+}
+
+struct ast_json *ast_json_load_buf(const char *buffer, size_t buflen, void *error) {
+    return NULL;
+}
+
+char *ast_json_dump_string_format(struct ast_json *root, enum ast_json_encoding_format format) {
+    return NULL;
+}
+
+/* astobj2 */
+
+struct ao2_header {
+    pthread_mutex_t lock;
+    volatile int ref;
+    ao2_destructor_fn destructor;
+    char data[0] __attribute__((aligned(16)));
+};
+
+#define AO2_HEADER(obj) ((struct ao2_header *) ((char *) (obj) - offsetof(struct ao2_header, data)))
+
+void *ao2_alloc_options(size_t data_size, ao2_destructor_fn destructor_fn, unsigned int options) {
+    struct ao2_header *h;
+    pthread_mutexattr_t attr;
+
+    if (!(h = calloc(1, sizeof(*h) + data_size))) {
+        return NULL;
+    }
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&h->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    h->ref = 1;
+    h->destructor = destructor_fn;
+    return h->data;
+}
+
+int ao2_ref(void *o, int delta) {
+    struct ao2_header *h;
+    int ref;
+
+    if (!o) {
+        return -1;
+    }
+    h = AO2_HEADER(o);
+    ref = __sync_fetch_and_add(&h->ref, delta);
+    if (ref + delta == 0) {
+        if (h->destructor) {
+            h->destructor(o);
+        }
+        pthread_mutex_destroy(&h->lock);
+        free(h);
+    }
+    return ref;
+}
+
+void ao2_cleanup(void *obj) {
+    if (obj) {
+        ao2_ref(obj, -1);
+    }
+}
+
+int ao2_lock(void *obj) {
+    return pthread_mutex_lock(&AO2_HEADER(obj)->lock);
+}
+
+int ao2_unlock(void *obj) {
+    return pthread_mutex_unlock(&AO2_HEADER(obj)->lock);
+}
+
+/* astobj2 containers */
+
+struct ao2_node {
+    void *obj;
+    struct ao2_node *next;
+};
+
+struct ao2_container {
+    ao2_callback_fn *cmp_fn;
+    struct ao2_node *head;
+    struct ao2_node *tail;
+    int count;
+};
+
+static void container_destructor(void *obj) {
+    struct ao2_container *c = obj;
+    struct ao2_node *node;
+
+    while ((node = c->head)) {
+        c->head = node->next;
+        ao2_ref(node->obj, -1);
+        free(node);
+    }
+}
+
+struct ao2_container *ao2_container_alloc_list(unsigned int ao2_options, unsigned int container_options,
+                                               ao2_sort_fn *sort_fn, ao2_callback_fn *cmp_fn) {
+    struct ao2_container *c;
+
+    if (!(c = ao2_alloc_options(sizeof(*c), container_destructor, ao2_options))) {
+        return NULL;
+    }
+    c->cmp_fn = cmp_fn;
+    return c;
+}
+
+struct ao2_container *ao2_container_alloc_hash(unsigned int ao2_options, unsigned int container_options,
+                                               unsigned int n_buckets, ao2_hash_fn *hash_fn, ao2_sort_fn *sort_fn,
+                                               ao2_callback_fn *cmp_fn) {
+    return ao2_container_alloc_list(ao2_options, container_options, sort_fn, cmp_fn);
+}
+
+int ao2_container_count(struct ao2_container *c) {
+    return c->count;
+}
+
+int ao2_link_flags(struct ao2_container *c, void *obj, int flags) {
+    struct ao2_node *node;
+
+    if (!(node = calloc(1, sizeof(*node)))) {
+        return 0;
+    }
+    node->obj = ao2_bump(obj);
+    if (!(flags & OBJ_NOLOCK)) {
+        ao2_lock(c);
+    }
+    if (c->tail) {
+        c->tail->next = node;
+    } else {
+        c->head = node;
+    }
+    c->tail = node;
+    c->count++;
+    if (!(flags & OBJ_NOLOCK)) {
+        ao2_unlock(c);
+    }
+    return 1;
+}
+
+/*! \brief Remove \a node following \a prev, the reference of the container is returned */
+static void *container_remove(struct ao2_container *c, struct ao2_node *prev, struct ao2_node *node) {
+    void *obj = node->obj;
+
+    if (prev) {
+        prev->next = node->next;
+    } else {
+        c->head = node->next;
+    }
+    if (c->tail == node) {
+        c->tail = prev;
+    }
+    c->count--;
+    free(node);
+    return obj;
+}
+
+static int match_by_addr(void *obj, void *arg, int flags) {
+    return obj == arg ? CMP_MATCH | CMP_STOP : 0;
+}
+
+void *ao2_unlink_flags(struct ao2_container *c, void *obj, int flags) {
+    ao2_callback(c, (flags & OBJ_NOLOCK) | OBJ_UNLINK | OBJ_NODATA, match_by_addr, obj);
+    return NULL;
+}
+
+void *ao2_callback(struct ao2_container *c, int flags, ao2_callback_fn *cb_fn, void *arg) {
+    struct ao2_node *prev = NULL, *node, *next;
+    struct ao2_iterator *multi = NULL;
+    void *found = NULL;
+    void *obj;
+    int res;
+
+    if ((flags & OBJ_MULTIPLE) && !(flags & OBJ_NODATA)) {
+        if (!(multi = calloc(1, sizeof(*multi)))) {
+            return NULL;
+        }
+        multi->flags = OBJ_MULTIPLE;
+    }
+    if (!(flags & OBJ_NOLOCK)) {
+        ao2_lock(c);
+    }
+    if (multi && c->count && !(multi->objs = calloc(c->count, sizeof(void *)))) {
+        flags |= OBJ_NODATA;
+    }
+    for (node = c->head; node; node = next) {
+        next = node->next;
+        res = cb_fn ? cb_fn(node->obj, arg, flags) : CMP_MATCH;
+        if (!(res & CMP_MATCH)) {
+            prev = node;
+        } else {
+            obj = (flags & OBJ_UNLINK) ? container_remove(c, prev, node) : ao2_bump(node->obj);
+            if (!(flags & OBJ_UNLINK)) {
+                prev = node;
+            }
+            if (flags & OBJ_NODATA) {
+                ao2_ref(obj, -1);
+            } else if (multi) {
+                multi->objs[multi->count++] = obj;
+            } else {
+                found = obj;
+                break;
+            }
+            if (!(flags & OBJ_MULTIPLE)) {
+                break;
+            }
+        }
+        if (res & CMP_STOP) {
+            break;
+        }
+    }
+    if (!(flags & OBJ_NOLOCK)) {
+        ao2_unlock(c);
+    }
+    return multi ? (void *) multi : found;
+}
+
+void *ao2_find(struct ao2_container *c, const void *arg, int flags) {
+    if (!(flags & OBJ_SEARCH_MASK)) {
+        flags |= OBJ_SEARCH_OBJECT;
+    }
+    return ao2_callback(c, flags & ~OBJ_NODATA, c->cmp_fn, (void *) arg);
+}
+
+struct ao2_iterator ao2_iterator_init(struct ao2_container *c, int flags) {
+    struct ao2_iterator it = {0};
+    struct ao2_iterator *all;
+
+    all = ao2_callback(c, OBJ_MULTIPLE, NULL, NULL);
+    if (all) {
+        it = *all;
+        free(all);
+    }
+    it.flags = 0;
+    return it;
+}
+
+void *ao2_iterator_next(struct ao2_iterator *iter) {
+    return iter->pos < iter->count ? iter->objs[iter->pos++] : NULL;
+}
+
+void ao2_iterator_destroy(struct ao2_iterator *iter) {
+    while (iter->pos < iter->count) {
+        ao2_ref(iter->objs[iter->pos++], -1);
+    }
+    free(iter->objs);
+    if (iter->flags & OBJ_MULTIPLE) {
+        free(iter);
+    }
+}
+
+/* config */
+
+struct shim_category {
+    char *name;
+    struct ast_variable *vars;
+    struct shim_category *next;
+};
+
+struct ast_config {
+    char *filename;
+    struct shim_category *categories;
+    struct ast_config *next;
+};
+
+/*! \brief Configurations built by shim_config_set(), kept until exit */
+static struct ast_config *configs;
+
+static struct ast_config *config_find(const char *filename) {
+    struct ast_config *cfg;
+
+    for (cfg = configs; cfg && strcmp(cfg->filename, filename); cfg = cfg->next) {
+    }
+    return cfg;
+}
+
+static struct shim_category *category_find(const struct ast_config *cfg, const char *name) {
+    struct shim_category *cat;
+
+    for (cat = cfg->categories; cat && strcasecmp(cat->name, name); cat = cat->next) {
+    }
+    return cat;
+}
+
+int shim_config_set(const char *filename, const char *category, const char *name, const char *value) {
+    struct ast_config *cfg;
+    struct shim_category *cat, **tail;
+
+    if (!(cfg = config_find(filename))) {
+        if (!(cfg = calloc(1, sizeof(*cfg)))) {
+            return -1;
+        }
+        cfg->filename = strdup(filename);
+        cfg->next = configs;
+        configs = cfg;
+    }
+    if (!(cat = category_find(cfg, category))) {
+        if (!(cat = calloc(1, sizeof(*cat)))) {
+            return -1;
+        }
+        cat->name = strdup(category);
+        for (tail = &cfg->categories; *tail; tail = &(*tail)->next) {
+        }
+        *tail = cat;
+    }
+    ast_variable_list_append(&cat->vars, ast_variable_new(name, value, filename));
+    return 0;
+}
+
+struct ast_config *ast_config_load(const char *filename, struct ast_flags flags) {
+    return config_find(filename);
+}
+
+void ast_config_destroy(struct ast_config *cfg) {
+}
+
+char *ast_category_browse(struct ast_config *config, const char *prev_name) {
+    struct shim_category *cat;
+
+    if (!prev_name) {
+        cat = config->categories;
+    } else {
+        cat = category_find(config, prev_name);
+        cat = cat ? cat->next : NULL;
+    }
+    return cat ? cat->name : NULL;
+}
+
+struct ast_variable *ast_variable_browse(const struct ast_config *config, const char *category) {
+    struct shim_category *cat = category_find(config, category);
+
+    return cat ? cat->vars : NULL;
+}
+
+const char *ast_variable_retrieve(struct ast_config *config, const char *category, const char *variable) {
+    struct ast_variable *v;
+
+    for (v = ast_variable_browse(config, category); v; v = v->next) {
+        if (!strcasecmp(v->name, variable)) {
+            return v->value;
+        }
+    }
+    return NULL;
+}
+
+/*! \brief The name and value are stored after the variable, as Asterisk does */
+struct ast_variable *ast_variable_new(const char *name, const char *value, const char *filename) {
+    struct ast_variable *v;
+    size_t name_len = strlen(name) + 1;
+    size_t value_len = strlen(value) + 1;
+
+    if (!(v = ast_calloc(1, sizeof(*v) + name_len + value_len))) {
+        return NULL;
+    }
+    v->name = memcpy((char *) (v + 1), name, name_len);
+    v->value = memcpy((char *) (v + 1) + name_len, value, value_len);
+    return v;
+}
+
+void ast_variables_destroy(struct ast_variable *var) {
+    struct ast_variable *next;
+
+    for (; var; var = next) {
+        next = var->next;
+        ast_free(var);
+    }
+}
+
+void ast_variable_list_append(struct ast_variable **head, struct ast_variable *new_var) {
+    while (*head) {
+        head = &(*head)->next;
+    }
+    *head = new_var;
+}
+
+/* cli */
+
+int ast_cli_register(struct ast_cli_entry *e) {
+    return 0;
+}
+
+int ast_cli_unregister(struct ast_cli_entry *e) {
+    return 0;
+}
+
+void ast_cli(int fd, const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    vdprintf(fd, fmt, ap);
+    va_end(ap);
+}
+
+/* manager */
+
+#define MAX_MANAGER_ACTIONS 16
+
+struct manager_action {
+    const char *action;
+    int (*func)(struct mansession *s, const struct message *m);
+};
+
+static struct manager_action manager_actions[MAX_MANAGER_ACTIONS];
+
+int ast_manager_register(const char *action, int authority,
+                         int (*func)(struct mansession *s, const struct message *m), const char *synopsis) {
+    size_t i;
+
+    for (i = 0; i < ARRAY_LEN(manager_actions); i++) {
+        if (!manager_actions[i].action) {
+            manager_actions[i].action = action;
+            manager_actions[i].func = func;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int ast_manager_unregister(const char *action) {
+    size_t i;
+
+    for (i = 0; i < ARRAY_LEN(manager_actions); i++) {
+        if (manager_actions[i].action && !strcasecmp(manager_actions[i].action, action)) {
+            manager_actions[i].action = NULL;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+struct ast_str *shim_manager_action(const char *action, const struct ast_variable *headers) {
+    struct mansession s;
+    struct message m = {headers};
+    size_t i;
+
+    for (i = 0; i < ARRAY_LEN(manager_actions); i++) {
+        if (manager_actions[i].action && !strcasecmp(manager_actions[i].action, action)) {
+            if (!(s.out = ast_str_create(1024))) {
+                return NULL;
+            }
+            manager_actions[i].func(&s, &m);
+            return s.out;
+        }
+    }
+    return NULL;
+}
+
+const char *astman_get_header(const struct message *m, char *var) {
+    const struct ast_variable *v;
+
+    for (v = m->headers; v; v = v->next) {
+        if (!strcasecmp(v->name, var)) {
+            return v->value;
+        }
+    }
+    return "";
+}
+
+void astman_append(struct mansession *s, const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    str_vappend(&s->out, 0, 1, fmt, ap);
+    va_end(ap);
+}
+
+void astman_send_error(struct mansession *s, const struct message *m, char *error) {
+    astman_append(s, "Response: Error\r\nMessage: %s\r\n\r\n", error);
+}
+
+void astman_send_listack(struct mansession *s, const struct message *m, char *msg, char *listflag) {
+    astman_append(s, "Response: Success\r\nEventList: %s\r\nMessage: %s\r\n\r\n", listflag, msg);
+}
+
+void astman_send_list_complete_start(struct mansession *s, const struct message *m, const char *event_name, int count) {
+    astman_append(s, "Event: %s\r\nEventList: Complete\r\nListItems: %d\r\n", event_name, count);
+}
+
+void astman_send_list_complete_end(struct mansession *s) {
+    astman_append(s, "\r\n");
+}
+
+/* cdr */
+
+ast_cdrbe shim_cdr_backend;
+
+int ast_cdr_register(const char *name, const char *desc, ast_cdrbe be) {
+    shim_cdr_backend = be;
+    return 0;
+}
+
+int ast_cdr_unregister(const char *name) {
+    shim_cdr_backend = NULL;
+    return 0;
+}
+
+/* cel */
+
+ast_cel_backend_cb shim_cel_backend;
+
+static const char * const cel_event_names[] = {
+    [AST_CEL_ALL] = "ALL",
+    [AST_CEL_CHANNEL_START] = "CHAN_START",
+    [AST_CEL_CHANNEL_END] = "CHAN_END",
+    [AST_CEL_ANSWER] = "ANSWER",
+    [AST_CEL_HANGUP] = "HANGUP",
+    [AST_CEL_APP_START] = "APP_START",
+    [AST_CEL_APP_END] = "APP_END",
+    [AST_CEL_PARK_START] = "PARK_START",
+    [AST_CEL_PARK_END] = "PARK_END",
+    [AST_CEL_USER_DEFINED] = "USER_DEFINED",
+    [AST_CEL_BRIDGE_ENTER] = "BRIDGE_ENTER",
+    [AST_CEL_BRIDGE_EXIT] = "BRIDGE_EXIT",
+    [AST_CEL_BLINDTRANSFER] = "BLINDTRANSFER",
+    [AST_CEL_ATTENDEDTRANSFER] = "ATTENDEDTRANSFER",
+    [AST_CEL_PICKUP] = "PICKUP",
+    [AST_CEL_FORWARD] = "FORWARD",
+    [AST_CEL_LINKEDID_END] = "LINKEDID_END",
+    [AST_CEL_LOCAL_OPTIMIZE] = "LOCAL_OPTIMIZE",
+};
+
+int ast_cel_backend_register(const char *name, ast_cel_backend_cb backend_callback) {
+    shim_cel_backend = backend_callback;
+    return 0;
+}
+
+int ast_cel_backend_unregister(const char *name) {
+    shim_cel_backend = NULL;
+    return 0;
+}
+
+int ast_cel_fill_record(const struct ast_event *event, struct ast_cel_event_record *r) {
+    if (r->version != AST_CEL_EVENT_RECORD_VERSION) {
+        return -1;
+    }
+    *r = event->record;
+    r->version = AST_CEL_EVENT_RECORD_VERSION;
+    return 0;
+}
+
+enum ast_cel_event_type ast_cel_str_to_event_type(const char *name) {
+    size_t i;
+
+    for (i = 0; i < ARRAY_LEN(cel_event_names); i++) {
+        if (cel_event_names[i] && !strcasecmp(name, cel_event_names[i])) {
+            return i;
+        }
+    }
+    return AST_CEL_INVALID_VALUE;
+}
+
+const char *ast_cel_get_type_name(enum ast_cel_event_type type) {
+    return type >= 0 && (size_t) type < ARRAY_LEN(cel_event_names) && cel_event_names[type]
+        ? cel_event_names[type] : "Unknown";
+}
+
+uint32_t ast_event_get_ie_uint(const struct ast_event *event, enum ast_event_ie_type ie_type) {
+    return ie_type == AST_EVENT_IE_CEL_EVENT_TYPE ? event->record.event_type : 0;
+}
+
+/* channel */
+
+struct ast_channel *ast_channel_get_by_name(const char *name) {
+    return NULL;
+}
+
+/*! \brief Nor can they be created, the dialplan of the consumers is not run */
+struct ast_channel *ast_channel_alloc(int needqueue, enum ast_channel_state state, const char *cid_num,
+                                      const char *cid_name, const char *acctcode, const char *exten,
+                                      const char *context, const void *assignedids, const void *requestor,
+                                      int amaflag, const char *name_fmt, ...) {
+    return NULL;
+}
+
+void ast_channel_tech_set(struct ast_channel *chan, const struct ast_channel_tech *tech) {
+}
+
+const char *ast_channel_name(const struct ast_channel *chan) {
+    return "";
+}
+
+void ast_hangup(struct ast_channel *chan) {
+}
+
+int ast_cdr_set_property(const char *channel_name, int option) {
+    return 0;
+}
+
+const char *pbx_builtin_getvar_helper(struct ast_channel *chan, const char *name) {
+    return NULL;
+}
+
+int pbx_builtin_setvar_helper(struct ast_channel *chan, const char *name, const char *value) {
+    return 0;
+}
+
+int ast_pbx_run_args(struct ast_channel *chan, struct ast_pbx_args *args) {
+    return -1;
+}
@@ -0,0 +1,500 @@
+/*! \file
+ *
+ * \brief Soak test of the produce path with broker outages
+ *
+ * Loads res_kafka, cdr_kafka and cel_kafka against the thin Asterisk shim and
+ * a librdkafka mock cluster of its own, so the brokers can be taken down and
+ * brought back at fixed intervals. Calls (a CDR and BENCH_CEL_EVENTS_PER_CALL
+ * CEL events each) are fed at a steady rate for the whole run while RSS, the
+ * live heap and the queue depth are sampled and printed as JSON lines.
+ *
+ * The baseline is taken once the warmup is over. At the end the traffic stops,
+ * the brokers come back and the queues drain, then the run fails if the heap
+ * or RSS grew past its threshold or the queues did not drain. Statistics stay
+ * on (statistics.interval.ms=1000), so a leak in the stats callback shows up
+ * as heap growth.
+ *
+ * \author Max Nesterov <braams@braams.ru>
+ *
+ */
+
+#define _GNU_SOURCE
+#include "asterisk.h"
+#include "asterisk/manager.h"
+#include "res_kafka.h"
+#include "records.h"
+#include <librdkafka/rdkafka.h>
+#include <librdkafka/rdkafka_mock.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include <signal.h>
+
+#define CDR_TOPIC "soak_cdr"
+#define CEL_TOPIC "soak_cel"
+#define DEFAULT_RATE 200
+#define DEFAULT_SECONDS 600
+#define DEFAULT_WARMUP_SECONDS 60
+#define DEFAULT_INTERVAL_SECONDS 10
+#define DEFAULT_BROKERS 3
+#define DEFAULT_OUTAGE_EVERY 120
+#define DEFAULT_OUTAGE_SECONDS 20
+#define DEFAULT_DRAIN_SECONDS 60
+/*! \brief Growth limits in megabytes */
+#define DEFAULT_HEAP_GROWTH 16
+#define DEFAULT_RSS_GROWTH 64
+
+extern int shim_log_level;
+extern const struct ast_module_info __internal_res_kafka_self_info;
+extern const struct ast_module_info __internal_cdr_kafka_self_info;
+extern const struct ast_module_info __internal_cel_kafka_self_info;
+
+/*! \brief Calls per second */
+static long rate = DEFAULT_RATE;
+/*! \brief Length of the CDR userfield and the CEL extra field */
+static size_t pad_size;
+static int stop;
+static uint64_t calls;
+
+/*
+ * Live heap counters, malloc() and friends are wrapped for the whole process,
+ * librdkafka included. Blocks are counted at their usable size.
+ */
+static int64_t heap_bytes;
+static int64_t heap_blocks;
+static uint64_t allocations;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+static void *heap_add(void *ptr) {
+    if (ptr) {
+        __atomic_fetch_add(&heap_bytes, malloc_usable_size(ptr), __ATOMIC_RELAXED);
+        __atomic_fetch_add(&heap_blocks, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    }
+    return ptr;
+}
+
+static void heap_sub(size_t size) {
+    __atomic_fetch_sub(&heap_bytes, size, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&heap_blocks, 1, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size) {
+    return heap_add(__libc_malloc(size));
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    return heap_add(__libc_calloc(nmemb, size));
+}
+
+void *realloc(void *ptr, size_t size) {
+    size_t old = ptr ? malloc_usable_size(ptr) : 0;
+    void *ret = __libc_realloc(ptr, size);
+
+    /* A failed realloc() leaves the block alone, realloc(ptr, 0) frees it */
+    if (!ret && size) {
+        return NULL;
+    }
+    if (ptr) {
+        heap_sub(old);
+    }
+    return heap_add(ret);
+}
+
+void free(void *ptr) {
+    if (ptr) {
+        heap_sub(malloc_usable_size(ptr));
+    }
+    __libc_free(ptr);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    return heap_add(__libc_memalign(alignment, size));
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return heap_add(__libc_memalign(alignment, size));
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    void *ret;
+
+    if (!alignment || (alignment & (alignment - 1)) || alignment % sizeof(void *)) {
+        return EINVAL;
+    }
+    if (!(ret = heap_add(__libc_memalign(alignment, size)))) {
+        return ENOMEM;
+    }
+    *ptr = ret;
+    return 0;
+}
+#define HAVE_HEAP_COUNTER 1
+#else
+#define HAVE_HEAP_COUNTER 0
+#endif
+
+/*! \brief A point of the run */
+struct soak_sample {
+    double seconds;
+    uint64_t calls;
+    /*! Resident set in kilobytes */
+    long rss_kb;
+    int64_t heap_bytes;
+    int64_t heap_blocks;
+    uint64_t allocations;
+    /*! Messages in the librdkafka queues */
+    int queue_depth;
+    /*! The KafkaMetrics events of all topics, summed */
+    uint64_t enqueued;
+    uint64_t delivered;
+    uint64_t failed;
+    uint64_t dropped;
+};
+
+static uint64_t event_value(const char *event, const char *name) {
+    const char *line = event;
+    size_t len = strlen(name);
+
+    while ((line = strstr(line, "\r\n")) && strncmp(line, "\r\n\r\n", 4)) {
+        line += 2;
+        if (!strncmp(line, name, len) && line[len] == ':') {
+            return strtoull(line + len + 1, NULL, 10);
+        }
+    }
+    return 0;
+}
+
+/*! \brief Sum the KafkaMetrics events of all topics the way an AMI client does */
+static void metrics_get(struct soak_sample *sample) {
+    struct ast_str *out;
+    const char *event;
+
+    if (!(out = shim_manager_action("KafkaMetrics", NULL))) {
+        return;
+    }
+    event = ast_str_buffer(out);
+    while ((event = strstr(event, "Event: KafkaMetrics\r\n"))) {
+        sample->enqueued += event_value(event, "Enqueued");
+        sample->delivered += event_value(event, "Delivered");
+        sample->failed += event_value(event, "Failed");
+        sample->dropped += event_value(event, "Dropped");
+        event++;
+    }
+    ast_free(out);
+}
+
+static long rss_kb(void) {
+    FILE *f;
+    long size, resident = 0;
+
+    if (!(f = fopen("/proc/self/statm", "r"))) {
+        return 0;
+    }
+    if (fscanf(f, "%ld %ld", &size, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(f);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sample_take(struct soak_sample *sample, double start) {
+    struct ast_kafka_queue_info info = {0};
+
+    memset(sample, 0, sizeof(*sample));
+    metrics_get(sample);
+    ast_kafka_queue_get_info(&info);
+    sample->queue_depth = info.depth;
+    sample->seconds = now_seconds() - start;
+    sample->calls = __atomic_load_n(&calls, __ATOMIC_RELAXED);
+    sample->rss_kb = rss_kb();
+    sample->heap_bytes = __atomic_load_n(&heap_bytes, __ATOMIC_RELAXED);
+    sample->heap_blocks = __atomic_load_n(&heap_blocks, __ATOMIC_RELAXED);
+    sample->allocations = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+}
+
+static void sample_print(const char *name, const struct soak_sample *sample, int brokers_down) {
+    printf("{\"sample\":\"%s\",\"seconds\":%.0f,\"calls\":%" PRIu64 ",\"rss_kb\":%ld,", name, sample->seconds,
+           sample->calls, sample->rss_kb);
+    if (HAVE_HEAP_COUNTER) {
+        printf("\"heap_bytes\":%" PRId64 ",\"heap_blocks\":%" PRId64 ",\"allocations\":%" PRIu64 ",",
+               sample->heap_bytes, sample->heap_blocks, sample->allocations);
+    }
+    printf("\"queue_depth\":%d,\"enqueued\":%" PRIu64 ",\"delivered\":%" PRIu64 ",\"failed\":%" PRIu64 ","
+           "\"dropped\":%" PRIu64 ",\"brokers_down\":%s}\n",
+           sample->queue_depth, sample->enqueued, sample->delivered, sample->failed, sample->dropped,
+           brokers_down ? "true" : "false");
+    fflush(stdout);
+}
+
+static void *generator(void *data) {
+    long interval_ns = 1000000000L / rate;
+    struct timespec next;
+    struct ast_cdr cdr;
+    struct ast_event event;
+    struct bench_cel_strings strings;
+    long seq, i;
+
+    if (!(strings.extra = ast_malloc(pad_size + 1))) {
+        return NULL;
+    }
+    bench_fill_cdr(&cdr, pad_size, 0);
+    bench_fill_cel(&event, &strings, pad_size, 0);
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (seq = 0; !__atomic_load_n(&stop, __ATOMIC_RELAXED); seq++) {
+        for (i = 0; i < BENCH_CEL_EVENTS_PER_CALL; i++) {
+            bench_next_cel(&event, &strings, seq * BENCH_CEL_EVENTS_PER_CALL + i);
+            shim_cel_backend(&event);
+        }
+        bench_next_cdr(&cdr, seq);
+        shim_cdr_backend(&cdr);
+        __atomic_fetch_add(&calls, 1, __ATOMIC_RELAXED);
+        next.tv_nsec += interval_ns;
+        next.tv_sec += next.tv_nsec / 1000000000;
+        next.tv_nsec %= 1000000000;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+    ast_free(strings.extra);
+    return NULL;
+}
+
+static void brokers_set(rd_kafka_mock_cluster_t *mcluster, int brokers, int down) {
+    int32_t id;
+
+    for (id = 1; id <= brokers; id++) {
+        if (down) {
+            rd_kafka_mock_broker_set_down(mcluster, id);
+        } else {
+            rd_kafka_mock_broker_set_up(mcluster, id);
+        }
+    }
+}
+
+static void stop_handler(int sig) {
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -r rate           calls per second, a CDR and %d CEL events each (%d)\n"
+            "  -T seconds        duration of the traffic (%d)\n"
+            "  -W seconds        warmup before the baseline is taken (%d)\n"
+            "  -i seconds        sampling interval (%d)\n"
+            "  -s size           length of the CDR userfield (up to 255) and the CEL extra field (0)\n"
+            "  -b brokers        brokers of the mock cluster (%d)\n"
+            "  -O seconds        take all brokers down every that many seconds, 0 for never (%d)\n"
+            "  -D seconds        length of an outage (%d)\n"
+            "  -g megabytes      heap growth limit (%d)\n"
+            "  -R megabytes      RSS growth limit (%d)\n"
+            "  -o name=value     librdkafka option of the [producer] section, repeatable\n"
+            "  -d seconds        wait for the queues to drain at the end (%d)\n"
+            "  -v                log notices of the modules\n",
+            prog, BENCH_CEL_EVENTS_PER_CALL, DEFAULT_RATE, DEFAULT_SECONDS, DEFAULT_WARMUP_SECONDS,
+            DEFAULT_INTERVAL_SECONDS, DEFAULT_BROKERS, DEFAULT_OUTAGE_EVERY, DEFAULT_OUTAGE_SECONDS,
+            DEFAULT_HEAP_GROWTH, DEFAULT_RSS_GROWTH, DEFAULT_DRAIN_SECONDS);
+}
+
+int main(int argc, char *argv[]) {
+    int seconds = DEFAULT_SECONDS;
+    int warmup = DEFAULT_WARMUP_SECONDS;
+    int interval = DEFAULT_INTERVAL_SECONDS;
+    int brokers = DEFAULT_BROKERS;
+    int outage_every = DEFAULT_OUTAGE_EVERY;
+    int outage_seconds = DEFAULT_OUTAGE_SECONDS;
+    int drain_seconds = DEFAULT_DRAIN_SECONDS;
+    double heap_limit = DEFAULT_HEAP_GROWTH;
+    double rss_limit = DEFAULT_RSS_GROWTH;
+    rd_kafka_t *mock_rk;
+    rd_kafka_mock_cluster_t *mcluster;
+    char errstr[512];
+    char *value;
+    pthread_t worker;
+    struct soak_sample baseline, sample, final;
+    struct ast_kafka_queue_info info;
+    double start, elapsed, next_sample, outage_start = 0, drain_start;
+    int64_t heap_growth;
+    long rss_growth;
+    int down = 0, outages = 0, max_depth = 0, drained, failed;
+    int opt;
+
+    /* The stats callback runs every second, as it does in production */
+    shim_config_set("res_kafka.conf", "producer", "statistics.interval.ms", "1000");
+    while ((opt = getopt(argc, argv, "r:T:W:i:s:b:O:D:g:R:o:d:vh")) != -1) {
+        switch (opt) {
+            case 'r':
+                rate = atol(optarg);
+                break;
+            case 'T':
+                seconds = atoi(optarg);
+                break;
+            case 'W':
+                warmup = atoi(optarg);
+                break;
+            case 'i':
+                interval = atoi(optarg);
+                break;
+            case 's':
+                pad_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'b':
+                brokers = atoi(optarg);
+                break;
+            case 'O':
+                outage_every = atoi(optarg);
+                break;
+            case 'D':
+                outage_seconds = atoi(optarg);
+                break;
+            case 'g':
+                heap_limit = atof(optarg);
+                break;
+            case 'R':
+                rss_limit = atof(optarg);
+                break;
+            case 'o':
+                if (!(value = strchr(optarg, '='))) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                *value++ = '\0';
+                shim_config_set("res_kafka.conf", "producer", optarg, value);
+                break;
+            case 'd':
+                drain_seconds = atoi(optarg);
+                break;
+            case 'v':
+                shim_log_level = __LOG_NOTICE;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (rate <= 0 || seconds <= 0 || warmup < 0 || warmup >= seconds || interval <= 0 || brokers <= 0
+        || outage_every < 0 || outage_seconds < 0 || (outage_every && outage_seconds >= outage_every)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* A cluster of our own, the one of test.mock.num.brokers can not be taken down from here */
+    if (!(mock_rk = rd_kafka_new(RD_KAFKA_PRODUCER, rd_kafka_conf_new(), errstr, sizeof(errstr)))) {
+        fprintf(stderr, "Failed to create the mock cluster handle: %s\n", errstr);
+        return 1;
+    }
+    if (!(mcluster = rd_kafka_mock_cluster_new(mock_rk, brokers))) {
+        fprintf(stderr, "Failed to create the mock cluster\n");
+        rd_kafka_destroy(mock_rk);
+        return 1;
+    }
+    rd_kafka_mock_topic_create(mcluster, CDR_TOPIC, brokers, 1);
+    rd_kafka_mock_topic_create(mcluster, CEL_TOPIC, brokers, 1);
+    shim_config_set("res_kafka.conf", "general", "brokers", rd_kafka_mock_cluster_bootstraps(mcluster));
+    shim_config_set("cdr_kafka.conf", "general", "enabled", "yes");
+    shim_config_set("cdr_kafka.conf", "general", "topic", CDR_TOPIC);
+    shim_config_set("cdr_kafka.conf", "general", "key", "linkedid");
+    shim_config_set("cel_kafka.conf", "general", "enabled", "yes");
+    shim_config_set("cel_kafka.conf", "general", "topic", CEL_TOPIC);
+    shim_config_set("cel_kafka.conf", "general", "key", "linkedid");
+
+    if (__internal_res_kafka_self_info.load() != AST_MODULE_LOAD_SUCCESS) {
+        fprintf(stderr, "res_kafka declined to load\n");
+        rd_kafka_mock_cluster_destroy(mcluster);
+        rd_kafka_destroy(mock_rk);
+        return 1;
+    }
+    if (__internal_cdr_kafka_self_info.load() != AST_MODULE_LOAD_SUCCESS
+        || __internal_cel_kafka_self_info.load() != AST_MODULE_LOAD_SUCCESS) {
+        fprintf(stderr, "cdr_kafka or cel_kafka declined to load\n");
+        __internal_cdr_kafka_self_info.unload();
+        __internal_res_kafka_self_info.unload();
+        rd_kafka_mock_cluster_destroy(mcluster);
+        rd_kafka_destroy(mock_rk);
+        return 1;
+    }
+
+    /* Ctrl-C ends the traffic early, the run still drains and is judged */
+    signal(SIGINT, stop_handler);
+    signal(SIGTERM, stop_handler);
+    start = now_seconds();
+    if (pthread_create(&worker, NULL, generator, NULL)) {
+        fprintf(stderr, "Failed to start the generator\n");
+        __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    }
+    sample_take(&baseline, start);
+    next_sample = interval;
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED) && (elapsed = now_seconds() - start) < seconds) {
+        if (!down && outage_every && elapsed >= (outages + 1) * outage_every) {
+            brokers_set(mcluster, brokers, 1);
+            outage_start = elapsed;
+            outages++;
+            down = 1;
+        } else if (down && elapsed - outage_start >= outage_seconds) {
+            brokers_set(mcluster, brokers, 0);
+            down = 0;
+        }
+        ast_kafka_queue_get_info(&info);
+        max_depth = MAX(max_depth, info.depth);
+        if (warmup && elapsed >= warmup) {
+            sample_take(&baseline, start);
+            sample_print("baseline", &baseline, down);
+            warmup = 0;
+        } else if (elapsed >= next_sample) {
+            sample_take(&sample, start);
+            sample_print("run", &sample, down);
+        }
+        while (next_sample <= elapsed) {
+            next_sample += interval;
+        }
+        usleep(100000);
+    }
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    pthread_join(worker, NULL);
+    if (down) {
+        brokers_set(mcluster, brokers, 0);
+    }
+
+    drain_start = now_seconds();
+    do {
+        usleep(100000);
+        sample_take(&final, start);
+    } while ((final.queue_depth || final.delivered + final.failed < final.enqueued)
+             && now_seconds() - drain_start < drain_seconds);
+    /* Messages dropped on a full queue were never enqueued */
+    drained = !final.queue_depth && final.delivered + final.failed >= final.enqueued;
+    sample_print("final", &final, 0);
+
+    heap_growth = final.heap_bytes - baseline.heap_bytes;
+    rss_growth = final.rss_kb - baseline.rss_kb;
+    failed = !drained || rss_growth > rss_limit * 1024
+        || (HAVE_HEAP_COUNTER && heap_growth > heap_limit * 1024 * 1024);
+    printf("{\"summary\":true,\"seconds\":%.0f,\"rate\":%ld,\"calls\":%" PRIu64 ",\"brokers\":%d,\"outages\":%d,"
+           "\"max_queue_depth\":%d,\"drained\":%s,\"rss_growth_kb\":%ld,",
+           final.seconds, rate, final.calls, brokers, outages, max_depth, drained ? "true" : "false", rss_growth);
+    if (HAVE_HEAP_COUNTER) {
+        printf("\"heap_growth_bytes\":%" PRId64 ",\"heap_blocks_growth\":%" PRId64 ",",
+               heap_growth, final.heap_blocks - baseline.heap_blocks);
+    } else {
+        printf("\"heap_growth_bytes\":null,\"heap_blocks_growth\":null,");
+    }
+    printf("\"result\":\"%s\"}\n", failed ? "fail" : "pass");
+
+    __internal_cel_kafka_self_info.unload();
+    __internal_cdr_kafka_self_info.unload();
+    __internal_res_kafka_self_info.unload();
+    rd_kafka_mock_cluster_destroy(mcluster);
+    rd_kafka_destroy(mock_rk);
+    return failed;
+}
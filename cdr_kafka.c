@@ -12,17 +12,23 @@
 #include <asterisk.h>
 #include <stdio.h>
 
-#include <librdkafka/rdkafka.h>
 #include <asterisk/cdr.h>
+#include <asterisk/chanvars.h>
 #include <asterisk/module.h>
 #include <asterisk/config.h>
 #include <asterisk/json.h>
+#include <asterisk/astobj2.h>
+#include <asterisk/strings.h>
+#include <asterisk/threadstorage.h>
 #include "res_kafka.h"
 
 
 #define DESCRIPTION         "Kafka CDR Backend"
 #define DEFAULT_KAFKA_TOPIC "asterisk-cdr"
-#define DEFAULT_DATE_FORMAT    "%F %T"
+#define DEFAULT_DATE_FORMAT    AST_KAFKA_DEFAULT_DATEFORMAT
+#define CDR_BUFFER_INIT_SIZE 1024
+#define KEY_VARIABLE_PREFIX "var:"
+#define KEY_LEN 32
 
 static const char name[] = "cdr_kafka";
 static const char conf_file[] = "cdr_kafka.conf";
@@ -30,16 +36,46 @@ static const char conf_file[] = "cdr_kafka.conf";
 
 static int enablecdr = 0;
 static char *kafka_topic;
+/*! \brief Cluster of the topic, NULL for the default one */
+static char *cluster_name;
+static struct ast_kafka_topic *topic;
 static char *dateformat;
 static char *zone;
+static struct ast_kafka_timefmt *timefmt;
+/*! \brief Write the answer time of an unanswered call as null, not as 1970-01-01 */
+static int null_times;
+/*! \brief Build an ast_json tree instead of writing the JSON directly */
+static int use_ast_json;
+static enum ast_kafka_format format;
+/*! \brief Message key, a CDR column or var:<name> for a CDR variable */
+static char *key_name;
+static const struct ast_kafka_field *key_field;
+static const char *key_variable;
+/*! \brief Columns to write and their names, all the CDR columns when unset */
+static char *fields_list;
+/*! \brief Columns of the records, compiled from fields_list or cdr_fields as is */
+static struct ast_kafka_field *projection;
+static const struct ast_kafka_field *record_fields;
+static size_t record_field_count;
+/*! \brief Message headers, e.g. accountcode for consumers to route on without parsing the payload */
+static char *headers_list;
+static struct ast_kafka_header_spec header_specs[AST_KAFKA_MAX_HEADERS];
+static int header_count;
+static struct ast_kafka_batch_config batch_config;
+/*! \brief Records packed into multi-record messages, NULL without batching */
+static struct ast_kafka_batch *batch;
+/*! \brief Headers of the batched messages, those with the same value for every record */
+static struct ast_kafka_header batch_headers[AST_KAFKA_MAX_HEADERS];
 
 AST_RWLOCK_DEFINE_STATIC(config_lock);
+AST_THREADSTORAGE(cdr_buf);
 
 static int load_config() {
     char *cat = NULL;
     struct ast_config *cfg;
     struct ast_variable *v;
     struct ast_flags config_flags = {0};
+    int res = 0;
 
     cfg = ast_config_load(conf_file, config_flags);
 
@@ -55,8 +91,16 @@ static int load_config() {
 
     /* Bootstrap the default configuration */
     kafka_topic = ast_strdup(DEFAULT_KAFKA_TOPIC);
+    cluster_name = NULL;
     dateformat = ast_strdup(DEFAULT_DATE_FORMAT);
     zone = NULL;
+    null_times = 0;
+    use_ast_json = 0;
+    format = AST_KAFKA_FORMAT_JSON;
+    key_name = NULL;
+    fields_list = NULL;
+    headers_list = NULL;
+    ast_kafka_batch_config_init(&batch_config);
 
     while ((cat = ast_category_browse(cfg, cat))) {
         if (!strcasecmp(cat, "general")) {
@@ -68,12 +112,42 @@ static int load_config() {
                 } else if (!strcasecmp(v->name, "topic")) {
                     ast_free(kafka_topic);
                     kafka_topic = ast_strdup(v->value);
+                } else if (!strcasecmp(v->name, "cluster")) {
+                    ast_free(cluster_name);
+                    cluster_name = ast_strdup(v->value);
                 } else if (!strcasecmp(v->name, "dateformat")) {
                     ast_free(dateformat);
                     dateformat = ast_strdup(v->value);
                 } else if (!strcasecmp(v->name, "timezone")) {
                     ast_free(zone);
                     zone = ast_strdup(v->value);
+                } else if (!strcasecmp(v->name, "null_times")) {
+                    null_times = ast_true(v->value);
+                } else if (!strcasecmp(v->name, "key")) {
+                    ast_free(key_name);
+                    key_name = ast_strdup(v->value);
+                } else if (!strcasecmp(v->name, "fields")) {
+                    ast_free(fields_list);
+                    fields_list = ast_strdup(v->value);
+                } else if (!strcasecmp(v->name, "headers")) {
+                    ast_free(headers_list);
+                    headers_list = ast_strdup(v->value);
+                } else if (!strcasecmp(v->name, "format")) {
+                    if (ast_kafka_format_from_str(v->value) < 0) {
+                        ast_log(LOG_WARNING, "Unknown format '%s', using json\n", v->value);
+                    } else {
+                        format = ast_kafka_format_from_str(v->value);
+                    }
+                } else if (!strcasecmp(v->name, "serializer")) {
+                    if (!strcasecmp(v->value, "ast_json")) {
+                        use_ast_json = 1;
+                    } else if (!strcasecmp(v->value, "stream")) {
+                        use_ast_json = 0;
+                    } else {
+                        ast_log(LOG_WARNING, "Unknown serializer '%s', using stream\n", v->value);
+                    }
+                } else if (ast_kafka_batch_config_set(&batch_config, v->name, v->value) < 0) {
+                    res = -1;
                 }
                 v = v->next;
 
@@ -82,9 +156,17 @@ static int load_config() {
     }
 
     ast_config_destroy(cfg);
+    if (res) {
+        return -1;
+    }
+
+    timefmt = ast_kafka_timefmt_create(dateformat, zone, null_times ? AST_KAFKA_TIMEFMT_UNSET_NULL : 0);
+    if (!timefmt) {
+        return -1;
+    }
 
     if (enablecdr) {
-        ast_log(LOG_NOTICE, "Using kafka topic %s", kafka_topic);
+        ast_log(LOG_NOTICE, "Using kafka topic %s, format %s\n", kafka_topic, ast_kafka_format_name(format));
     } else {
         ast_log(LOG_NOTICE, "%s is not enabled", DESCRIPTION);
     }
@@ -92,109 +174,208 @@ static int load_config() {
     return 0;
 }
 
-struct ast_json *json_timeformat(const struct timeval tv, const char *zone, const char *format) {
-    char buf[AST_ISO8601_LEN];
-    struct ast_tm tm = {};
-    ast_localtime(&tv, &tm, zone);
-    ast_strftime(buf, sizeof(buf), format, &tm);
-    return ast_json_string_create(buf);
+#define CDR_FIELD(member, type) AST_KAFKA_FIELD(struct ast_cdr, member, type)
+
+/*! \brief CDR columns, in the order of clickhouse/cdr.sql */
+static const struct ast_kafka_field cdr_fields[] = {
+    CDR_FIELD(clid, AST_KAFKA_FIELD_CHARS),
+    CDR_FIELD(src, AST_KAFKA_FIELD_CHARS),
+    CDR_FIELD(dst, AST_KAFKA_FIELD_CHARS),
+    CDR_FIELD(dcontext, AST_KAFKA_FIELD_CHARS),
+    CDR_FIELD(channel, AST_KAFKA_FIELD_CHARS),
+    CDR_FIELD(dstchannel, AST_KAFKA_FIELD_CHARS),
+    CDR_FIELD(lastapp, AST_KAFKA_FIELD_CHARS),
+    CDR_FIELD(lastdata, AST_KAFKA_FIELD_CHARS),
+    CDR_FIELD(start, AST_KAFKA_FIELD_TIME),
+    CDR_FIELD(answer, AST_KAFKA_FIELD_TIME),
+    CDR_FIELD(end, AST_KAFKA_FIELD_TIME),
+    CDR_FIELD(duration, AST_KAFKA_FIELD_LONG),
+    CDR_FIELD(billsec, AST_KAFKA_FIELD_LONG),
+    CDR_FIELD(disposition, AST_KAFKA_FIELD_LONG),
+    CDR_FIELD(amaflags, AST_KAFKA_FIELD_LONG),
+    CDR_FIELD(accountcode, AST_KAFKA_FIELD_CHARS),
+    CDR_FIELD(peeraccount, AST_KAFKA_FIELD_CHARS),
+    CDR_FIELD(flags, AST_KAFKA_FIELD_UINT),
+    CDR_FIELD(uniqueid, AST_KAFKA_FIELD_CHARS),
+    CDR_FIELD(linkedid, AST_KAFKA_FIELD_CHARS),
+    CDR_FIELD(userfield, AST_KAFKA_FIELD_CHARS),
+    CDR_FIELD(sequence, AST_KAFKA_FIELD_INT),
+};
+
+/*! \brief Resolve the key option against the CDR columns */
+static int resolve_key(void) {
+    key_field = NULL;
+    key_variable = NULL;
+    if (ast_strlen_zero(key_name) || !strcasecmp(key_name, "none")) {
+        return 0;
+    }
+    if (!strncasecmp(key_name, KEY_VARIABLE_PREFIX, strlen(KEY_VARIABLE_PREFIX))) {
+        key_variable = key_name + strlen(KEY_VARIABLE_PREFIX);
+        return 0;
+    }
+    key_field = ast_kafka_field_find(cdr_fields, ARRAY_LEN(cdr_fields), key_name);
+    if (!key_field) {
+        ast_log(LOG_ERROR, "Unknown CDR column '%s' for the message key\n", key_name);
+        return -1;
+    }
+    return 0;
 }
 
+/*!
+ * \brief Compile the fields option into the columns of the records
+ *
+ * Done once, so a CDR costs the columns written and the variables looked up, nothing more.
+ */
+static int resolve_fields(void) {
+    int count;
 
-static struct ast_json *obj_as_is(struct ast_cdr *cdr) {
-//    char clid[AST_MAX_EXTENSION];
-//    /*! Caller*ID number */
-//    char src[AST_MAX_EXTENSION];
-//    /*! Destination extension */
-//    char dst[AST_MAX_EXTENSION];
-//    /*! Destination context */
-//    char dcontext[AST_MAX_EXTENSION];
-//
-//    char channel[AST_MAX_EXTENSION];
-//    /*! Destination channel if appropriate */
-//    char dstchannel[AST_MAX_EXTENSION];
-//    /*! Last application if appropriate */
-//    char lastapp[AST_MAX_EXTENSION];
-//    /*! Last application data */
-//    char lastdata[AST_MAX_EXTENSION];
-//
-//    struct timeval start;
-//
-//    struct timeval answer;
-//
-//    struct timeval end;
-//    /*! Total time in system, in seconds */
-//    long int duration;
-//    /*! Total time call is up, in seconds */
-//    long int billsec;
-//    /*! What happened to the call */
-//    long int disposition;
-//    /*! What flags to use */
-//    long int amaflags;
-//    /*! What account number to use */
-//    char accountcode[AST_MAX_ACCOUNT_CODE];
-//    /*! Account number of the last person we talked to */
-//    char peeraccount[AST_MAX_ACCOUNT_CODE];
-//    /*! flags */
-//    unsigned int flags;
-//    /*! Unique Channel Identifier */
-//    char uniqueid[AST_MAX_UNIQUEID];
-//    /*! Linked group Identifier */
-//    char linkedid[AST_MAX_UNIQUEID];
-//    /*! User field */
-//    char userfield[AST_MAX_USER_FIELD];
-//    /*! Sequence field */
-//    int sequence;
-//
-//    /*! A linked list for variables */
-//    struct varshead varshead;
-//
-//    struct ast_cdr *next;
-    struct ast_json *payload;
-    payload = ast_json_object_create();
-    if (!payload) { return NULL; }
-    int res = 0;
-//res |= ast_json_object_set(payload, "", ast_json_string_create(cdr->));
-    res |= ast_json_object_set(payload, "clid", ast_json_string_create(cdr->clid));
-    res |= ast_json_object_set(payload, "src", ast_json_string_create(cdr->src));
-    res |= ast_json_object_set(payload, "dst", ast_json_string_create(cdr->dst));
-    res |= ast_json_object_set(payload, "dcontext", ast_json_string_create(cdr->dcontext));
-    res |= ast_json_object_set(payload, "channel", ast_json_string_create(cdr->channel));
-    res |= ast_json_object_set(payload, "dstchannel", ast_json_string_create(cdr->dstchannel));
-    res |= ast_json_object_set(payload, "lastapp", ast_json_string_create(cdr->lastapp));
-    res |= ast_json_object_set(payload, "lastdata", ast_json_string_create(cdr->lastdata));
+    record_fields = cdr_fields;
+    record_field_count = ARRAY_LEN(cdr_fields);
+    if (ast_strlen_zero(fields_list)) {
+        return 0;
+    }
+    count = ast_kafka_fields_parse(fields_list, cdr_fields, ARRAY_LEN(cdr_fields), offsetof(struct ast_cdr, varshead),
+                                   &projection);
+    if (count <= 0) {
+        ast_log(LOG_ERROR, "Invalid fields '%s'\n", fields_list);
+        return -1;
+    }
+    record_fields = projection;
+    record_field_count = count;
+    return 0;
+}
 
-    res |= ast_json_object_set(payload, "start", json_timeformat(cdr->start, zone, dateformat));
-    res |= ast_json_object_set(payload, "answer", json_timeformat(cdr->answer, zone, dateformat));
-    res |= ast_json_object_set(payload, "end", json_timeformat(cdr->end, zone, dateformat));
+/*! \brief Resolve the headers option against the CDR columns */
+static int resolve_headers(void) {
+    header_count = 0;
+    if (ast_strlen_zero(headers_list)) {
+        return 0;
+    }
+    header_count = ast_kafka_header_specs_parse(headers_list, cdr_fields, ARRAY_LEN(cdr_fields), header_specs);
+    if (header_count < 0) {
+        header_count = 0;
+        return -1;
+    }
+    return 0;
+}
 
-    res |= ast_json_object_set(payload, "duration", ast_json_integer_create(cdr->duration));
-    res |= ast_json_object_set(payload, "billsec", ast_json_integer_create(cdr->billsec));
+/*!
+ * \brief Set up batching once the topic, key and headers are known
+ *
+ * JSON records are separated by newlines as JSONEachRow expects, the rows
+ * of the binary formats follow each other as they are. Only the headers
+ * with the same value for every record are kept for the batched messages.
+ */
+static int create_batch(void) {
+    size_t count = 0;
+    int i;
 
-    res |= ast_json_object_set(payload, "disposition", ast_json_integer_create(cdr->disposition));
-    res |= ast_json_object_set(payload, "amaflags", ast_json_integer_create(cdr->amaflags));
+    if (batch_config.records <= 1) {
+        return 0;
+    }
+    batch_config.separator = format == AST_KAFKA_FORMAT_JSON ? '\n' : '\0';
+    if (!key_field && !key_variable) {
+        batch_config.slots = 0;
+    }
+    for (i = 0; i < header_count; i++) {
+        if (!header_specs[i].value) {
+            ast_log(LOG_WARNING, "Header %s differs between records and is left out of the batches\n",
+                    header_specs[i].name);
+            continue;
+        }
+        batch_headers[count].name = header_specs[i].name;
+        batch_headers[count].value = header_specs[i].value;
+        batch_headers[count].len = strlen(header_specs[i].value);
+        count++;
+    }
+    batch = ast_kafka_batch_create(topic, &batch_config, batch_headers, count);
+    return batch ? 0 : -1;
+}
 
-    res |= ast_json_object_set(payload, "accountcode", ast_json_string_create(cdr->accountcode));
-    res |= ast_json_object_set(payload, "peeraccount", ast_json_string_create(cdr->peeraccount));
+/*! \brief Value of a CDR variable, NULL when it is not set */
+static const char *cdr_variable(struct ast_cdr *cdr, const char *variable) {
+    struct ast_var_t *var;
 
-    res |= ast_json_object_set(payload, "flags", ast_json_integer_create(cdr->flags));
+    AST_LIST_TRAVERSE(&cdr->varshead, var, entries) {
+        if (!strcasecmp(ast_var_name(var), variable)) {
+            return ast_var_value(var);
+        }
+    }
+    return NULL;
+}
 
-    res |= ast_json_object_set(payload, "uniqueid", ast_json_string_create(cdr->uniqueid));
-    res |= ast_json_object_set(payload, "linkedid", ast_json_string_create(cdr->linkedid));
+/*! \brief Message key of a CDR, NULL when no key is configured or its value is empty */
+static const char *cdr_key(struct ast_cdr *cdr, char *buf, size_t size) {
+    const char *key = NULL;
 
-    res |= ast_json_object_set(payload, "userfield", ast_json_string_create(cdr->userfield));
-    res |= ast_json_object_set(payload, "sequence", ast_json_integer_create(cdr->sequence));
+    if (key_field) {
+        key = ast_kafka_field_text(key_field, cdr, buf, size);
+    } else if (key_variable) {
+        key = cdr_variable(cdr, key_variable);
+    }
+    return ast_strlen_zero(key) ? NULL : key;
+}
 
-    return payload;
+/*! \brief Fill the message headers of a CDR, headers with an empty value are left out */
+static size_t cdr_headers(struct ast_cdr *cdr, struct ast_kafka_header *headers, char (*bufs)[KEY_LEN]) {
+    const char *value;
+    size_t n = 0;
+    int i;
+
+    for (i = 0; i < header_count; i++) {
+        if (header_specs[i].field) {
+            value = ast_kafka_field_text(header_specs[i].field, cdr, bufs[i], KEY_LEN);
+        } else if (header_specs[i].variable) {
+            value = cdr_variable(cdr, header_specs[i].variable);
+        } else {
+            value = header_specs[i].value;
+        }
+        if (ast_strlen_zero(value)) {
+            continue;
+        }
+        headers[n].name = header_specs[i].name;
+        headers[n].value = value;
+        headers[n].len = strlen(value);
+        n++;
+    }
+    return n;
 }
 
 static int kafka_put(struct ast_cdr *cdr) {
     char *cdr_buffer;
     struct ast_json *t_cdr_json;
-    if (!enablecdr) {
+    struct ast_str *buf;
+    char key_buf[KEY_LEN];
+    const char *key;
+    struct ast_kafka_header headers[AST_KAFKA_MAX_HEADERS];
+    char header_bufs[AST_KAFKA_MAX_HEADERS][KEY_LEN];
+    size_t count;
+
+    if (!enablecdr || !topic) {
         return 0;
     }
-    t_cdr_json = obj_as_is(cdr);
+    /* Every record of a call gets the same key and so lands on the same partition */
+    key = cdr_key(cdr, key_buf, sizeof(key_buf));
+
+    if (!use_ast_json || format != AST_KAFKA_FORMAT_JSON) {
+        /* Written in one pass into a buffer reused by the next CDR of this thread */
+        buf = ast_str_thread_get(&cdr_buf, CDR_BUFFER_INIT_SIZE);
+        if (!buf) {
+            return 0;
+        }
+        ast_str_reset(buf);
+        ast_kafka_encode_record(&buf, format, record_fields, record_field_count, cdr, timefmt);
+        if (batch) {
+            ast_kafka_batch_add(batch, key, key ? strlen(key) : 0, ast_str_buffer(buf), ast_str_strlen(buf));
+            return 0;
+        }
+        count = cdr_headers(cdr, headers, header_bufs);
+        ast_kafka_topic_produce_headers(topic, key, key ? strlen(key) : 0, headers, count, ast_str_buffer(buf),
+                                        ast_str_strlen(buf), AST_KAFKA_F_COPY);
+        return 0;
+    }
+
+    t_cdr_json = ast_kafka_record_json(record_fields, record_field_count, cdr, timefmt);
     if (!t_cdr_json) {
         return 0;
     }
@@ -202,9 +383,20 @@ static int kafka_put(struct ast_cdr *cdr) {
     cdr_buffer = ast_json_dump_string(t_cdr_json);
 
     ast_json_unref(t_cdr_json);
+    if (!cdr_buffer) {
+        return 0;
+    }
+
+    if (batch) {
+        ast_kafka_batch_add(batch, key, key ? strlen(key) : 0, cdr_buffer, strlen(cdr_buffer));
+        ast_json_free(cdr_buffer);
+        return 0;
+    }
 
-    ast_kafka_produce(kafka_topic, cdr_buffer);
-    ast_json_free(cdr_buffer);
+    /* The dumped buffer is handed over to res_kafka as is */
+    count = cdr_headers(cdr, headers, header_bufs);
+    ast_kafka_topic_produce_headers(topic, key, key ? strlen(key) : 0, headers, count, cdr_buffer, strlen(cdr_buffer),
+                                    AST_KAFKA_F_FREE);
 
     return 0;
 }
@@ -214,14 +406,39 @@ static int unload_module(void) {
     if (ast_cdr_unregister(name)) {
         return -1;
     }
+    /* What the batch holds goes out before the topic is released */
+    ast_kafka_batch_destroy(batch);
+    batch = NULL;
+    ao2_cleanup(topic);
+    topic = NULL;
     ast_free(kafka_topic);
     ast_free(dateformat);
     ast_free(zone);
+    ast_free(key_name);
+    ast_kafka_fields_free(projection, record_field_count);
+    projection = NULL;
+    ast_free(fields_list);
+    ast_kafka_header_specs_free(header_specs, header_count);
+    header_count = 0;
+    ast_free(headers_list);
+    ast_free(cluster_name);
+    ast_kafka_timefmt_destroy(timefmt);
+    timefmt = NULL;
     return 0;
 }
 
 static int load_module(void) {
-    if (load_config()) {
+    if (load_config() || resolve_key() || resolve_fields() || resolve_headers()) {
+        return AST_MODULE_LOAD_DECLINE;
+    }
+
+    if (enablecdr && !(topic = ast_kafka_cluster_topic_get(cluster_name, kafka_topic))) {
+        ast_log(LOG_ERROR, "Unable to register kafka topic %s\n", kafka_topic);
+        return AST_MODULE_LOAD_DECLINE;
+    }
+    if (enablecdr && create_batch()) {
+        ao2_ref(topic, -1);
+        topic = NULL;
         return AST_MODULE_LOAD_DECLINE;
     }
 
@@ -16,109 +16,390 @@
 #include <asterisk/cel.h>
 #include <asterisk/config.h>
 #include <asterisk/json.h>
+#include <asterisk/astobj2.h>
 #include <asterisk/channel.h>
+#include <asterisk/pbx.h>
+#include <asterisk/strings.h>
+#include <asterisk/threadstorage.h>
 #include "res_kafka.h"
 #include <sys/time.h>
 
 #define DESCRIPTION         "Kafka CEL Backend"
 #define DEFAULT_KAFKA_TOPIC "asterisk_cel"
-#define DEFAULT_DATEFORMAT    "%F %T"
+#define DEFAULT_DATEFORMAT    AST_KAFKA_DEFAULT_DATEFORMAT
+/*! \brief Size of the event type bitmask, well above the last enum ast_cel_event_type value */
+#define CEL_EVENT_TYPES 64
+#define EVENT_BIT(type) (1ULL << (type))
+#define CEL_BUFFER_INIT_SIZE 1024
+#define KEY_VARIABLE_PREFIX "var:"
+#define KEY_LEN 256
 
 static char conf_file[] = "cel_kafka.conf";
 static char name[] = "cel_kafka";
 static int enablecel;
 
 static char *kafka_topic;
+/*! \brief Cluster of the topics, NULL for the default one */
+static char *cluster_name;
+static struct ast_kafka_topic *topic;
+/*! \brief Bitmask of enum ast_cel_event_type values to produce */
+static uint64_t event_mask;
+static char *event_topic_names[CEL_EVENT_TYPES];
+/*! \brief Per event type topics, NULL means the default topic */
+static struct ast_kafka_topic *event_topics[CEL_EVENT_TYPES];
 static char *dateformat;
 static char *zone;
+static struct ast_kafka_timefmt *timefmt;
+/*! \brief Build an ast_json tree instead of writing the JSON directly */
+static int use_ast_json;
+static enum ast_kafka_format format;
+/*! \brief Message key, a CEL column or var:<name> for a channel variable */
+static char *key_name;
+static const struct ast_kafka_field *key_field;
+static const char *key_variable;
+/*! \brief Message headers, e.g. event_name for consumers to route on without parsing the payload */
+static char *headers_list;
+static struct ast_kafka_header_spec header_specs[AST_KAFKA_MAX_HEADERS];
+static int header_count;
+static struct ast_kafka_batch_config batch_config;
+/*! \brief Records packed into multi-record messages of the general topic, NULL without batching */
+static struct ast_kafka_batch *batch;
+/*! \brief Batches of the per event type topics, shared by the event types of a topic */
+static struct ast_kafka_batch *event_batches[CEL_EVENT_TYPES];
+/*! \brief Headers of the batched messages, those with the same value for every record */
+static struct ast_kafka_header batch_headers[AST_KAFKA_MAX_HEADERS];
 
-struct ast_json *json_timeformat(const struct timeval tv, const char *zone, const char *format) {
-    char buf[AST_ISO8601_LEN];
-    struct ast_tm tm = {};
-    ast_localtime(&tv, &tm, zone);
-    ast_strftime(buf, sizeof(buf), format, &tm);
-    return ast_json_string_create(buf);
+AST_THREADSTORAGE(cel_buf);
+
+#define CEL_FIELD(member, type) AST_KAFKA_FIELD(struct ast_cel_event_record, member, type)
+
+/*! \brief CEL columns, in the order of clickhouse/cel.sql */
+static const struct ast_kafka_field cel_fields[] = {
+    CEL_FIELD(event_time, AST_KAFKA_FIELD_TIME),
+    CEL_FIELD(event_name, AST_KAFKA_FIELD_STRING),
+    CEL_FIELD(user_defined_name, AST_KAFKA_FIELD_STRING),
+    CEL_FIELD(caller_id_name, AST_KAFKA_FIELD_STRING),
+    CEL_FIELD(caller_id_num, AST_KAFKA_FIELD_STRING),
+    CEL_FIELD(caller_id_ani, AST_KAFKA_FIELD_STRING),
+    CEL_FIELD(caller_id_rdnis, AST_KAFKA_FIELD_STRING),
+    CEL_FIELD(caller_id_dnid, AST_KAFKA_FIELD_STRING),
+    CEL_FIELD(extension, AST_KAFKA_FIELD_STRING),
+    CEL_FIELD(context, AST_KAFKA_FIELD_STRING),
+    CEL_FIELD(channel_name, AST_KAFKA_FIELD_STRING),
+    CEL_FIELD(application_name, AST_KAFKA_FIELD_STRING),
+    CEL_FIELD(application_data, AST_KAFKA_FIELD_STRING),
+    CEL_FIELD(account_code, AST_KAFKA_FIELD_STRING),
+    CEL_FIELD(peer_account, AST_KAFKA_FIELD_STRING),
+    CEL_FIELD(unique_id, AST_KAFKA_FIELD_STRING),
+    CEL_FIELD(linked_id, AST_KAFKA_FIELD_STRING),
+    CEL_FIELD(amaflag, AST_KAFKA_FIELD_UINT),
+    CEL_FIELD(user_field, AST_KAFKA_FIELD_STRING),
+    CEL_FIELD(peer, AST_KAFKA_FIELD_STRING),
+    CEL_FIELD(extra, AST_KAFKA_FIELD_STRING),
+};
+
+/*! \brief Message key of an event, NULL when no key is configured or its value is empty */
+static const char *cel_key(const struct ast_cel_event_record *record, char *buf, size_t size) {
+    struct ast_channel *chan;
+    const char *value;
+
+    if (key_field) {
+        value = ast_kafka_field_text(key_field, record, buf, size);
+        return ast_strlen_zero(value) ? NULL : value;
+    }
+    if (!key_variable || ast_strlen_zero(record->unique_id)) {
+        return NULL;
+    }
+    /* The channel is gone by the time of some events, those get no key */
+    chan = ast_channel_get_by_name(record->unique_id);
+    if (!chan) {
+        return NULL;
+    }
+    *buf = '\0';
+    ast_channel_lock(chan);
+    value = pbx_builtin_getvar_helper(chan, key_variable);
+    if (value) {
+        ast_copy_string(buf, value, size);
+    }
+    ast_channel_unlock(chan);
+    ast_channel_unref(chan);
+    return ast_strlen_zero(buf) ? NULL : buf;
 }
 
-static struct ast_json *obj_as_is(struct ast_cel_event_record record) {
-
-//    uint32_t version;
-//    enum ast_cel_event_type event_type;
-//    struct timeval event_time;
-//    const char *event_name;
-//    const char *user_defined_name;
-//    const char *caller_id_name;
-//    const char *caller_id_num;
-//    const char *caller_id_ani;
-//    const char *caller_id_rdnis;
-//    const char *caller_id_dnid;
-//    const char *extension;
-//    const char *context;
-//    const char *channel_name;
-//    const char *application_name;
-//    const char *application_data;
-//    const char *account_code;
-//    const char *peer_account;
-//    const char *unique_id;
-//    const char *linked_id;
-//    uint amaflag;
-//    const char *user_field;
-//    const char *peer;
-//    const char *extra;
-
-    struct ast_json *payload;
-    payload = ast_json_object_create();
-    if (!payload) { return NULL; }
-    int res = 0;
-//    res |= ast_json_object_set(payload, "", ast_json_string_create(record.));
-    res |= ast_json_object_set(payload, "event_time", json_timeformat(record.event_time, zone, dateformat));
-    res |= ast_json_object_set(payload, "event_name", ast_json_string_create(record.event_name));
-    res |= ast_json_object_set(payload, "user_defined_name", ast_json_string_create(record.user_defined_name));
-    res |= ast_json_object_set(payload, "caller_id_name", ast_json_string_create(record.caller_id_name));
-    res |= ast_json_object_set(payload, "caller_id_num", ast_json_string_create(record.caller_id_num));
-    res |= ast_json_object_set(payload, "caller_id_ani", ast_json_string_create(record.caller_id_ani));
-    res |= ast_json_object_set(payload, "caller_id_rdnis", ast_json_string_create(record.caller_id_rdnis));
-    res |= ast_json_object_set(payload, "caller_id_dnid", ast_json_string_create(record.caller_id_dnid));
-    res |= ast_json_object_set(payload, "extension", ast_json_string_create(record.extension));
-    res |= ast_json_object_set(payload, "context", ast_json_string_create(record.context));
-    res |= ast_json_object_set(payload, "channel_name", ast_json_string_create(record.channel_name));
-    res |= ast_json_object_set(payload, "application_name", ast_json_string_create(record.application_name));
-    res |= ast_json_object_set(payload, "application_data", ast_json_string_create(record.application_data));
-    res |= ast_json_object_set(payload, "account_code", ast_json_string_create(record.account_code));
-    res |= ast_json_object_set(payload, "peer_account", ast_json_string_create(record.peer_account));
-    res |= ast_json_object_set(payload, "unique_id", ast_json_string_create(record.unique_id));
-    res |= ast_json_object_set(payload, "linked_id", ast_json_string_create(record.linked_id));
-    res |= ast_json_object_set(payload, "amaflag", ast_json_integer_create(record.amaflag));
-    res |= ast_json_object_set(payload, "user_field", ast_json_string_create(record.user_field));
-    res |= ast_json_object_set(payload, "peer", ast_json_string_create(record.peer));
-    res |= ast_json_object_set(payload, "extra", ast_json_string_create(record.extra));
-
-    return payload;
+/*! \brief Fill the message headers of an event, headers with an empty value are left out */
+static size_t cel_headers(const struct ast_cel_event_record *record, struct ast_kafka_header *headers,
+                          char (*bufs)[KEY_LEN]) {
+    struct ast_channel *chan = NULL;
+    const char *value;
+    size_t n = 0;
+    int i;
+
+    for (i = 0; i < header_count; i++) {
+        if (header_specs[i].field) {
+            value = ast_kafka_field_text(header_specs[i].field, record, bufs[i], KEY_LEN);
+        } else if (header_specs[i].variable) {
+            /* Looked up once for all the variables, the channel is gone by the time of some events */
+            if (!chan && !ast_strlen_zero(record->unique_id)) {
+                chan = ast_channel_get_by_name(record->unique_id);
+                if (chan) {
+                    ast_channel_lock(chan);
+                }
+            }
+            value = chan ? pbx_builtin_getvar_helper(chan, header_specs[i].variable) : NULL;
+            if (value) {
+                ast_copy_string(bufs[i], value, KEY_LEN);
+                value = bufs[i];
+            }
+        } else {
+            value = header_specs[i].value;
+        }
+        if (ast_strlen_zero(value)) {
+            continue;
+        }
+        headers[n].name = header_specs[i].name;
+        headers[n].value = value;
+        headers[n].len = strlen(value);
+        n++;
+    }
+    if (chan) {
+        ast_channel_unlock(chan);
+        ast_channel_unref(chan);
+    }
+    return n;
 }
 
 static void cel_kafka_put(struct ast_event *event) {
     char *cel_buffer;
     struct ast_json *t_cel_json;
+    struct ast_kafka_topic *event_topic;
+    struct ast_kafka_batch *event_batch;
+    struct ast_str *buf;
+    unsigned int type;
+    char key_buf[KEY_LEN];
+    const char *key;
+    struct ast_kafka_header headers[AST_KAFKA_MAX_HEADERS];
+    char header_bufs[AST_KAFKA_MAX_HEADERS][KEY_LEN];
+    size_t count;
     struct ast_cel_event_record record = {
             .version = AST_CEL_EVENT_RECORD_VERSION,
     };
 
-    if (!enablecel) {
+    if (!enablecel || !topic) {
         return;
     }
 
+    /* Drop filtered events before anything is copied or serialized */
+    type = ast_event_get_ie_uint(event, AST_EVENT_IE_CEL_EVENT_TYPE);
+    if (type >= CEL_EVENT_TYPES || !(event_mask & EVENT_BIT(type))) {
+        return;
+    }
+    event_topic = event_topics[type] ? event_topics[type] : topic;
+
     if (ast_cel_fill_record(event, &record)) {
         return;
     }
+    /* During a flood whole calls are sampled out or throttled, before anything is serialized */
+    if (ast_kafka_topic_admit(event_topic, record.linked_id, AST_KAFKA_PRIORITY_NORMAL)) {
+        return;
+    }
+    /* Every event of a call gets the same key and so lands on the same partition */
+    key = cel_key(&record, key_buf, sizeof(key_buf));
+    event_batch = event_batches[type] ? event_batches[type] : batch;
+
+    if (!use_ast_json || format != AST_KAFKA_FORMAT_JSON) {
+        /* Written in one pass into a buffer reused by the next event of this thread */
+        buf = ast_str_thread_get(&cel_buf, CEL_BUFFER_INIT_SIZE);
+        if (!buf) {
+            return;
+        }
+        ast_str_reset(buf);
+        ast_kafka_encode_record(&buf, format, cel_fields, ARRAY_LEN(cel_fields), &record, timefmt);
+        if (event_batch) {
+            ast_kafka_batch_add(event_batch, key, key ? strlen(key) : 0, ast_str_buffer(buf), ast_str_strlen(buf));
+            return;
+        }
+        count = cel_headers(&record, headers, header_bufs);
+        ast_kafka_topic_produce_headers(event_topic, key, key ? strlen(key) : 0, headers, count,
+                                        ast_str_buffer(buf), ast_str_strlen(buf), AST_KAFKA_F_COPY);
+        return;
+    }
 
-    t_cel_json = obj_as_is(record);
+    t_cel_json = ast_kafka_record_json(cel_fields, ARRAY_LEN(cel_fields), &record, timefmt);
     if (!t_cel_json) {
         return;
     }
     cel_buffer = ast_json_dump_string(t_cel_json);
     ast_json_unref(t_cel_json);
-    ast_kafka_produce(kafka_topic, cel_buffer);
-    ast_json_free(cel_buffer);
+    if (!cel_buffer) {
+        return;
+    }
+    if (event_batch) {
+        ast_kafka_batch_add(event_batch, key, key ? strlen(key) : 0, cel_buffer, strlen(cel_buffer));
+        ast_json_free(cel_buffer);
+        return;
+    }
+    /* The dumped buffer is handed over to res_kafka as is */
+    count = cel_headers(&record, headers, header_bufs);
+    ast_kafka_topic_produce_headers(event_topic, key, key ? strlen(key) : 0, headers, count, cel_buffer,
+                                    strlen(cel_buffer), AST_KAFKA_F_FREE);
+}
+
+/*!
+ * \brief Parse a comma separated list of CEL event names into a bitmask
+ * \retval -1 on an unknown event name
+ */
+static int parse_events(const char *value, uint64_t *mask) {
+    char *list = ast_strdupa(value);
+    char *event_name;
+    enum ast_cel_event_type type;
+
+    *mask = 0;
+    while ((event_name = ast_strsep(&list, ',', AST_STRSEP_STRIP))) {
+        if (ast_strlen_zero(event_name)) {
+            continue;
+        }
+        type = ast_cel_str_to_event_type(event_name);
+        if (type == AST_CEL_ALL) {
+            *mask = ~0ULL;
+        } else if (type > AST_CEL_ALL && type < CEL_EVENT_TYPES) {
+            *mask |= EVENT_BIT(type);
+        } else {
+            ast_log(LOG_WARNING, "Unknown CEL event '%s' specified for %s.\n", event_name, DESCRIPTION);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void free_event_topics(void) {
+    int i;
+    for (i = 0; i < CEL_EVENT_TYPES; i++) {
+        ao2_cleanup(event_topics[i]);
+        event_topics[i] = NULL;
+        ast_free(event_topic_names[i]);
+        event_topic_names[i] = NULL;
+    }
+}
+
+/*! \brief Resolve the key option against the CEL columns */
+static int resolve_key(void) {
+    key_field = NULL;
+    key_variable = NULL;
+    if (ast_strlen_zero(key_name) || !strcasecmp(key_name, "none")) {
+        return 0;
+    }
+    if (!strncasecmp(key_name, KEY_VARIABLE_PREFIX, strlen(KEY_VARIABLE_PREFIX))) {
+        key_variable = key_name + strlen(KEY_VARIABLE_PREFIX);
+        return 0;
+    }
+    key_field = ast_kafka_field_find(cel_fields, ARRAY_LEN(cel_fields), key_name);
+    if (!key_field) {
+        ast_log(LOG_ERROR, "Unknown CEL column '%s' for the message key\n", key_name);
+        return -1;
+    }
+    return 0;
+}
+
+/*! \brief Resolve the headers option against the CEL columns */
+static int resolve_headers(void) {
+    header_count = 0;
+    if (ast_strlen_zero(headers_list)) {
+        return 0;
+    }
+    header_count = ast_kafka_header_specs_parse(headers_list, cel_fields, ARRAY_LEN(cel_fields), header_specs);
+    if (header_count < 0) {
+        header_count = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/*!
+ * \brief Set up batching once the topics, key and headers are known
+ *
+ * Event types of the same topic share its batch, so the events of a call
+ * stay in order. Only the headers with the same value for every record are
+ * kept for the batched messages.
+ */
+static int create_batches(void) {
+    size_t count = 0;
+    int i, j;
+
+    if (batch_config.records <= 1) {
+        return 0;
+    }
+    batch_config.separator = format == AST_KAFKA_FORMAT_JSON ? '\n' : '\0';
+    if (!key_field && !key_variable) {
+        batch_config.slots = 0;
+    }
+    for (i = 0; i < header_count; i++) {
+        if (!header_specs[i].value) {
+            ast_log(LOG_WARNING, "Header %s differs between records and is left out of the batches\n",
+                    header_specs[i].name);
+            continue;
+        }
+        batch_headers[count].name = header_specs[i].name;
+        batch_headers[count].value = header_specs[i].value;
+        batch_headers[count].len = strlen(header_specs[i].value);
+        count++;
+    }
+    if (!(batch = ast_kafka_batch_create(topic, &batch_config, batch_headers, count))) {
+        return -1;
+    }
+    for (i = 0; i < CEL_EVENT_TYPES; i++) {
+        if (!event_topics[i] || event_topics[i] == topic) {
+            continue;
+        }
+        for (j = 0; j < i && event_topics[j] != event_topics[i]; j++) {
+        }
+        if (j < i) {
+            event_batches[i] = event_batches[j];
+        } else if (!(event_batches[i] = ast_kafka_batch_create(event_topics[i], &batch_config, batch_headers,
+                                                               count))) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*! \brief Produce what the batches hold, before the topics are released */
+static void destroy_batches(void) {
+    int i, j;
+
+    for (i = 0; i < CEL_EVENT_TYPES; i++) {
+        if (!event_batches[i]) {
+            continue;
+        }
+        for (j = i + 1; j < CEL_EVENT_TYPES; j++) {
+            if (event_batches[j] == event_batches[i]) {
+                event_batches[j] = NULL;
+            }
+        }
+        ast_kafka_batch_destroy(event_batches[i]);
+        event_batches[i] = NULL;
+    }
+    ast_kafka_batch_destroy(batch);
+    batch = NULL;
+}
+
+/*! \brief Resolve the configured topic handles once */
+static int resolve_topics(void) {
+    int i;
+
+    if (!(topic = ast_kafka_cluster_topic_get(cluster_name, kafka_topic))) {
+        ast_log(LOG_ERROR, "Unable to register kafka topic %s\n", kafka_topic);
+        return -1;
+    }
+    for (i = 0; i < CEL_EVENT_TYPES; i++) {
+        if (!event_topic_names[i]) {
+            continue;
+        }
+        if (!(event_topics[i] = ast_kafka_cluster_topic_get(cluster_name, event_topic_names[i]))) {
+            ast_log(LOG_ERROR, "Unable to register kafka topic %s\n", event_topic_names[i]);
+            return -1;
+        }
+    }
+    return 0;
 }
 
 static int load_config() {
@@ -126,6 +407,10 @@ static int load_config() {
     struct ast_config *cfg;
     struct ast_flags config_flags = {0};
     struct ast_variable *v;
+    uint64_t exclude_mask = 0;
+    enum ast_cel_event_type type;
+    int res = 0;
+    int batch_res;
 
     cfg = ast_config_load(conf_file, config_flags);
 
@@ -139,11 +424,34 @@ static int load_config() {
 
     enablecel = 0;
     kafka_topic = ast_strdup(DEFAULT_KAFKA_TOPIC);
+    cluster_name = NULL;
     dateformat = ast_strdup(DEFAULT_DATEFORMAT);
     zone = NULL;
+    use_ast_json = 0;
+    format = AST_KAFKA_FORMAT_JSON;
+    key_name = NULL;
+    headers_list = NULL;
+    ast_kafka_batch_config_init(&batch_config);
+
+    event_mask = ~0ULL;
 
     while ((cat = ast_category_browse(cfg, cat))) {
 
+        if (!strcasecmp(cat, "topics")) {
+            /* Event type to topic map */
+            for (v = ast_variable_browse(cfg, cat); v; v = v->next) {
+                type = ast_cel_str_to_event_type(v->name);
+                if (type <= AST_CEL_ALL || type >= CEL_EVENT_TYPES) {
+                    ast_log(LOG_WARNING, "Unknown CEL event '%s' specified for %s.\n", v->name, DESCRIPTION);
+                    res = -1;
+                    continue;
+                }
+                ast_free(event_topic_names[type]);
+                event_topic_names[type] = ast_strdup(v->value);
+            }
+            continue;
+        }
+
         if (strcasecmp(cat, "general")) {
             continue;
         }
@@ -154,12 +462,41 @@ static int load_config() {
             } else if (!strcasecmp(v->name, "topic")) {
                 ast_free(kafka_topic);
                 kafka_topic = ast_strdup(v->value);
+            } else if (!strcasecmp(v->name, "cluster")) {
+                ast_free(cluster_name);
+                cluster_name = ast_strdup(v->value);
             } else if (!strcasecmp(v->name, "dateformat")) {
                 ast_free(dateformat);
                 dateformat = ast_strdup(v->value);
             } else if (!strcasecmp(v->name, "timezone")) {
                 ast_free(zone);
                 zone = ast_strdup(v->value);
+            } else if (!strcasecmp(v->name, "key")) {
+                ast_free(key_name);
+                key_name = ast_strdup(v->value);
+            } else if (!strcasecmp(v->name, "headers")) {
+                ast_free(headers_list);
+                headers_list = ast_strdup(v->value);
+            } else if (!strcasecmp(v->name, "format")) {
+                if (ast_kafka_format_from_str(v->value) < 0) {
+                    ast_log(LOG_WARNING, "Unknown format '%s', using json\n", v->value);
+                } else {
+                    format = ast_kafka_format_from_str(v->value);
+                }
+            } else if (!strcasecmp(v->name, "serializer")) {
+                if (!strcasecmp(v->value, "ast_json")) {
+                    use_ast_json = 1;
+                } else if (!strcasecmp(v->value, "stream")) {
+                    use_ast_json = 0;
+                } else {
+                    ast_log(LOG_WARNING, "Unknown serializer '%s', using stream\n", v->value);
+                }
+            } else if (!strcasecmp(v->name, "events")) {
+                res |= parse_events(v->value, &event_mask);
+            } else if (!strcasecmp(v->name, "exclude_events")) {
+                res |= parse_events(v->value, &exclude_mask);
+            } else if ((batch_res = ast_kafka_batch_config_set(&batch_config, v->name, v->value)) <= 0) {
+                res |= batch_res;
             } else {
                 ast_log(LOG_NOTICE, "Unknown option '%s' specified for %s.\n", v->name, DESCRIPTION);
             }
@@ -167,8 +504,20 @@ static int load_config() {
     }
     ast_config_destroy(cfg);
 
+    if (res) {
+        free_event_topics();
+        return -1;
+    }
+    event_mask &= ~exclude_mask;
+
+    timefmt = ast_kafka_timefmt_create(dateformat, zone, 0);
+    if (!timefmt) {
+        free_event_topics();
+        return -1;
+    }
+
     if (enablecel) {
-        ast_log(LOG_NOTICE, "Using kafka topic %s", kafka_topic);
+        ast_log(LOG_NOTICE, "Using kafka topic %s, format %s\n", kafka_topic, ast_kafka_format_name(format));
     } else {
         ast_log(LOG_NOTICE, "%s is not enabled", DESCRIPTION);
     }
@@ -178,10 +527,17 @@ static int load_config() {
 
 
 static int load_module(void) {
-    if (load_config()) {
+    if (load_config() || resolve_key() || resolve_headers()) {
         ast_log(LOG_WARNING, "%s is not activated.\n", DESCRIPTION);
         return AST_MODULE_LOAD_DECLINE;
     }
+    if (enablecel && (resolve_topics() || create_batches())) {
+        destroy_batches();
+        ao2_cleanup(topic);
+        topic = NULL;
+        free_event_topics();
+        return AST_MODULE_LOAD_DECLINE;
+    }
     if (ast_cel_backend_register(DESCRIPTION, cel_kafka_put)) {
         ast_log(LOG_ERROR, "Unable to register %s\n", DESCRIPTION);
         return AST_MODULE_LOAD_DECLINE;
@@ -192,9 +548,20 @@ static int load_module(void) {
 
 static int unload_module(void) {
     ast_cel_backend_unregister(DESCRIPTION);
+    destroy_batches();
+    ao2_cleanup(topic);
+    topic = NULL;
+    free_event_topics();
     ast_free(kafka_topic);
     ast_free(dateformat);
     ast_free(zone);
+    ast_free(key_name);
+    ast_kafka_header_specs_free(header_specs, header_count);
+    header_count = 0;
+    ast_free(headers_list);
+    ast_free(cluster_name);
+    ast_kafka_timefmt_destroy(timefmt);
+    timefmt = NULL;
 
     return 0;
 }
@@ -9,7 +9,7 @@ CREATE TABLE kafka_asterisk_cdr
     lastapp     String,
     lastdata    String,
     start       DateTime,
-    answer      DateTime,
+    answer      DateTime, -- Nullable(DateTime) with null_times=yes in cdr_kafka.conf
     end         DateTime,
     duration    Int32,
     billsec     Int32,
@@ -35,7 +35,7 @@ CREATE TABLE asterisk_cdr
     lastapp     String,
     lastdata    String,
     start       DateTime,
-    answer      DateTime,
+    answer      DateTime, -- Nullable(DateTime) with null_times=yes in cdr_kafka.conf
     end         DateTime,
     duration    Int32,
     billsec     Int32,
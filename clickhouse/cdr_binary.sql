@@ -0,0 +1,34 @@
+-- Kafka tables for the binary formats of cdr_kafka (format=rowbinary, msgpack, protobuf
+-- in cdr_kafka.conf). Each one reads its own topic into the asterisk_cdr table of cdr.sql.
+-- The Protobuf table needs cdr.proto in the format_schemas directory of the server.
+
+CREATE TABLE kafka_asterisk_cdr_rowbinary AS kafka_asterisk_cdr
+ENGINE = Kafka SETTINGS kafka_broker_list = 'localhost:9092',
+         kafka_topic_list = 'asterisk_cdr_rowbinary',
+         kafka_group_name = 'group1',
+         kafka_format = 'RowBinary';
+
+CREATE MATERIALIZED VIEW asterisk_cdr_rowbinary_consumer TO asterisk_cdr AS
+SELECT *
+FROM kafka_asterisk_cdr_rowbinary;
+
+CREATE TABLE kafka_asterisk_cdr_msgpack AS kafka_asterisk_cdr
+ENGINE = Kafka SETTINGS kafka_broker_list = 'localhost:9092',
+         kafka_topic_list = 'asterisk_cdr_msgpack',
+         kafka_group_name = 'group1',
+         kafka_format = 'MsgPack';
+
+CREATE MATERIALIZED VIEW asterisk_cdr_msgpack_consumer TO asterisk_cdr AS
+SELECT *
+FROM kafka_asterisk_cdr_msgpack;
+
+CREATE TABLE kafka_asterisk_cdr_protobuf AS kafka_asterisk_cdr
+ENGINE = Kafka SETTINGS kafka_broker_list = 'localhost:9092',
+         kafka_topic_list = 'asterisk_cdr_protobuf',
+         kafka_group_name = 'group1',
+         kafka_format = 'Protobuf',
+         kafka_schema = 'cdr:Cdr';
+
+CREATE MATERIALIZED VIEW asterisk_cdr_protobuf_consumer TO asterisk_cdr AS
+SELECT *
+FROM kafka_asterisk_cdr_protobuf;
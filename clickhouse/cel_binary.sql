@@ -0,0 +1,34 @@
+-- Kafka tables for the binary formats of cel_kafka (format=rowbinary, msgpack, protobuf
+-- in cel_kafka.conf). Each one reads its own topic into the asterisk_cel table of cel.sql.
+-- The Protobuf table needs cel.proto in the format_schemas directory of the server.
+
+CREATE TABLE kafka_asterisk_cel_rowbinary AS kafka_asterisk_cel
+ENGINE = Kafka SETTINGS kafka_broker_list = 'localhost:9092',
+         kafka_topic_list = 'asterisk_cel_rowbinary',
+         kafka_group_name = 'group1',
+         kafka_format = 'RowBinary';
+
+CREATE MATERIALIZED VIEW asterisk_cel_rowbinary_consumer TO asterisk_cel AS
+SELECT *
+FROM kafka_asterisk_cel_rowbinary;
+
+CREATE TABLE kafka_asterisk_cel_msgpack AS kafka_asterisk_cel
+ENGINE = Kafka SETTINGS kafka_broker_list = 'localhost:9092',
+         kafka_topic_list = 'asterisk_cel_msgpack',
+         kafka_group_name = 'group1',
+         kafka_format = 'MsgPack';
+
+CREATE MATERIALIZED VIEW asterisk_cel_msgpack_consumer TO asterisk_cel AS
+SELECT *
+FROM kafka_asterisk_cel_msgpack;
+
+CREATE TABLE kafka_asterisk_cel_protobuf AS kafka_asterisk_cel
+ENGINE = Kafka SETTINGS kafka_broker_list = 'localhost:9092',
+         kafka_topic_list = 'asterisk_cel_protobuf',
+         kafka_group_name = 'group1',
+         kafka_format = 'Protobuf',
+         kafka_schema = 'cel:Cel';
+
+CREATE MATERIALIZED VIEW asterisk_cel_protobuf_consumer TO asterisk_cel AS
+SELECT *
+FROM kafka_asterisk_cel_protobuf;
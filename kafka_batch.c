@@ -0,0 +1,322 @@
+/*! \file
+ *
+ * \brief Batching of records into multi-record Kafka messages
+ *
+ * Records are appended to the open batch of their slot, which is produced
+ * as one message once it holds enough records or bytes, or once its first
+ * record has waited for the linger time. The buffer of a batch is handed
+ * over to librdkafka as is. The message carries its record count in a
+ * header, so the delivery metrics count records as well as messages.
+ *
+ * \author Max Nesterov <braams@braams.ru>
+ *
+ */
+
+#define AST_MODULE_SELF_SYM __internal_res_kafka_self
+#define AST_MODULE "res_kafka"
+
+#include <asterisk.h>
+#include <asterisk/linkedlists.h>
+#include <asterisk/lock.h>
+#include <asterisk/strings.h>
+#include <asterisk/time.h>
+#include <asterisk/utils.h>
+#include "res_kafka.h"
+#include "kafka_batch.h"
+
+#define DEFAULT_BATCH_BYTES 262144
+#define DEFAULT_BATCH_LINGER_MS 100
+#define DEFAULT_BATCH_SLOTS 16
+#define BATCH_BUFFER_INIT_SIZE 4096
+/*! \brief Longest sleep of the linger thread, it checks the batches at least that often */
+#define LINGER_TICK_MAX_MS 1000
+/*! \brief Shortest sleep of the linger thread */
+#define LINGER_TICK_MIN_MS 5
+
+/*! \brief Open batch of a slot */
+struct batch_slot {
+    /*! ast_malloc()ed, taken over by the message */
+    char *data;
+    size_t len;
+    size_t size;
+    unsigned int records;
+    /*! When the first record was added */
+    struct timeval first;
+};
+
+struct ast_kafka_batch {
+    AST_LIST_ENTRY(ast_kafka_batch) list;
+    /*! Held while a batch is produced, so the batches of a slot are produced in order */
+    ast_mutex_t lock;
+    struct ast_kafka_topic *topic;
+    struct ast_kafka_batch_config config;
+    const struct ast_kafka_header *headers;
+    size_t header_count;
+    unsigned int slot_count;
+    struct batch_slot slots[0];
+};
+
+static AST_LIST_HEAD_NOLOCK_STATIC(batches, ast_kafka_batch);
+AST_MUTEX_DEFINE_STATIC(batches_lock);
+static ast_cond_t linger_cond;
+static pthread_t linger_thread = AST_PTHREADT_NULL;
+static int linger_running;
+
+void ast_kafka_batch_config_init(struct ast_kafka_batch_config *config) {
+    config->records = 0;
+    config->bytes = DEFAULT_BATCH_BYTES;
+    config->linger_ms = DEFAULT_BATCH_LINGER_MS;
+    config->slots = DEFAULT_BATCH_SLOTS;
+    config->separator = '\n';
+}
+
+int ast_kafka_batch_config_set(struct ast_kafka_batch_config *config, const char *name, const char *value) {
+    unsigned int number;
+
+    if (strcasecmp(name, "batch_records") && strcasecmp(name, "batch_bytes") && strcasecmp(name, "batch_linger_ms")
+        && strcasecmp(name, "batch_slots")) {
+        return 1;
+    }
+    /* 0 records turns batching off, 0 or 1 slot keeps the records in one batch without a key */
+    if (sscanf(value, "%30u", &number) != 1
+        || (!number && strcasecmp(name, "batch_records") && strcasecmp(name, "batch_slots"))) {
+        ast_log(LOG_ERROR, "Invalid value '%s' of option '%s'\n", value, name);
+        return -1;
+    }
+    if (!strcasecmp(name, "batch_records")) {
+        config->records = number;
+    } else if (!strcasecmp(name, "batch_bytes")) {
+        config->bytes = number;
+    } else if (!strcasecmp(name, "batch_linger_ms")) {
+        config->linger_ms = number;
+    } else {
+        config->slots = number;
+    }
+    return 0;
+}
+
+/*! \brief Produce the batch of a slot, the batch is locked */
+static void slot_flush(struct ast_kafka_batch *batch, unsigned int index) {
+    struct batch_slot *slot = &batch->slots[index];
+    struct ast_kafka_header headers[AST_KAFKA_MAX_HEADERS + 1];
+    char records[16];
+    char key[16];
+    int key_len = 0;
+
+    if (!slot->records) {
+        return;
+    }
+    memcpy(headers, batch->headers, batch->header_count * sizeof(*headers));
+    headers[batch->header_count].name = AST_KAFKA_RECORDS_HEADER;
+    headers[batch->header_count].value = records;
+    headers[batch->header_count].len = snprintf(records, sizeof(records), "%u", slot->records);
+    if (batch->config.slots > 1) {
+        key_len = snprintf(key, sizeof(key), "%u", index);
+    }
+    ast_kafka_topic_produce_headers(batch->topic, key_len ? key : NULL, key_len, headers, batch->header_count + 1,
+                                    slot->data, slot->len, AST_KAFKA_F_FREE);
+    slot->data = NULL;
+    slot->len = slot->size = 0;
+    slot->records = 0;
+}
+
+static void batch_flush(struct ast_kafka_batch *batch) {
+    unsigned int i;
+
+    ast_mutex_lock(&batch->lock);
+    for (i = 0; i < batch->slot_count; i++) {
+        slot_flush(batch, i);
+    }
+    ast_mutex_unlock(&batch->lock);
+}
+
+/*! \brief Produce the batches whose first record has waited long enough */
+static void batch_linger(struct ast_kafka_batch *batch, struct timeval now) {
+    unsigned int i;
+
+    ast_mutex_lock(&batch->lock);
+    for (i = 0; i < batch->slot_count; i++) {
+        if (batch->slots[i].records && ast_tvdiff_ms(now, batch->slots[i].first) >= batch->config.linger_ms) {
+            slot_flush(batch, i);
+        }
+    }
+    ast_mutex_unlock(&batch->lock);
+}
+
+/*! \brief Sleep of the linger thread, a quarter of the shortest linger time */
+static unsigned int linger_tick(void) {
+    struct ast_kafka_batch *batch;
+    unsigned int tick = LINGER_TICK_MAX_MS;
+
+    AST_LIST_TRAVERSE(&batches, batch, list) {
+        tick = MIN(tick, batch->config.linger_ms / 4);
+    }
+    return MAX(tick, LINGER_TICK_MIN_MS);
+}
+
+static void *do_linger(void *data) {
+    struct ast_kafka_batch *batch;
+    struct timeval now, wake;
+    struct timespec ts;
+    unsigned int tick;
+
+    ast_mutex_lock(&batches_lock);
+    while (linger_running) {
+        now = ast_tvnow();
+        AST_LIST_TRAVERSE(&batches, batch, list) {
+            batch_linger(batch, now);
+        }
+        tick = linger_tick();
+        wake = ast_tvadd(ast_tvnow(), ast_tv(tick / 1000, (tick % 1000) * 1000));
+        ts.tv_sec = wake.tv_sec;
+        ts.tv_nsec = wake.tv_usec * 1000;
+        ast_cond_timedwait(&linger_cond, &batches_lock, &ts);
+    }
+    ast_mutex_unlock(&batches_lock);
+    return NULL;
+}
+
+int kafka_batch_start(void) {
+    ast_cond_init(&linger_cond, NULL);
+    linger_running = 1;
+    if (ast_pthread_create_background(&linger_thread, NULL, do_linger, NULL)) {
+        ast_log(LOG_ERROR, "Unable to start the batch linger thread\n");
+        linger_thread = AST_PTHREADT_NULL;
+        linger_running = 0;
+        ast_cond_destroy(&linger_cond);
+        return -1;
+    }
+    return 0;
+}
+
+void kafka_batch_stop(void) {
+    struct ast_kafka_batch *batch;
+
+    if (linger_thread == AST_PTHREADT_NULL) {
+        return;
+    }
+    ast_mutex_lock(&batches_lock);
+    linger_running = 0;
+    ast_cond_signal(&linger_cond);
+    ast_mutex_unlock(&batches_lock);
+    pthread_join(linger_thread, NULL);
+    linger_thread = AST_PTHREADT_NULL;
+    ast_cond_destroy(&linger_cond);
+
+    /* Batches of modules which are still loaded */
+    ast_mutex_lock(&batches_lock);
+    AST_LIST_TRAVERSE(&batches, batch, list) {
+        batch_flush(batch);
+    }
+    ast_mutex_unlock(&batches_lock);
+}
+
+struct ast_kafka_batch *ast_kafka_batch_create(struct ast_kafka_topic *topic,
+                                               const struct ast_kafka_batch_config *config,
+                                               const struct ast_kafka_header *headers, size_t header_count) {
+    struct ast_kafka_batch *batch;
+    unsigned int slot_count = MAX(config->slots, 1);
+
+    if (header_count > AST_KAFKA_MAX_HEADERS) {
+        ast_log(LOG_ERROR, "More than %d headers\n", AST_KAFKA_MAX_HEADERS);
+        return NULL;
+    }
+    batch = ast_calloc(1, sizeof(*batch) + slot_count * sizeof(*batch->slots));
+    if (!batch) {
+        return NULL;
+    }
+    ast_mutex_init(&batch->lock);
+    batch->topic = ao2_bump(topic);
+    batch->config = *config;
+    batch->headers = headers;
+    batch->header_count = header_count;
+    batch->slot_count = slot_count;
+
+    ast_mutex_lock(&batches_lock);
+    AST_LIST_INSERT_TAIL(&batches, batch, list);
+    ast_mutex_unlock(&batches_lock);
+    return batch;
+}
+
+void ast_kafka_batch_destroy(struct ast_kafka_batch *batch) {
+    if (!batch) {
+        return;
+    }
+    ast_mutex_lock(&batches_lock);
+    AST_LIST_REMOVE(&batches, batch, list);
+    ast_mutex_unlock(&batches_lock);
+
+    batch_flush(batch);
+    ast_mutex_destroy(&batch->lock);
+    ao2_ref(batch->topic, -1);
+    ast_free(batch);
+}
+
+/*! \brief FNV-1a, the slot of a key has to be the same after a restart */
+static unsigned int key_hash(const unsigned char *key, size_t len) {
+    unsigned int hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ key[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/*! \brief Make room for \a len more bytes in the buffer of a slot */
+static int slot_reserve(struct batch_slot *slot, size_t len) {
+    size_t size = slot->size ? slot->size : BATCH_BUFFER_INIT_SIZE;
+    char *data;
+
+    if (slot->len + len <= slot->size) {
+        return 0;
+    }
+    while (size < slot->len + len) {
+        size *= 2;
+    }
+    data = ast_realloc(slot->data, size);
+    if (!data) {
+        return -1;
+    }
+    slot->data = data;
+    slot->size = size;
+    return 0;
+}
+
+int ast_kafka_batch_add(struct ast_kafka_batch *batch, const void *key, size_t key_len, const void *record,
+                        size_t len) {
+    struct batch_slot *slot;
+    unsigned int index = 0;
+    size_t separator;
+
+    if (batch->config.slots > 1 && key && key_len) {
+        index = key_hash(key, key_len) % batch->config.slots;
+    }
+    slot = &batch->slots[index];
+
+    ast_mutex_lock(&batch->lock);
+    separator = batch->config.separator && slot->records ? 1 : 0;
+    /* A batch never grows over the size limit, a larger record goes on its own */
+    if (slot->records && slot->len + separator + len > batch->config.bytes) {
+        slot_flush(batch, index);
+        separator = 0;
+    }
+    if (slot_reserve(slot, separator + len)) {
+        ast_mutex_unlock(&batch->lock);
+        ast_log(LOG_ERROR, "Failed to add a record to the batch of topic %s\n", ast_kafka_topic_name(batch->topic));
+        return -1;
+    }
+    if (separator) {
+        slot->data[slot->len++] = batch->config.separator;
+    }
+    memcpy(slot->data + slot->len, record, len);
+    slot->len += len;
+    if (!slot->records++) {
+        slot->first = ast_tvnow();
+    }
+    if (slot->records >= batch->config.records || slot->len >= batch->config.bytes) {
+        slot_flush(batch, index);
+    }
+    ast_mutex_unlock(&batch->lock);
+    return 0;
+}
@@ -0,0 +1,14 @@
+//
+// Linger thread of the record batches of res_kafka, not exported to other modules
+//
+
+#ifndef ASTERISK_KAFKA_BATCH_H
+#define ASTERISK_KAFKA_BATCH_H
+
+/*! \brief Start the thread which produces the batches whose linger time is up */
+int kafka_batch_start(void);
+
+/*! \brief Stop the linger thread, the batches left are produced first */
+void kafka_batch_stop(void);
+
+#endif //ASTERISK_KAFKA_BATCH_H
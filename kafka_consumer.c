@@ -0,0 +1,704 @@
+/*! \file
+ *
+ * \brief Kafka consumers
+ *
+ * Every [consumer:<name>] section of res_kafka.conf is a member of a
+ * consumer group with a thread of its own. The thread takes the messages
+ * in batches and hands each of them either to the dialplan or to a handler
+ * registered by another module. Offsets are stored once a message is
+ * handled and committed after the batch, so a restart redelivers what was
+ * not handled yet. While a batch takes long to handle a second thread pauses
+ * the partitions of the consumer and keeps polling, so the group does not
+ * evict it after max.poll.interval.ms.
+ *
+ * For the dialplan a channel without media is created per message, runs
+ * the extension with the message in KAFKA_* channel variables and is hung
+ * up, like the channel which delivers text messages to the dialplan.
+ *
+ * \author Max Nesterov <braams@braams.ru>
+ *
+ */
+
+#define AST_MODULE_SELF_SYM __internal_res_kafka_self
+#define AST_MODULE "res_kafka"
+
+#include <asterisk.h>
+#include <asterisk/astobj2.h>
+#include <asterisk/cdr.h>
+#include <asterisk/channel.h>
+#include <asterisk/cli.h>
+#include <asterisk/linkedlists.h>
+#include <asterisk/lock.h>
+#include <asterisk/logger.h>
+#include <asterisk/pbx.h>
+#include <asterisk/strings.h>
+#include <asterisk/utils.h>
+#include <librdkafka/rdkafka.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include "res_kafka.h"
+#include "kafka_consumer.h"
+
+#define DEFAULT_BATCH_SIZE 100
+#define MAX_BATCH_SIZE 10000
+#define DEFAULT_EXTENSION "s"
+#define CONSUME_TIMEOUT_MS 100
+/*! \brief A batch is handled for this long before the keeper thread pauses the partitions */
+#define KEEPALIVE_AFTER_MS 1000
+#define HANDLER_BUCKETS 7
+
+/*! \brief A handler was unregistered while its consumer had messages for it */
+#define HANDLER_GONE 1
+
+struct kafka_handler {
+    /*! NULL once unregistered */
+    ast_kafka_handler_fn fn;
+    void *data;
+    char name[0];
+};
+
+struct kafka_consumer {
+    rd_kafka_t *rk;
+    /*! Configuration of the consumer until it is created */
+    rd_kafka_conf_t *conf;
+    rd_kafka_queue_t *queue;
+    /*! Comma separated topics to subscribe to */
+    char *topics;
+    char *group;
+    /*! Dialplan location of the messages, unless a handler is set */
+    char *context;
+    char *exten;
+    /*! Name of the registered handler of the messages */
+    char *handler;
+    unsigned int batch_size;
+    pthread_t thread;
+    /*! Polls while a batch is handled, see do_keepalive() */
+    pthread_t keeper;
+    ast_mutex_t lock;
+    ast_cond_t cond;
+    /*! When the batch being handled was taken, zero between batches */
+    struct timeval batch_start;
+    /*! The partitions paused by the keeper, resumed after the batch */
+    rd_kafka_topic_partition_list_t *paused;
+    /*! The keeper is in a poll call */
+    int polling;
+    /*! The handler is not registered, the messages wait in Kafka */
+    int waiting;
+    uint64_t consumed;
+    uint64_t failed;
+    AST_LIST_ENTRY(kafka_consumer) list;
+    char name[0];
+};
+
+static AST_LIST_HEAD_NOLOCK_STATIC(consumers, kafka_consumer);
+static volatile int consume_running;
+static int channel_seq;
+
+static struct ao2_container *handlers;
+
+AO2_STRING_FIELD_HASH_FN(kafka_handler, name)
+AO2_STRING_FIELD_CMP_FN(kafka_handler, name)
+
+/*! \brief The channels of the dialplan messages have no media */
+static const struct ast_channel_tech consumer_tech = {
+    .type = "Kafka",
+    .description = "Kafka consumer",
+};
+
+int ast_kafka_handler_register(const char *name, ast_kafka_handler_fn fn, void *data) {
+    struct kafka_handler *handler;
+
+    if (ast_strlen_zero(name) || !fn || !handlers) {
+        return -1;
+    }
+    ao2_lock(handlers);
+    handler = ao2_find(handlers, name, OBJ_SEARCH_KEY | OBJ_NOLOCK);
+    if (handler) {
+        ao2_unlock(handlers);
+        ao2_ref(handler, -1);
+        ast_log(LOG_ERROR, "Kafka message handler %s is registered already\n", name);
+        return -1;
+    }
+    handler = ao2_alloc(sizeof(*handler) + strlen(name) + 1, NULL);
+    if (!handler) {
+        ao2_unlock(handlers);
+        return -1;
+    }
+    strcpy(handler->name, name); /* Safe */
+    handler->fn = fn;
+    handler->data = data;
+    ao2_link_flags(handlers, handler, OBJ_NOLOCK);
+    ao2_unlock(handlers);
+    ao2_ref(handler, -1);
+    return 0;
+}
+
+void ast_kafka_handler_unregister(const char *name) {
+    struct kafka_handler *handler;
+
+    if (!handlers || !(handler = ao2_find(handlers, name, OBJ_SEARCH_KEY | OBJ_UNLINK))) {
+        return;
+    }
+    /* The handler is called with its lock held */
+    ao2_lock(handler);
+    handler->fn = NULL;
+    ao2_unlock(handler);
+    ao2_ref(handler, -1);
+}
+
+static int handler_registered(const char *name) {
+    struct kafka_handler *handler = ao2_find(handlers, name, OBJ_SEARCH_KEY);
+
+    ao2_cleanup(handler);
+    return handler != NULL;
+}
+
+static int dispatch_handler(struct kafka_consumer *consumer, const struct ast_kafka_message *message) {
+    struct kafka_handler *handler;
+    int res = HANDLER_GONE;
+
+    handler = ao2_find(handlers, consumer->handler, OBJ_SEARCH_KEY);
+    if (!handler) {
+        return HANDLER_GONE;
+    }
+    ao2_lock(handler);
+    if (handler->fn) {
+        res = handler->fn(message, handler->data) ? -1 : 0;
+    }
+    ao2_unlock(handler);
+    ao2_ref(handler, -1);
+    return res;
+}
+
+/*! \brief Set a channel variable from a buffer which is not NUL terminated */
+static void set_variable(struct ast_channel *chan, const char *name, const void *value, size_t len) {
+    char *copy;
+
+    if (!value) {
+        return;
+    }
+    copy = ast_strndup(value, len);
+    if (copy) {
+        pbx_builtin_setvar_helper(chan, name, copy);
+        ast_free(copy);
+    }
+}
+
+/*! \brief Run the extension of the consumer for a message, returns when the dialplan is done */
+static int dispatch_dialplan(struct kafka_consumer *consumer, const struct ast_kafka_message *message) {
+    struct ast_channel *chan;
+    struct ast_pbx_args args = {
+        .no_hangup_chan = 1,
+    };
+    char number[32];
+    int res;
+
+    chan = ast_channel_alloc(0, AST_STATE_UP, NULL, NULL, NULL, consumer->exten, consumer->context, NULL, NULL, 0,
+                             "Kafka/%s-%08x", consumer->name,
+                             (unsigned int) ast_atomic_fetchadd_int(&channel_seq, +1));
+    if (!chan) {
+        return -1;
+    }
+    ast_channel_tech_set(chan, &consumer_tech);
+    ast_channel_unlock(chan);
+    /* A message is not a call */
+    ast_cdr_set_property(ast_channel_name(chan), AST_CDR_FLAG_DISABLE_ALL);
+
+    pbx_builtin_setvar_helper(chan, "KAFKA_CONSUMER", consumer->name);
+    pbx_builtin_setvar_helper(chan, "KAFKA_TOPIC", message->topic);
+    snprintf(number, sizeof(number), "%d", message->partition);
+    pbx_builtin_setvar_helper(chan, "KAFKA_PARTITION", number);
+    snprintf(number, sizeof(number), "%lld", message->offset);
+    pbx_builtin_setvar_helper(chan, "KAFKA_OFFSET", number);
+    set_variable(chan, "KAFKA_KEY", message->key, message->key_len);
+    set_variable(chan, "KAFKA_PAYLOAD", message->payload, message->len);
+
+    res = ast_pbx_run_args(chan, &args);
+    ast_hangup(chan);
+    return res ? -1 : 0;
+}
+
+/*!
+ * \brief Seek the partitions of the messages left in a batch back to the first of them
+ *
+ * Their offsets are not stored, the consumer fetches them again.
+ */
+static void rewind_batch(rd_kafka_message_t **batch, ssize_t count) {
+    ssize_t i, j;
+
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < i; j++) {
+            if (batch[j]->rkt == batch[i]->rkt && batch[j]->partition == batch[i]->partition) {
+                break;
+            }
+        }
+        if (j == i && !batch[i]->err) {
+            rd_kafka_seek(batch[i]->rkt, batch[i]->partition, batch[i]->offset, 0);
+        }
+    }
+}
+
+/*! \return number of messages whose offsets were stored */
+static unsigned int consume_batch(struct kafka_consumer *consumer, rd_kafka_message_t **batch, ssize_t count) {
+    struct ast_kafka_message message = {
+        .consumer = consumer->name,
+    };
+    rd_kafka_message_t *rkmessage;
+    unsigned int stored = 0;
+    ssize_t i;
+    int res;
+
+    for (i = 0; i < count; i++) {
+        rkmessage = batch[i];
+        if (rkmessage->err) {
+            if (rkmessage->err != RD_KAFKA_RESP_ERR__PARTITION_EOF) {
+                ast_log(LOG_WARNING, "Consumer %s: %s\n", consumer->name, rd_kafka_message_errstr(rkmessage));
+            }
+            continue;
+        }
+        message.topic = rd_kafka_topic_name(rkmessage->rkt);
+        message.partition = rkmessage->partition;
+        message.offset = rkmessage->offset;
+        message.key = rkmessage->key;
+        message.key_len = rkmessage->key_len;
+        message.payload = rkmessage->payload;
+        message.len = rkmessage->len;
+
+        res = consumer->handler ? dispatch_handler(consumer, &message) : dispatch_dialplan(consumer, &message);
+        if (res == HANDLER_GONE) {
+            ast_log(LOG_WARNING, "Handler %s of consumer %s was unregistered, waiting for it\n", consumer->handler,
+                    consumer->name);
+            consumer->waiting = 1;
+            rewind_batch(batch + i, count - i);
+            break;
+        }
+        __atomic_fetch_add(&consumer->consumed, 1, __ATOMIC_RELAXED);
+        if (res) {
+            __atomic_fetch_add(&consumer->failed, 1, __ATOMIC_RELAXED);
+            ast_log(LOG_WARNING, "Consumer %s failed to handle the message of %s [%d] at offset %lld\n",
+                    consumer->name, message.topic, message.partition, message.offset);
+        }
+        /* Committed as offset + 1, the next message to consume */
+        rd_kafka_offset_store(rkmessage->rkt, rkmessage->partition, rkmessage->offset);
+        stored++;
+    }
+    return stored;
+}
+
+/*!
+ * \brief Keeper thread of a consumer
+ *
+ * The consume thread does not poll while it waits for a handler or the
+ * dialplan. Once a batch takes longer than KEEPALIVE_AFTER_MS the keeper
+ * pauses the assigned partitions and polls in its place, so the consumer
+ * stays in the group and serves its callbacks. Messages fetched before the
+ * pause went into effect are not handled here, their partitions are seeked
+ * back and they are consumed again after the batch.
+ */
+static void *do_keepalive(void *data) {
+    struct kafka_consumer *consumer = data;
+    rd_kafka_message_t *batch[16];
+    rd_kafka_resp_err_t err;
+    struct timespec ts;
+    struct timeval tv;
+    ssize_t count, i;
+
+    ast_mutex_lock(&consumer->lock);
+    while (consume_running) {
+        if (ast_tvzero(consumer->batch_start)
+            || ast_tvdiff_ms(ast_tvnow(), consumer->batch_start) < KEEPALIVE_AFTER_MS) {
+            tv = ast_tvadd(ast_tvnow(), ast_samp2tv(CONSUME_TIMEOUT_MS, 1000));
+            ts.tv_sec = tv.tv_sec;
+            ts.tv_nsec = tv.tv_usec * 1000;
+            ast_cond_timedwait(&consumer->cond, &consumer->lock, &ts);
+            continue;
+        }
+        if (!consumer->paused) {
+            err = rd_kafka_assignment(consumer->rk, &consumer->paused);
+            if (!err) {
+                err = rd_kafka_pause_partitions(consumer->rk, consumer->paused);
+            }
+            if (err) {
+                ast_log(LOG_WARNING, "Consumer %s failed to pause its partitions: %s\n", consumer->name,
+                        rd_kafka_err2str(err));
+            }
+            ast_debug(1, "Consumer %s paused its partitions while a batch is handled\n", consumer->name);
+        }
+        consumer->polling = 1;
+        ast_mutex_unlock(&consumer->lock);
+
+        count = rd_kafka_consume_batch_queue(consumer->queue, CONSUME_TIMEOUT_MS, batch, ARRAY_LEN(batch));
+        for (i = 0; i < count; i++) {
+            if (batch[i]->err && batch[i]->err != RD_KAFKA_RESP_ERR__PARTITION_EOF) {
+                ast_log(LOG_WARNING, "Consumer %s: %s\n", consumer->name, rd_kafka_message_errstr(batch[i]));
+            }
+        }
+        if (count > 0) {
+            rewind_batch(batch, count);
+        }
+        for (i = 0; i < count; i++) {
+            rd_kafka_message_destroy(batch[i]);
+        }
+
+        ast_mutex_lock(&consumer->lock);
+        consumer->polling = 0;
+        ast_cond_broadcast(&consumer->cond);
+    }
+    ast_mutex_unlock(&consumer->lock);
+    return NULL;
+}
+
+/*! \brief Let the keeper poll from now on if the batch takes long */
+static void batch_begin(struct kafka_consumer *consumer) {
+    ast_mutex_lock(&consumer->lock);
+    consumer->batch_start = ast_tvnow();
+    ast_mutex_unlock(&consumer->lock);
+}
+
+/*! \brief Take polling back from the keeper and resume what it paused */
+static void batch_end(struct kafka_consumer *consumer) {
+    rd_kafka_resp_err_t err;
+
+    ast_mutex_lock(&consumer->lock);
+    consumer->batch_start = ast_tv(0, 0);
+    while (consumer->polling) {
+        ast_cond_wait(&consumer->cond, &consumer->lock);
+    }
+    if (consumer->paused) {
+        err = rd_kafka_resume_partitions(consumer->rk, consumer->paused);
+        if (err) {
+            ast_log(LOG_WARNING, "Consumer %s failed to resume its partitions: %s\n", consumer->name,
+                    rd_kafka_err2str(err));
+        }
+        rd_kafka_topic_partition_list_destroy(consumer->paused);
+        consumer->paused = NULL;
+    }
+    ast_mutex_unlock(&consumer->lock);
+}
+
+/*!
+ * \brief Consume thread
+ *
+ * Takes up to batch_size messages at once, handles them in order and
+ * commits their offsets without waiting for the broker to confirm.
+ */
+static void *do_consume(void *data) {
+    struct kafka_consumer *consumer = data;
+    rd_kafka_message_t **batch;
+    rd_kafka_resp_err_t err;
+    unsigned int stored;
+    ssize_t count, i;
+
+    batch = ast_calloc(consumer->batch_size, sizeof(*batch));
+    if (!batch) {
+        return NULL;
+    }
+    while (consume_running) {
+        /* Not consumed, so nothing is committed before the handler is there */
+        if (consumer->handler && !handler_registered(consumer->handler)) {
+            if (!consumer->waiting) {
+                ast_log(LOG_NOTICE, "Consumer %s is waiting for handler %s\n", consumer->name, consumer->handler);
+                consumer->waiting = 1;
+            }
+            usleep(CONSUME_TIMEOUT_MS * 1000);
+            continue;
+        }
+        consumer->waiting = 0;
+        count = rd_kafka_consume_batch_queue(consumer->queue, CONSUME_TIMEOUT_MS, batch, consumer->batch_size);
+        if (count < 0) {
+            ast_log(LOG_ERROR, "Consumer %s: %s\n", consumer->name, rd_kafka_err2str(rd_kafka_last_error()));
+            usleep(CONSUME_TIMEOUT_MS * 1000);
+            continue;
+        }
+        batch_begin(consumer);
+        stored = consume_batch(consumer, batch, count);
+        batch_end(consumer);
+        if (stored) {
+            err = rd_kafka_commit(consumer->rk, NULL, 1);
+            if (err) {
+                ast_log(LOG_WARNING, "Consumer %s failed to commit: %s\n", consumer->name, rd_kafka_err2str(err));
+            }
+        }
+        for (i = 0; i < count; i++) {
+            rd_kafka_message_destroy(batch[i]);
+        }
+    }
+    ast_free(batch);
+    return NULL;
+}
+
+static void consumer_log_cb(const rd_kafka_t *rk, int level, const char *fac, const char *buf) {
+    ast_log(LOG_NOTICE, " %s: %s: %s\n", fac, rk ? rd_kafka_name(rk) : NULL, buf);
+}
+
+static void consumer_error_cb(rd_kafka_t *rk, int err, const char *reason, void *opaque) {
+    struct kafka_consumer *consumer = opaque;
+
+    ast_log(LOG_ERROR, "Consumer %s: %s: %s\n", consumer->name, rd_kafka_err2str(err), reason);
+}
+
+static int consumer_connect(struct kafka_consumer *consumer) {
+    rd_kafka_topic_partition_list_t *subscription;
+    rd_kafka_resp_err_t err;
+    char errstr[512];
+    char *list, *topic;
+
+    rd_kafka_conf_set_log_cb(consumer->conf, consumer_log_cb);
+    rd_kafka_conf_set_error_cb(consumer->conf, consumer_error_cb);
+    rd_kafka_conf_set_opaque(consumer->conf, consumer);
+    /* Takes the configuration on success */
+    consumer->rk = rd_kafka_new(RD_KAFKA_CONSUMER, consumer->conf, errstr, sizeof(errstr));
+    if (!consumer->rk) {
+        ast_log(LOG_ERROR, "Failed to create consumer %s: %s\n", consumer->name, errstr);
+        return -1;
+    }
+    consumer->conf = NULL;
+    /* The callbacks are served by the consume thread */
+    rd_kafka_poll_set_consumer(consumer->rk);
+
+    subscription = rd_kafka_topic_partition_list_new(1);
+    list = ast_strdupa(consumer->topics);
+    while ((topic = ast_strsep(&list, ',', AST_STRSEP_STRIP))) {
+        if (!ast_strlen_zero(topic)) {
+            rd_kafka_topic_partition_list_add(subscription, topic, RD_KAFKA_PARTITION_UA);
+        }
+    }
+    err = rd_kafka_subscribe(consumer->rk, subscription);
+    rd_kafka_topic_partition_list_destroy(subscription);
+    if (err) {
+        ast_log(LOG_ERROR, "Consumer %s failed to subscribe to %s: %s\n", consumer->name, consumer->topics,
+                rd_kafka_err2str(err));
+        return -1;
+    }
+    consumer->queue = rd_kafka_queue_get_consumer(consumer->rk);
+    ast_log(LOG_NOTICE, "Consumer %s of group %s subscribed to %s\n", consumer->name, consumer->group,
+            consumer->topics);
+    return 0;
+}
+
+static void consumer_close(struct kafka_consumer *consumer) {
+    rd_kafka_resp_err_t err;
+
+    if (!consumer->rk) {
+        return;
+    }
+    /* Whatever the last asynchronous commit has not covered */
+    err = rd_kafka_commit(consumer->rk, NULL, 0);
+    if (err && err != RD_KAFKA_RESP_ERR__NO_OFFSET) {
+        ast_log(LOG_WARNING, "Consumer %s failed to commit: %s\n", consumer->name, rd_kafka_err2str(err));
+    }
+    if (consumer->queue) {
+        rd_kafka_queue_destroy(consumer->queue);
+        consumer->queue = NULL;
+    }
+    rd_kafka_consumer_close(consumer->rk);
+    rd_kafka_destroy(consumer->rk);
+    consumer->rk = NULL;
+}
+
+static void consumer_destroy(struct kafka_consumer *consumer) {
+    consumer_close(consumer);
+    if (consumer->conf) {
+        rd_kafka_conf_destroy(consumer->conf);
+    }
+    ast_free(consumer->topics);
+    ast_free(consumer->group);
+    ast_free(consumer->context);
+    ast_free(consumer->exten);
+    ast_free(consumer->handler);
+    ast_mutex_destroy(&consumer->lock);
+    ast_cond_destroy(&consumer->cond);
+    ast_free(consumer);
+}
+
+static void replace_string(char **dst, const char *value) {
+    ast_free(*dst);
+    *dst = ast_strdup(value);
+}
+
+static int consumer_option(struct kafka_consumer *consumer, const char *name, const char *value) {
+    char errstr[512];
+
+    if (rd_kafka_conf_set(consumer->conf, name, value, errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK) {
+        ast_log(LOG_ERROR, "Invalid option '%s' for consumer %s: %s\n", name, consumer->name, errstr);
+        return -1;
+    }
+    return 0;
+}
+
+/*!
+ * \brief Apply the options of a [consumer:<name>] section
+ *
+ * topics, group, context, extension, handler and batch_size are ours,
+ * cluster is resolved by res_kafka, everything else goes to librdkafka as is.
+ */
+static int consumer_configure(struct kafka_consumer *consumer, const char *brokers, const struct ast_variable *v) {
+    char value[512];
+    size_t size = sizeof(value);
+
+    for (; v; v = v->next) {
+        if (!strcasecmp(v->name, "topics")) {
+            replace_string(&consumer->topics, v->value);
+        } else if (!strcasecmp(v->name, "group") || !strcasecmp(v->name, "group.id")) {
+            replace_string(&consumer->group, v->value);
+        } else if (!strcasecmp(v->name, "context")) {
+            replace_string(&consumer->context, v->value);
+        } else if (!strcasecmp(v->name, "extension")) {
+            replace_string(&consumer->exten, v->value);
+        } else if (!strcasecmp(v->name, "handler")) {
+            replace_string(&consumer->handler, v->value);
+        } else if (!strcasecmp(v->name, "batch_size")) {
+            if (sscanf(v->value, "%30u", &consumer->batch_size) != 1 || !consumer->batch_size
+                || consumer->batch_size > MAX_BATCH_SIZE) {
+                ast_log(LOG_ERROR, "Invalid batch_size '%s' for consumer %s, expected 1 to %d\n", v->value,
+                        consumer->name, MAX_BATCH_SIZE);
+                return -1;
+            }
+        } else if (!strcasecmp(v->name, "cluster")) {
+            continue;
+        } else if (consumer_option(consumer, strcasecmp(v->name, "brokers") ? v->name : "bootstrap.servers",
+                                   v->value)) {
+            return -1;
+        }
+    }
+
+    if (ast_strlen_zero(consumer->topics)) {
+        ast_log(LOG_ERROR, "No topics for consumer %s\n", consumer->name);
+        return -1;
+    }
+    if (ast_strlen_zero(consumer->context) == ast_strlen_zero(consumer->handler)) {
+        ast_log(LOG_ERROR, "Consumer %s needs either a context or a handler\n", consumer->name);
+        return -1;
+    }
+    if (ast_strlen_zero(consumer->handler)) {
+        ast_free(consumer->handler);
+        consumer->handler = NULL;
+    }
+    if (ast_strlen_zero(consumer->exten)) {
+        replace_string(&consumer->exten, DEFAULT_EXTENSION);
+    }
+    if (ast_strlen_zero(consumer->group)) {
+        replace_string(&consumer->group, consumer->name);
+    }
+    if (rd_kafka_conf_get(consumer->conf, "bootstrap.servers", value, &size) != RD_KAFKA_CONF_OK
+        || ast_strlen_zero(value)) {
+        if (ast_strlen_zero(brokers)) {
+            ast_log(LOG_ERROR, "No brokers for consumer %s\n", consumer->name);
+            return -1;
+        }
+        if (consumer_option(consumer, "bootstrap.servers", brokers)) {
+            return -1;
+        }
+    }
+    /* Offsets are stored once a message is handled and committed by the consume thread */
+    if (consumer_option(consumer, "group.id", consumer->group)
+        || consumer_option(consumer, "enable.auto.commit", "false")
+        || consumer_option(consumer, "enable.auto.offset.store", "false")) {
+        return -1;
+    }
+    return 0;
+}
+
+int kafka_consumer_add(const char *name, const char *brokers, const struct ast_variable *v) {
+    struct kafka_consumer *consumer;
+
+    if (ast_strlen_zero(name)) {
+        ast_log(LOG_ERROR, "Invalid consumer name ''\n");
+        return -1;
+    }
+    consumer = ast_calloc(1, sizeof(*consumer) + strlen(name) + 1);
+    if (!consumer) {
+        return -1;
+    }
+    strcpy(consumer->name, name); /* Safe */
+    consumer->thread = AST_PTHREADT_NULL;
+    consumer->keeper = AST_PTHREADT_NULL;
+    ast_mutex_init(&consumer->lock);
+    ast_cond_init(&consumer->cond, NULL);
+    consumer->batch_size = DEFAULT_BATCH_SIZE;
+    consumer->conf = rd_kafka_conf_new();
+    /* Destroyed with the others when the configuration fails */
+    AST_LIST_INSERT_TAIL(&consumers, consumer, list);
+    return consumer_configure(consumer, brokers, v);
+}
+
+int kafka_consumer_start(void) {
+    struct kafka_consumer *consumer;
+
+    consume_running = 1;
+    AST_LIST_TRAVERSE(&consumers, consumer, list) {
+        if (consumer_connect(consumer)) {
+            return -1;
+        }
+        if (ast_pthread_create_background(&consumer->thread, NULL, do_consume, consumer)) {
+            ast_log(LOG_ERROR, "Failed to start the thread of consumer %s\n", consumer->name);
+            consumer->thread = AST_PTHREADT_NULL;
+            return -1;
+        }
+        if (ast_pthread_create_background(&consumer->keeper, NULL, do_keepalive, consumer)) {
+            ast_log(LOG_ERROR, "Failed to start the keeper thread of consumer %s\n", consumer->name);
+            consumer->keeper = AST_PTHREADT_NULL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void kafka_consumer_stop(void) {
+    struct kafka_consumer *consumer;
+
+    consume_running = 0;
+    AST_LIST_TRAVERSE(&consumers, consumer, list) {
+        if (consumer->thread != AST_PTHREADT_NULL) {
+            pthread_join(consumer->thread, NULL);
+            consumer->thread = AST_PTHREADT_NULL;
+        }
+        if (consumer->keeper != AST_PTHREADT_NULL) {
+            pthread_join(consumer->keeper, NULL);
+            consumer->keeper = AST_PTHREADT_NULL;
+        }
+        consumer_close(consumer);
+    }
+}
+
+int kafka_consumer_init(void) {
+    handlers = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, HANDLER_BUCKETS,
+                                        kafka_handler_hash_fn, NULL, kafka_handler_cmp_fn);
+    return handlers ? 0 : -1;
+}
+
+void kafka_consumer_cleanup(void) {
+    struct kafka_consumer *consumer;
+
+    kafka_consumer_stop();
+    while ((consumer = AST_LIST_REMOVE_HEAD(&consumers, list))) {
+        consumer_destroy(consumer);
+    }
+    ao2_cleanup(handlers);
+    handlers = NULL;
+}
+
+#define CONSUMER_HEADER "%-16s %-16s %-24s %-24s %12s %8s\n"
+#define CONSUMER_ROW "%-16s %-16s %-24s %-24s %12" PRIu64 " %8" PRIu64 "%s\n"
+
+void kafka_consumer_cli(int fd) {
+    struct kafka_consumer *consumer;
+    char target[AST_MAX_EXTENSION + AST_MAX_CONTEXT + 16];
+
+    if (AST_LIST_EMPTY(&consumers)) {
+        ast_cli(fd, "No consumers\n");
+        return;
+    }
+    ast_cli(fd, CONSUMER_HEADER, "Consumer", "Group", "Topics", "Target", "Consumed", "Failed");
+    AST_LIST_TRAVERSE(&consumers, consumer, list) {
+        if (consumer->handler) {
+            snprintf(target, sizeof(target), "handler %s", consumer->handler);
+        } else {
+            snprintf(target, sizeof(target), "%s@%s", consumer->exten, consumer->context);
+        }
+        ast_cli(fd, CONSUMER_ROW, consumer->name, consumer->group, consumer->topics, target,
+                __atomic_load_n(&consumer->consumed, __ATOMIC_RELAXED),
+                __atomic_load_n(&consumer->failed, __ATOMIC_RELAXED),
+                consumer->waiting ? " (waiting for the handler)" : "");
+    }
+}
@@ -0,0 +1,37 @@
+//
+// Consumers of res_kafka, not exported to other modules
+//
+
+#ifndef ASTERISK_KAFKA_CONSUMER_H
+#define ASTERISK_KAFKA_CONSUMER_H
+
+struct ast_variable;
+
+/*! \brief Set up the handler registry, before the configuration is loaded */
+int kafka_consumer_init(void);
+
+/*! \brief Stop and destroy the consumers and the handler registry */
+void kafka_consumer_cleanup(void);
+
+/*!
+ * \brief Add the consumer of a [consumer:<name>] section
+ *
+ * \param brokers Brokers unless the section sets its own
+ * \param v Options of the section, those which are not ours go to librdkafka as is
+ */
+int kafka_consumer_add(const char *name, const char *brokers, const struct ast_variable *v);
+
+/*! \brief Connect the consumers and start their threads */
+int kafka_consumer_start(void);
+
+/*!
+ * \brief Stop the consume threads and close the consumers
+ *
+ * The offsets of the handled messages are committed before the consumers leave their groups.
+ */
+void kafka_consumer_stop(void);
+
+/*! \brief State of the consumers for 'kafka consumers' */
+void kafka_consumer_cli(int fd);
+
+#endif //ASTERISK_KAFKA_CONSUMER_H
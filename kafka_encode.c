@@ -0,0 +1,682 @@
+/*! \file
+ *
+ * \brief Kafka record encoders
+ *
+ * Writes records straight into a reusable buffer, without building an
+ * intermediate ast_json tree. Records are described by a table of
+ * struct ast_kafka_field, one per record type, and can be written as
+ * JSON or in the ClickHouse RowBinary, MsgPack and Protobuf formats.
+ *
+ * \author Max Nesterov <braams@braams.ru>
+ *
+ */
+
+#define AST_MODULE_SELF_SYM __internal_res_kafka_self
+#define AST_MODULE "res_kafka"
+
+#include <asterisk.h>
+#include <asterisk/chanvars.h>
+#include <asterisk/json.h>
+#include <asterisk/linkedlists.h>
+#include <asterisk/paths.h>
+#include <asterisk/strings.h>
+#include <asterisk/utils.h>
+#include <ctype.h>
+#include "res_kafka.h"
+
+#define HEADER_VARIABLE_PREFIX "var:"
+#define FIELD_VARIABLE_PREFIX "var:"
+
+static const char * const format_names[] = {
+    [AST_KAFKA_FORMAT_JSON] = "json",
+    [AST_KAFKA_FORMAT_ROWBINARY] = "rowbinary",
+    [AST_KAFKA_FORMAT_MSGPACK] = "msgpack",
+    [AST_KAFKA_FORMAT_PROTOBUF] = "protobuf",
+};
+
+int ast_kafka_format_from_str(const char *name) {
+    int i;
+
+    for (i = 0; i < ARRAY_LEN(format_names); i++) {
+        if (!strcasecmp(name, format_names[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const char *ast_kafka_format_name(enum ast_kafka_format format) {
+    return format_names[format];
+}
+
+/*!
+ * \brief Length of the UTF-8 sequence starting at \a s, 0 if it is invalid
+ *
+ * Follows jansson, which refuses to create strings with overlong
+ * sequences, surrogates or code points above U+10FFFF.
+ */
+static size_t utf8_sequence_len(const unsigned char *s) {
+    unsigned int cp;
+    size_t len, i;
+
+    if (s[0] < 0x80) {
+        return 1;
+    } else if (s[0] < 0xC2) {
+        return 0;
+    } else if (s[0] < 0xE0) {
+        len = 2;
+        cp = s[0] & 0x1F;
+    } else if (s[0] < 0xF0) {
+        len = 3;
+        cp = s[0] & 0x0F;
+    } else if (s[0] < 0xF5) {
+        len = 4;
+        cp = s[0] & 0x07;
+    } else {
+        return 0;
+    }
+    for (i = 1; i < len; i++) {
+        if ((s[i] & 0xC0) != 0x80) {
+            return 0;
+        }
+        cp = (cp << 6) | (s[i] & 0x3F);
+    }
+    if ((len == 3 && cp < 0x800) || (len == 4 && cp < 0x10000)
+        || (cp >= 0xD800 && cp <= 0xDFFF) || cp > 0x10FFFF) {
+        return 0;
+    }
+    return len;
+}
+
+int ast_kafka_json_append_escaped(struct ast_str **buf, const char *value) {
+    const unsigned char *s = (const unsigned char *) value;
+    const unsigned char *run = s;
+    size_t start = ast_str_strlen(*buf);
+    size_t len;
+    char esc[8];
+
+    while (*s) {
+        if (*s >= 0x20 && *s != '"' && *s != '\\') {
+            if (*s < 0x80) {
+                s++;
+                continue;
+            }
+            if (!(len = utf8_sequence_len(s))) {
+                /* Same as a failed ast_json_string_create() */
+                ast_str_truncate(*buf, start);
+                return -1;
+            }
+            s += len;
+            continue;
+        }
+        ast_str_append_substr(buf, 0, (const char *) run, s - run);
+        switch (*s) {
+            case '"':
+                ast_str_append_substr(buf, 0, "\\\"", 2);
+                break;
+            case '\\':
+                ast_str_append_substr(buf, 0, "\\\\", 2);
+                break;
+            case '\b':
+                ast_str_append_substr(buf, 0, "\\b", 2);
+                break;
+            case '\f':
+                ast_str_append_substr(buf, 0, "\\f", 2);
+                break;
+            case '\n':
+                ast_str_append_substr(buf, 0, "\\n", 2);
+                break;
+            case '\r':
+                ast_str_append_substr(buf, 0, "\\r", 2);
+                break;
+            case '\t':
+                ast_str_append_substr(buf, 0, "\\t", 2);
+                break;
+            default:
+                snprintf(esc, sizeof(esc), "\\u%04X", *s);
+                ast_str_append_substr(buf, 0, esc, 6);
+                break;
+        }
+        run = ++s;
+    }
+    ast_str_append_substr(buf, 0, (const char *) run, s - run);
+    return 0;
+}
+
+int ast_kafka_json_append_string(struct ast_str **buf, const char *value) {
+    size_t start = ast_str_strlen(*buf);
+
+    ast_str_append_substr(buf, 0, "\"", 1);
+    if (ast_kafka_json_append_escaped(buf, value)) {
+        ast_str_truncate(*buf, start);
+        return -1;
+    }
+    ast_str_append_substr(buf, 0, "\"", 1);
+    return 0;
+}
+
+/*! \brief Append the separator and the member name */
+static void json_key(struct ast_str **buf, const char *name) {
+    size_t used = ast_str_strlen(*buf);
+
+    if (used && ast_str_buffer(*buf)[used - 1] != '{') {
+        ast_str_append_substr(buf, 0, ",", 1);
+    }
+    ast_kafka_json_append_string(buf, name);
+    ast_str_append_substr(buf, 0, ":", 1);
+}
+
+int ast_kafka_json_add_string(struct ast_str **buf, const char *name, const char *value) {
+    size_t start = ast_str_strlen(*buf);
+
+    json_key(buf, name);
+    if (ast_kafka_json_append_string(buf, S_OR(value, ""))) {
+        /* Leave the member out altogether */
+        ast_str_truncate(*buf, start);
+        return -1;
+    }
+    return 0;
+}
+
+void ast_kafka_json_add_integer(struct ast_str **buf, const char *name, long long value) {
+    json_key(buf, name);
+    ast_str_append(buf, 0, "%lld", value);
+}
+
+void ast_kafka_json_add_time(struct ast_str **buf, const char *name, const struct ast_kafka_timefmt *fmt, const struct timeval *tv) {
+    char value[AST_KAFKA_TIME_LEN];
+    size_t start = ast_str_strlen(*buf);
+
+    json_key(buf, name);
+    if (ast_kafka_timefmt_format(fmt, tv, value, sizeof(value)) < 0) {
+        /* Unset timestamp with AST_KAFKA_TIMEFMT_UNSET_NULL */
+        ast_str_append_substr(buf, 0, "null", 4);
+    } else if (ast_kafka_timefmt_is_numeric(fmt)) {
+        ast_str_append_substr(buf, 0, value, sizeof(value));
+    } else if (ast_kafka_json_append_string(buf, value)) {
+        ast_str_truncate(*buf, start);
+    }
+}
+
+/*! \brief Value of the variable of a field, the list is short and read once per record */
+static const char *field_variable(const struct ast_kafka_field *field, const void *record) {
+    struct varshead *head = (struct varshead *) ((const char *) record + field->offset);
+    struct ast_var_t *var;
+
+    AST_LIST_TRAVERSE(head, var, entries) {
+        if (!strcasecmp(ast_var_name(var), field->variable)) {
+            return S_OR(ast_var_value(var), "");
+        }
+    }
+    return "";
+}
+
+static const char *field_string(const struct ast_kafka_field *field, const void *record) {
+    const char *member = (const char *) record + field->offset;
+
+    if (field->type == AST_KAFKA_FIELD_CHARS) {
+        return member;
+    }
+    if (field->type == AST_KAFKA_FIELD_VARIABLE) {
+        return field_variable(field, record);
+    }
+    return S_OR(*(const char * const *) member, "");
+}
+
+static long long field_integer(const struct ast_kafka_field *field, const void *record) {
+    const char *member = (const char *) record + field->offset;
+
+    switch (field->type) {
+        case AST_KAFKA_FIELD_LONG:
+            return *(const long *) member;
+        case AST_KAFKA_FIELD_INT:
+            return *(const int *) member;
+        case AST_KAFKA_FIELD_UINT:
+            return *(const unsigned int *) member;
+        case AST_KAFKA_FIELD_TIME:
+            /* Binary formats carry DateTime, seconds since the epoch */
+            return ((const struct timeval *) member)->tv_sec;
+        default:
+            return 0;
+    }
+}
+
+static const struct timeval *field_time(const struct ast_kafka_field *field, const void *record) {
+    return (const struct timeval *) ((const char *) record + field->offset);
+}
+
+static int field_is_string(const struct ast_kafka_field *field) {
+    return field->type == AST_KAFKA_FIELD_CHARS || field->type == AST_KAFKA_FIELD_STRING
+           || field->type == AST_KAFKA_FIELD_VARIABLE;
+}
+
+static int field_is_signed(const struct ast_kafka_field *field) {
+    return field->type == AST_KAFKA_FIELD_LONG || field->type == AST_KAFKA_FIELD_INT;
+}
+
+/*!
+ * \brief Append raw bytes, which may include NULs
+ *
+ * ast_str_append_substr() stops at a NUL, so the bytes are copied and the
+ * used length is then moved with ast_str_truncate().
+ */
+static void append_bytes(struct ast_str **buf, const void *data, size_t len) {
+    size_t used = ast_str_strlen(*buf);
+
+    if (ast_str_make_space(buf, used + len + 1)) {
+        return;
+    }
+    memcpy(ast_str_buffer(*buf) + used, data, len);
+    ast_str_truncate(*buf, used + len);
+}
+
+static void append_varint(struct ast_str **buf, unsigned long long value) {
+    unsigned char bytes[10];
+    size_t len = 0;
+
+    do {
+        bytes[len] = value & 0x7F;
+        value >>= 7;
+        if (value) {
+            bytes[len] |= 0x80;
+        }
+        len++;
+    } while (value);
+    append_bytes(buf, bytes, len);
+}
+
+static void append_be(struct ast_str **buf, unsigned char prefix, unsigned long long value, size_t width) {
+    unsigned char bytes[9];
+    size_t i;
+
+    bytes[0] = prefix;
+    for (i = 0; i < width; i++) {
+        bytes[width - i] = (value >> (8 * i)) & 0xFF;
+    }
+    append_bytes(buf, bytes, width + 1);
+}
+
+static void append_le32(struct ast_str **buf, unsigned int value) {
+    unsigned char bytes[4] = {value & 0xFF, (value >> 8) & 0xFF, (value >> 16) & 0xFF, (value >> 24) & 0xFF};
+    append_bytes(buf, bytes, sizeof(bytes));
+}
+
+static void encode_json(struct ast_str **buf, const struct ast_kafka_field *fields, size_t count,
+                        const void *record, const struct ast_kafka_timefmt *timefmt) {
+    size_t i;
+
+    ast_str_append_substr(buf, 0, "{", 1);
+    for (i = 0; i < count; i++) {
+        if (field_is_string(&fields[i])) {
+            ast_kafka_json_add_string(buf, fields[i].name, field_string(&fields[i], record));
+        } else if (fields[i].type == AST_KAFKA_FIELD_TIME) {
+            ast_kafka_json_add_time(buf, fields[i].name, timefmt, field_time(&fields[i], record));
+        } else {
+            ast_kafka_json_add_integer(buf, fields[i].name, field_integer(&fields[i], record));
+        }
+    }
+    ast_str_append_substr(buf, 0, "}", 1);
+}
+
+/*! \brief ClickHouse RowBinary: columns in table order, little endian, strings prefixed with a varint length */
+static void encode_rowbinary(struct ast_str **buf, const struct ast_kafka_field *fields, size_t count, const void *record) {
+    const char *value;
+    size_t i, len;
+
+    for (i = 0; i < count; i++) {
+        if (field_is_string(&fields[i])) {
+            value = field_string(&fields[i], record);
+            len = strlen(value);
+            append_varint(buf, len);
+            append_bytes(buf, value, len);
+        } else {
+            /* Int32, UInt32 and DateTime are all four bytes wide */
+            append_le32(buf, (unsigned int) field_integer(&fields[i], record));
+        }
+    }
+}
+
+static void msgpack_integer(struct ast_str **buf, long long value) {
+    unsigned char byte;
+
+    if (value >= 0 && value < 128) {
+        byte = value;
+        append_bytes(buf, &byte, 1);
+    } else if (value < 0 && value >= -32) {
+        byte = (unsigned char) (value & 0xFF);
+        append_bytes(buf, &byte, 1);
+    } else if (value > 0 && value <= 0xFFFFFFFFLL) {
+        append_be(buf, 0xCE, value, 4);
+    } else if (value >= -2147483648LL && value <= 2147483647LL) {
+        append_be(buf, 0xD2, (unsigned long long) value, 4);
+    } else {
+        append_be(buf, 0xD3, (unsigned long long) value, 8);
+    }
+}
+
+/*! \brief MessagePack values in column order, the way the ClickHouse MsgPack format reads a row */
+static void encode_msgpack(struct ast_str **buf, const struct ast_kafka_field *fields, size_t count, const void *record) {
+    const char *value;
+    unsigned char byte;
+    size_t i, len;
+
+    for (i = 0; i < count; i++) {
+        if (!field_is_string(&fields[i])) {
+            msgpack_integer(buf, field_integer(&fields[i], record));
+            continue;
+        }
+        value = field_string(&fields[i], record);
+        len = strlen(value);
+        if (len < 32) {
+            byte = 0xA0 | len;
+            append_bytes(buf, &byte, 1);
+        } else if (len <= 0xFF) {
+            append_be(buf, 0xD9, len, 1);
+        } else if (len <= 0xFFFF) {
+            append_be(buf, 0xDA, len, 2);
+        } else {
+            append_be(buf, 0xDB, len, 4);
+        }
+        append_bytes(buf, value, len);
+    }
+}
+
+/*!
+ * \brief Length delimited protobuf message, field numbers follow the table order
+ *
+ * Default values are left out as proto3 does, see clickhouse/cdr.proto.
+ */
+static void encode_protobuf(struct ast_str **buf, const struct ast_kafka_field *fields, size_t count, const void *record) {
+    size_t start = ast_str_strlen(*buf);
+    size_t i, len, prefix_len;
+    unsigned long long body_len;
+    unsigned char prefix[10];
+    const char *value;
+    long long number;
+    char *data;
+
+    for (i = 0; i < count; i++) {
+        if (field_is_string(&fields[i])) {
+            value = field_string(&fields[i], record);
+            len = strlen(value);
+            if (!len) {
+                continue;
+            }
+            append_varint(buf, ((i + 1) << 3) | 2);
+            append_varint(buf, len);
+            append_bytes(buf, value, len);
+            continue;
+        }
+        number = field_integer(&fields[i], record);
+        if (!number) {
+            continue;
+        }
+        append_varint(buf, (i + 1) << 3);
+        if (field_is_signed(&fields[i])) {
+            /* int32, negative values are sign extended to ten bytes */
+            append_varint(buf, (unsigned long long) (long long) (int) number);
+        } else {
+            append_varint(buf, (unsigned int) number);
+        }
+    }
+
+    /* Prepend the length of the message */
+    body_len = ast_str_strlen(*buf) - start;
+    prefix_len = 0;
+    do {
+        prefix[prefix_len] = body_len & 0x7F;
+        body_len >>= 7;
+        if (body_len) {
+            prefix[prefix_len] |= 0x80;
+        }
+        prefix_len++;
+    } while (body_len);
+    len = ast_str_strlen(*buf) - start;
+    append_bytes(buf, prefix, prefix_len);
+    data = ast_str_buffer(*buf) + start;
+    memmove(data + prefix_len, data, len);
+    memcpy(data, prefix, prefix_len);
+}
+
+/*! \brief Compare column names ignoring case and underscores */
+static int field_name_eq(const char *a, const char *b) {
+    for (;; a++, b++) {
+        while (*a == '_') {
+            a++;
+        }
+        while (*b == '_') {
+            b++;
+        }
+        if (tolower(*a) != tolower(*b)) {
+            return 0;
+        }
+        if (!*a) {
+            return 1;
+        }
+    }
+}
+
+const struct ast_kafka_field *ast_kafka_field_find(const struct ast_kafka_field *fields, size_t count, const char *name) {
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        if (field_name_eq(fields[i].name, name)) {
+            return &fields[i];
+        }
+    }
+    return NULL;
+}
+
+const char *ast_kafka_field_text(const struct ast_kafka_field *field, const void *record, char *buf, size_t size) {
+    if (field_is_string(field)) {
+        return field_string(field, record);
+    }
+    snprintf(buf, size, "%lld", field_integer(field, record));
+    return buf;
+}
+
+/*! \brief Add a column of the fields option, named \a name or after its source */
+static int field_add(struct ast_kafka_field *result, size_t *n, const struct ast_kafka_field *source,
+                     const char *name, const char *variable) {
+    struct ast_kafka_field *field = &result[*n];
+    char *copy;
+
+    /* The variable name follows the column name in the same allocation */
+    copy = ast_malloc(strlen(name) + (variable ? strlen(variable) + 1 : 0) + 1);
+    if (!copy) {
+        return -1;
+    }
+    strcpy(copy, name); /* Safe */
+    *field = *source;
+    field->name = copy;
+    if (variable) {
+        field->variable = strcpy(copy + strlen(name) + 1, variable); /* Safe */
+    }
+    (*n)++;
+    return 0;
+}
+
+int ast_kafka_fields_parse(const char *list, const struct ast_kafka_field *fields, size_t count,
+                           size_t varshead_offset, struct ast_kafka_field **result) {
+    struct ast_kafka_field variable = {
+        .type = AST_KAFKA_FIELD_VARIABLE,
+        .offset = varshead_offset,
+    };
+    const struct ast_kafka_field *field;
+    char *items = ast_strdupa(list);
+    char *item, *source;
+    const char *s;
+    size_t n = 0, size = 1;
+    size_t i;
+
+    /* Room for every item, all the columns for each * */
+    for (s = list; *s; s++) {
+        size += *s == ',' ? 1 : *s == '*' ? count : 0;
+    }
+    *result = ast_calloc(size, sizeof(**result));
+    if (!*result) {
+        return -1;
+    }
+    while ((item = ast_strsep(&items, ',', AST_STRSEP_STRIP))) {
+        if (ast_strlen_zero(item)) {
+            continue;
+        }
+        if (!strcmp(item, "*")) {
+            for (i = 0; i < count; i++) {
+                if (field_add(*result, &n, &fields[i], fields[i].name, NULL)) {
+                    break;
+                }
+            }
+            if (i < count) {
+                break;
+            }
+            continue;
+        }
+        source = strchr(item, '=');
+        if (source) {
+            *source++ = '\0';
+            ast_strip(item);
+            source = ast_strip(source);
+        } else {
+            source = item;
+        }
+        if (!strncasecmp(source, FIELD_VARIABLE_PREFIX, strlen(FIELD_VARIABLE_PREFIX))) {
+            source += strlen(FIELD_VARIABLE_PREFIX);
+            if (ast_strlen_zero(source)) {
+                ast_log(LOG_ERROR, "Variable name is missing for column %s\n", item);
+                break;
+            }
+            if (field_add(*result, &n, &variable, item == source - strlen(FIELD_VARIABLE_PREFIX) ? source : item,
+                          source)) {
+                break;
+            }
+        } else if ((field = ast_kafka_field_find(fields, count, source))) {
+            if (field_add(*result, &n, field, source == item ? field->name : item, NULL)) {
+                break;
+            }
+        } else {
+            ast_log(LOG_ERROR, "Unknown column '%s'\n", source);
+            break;
+        }
+    }
+    if (item) {
+        ast_kafka_fields_free(*result, n);
+        *result = NULL;
+        return -1;
+    }
+    return n;
+}
+
+void ast_kafka_fields_free(struct ast_kafka_field *fields, size_t count) {
+    size_t i;
+
+    for (i = 0; fields && i < count; i++) {
+        ast_free((char *) fields[i].name);
+    }
+    ast_free(fields);
+}
+
+int ast_kafka_header_specs_parse(const char *list, const struct ast_kafka_field *fields, size_t count,
+                                 struct ast_kafka_header_spec *specs) {
+    char *items = ast_strdupa(list);
+    char *item, *source;
+    int n = 0;
+
+    while ((item = ast_strsep(&items, ',', AST_STRSEP_STRIP))) {
+        if (ast_strlen_zero(item)) {
+            continue;
+        }
+        if (n == AST_KAFKA_MAX_HEADERS) {
+            ast_log(LOG_ERROR, "More than %d headers\n", AST_KAFKA_MAX_HEADERS);
+            ast_kafka_header_specs_free(specs, n);
+            return -1;
+        }
+        source = strchr(item, '=');
+        if (source) {
+            *source++ = '\0';
+            ast_strip(item);
+            source = ast_strip(source);
+        } else {
+            source = item;
+        }
+        memset(&specs[n], 0, sizeof(specs[n]));
+        if (!strncasecmp(source, HEADER_VARIABLE_PREFIX, strlen(HEADER_VARIABLE_PREFIX))) {
+            source += strlen(HEADER_VARIABLE_PREFIX);
+            if (item == source - strlen(HEADER_VARIABLE_PREFIX)) {
+                item = source;
+            }
+            /* The variable name follows the header name in the same allocation */
+            if ((specs[n].name = ast_malloc(strlen(item) + strlen(source) + 2))) {
+                strcpy(specs[n].name, item); /* Safe */
+                specs[n].variable = strcpy(specs[n].name + strlen(item) + 1, source); /* Safe */
+            }
+        } else if (!strcasecmp(source, "systemname")) {
+            specs[n].name = ast_strdup(item);
+            specs[n].value = ast_config_AST_SYSTEM_NAME;
+        } else if ((specs[n].field = ast_kafka_field_find(fields, count, source))) {
+            specs[n].name = ast_strdup(item);
+        } else {
+            ast_log(LOG_ERROR, "Unknown column '%s' for header %s\n", source, item);
+            ast_kafka_header_specs_free(specs, n);
+            return -1;
+        }
+        if (!specs[n].name) {
+            ast_kafka_header_specs_free(specs, n);
+            return -1;
+        }
+        n++;
+    }
+    return n;
+}
+
+void ast_kafka_header_specs_free(struct ast_kafka_header_spec *specs, int count) {
+    int i;
+
+    for (i = 0; i < count; i++) {
+        ast_free(specs[i].name);
+        specs[i].name = NULL;
+    }
+}
+
+int ast_kafka_encode_record(struct ast_str **buf, enum ast_kafka_format format, const struct ast_kafka_field *fields,
+                            size_t count, const void *record, const struct ast_kafka_timefmt *timefmt) {
+    switch (format) {
+        case AST_KAFKA_FORMAT_JSON:
+            encode_json(buf, fields, count, record, timefmt);
+            return 0;
+        case AST_KAFKA_FORMAT_ROWBINARY:
+            encode_rowbinary(buf, fields, count, record);
+            return 0;
+        case AST_KAFKA_FORMAT_MSGPACK:
+            encode_msgpack(buf, fields, count, record);
+            return 0;
+        case AST_KAFKA_FORMAT_PROTOBUF:
+            encode_protobuf(buf, fields, count, record);
+            return 0;
+    }
+    return -1;
+}
+
+struct ast_json *ast_kafka_record_json(const struct ast_kafka_field *fields, size_t count,
+                                       const void *record, const struct ast_kafka_timefmt *timefmt) {
+    struct ast_json *payload;
+    struct ast_json *value;
+    size_t i;
+
+    payload = ast_json_object_create();
+    if (!payload) {
+        return NULL;
+    }
+    for (i = 0; i < count; i++) {
+        if (field_is_string(&fields[i])) {
+            value = ast_json_string_create(field_string(&fields[i], record));
+        } else if (fields[i].type == AST_KAFKA_FIELD_TIME) {
+            value = ast_kafka_timefmt_json(timefmt, field_time(&fields[i], record));
+        } else {
+            value = ast_json_integer_create(field_integer(&fields[i], record));
+        }
+        /* A value that can not be created leaves the member out */
+        ast_json_object_set(payload, fields[i].name, value);
+    }
+    return payload;
+}
@@ -0,0 +1,132 @@
+/*! \file
+ *
+ * \brief Rate limits and sampling of the topics of res_kafka
+ *
+ * The rate limit is a token bucket kept as the theoretical arrival time of
+ * the next message (GCRA), a single counter updated by compare and swap, so
+ * the producing threads never take a lock for it. Sampling hashes the message
+ * key, every message of a call has the same key and so all of them are kept
+ * or all of them are dropped.
+ *
+ * \author Max Nesterov <braams@braams.ru>
+ *
+ */
+
+#define AST_MODULE_SELF_SYM __internal_res_kafka_self
+#define AST_MODULE "res_kafka"
+
+#include <asterisk.h>
+#include <asterisk/config.h>
+#include <asterisk/logger.h>
+#include <asterisk/strings.h>
+#include <time.h>
+#include "kafka_limit.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+
+int kafka_limit_option(struct kafka_limit_config *cfg, const struct ast_variable *v) {
+    unsigned int value;
+
+    if (strcasecmp(v->name, "rate_limit") && strcasecmp(v->name, "rate_burst") && strcasecmp(v->name, "sample")) {
+        return 0;
+    }
+    if (!strcasecmp(v->name, "rate_limit") && !strcasecmp(v->value, "off")) {
+        cfg->rate = KAFKA_LIMIT_OFF;
+        return 1;
+    }
+    if (sscanf(v->value, "%30u", &value) != 1 || !value || value == KAFKA_LIMIT_OFF) {
+        ast_log(LOG_ERROR, "Invalid value '%s' of option '%s'\n", v->value, v->name);
+        return -1;
+    }
+    if (!strcasecmp(v->name, "rate_limit")) {
+        cfg->rate = value;
+    } else if (!strcasecmp(v->name, "rate_burst")) {
+        cfg->burst = value;
+    } else {
+        cfg->sample = value;
+    }
+    return 1;
+}
+
+void kafka_limit_merge(struct kafka_limit_config *cfg, const struct kafka_limit_config *defaults) {
+    if (!cfg->rate) {
+        cfg->rate = defaults->rate;
+    }
+    if (!cfg->burst) {
+        cfg->burst = defaults->burst;
+    }
+    if (!cfg->sample) {
+        cfg->sample = defaults->sample;
+    }
+}
+
+void kafka_limit_set(struct kafka_limit *limit, const struct kafka_limit_config *cfg) {
+    uint64_t interval = 0;
+    unsigned int burst;
+
+    if (cfg->rate && cfg->rate != KAFKA_LIMIT_OFF) {
+        interval = NSEC_PER_SEC / cfg->rate;
+    }
+    /* A second of messages by default */
+    burst = cfg->burst ? cfg->burst : MAX(cfg->rate, 1);
+    __atomic_store_n(&limit->tolerance_ns, interval * (burst - 1), __ATOMIC_RELAXED);
+    __atomic_store_n(&limit->interval_ns, interval, __ATOMIC_RELAXED);
+    __atomic_store_n(&limit->sample, cfg->sample ? cfg->sample : 1, __ATOMIC_RELAXED);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/*! \brief FNV-1a 64 bit hash, folded so the low bits depend on every byte */
+static uint64_t key_hash(const unsigned char *key, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+
+    while (len--) {
+        hash ^= *key++;
+        hash *= 1099511628211ULL;
+    }
+    return hash ^ (hash >> 32);
+}
+
+static int sample_keep(struct kafka_limit *limit, const void *key, size_t key_len) {
+    unsigned int sample = __atomic_load_n(&limit->sample, __ATOMIC_RELAXED);
+
+    if (sample <= 1) {
+        return 1;
+    }
+    if (key && key_len) {
+        return !(key_hash(key, key_len) % sample);
+    }
+    return !(__atomic_fetch_add(&limit->sequence, 1, __ATOMIC_RELAXED) % sample);
+}
+
+enum kafka_limit_verdict kafka_limit_check(struct kafka_limit *limit, const void *key, size_t key_len, int low) {
+    uint64_t interval = __atomic_load_n(&limit->interval_ns, __ATOMIC_RELAXED);
+    uint64_t tolerance, now, tat, next;
+
+    if (!sample_keep(limit, key, key_len)) {
+        return KAFKA_LIMIT_SAMPLED;
+    }
+    if (!interval) {
+        return KAFKA_LIMIT_PASS;
+    }
+    tolerance = __atomic_load_n(&limit->tolerance_ns, __ATOMIC_RELAXED);
+    if (low) {
+        tolerance /= 2;
+    }
+    now = now_ns();
+    tat = __atomic_load_n(&limit->tat_ns, __ATOMIC_RELAXED);
+    do {
+        next = MAX(tat, now);
+        if (next - now > tolerance) {
+            return KAFKA_LIMIT_THROTTLED;
+        }
+        /* No ast_ wrapper for compare and swap */
+    } while (!__atomic_compare_exchange_n(&limit->tat_ns, &tat, next + interval, 1, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+    return KAFKA_LIMIT_PASS;
+}
@@ -0,0 +1,71 @@
+//
+// Rate limits and sampling of the topics of res_kafka, not exported to other modules
+//
+
+#ifndef ASTERISK_KAFKA_LIMIT_H
+#define ASTERISK_KAFKA_LIMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct ast_variable;
+
+/*! \brief rate_limit=off, the limit of the [general] section does not apply */
+#define KAFKA_LIMIT_OFF UINT32_MAX
+
+/*! \brief Options of the [general] or a [topic:<name>] section, 0 when not configured */
+struct kafka_limit_config {
+    /*! Messages per second, KAFKA_LIMIT_OFF for none */
+    unsigned int rate;
+    /*! Messages let through at once after a quiet period */
+    unsigned int burst;
+    /*! 1 of every sample calls is kept */
+    unsigned int sample;
+};
+
+/*! \brief Limit state of a topic, read and updated with atomics only */
+struct kafka_limit {
+    /*! Nanoseconds between two messages at the rate limit, 0 without a limit */
+    uint64_t interval_ns;
+    /*! How far ahead of the clock the bucket may run, the burst */
+    uint64_t tolerance_ns;
+    /*! Theoretical arrival time of the next message, in nanoseconds of the monotonic clock */
+    uint64_t tat_ns;
+    /*! 1 of every sample calls is kept, 1 for all */
+    unsigned int sample;
+    /*! Messages without a key, sampled by their sequence */
+    unsigned int sequence;
+};
+
+enum kafka_limit_verdict {
+    KAFKA_LIMIT_PASS = 0,
+    /*! Over the rate limit */
+    KAFKA_LIMIT_THROTTLED,
+    /*! Not part of the sample */
+    KAFKA_LIMIT_SAMPLED,
+};
+
+/*!
+ * \brief Parse a rate_limit, rate_burst or sample option
+ *
+ * \retval 1 the option is a limit one and is valid
+ * \retval 0 not a limit option
+ * \retval -1 invalid value
+ */
+int kafka_limit_option(struct kafka_limit_config *cfg, const struct ast_variable *v);
+
+/*! \brief Fill in the options a topic does not configure from the [general] section */
+void kafka_limit_merge(struct kafka_limit_config *cfg, const struct kafka_limit_config *defaults);
+
+/*! \brief Apply a configuration, also to a topic which is producing */
+void kafka_limit_set(struct kafka_limit *limit, const struct kafka_limit_config *cfg);
+
+/*!
+ * \brief Sample a message by its key, then take a token of the bucket
+ *
+ * \param low The message may use half of the burst only, so it is throttled
+ *        before the others once the bucket runs low
+ */
+enum kafka_limit_verdict kafka_limit_check(struct kafka_limit *limit, const void *key, size_t key_len, int low);
+
+#endif //ASTERISK_KAFKA_LIMIT_H
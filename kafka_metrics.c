@@ -0,0 +1,121 @@
+/*! \file
+ *
+ * \brief Kafka producer metrics
+ *
+ * Counters and latency histograms are plain integers updated with relaxed
+ * atomic additions, so the producing threads and the poll threads never
+ * take a lock for them. A histogram bucket covers 1/8 of a power of two,
+ * 16 buckets of one microsecond come first.
+ *
+ * \author Max Nesterov <braams@braams.ru>
+ *
+ */
+
+#define AST_MODULE_SELF_SYM __internal_res_kafka_self
+#define AST_MODULE "res_kafka"
+
+#include <asterisk.h>
+#include <asterisk/lock.h>
+#include <asterisk/utils.h>
+#include <time.h>
+#include "kafka_metrics.h"
+
+#define SUB_COUNT (1 << KAFKA_HISTOGRAM_SUB_BITS)
+#define HALF_COUNT (SUB_COUNT / 2)
+#define MAX_VALUE ((1ULL << KAFKA_HISTOGRAM_MAX_BITS) - 1)
+
+uint64_t kafka_metrics_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned int bucket_index(uint64_t us) {
+    unsigned int shift;
+
+    if (us < SUB_COUNT) {
+        return us;
+    }
+    if (us > MAX_VALUE) {
+        us = MAX_VALUE;
+    }
+    /* The top KAFKA_HISTOGRAM_SUB_BITS bits of the value select the sub-bucket */
+    shift = 63 - __builtin_clzll(us) - (KAFKA_HISTOGRAM_SUB_BITS - 1);
+    return SUB_COUNT + (shift - 1) * HALF_COUNT + (unsigned int) (us >> shift) - HALF_COUNT;
+}
+
+/*! \brief Largest value of a bucket */
+static uint64_t bucket_upper(unsigned int index) {
+    unsigned int shift;
+    uint64_t top;
+
+    if (index < SUB_COUNT) {
+        return index;
+    }
+    shift = (index - SUB_COUNT) / HALF_COUNT + 1;
+    top = (index - SUB_COUNT) % HALF_COUNT + HALF_COUNT;
+    return ((top + 1) << shift) - 1;
+}
+
+void kafka_histogram_record(struct kafka_histogram *hist, uint64_t us) {
+    uint64_t max;
+
+    kafka_metrics_add(hist->counts[bucket_index(us)], 1);
+    kafka_metrics_add(hist->total, 1);
+    kafka_metrics_add(hist->sum_us, us);
+    /* No ast_ wrapper for compare and swap */
+    max = __atomic_load_n(&hist->max_us, __ATOMIC_RELAXED);
+    while (us > max
+           && !__atomic_compare_exchange_n(&hist->max_us, &max, us, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static uint64_t load(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+void kafka_metrics_merge(struct kafka_metrics *dst, const struct kafka_metrics *src) {
+    unsigned int i;
+    uint64_t max;
+
+    dst->enqueued += load(&src->enqueued);
+    dst->delivered += load(&src->delivered);
+    dst->records += load(&src->records);
+    dst->failed += load(&src->failed);
+    dst->bytes += load(&src->bytes);
+    dst->throttled += load(&src->throttled);
+    dst->sampled += load(&src->sampled);
+    for (i = 0; i < KAFKA_HISTOGRAM_BUCKETS; i++) {
+        dst->latency.counts[i] += load(&src->latency.counts[i]);
+    }
+    dst->latency.total += load(&src->latency.total);
+    dst->latency.sum_us += load(&src->latency.sum_us);
+    max = load(&src->latency.max_us);
+    if (max > dst->latency.max_us) {
+        dst->latency.max_us = max;
+    }
+}
+
+uint64_t kafka_histogram_percentile(const struct kafka_histogram *hist, double percentile) {
+    double rank = hist->total * percentile / 100.0;
+    uint64_t target;
+    uint64_t seen = 0;
+    unsigned int i;
+
+    if (!hist->total) {
+        return 0;
+    }
+    /* Nearest rank */
+    target = (uint64_t) rank;
+    if (target < rank || !target) {
+        target++;
+    }
+    for (i = 0; i < KAFKA_HISTOGRAM_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= target) {
+            return MIN(bucket_upper(i), hist->max_us);
+        }
+    }
+    return hist->max_us;
+}
@@ -0,0 +1,61 @@
+//
+// Producer metrics of res_kafka, not exported to other modules
+//
+
+#ifndef ASTERISK_KAFKA_METRICS_H
+#define ASTERISK_KAFKA_METRICS_H
+
+#include <stdint.h>
+
+/*! \brief Sub-buckets per power of two, a bucket is at most 1/8 of its value wide */
+#define KAFKA_HISTOGRAM_SUB_BITS 4
+/*! \brief Latencies up to 2^36 microseconds (19 hours), longer ones land in the last bucket */
+#define KAFKA_HISTOGRAM_MAX_BITS 36
+#define KAFKA_HISTOGRAM_BUCKETS ((1 << KAFKA_HISTOGRAM_SUB_BITS) \
+    + (KAFKA_HISTOGRAM_MAX_BITS - KAFKA_HISTOGRAM_SUB_BITS) * (1 << (KAFKA_HISTOGRAM_SUB_BITS - 1)))
+
+/*! \brief Log-linear latency histogram in microseconds, HdrHistogram style */
+struct kafka_histogram {
+    uint64_t counts[KAFKA_HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t sum_us;
+    uint64_t max_us;
+};
+
+/*! \brief Counters of a topic, updated with relaxed atomics and never locked */
+struct kafka_metrics {
+    uint64_t enqueued;
+    uint64_t delivered;
+    /*! Records of the delivered messages, more than one in a batched message */
+    uint64_t records;
+    uint64_t failed;
+    /*! Payload bytes of the delivered messages */
+    uint64_t bytes;
+    /*! Dropped over the rate limit of the topic */
+    uint64_t throttled;
+    /*! Dropped by the sampling of the topic */
+    uint64_t sampled;
+    /*! From ast_kafka_topic_produce() to the delivery report */
+    struct kafka_histogram latency;
+};
+
+/*! \brief Add to a counter of struct kafka_metrics */
+#define kafka_metrics_add(counter, value) ast_atomic_fetch_add(&(counter), (value), __ATOMIC_RELAXED)
+
+/*! \brief Monotonic clock in microseconds, the enqueue timestamp of a message */
+uint64_t kafka_metrics_now(void);
+
+void kafka_histogram_record(struct kafka_histogram *hist, uint64_t us);
+
+/*!
+ * \brief Add the current values of \a src to \a dst
+ *
+ * Each counter is read atomically, the set of them is not, which is good
+ * enough for reporting. Used for snapshots and for the totals of all topics.
+ */
+void kafka_metrics_merge(struct kafka_metrics *dst, const struct kafka_metrics *src);
+
+/*! \brief Latency of the given percentile in microseconds, the upper bound of its bucket */
+uint64_t kafka_histogram_percentile(const struct kafka_histogram *hist, double percentile);
+
+#endif //ASTERISK_KAFKA_METRICS_H
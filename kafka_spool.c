@@ -0,0 +1,551 @@
+/*! \file
+ *
+ * \brief Kafka disk spool
+ *
+ * Messages which could not be delivered are appended to memory mapped
+ * segment files and replayed in order once the cluster is back.
+ *
+ * A segment starts with a file header followed by records. The magic of a
+ * record is stored after the rest of it, so a record torn by a crash is
+ * recognized and the scan of the segment stops there. Replayed records are
+ * marked in place and a segment is removed when all of its records are
+ * replayed. Space is reserved with posix_fallocate() when a segment is
+ * created, a full disk therefore fails the append instead of raising
+ * SIGBUS on a write to the mapping.
+ *
+ * \author Max Nesterov <braams@braams.ru>
+ *
+ */
+
+#define AST_MODULE_SELF_SYM __internal_res_kafka_self
+#define AST_MODULE "res_kafka"
+
+#include <asterisk.h>
+#include <asterisk/linkedlists.h>
+#include <asterisk/lock.h>
+#include <asterisk/logger.h>
+#include <asterisk/utils.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "kafka_spool.h"
+
+#define SPOOL_FILE_MAGIC "AKSP"
+#define SPOOL_FILE_VERSION 1
+#define SPOOL_FILE_SUFFIX ".spool"
+#define SPOOL_RECORD_MAGIC 0x52534b41
+#define SPOOL_ALIGN(len) (((len) + 7) & ~(size_t) 7)
+
+enum spool_record_state {
+    RECORD_PENDING = 0,
+    RECORD_REPLAYED = 1,
+};
+
+struct spool_file_header {
+    char magic[4];
+    uint32_t version;
+    uint64_t seq;
+};
+
+struct spool_record {
+    /*! SPOOL_RECORD_MAGIC, written last */
+    uint32_t magic;
+    /*! enum spool_record_state */
+    uint32_t state;
+    /*! CRC-32 of the topic, headers, key and payload */
+    uint32_t crc;
+    /*! Length of the topic including the terminating NUL */
+    uint32_t topic_len;
+    uint32_t key_len;
+    uint32_t len;
+    uint32_t headers_len;
+    /*! Topic, headers, key and payload, padded to 8 bytes */
+    char data[0];
+};
+
+struct spool_segment {
+    AST_LIST_ENTRY(spool_segment) list;
+    unsigned long long seq;
+    int fd;
+    char *map;
+    size_t size;
+    /*! Offset of the next record to replay */
+    size_t head;
+    /*! End of the records, where the next one is appended */
+    size_t tail;
+    unsigned int pending;
+    char path[0];
+};
+
+static AST_LIST_HEAD_NOLOCK_STATIC(segments, spool_segment);
+AST_MUTEX_DEFINE_STATIC(spool_lock);
+
+/*! Segment being appended to, the last one of the list */
+static struct spool_segment *active;
+static struct kafka_spool_config spool_config;
+static char *spool_directory;
+static int spool_open;
+static unsigned long long next_seq;
+static struct kafka_spool_stats totals;
+/*! The spool is full and the drop was already reported */
+static int full_reported;
+static uint32_t crc_table[256];
+
+static void crc_init(void) {
+    uint32_t c;
+    int i, k;
+
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (k = 0; k < 8; k++) {
+            c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc_update(uint32_t crc, const void *data, size_t len) {
+    const unsigned char *p = data;
+
+    crc = ~crc;
+    while (len--) {
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/*! \brief Length of the topic, headers, key and payload */
+static size_t record_data_len(const struct spool_record *rec) {
+    return (size_t) rec->topic_len + rec->headers_len + rec->key_len + rec->len;
+}
+
+static size_t record_size(size_t data_len) {
+    return SPOOL_ALIGN(sizeof(struct spool_record) + data_len);
+}
+
+static void segment_free(struct spool_segment *seg, int remove) {
+    if (seg->map) {
+        munmap(seg->map, seg->size);
+    }
+    if (seg->fd >= 0) {
+        close(seg->fd);
+    }
+    if (remove) {
+        unlink(seg->path);
+    }
+    ast_free(seg);
+}
+
+static struct spool_segment *segment_alloc(unsigned long long seq) {
+    struct spool_segment *seg;
+    size_t path_len = strlen(spool_directory) + 32;
+
+    seg = ast_calloc(1, sizeof(*seg) + path_len);
+    if (!seg) {
+        return NULL;
+    }
+    seg->seq = seq;
+    seg->fd = -1;
+    snprintf(seg->path, path_len, "%s/%020llu%s", spool_directory, seq, SPOOL_FILE_SUFFIX);
+    return seg;
+}
+
+static int segment_map(struct spool_segment *seg) {
+    seg->map = mmap(NULL, seg->size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+    if (seg->map == MAP_FAILED) {
+        ast_log(LOG_ERROR, "Unable to map spool segment %s: %s\n", seg->path, strerror(errno));
+        seg->map = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/*! \brief Create the next segment, its space is allocated on disk up front */
+static struct spool_segment *segment_create(void) {
+    struct spool_segment *seg;
+    struct spool_file_header *header;
+    int err;
+
+    seg = segment_alloc(next_seq);
+    if (!seg) {
+        return NULL;
+    }
+    seg->fd = open(seg->path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (seg->fd < 0) {
+        ast_log(LOG_ERROR, "Unable to create spool segment %s: %s\n", seg->path, strerror(errno));
+        segment_free(seg, 0);
+        return NULL;
+    }
+    seg->size = spool_config.segment_size;
+    if ((err = posix_fallocate(seg->fd, 0, seg->size))) {
+        ast_log(LOG_ERROR, "Unable to allocate spool segment %s: %s\n", seg->path, strerror(err));
+        segment_free(seg, 1);
+        return NULL;
+    }
+    if (segment_map(seg)) {
+        segment_free(seg, 1);
+        return NULL;
+    }
+    header = (struct spool_file_header *) seg->map;
+    memcpy(header->magic, SPOOL_FILE_MAGIC, sizeof(header->magic));
+    header->version = SPOOL_FILE_VERSION;
+    header->seq = seg->seq;
+    seg->head = seg->tail = sizeof(*header);
+    next_seq++;
+    return seg;
+}
+
+/*! \brief Find the complete records of a segment left by a previous run */
+static void segment_scan(struct spool_segment *seg) {
+    struct spool_record *rec;
+    size_t offset = sizeof(struct spool_file_header);
+    size_t total;
+    int head_set = 0;
+
+    while (offset + sizeof(*rec) <= seg->size) {
+        rec = (struct spool_record *) (seg->map + offset);
+        if (rec->magic != SPOOL_RECORD_MAGIC) {
+            break;
+        }
+        total = record_size(record_data_len(rec));
+        if (total > seg->size - offset) {
+            break;
+        }
+        if (rec->crc != crc_update(0, rec->data, record_data_len(rec))) {
+            ast_log(LOG_WARNING, "Spool segment %s is damaged at offset %zu, the rest is skipped\n", seg->path, offset);
+            break;
+        }
+        if (rec->state == RECORD_PENDING) {
+            seg->pending++;
+            if (!head_set) {
+                seg->head = offset;
+                head_set = 1;
+            }
+        }
+        offset += total;
+    }
+    seg->tail = offset;
+    if (!head_set) {
+        seg->head = offset;
+    }
+}
+
+static struct spool_segment *segment_recover(unsigned long long seq) {
+    struct spool_segment *seg;
+    struct spool_file_header *header;
+    struct stat st;
+
+    seg = segment_alloc(seq);
+    if (!seg) {
+        return NULL;
+    }
+    seg->fd = open(seg->path, O_RDWR);
+    if (seg->fd < 0 || fstat(seg->fd, &st)) {
+        ast_log(LOG_WARNING, "Unable to open spool segment %s: %s\n", seg->path, strerror(errno));
+        segment_free(seg, 0);
+        return NULL;
+    }
+    if ((size_t) st.st_size < sizeof(*header)) {
+        ast_log(LOG_WARNING, "Spool segment %s is truncated, removing it\n", seg->path);
+        segment_free(seg, 1);
+        return NULL;
+    }
+    seg->size = st.st_size;
+    if (segment_map(seg)) {
+        segment_free(seg, 0);
+        return NULL;
+    }
+    header = (struct spool_file_header *) seg->map;
+    if (memcmp(header->magic, SPOOL_FILE_MAGIC, sizeof(header->magic))
+        || header->version != SPOOL_FILE_VERSION) {
+        ast_log(LOG_WARNING, "%s is not a spool segment, removing it\n", seg->path);
+        segment_free(seg, 1);
+        return NULL;
+    }
+    segment_scan(seg);
+    if (!seg->pending) {
+        segment_free(seg, 1);
+        return NULL;
+    }
+    return seg;
+}
+
+static int seq_cmp(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *) a, y = *(const unsigned long long *) b;
+    return x < y ? -1 : x > y;
+}
+
+/*! \brief Sequence numbers of the segment files, sorted */
+static int list_segments(unsigned long long **result, size_t *count) {
+    DIR *dir;
+    struct dirent *entry;
+    unsigned long long *seqs = NULL, *grown, seq;
+    size_t n = 0, alloc = 0, name_len, suffix_len = strlen(SPOOL_FILE_SUFFIX);
+    char *end;
+
+    if (!(dir = opendir(spool_directory))) {
+        ast_log(LOG_ERROR, "Unable to open spool directory %s: %s\n", spool_directory, strerror(errno));
+        return -1;
+    }
+    while ((entry = readdir(dir))) {
+        name_len = strlen(entry->d_name);
+        if (name_len <= suffix_len || strcmp(entry->d_name + name_len - suffix_len, SPOOL_FILE_SUFFIX)) {
+            continue;
+        }
+        seq = strtoull(entry->d_name, &end, 10);
+        if (end != entry->d_name + name_len - suffix_len) {
+            continue;
+        }
+        if (n == alloc) {
+            alloc = alloc ? alloc * 2 : 16;
+            if (!(grown = ast_realloc(seqs, alloc * sizeof(*seqs)))) {
+                break;
+            }
+            seqs = grown;
+        }
+        seqs[n++] = seq;
+    }
+    closedir(dir);
+    if (seqs) {
+        qsort(seqs, n, sizeof(*seqs), seq_cmp);
+    }
+    *result = seqs;
+    *count = n;
+    return 0;
+}
+
+static void spool_close_segments(void) {
+    struct spool_segment *seg;
+
+    while ((seg = AST_LIST_REMOVE_HEAD(&segments, list))) {
+        /* Keep the ones with messages for the next run */
+        segment_free(seg, !seg->pending);
+    }
+    active = NULL;
+}
+
+int kafka_spool_open(const struct kafka_spool_config *config) {
+    struct spool_segment *seg;
+    unsigned long long *seqs = NULL;
+    size_t count = 0, i;
+
+    if (config->segment_size < sizeof(struct spool_file_header) + sizeof(struct spool_record) + 1024) {
+        ast_log(LOG_ERROR, "Spool segment size %zu is too small\n", config->segment_size);
+        return -1;
+    }
+    if (ast_mkdir(config->directory, 0700)) {
+        ast_log(LOG_ERROR, "Unable to create spool directory %s: %s\n", config->directory, strerror(errno));
+        return -1;
+    }
+
+    ast_mutex_lock(&spool_lock);
+    crc_init();
+    spool_directory = ast_strdup(config->directory);
+    spool_config = *config;
+    spool_config.directory = spool_directory;
+    memset(&totals, 0, sizeof(totals));
+    full_reported = 0;
+    next_seq = 1;
+
+    if (!spool_directory || list_segments(&seqs, &count)) {
+        ast_mutex_unlock(&spool_lock);
+        kafka_spool_close();
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        if ((seg = segment_recover(seqs[i]))) {
+            AST_LIST_INSERT_TAIL(&segments, seg, list);
+            totals.pending += seg->pending;
+        }
+        next_seq = seqs[i] + 1;
+    }
+    ast_free(seqs);
+
+    /* Recovered segments are only replayed, new messages go to a fresh one */
+    if (!(active = segment_create())) {
+        ast_mutex_unlock(&spool_lock);
+        kafka_spool_close();
+        return -1;
+    }
+    AST_LIST_INSERT_TAIL(&segments, active, list);
+    spool_open = 1;
+    ast_mutex_unlock(&spool_lock);
+
+    if (totals.pending) {
+        ast_log(LOG_NOTICE, "Recovered %lu spooled message(s) from %s\n", totals.pending, spool_directory);
+    }
+    return 0;
+}
+
+void kafka_spool_close(void) {
+    ast_mutex_lock(&spool_lock);
+    spool_open = 0;
+    spool_close_segments();
+    ast_free(spool_directory);
+    spool_directory = NULL;
+    ast_mutex_unlock(&spool_lock);
+}
+
+int kafka_spool_enabled(void) {
+    return spool_open;
+}
+
+static size_t spool_bytes(void) {
+    struct spool_segment *seg;
+    size_t bytes = 0;
+
+    AST_LIST_TRAVERSE(&segments, seg, list) {
+        bytes += seg->size;
+    }
+    return bytes;
+}
+
+/*! \brief Start a new segment, the full one is removed if nothing is left to replay in it */
+static int spool_roll(void) {
+    struct spool_segment *seg;
+
+    if (spool_bytes() + spool_config.segment_size > spool_config.max_size && active->pending) {
+        return -1;
+    }
+    if (!(seg = segment_create())) {
+        return -1;
+    }
+    if (!active->pending) {
+        AST_LIST_REMOVE(&segments, active, list);
+        segment_free(active, 1);
+    }
+    AST_LIST_INSERT_TAIL(&segments, seg, list);
+    active = seg;
+    return 0;
+}
+
+int kafka_spool_append(const char *topic, const void *key, size_t key_len, const void *headers, size_t headers_len,
+                       const void *payload, size_t len) {
+    struct spool_record *rec;
+    size_t topic_len = strlen(topic) + 1;
+    size_t total;
+    char *p;
+
+    if (!key) {
+        key_len = 0;
+    }
+    if (!headers) {
+        headers_len = 0;
+    }
+    total = record_size(topic_len + headers_len + key_len + len);
+
+    ast_mutex_lock(&spool_lock);
+    if (!spool_open) {
+        ast_mutex_unlock(&spool_lock);
+        return -1;
+    }
+    if (total > spool_config.segment_size - sizeof(struct spool_file_header)) {
+        totals.dropped++;
+        ast_mutex_unlock(&spool_lock);
+        ast_log(LOG_WARNING, "Message of %zu bytes for topic %s does not fit in a spool segment\n", len, topic);
+        return -1;
+    }
+    if (total > active->size - active->tail && spool_roll()) {
+        totals.dropped++;
+        if (!full_reported) {
+            full_reported = 1;
+            ast_log(LOG_WARNING, "Spool %s is full, messages are dropped\n", spool_directory);
+        }
+        ast_mutex_unlock(&spool_lock);
+        return -1;
+    }
+
+    rec = (struct spool_record *) (active->map + active->tail);
+    rec->state = RECORD_PENDING;
+    rec->topic_len = topic_len;
+    rec->key_len = key_len;
+    rec->len = len;
+    rec->headers_len = headers_len;
+    p = rec->data;
+    memcpy(p, topic, topic_len);
+    p += topic_len;
+    if (headers_len) {
+        memcpy(p, headers, headers_len);
+        p += headers_len;
+    }
+    if (key_len) {
+        memcpy(p, key, key_len);
+        p += key_len;
+    }
+    memcpy(p, payload, len);
+    rec->crc = crc_update(0, rec->data, topic_len + headers_len + key_len + len);
+    /* The record is complete only once the magic is in place */
+    __atomic_store_n(&rec->magic, SPOOL_RECORD_MAGIC, __ATOMIC_RELEASE);
+
+    active->tail += total;
+    active->pending++;
+    totals.pending++;
+    totals.spooled++;
+    full_reported = 0;
+    ast_mutex_unlock(&spool_lock);
+    return 0;
+}
+
+unsigned int kafka_spool_replay(kafka_spool_replay_fn fn, unsigned int max) {
+    struct spool_segment *seg;
+    struct spool_record *rec;
+    unsigned int replayed = 0;
+    const char *data, *key;
+    uint32_t headers_len;
+    int res;
+
+    ast_mutex_lock(&spool_lock);
+    while (spool_open && replayed < max && (seg = AST_LIST_FIRST(&segments))) {
+        if (seg->head >= seg->tail) {
+            if (seg == active) {
+                break;
+            }
+            AST_LIST_REMOVE_HEAD(&segments, list);
+            segment_free(seg, 1);
+            continue;
+        }
+        rec = (struct spool_record *) (seg->map + seg->head);
+        if (rec->state == RECORD_PENDING) {
+            data = rec->data;
+            headers_len = rec->headers_len;
+            key = data + rec->topic_len + headers_len;
+            /* A pending record keeps its segment, only the replay removes segments with records */
+            ast_mutex_unlock(&spool_lock);
+            res = fn(data, key, rec->key_len, headers_len ? data + rec->topic_len : NULL, headers_len,
+                     key + rec->key_len, rec->len);
+            ast_mutex_lock(&spool_lock);
+            if (res || !spool_open) {
+                break;
+            }
+            rec->state = RECORD_REPLAYED;
+            seg->pending--;
+            totals.pending--;
+            totals.replayed++;
+            replayed++;
+        }
+        seg->head += record_size(record_data_len(rec));
+    }
+    ast_mutex_unlock(&spool_lock);
+    return replayed;
+}
+
+unsigned long kafka_spool_pending(void) {
+    return totals.pending;
+}
+
+void kafka_spool_get_stats(struct kafka_spool_stats *stats) {
+    struct spool_segment *seg;
+
+    ast_mutex_lock(&spool_lock);
+    *stats = totals;
+    stats->segments = 0;
+    AST_LIST_TRAVERSE(&segments, seg, list) {
+        stats->segments++;
+    }
+    stats->bytes = spool_bytes();
+    stats->max_size = spool_config.max_size;
+    ast_mutex_unlock(&spool_lock);
+}
@@ -0,0 +1,81 @@
+//
+// Disk spool of res_kafka, not exported to other modules
+//
+
+#ifndef ASTERISK_KAFKA_SPOOL_H
+#define ASTERISK_KAFKA_SPOOL_H
+
+#include <stddef.h>
+
+struct kafka_spool_config {
+    /*! Directory of the segment files */
+    const char *directory;
+    /*! Size of a segment file in bytes */
+    size_t segment_size;
+    /*! Total size of the segment files in bytes */
+    size_t max_size;
+};
+
+/*! \brief Spool counters for the CLI */
+struct kafka_spool_stats {
+    unsigned int segments;
+    size_t bytes;
+    size_t max_size;
+    unsigned long pending;
+    unsigned long spooled;
+    unsigned long replayed;
+    unsigned long dropped;
+};
+
+/*!
+ * \brief Replay callback, called in spool order
+ *
+ * \param headers Headers as given to kafka_spool_append(), NULL if the message has none
+ *
+ * \retval 0 the message was enqueued and is marked as replayed
+ * \retval -1 stop, the message stays in the spool
+ */
+typedef int (*kafka_spool_replay_fn)(const char *topic, const void *key, size_t key_len, const void *headers,
+                                     size_t headers_len, const void *payload, size_t len);
+
+/*!
+ * \brief Open the spool directory and recover the segments left by a previous run
+ *
+ * Records written completely before a crash are kept, a torn last record is ignored.
+ */
+int kafka_spool_open(const struct kafka_spool_config *config);
+
+void kafka_spool_close(void);
+
+/*! \brief Whether the spool is open */
+int kafka_spool_enabled(void);
+
+/*!
+ * \brief Append a message to the spool
+ *
+ * \param headers Serialized headers, opaque to the spool, may be NULL
+ *
+ * \retval 0 the message is spooled
+ * \retval -1 the spool is closed, full or the message is larger than a segment
+ */
+int kafka_spool_append(const char *topic, const void *key, size_t key_len, const void *headers, size_t headers_len,
+                       const void *payload, size_t len);
+
+/*!
+ * \brief Replay up to \a max spooled messages
+ *
+ * Segments are removed once all of their messages are replayed. \a fn is
+ * called without the spool lock, so it may append to the spool, e.g. when
+ * a delivery fails meanwhile. Called by one thread at a time, which is
+ * done before the spool is closed.
+ *
+ * \return number of replayed messages
+ */
+unsigned int kafka_spool_replay(kafka_spool_replay_fn fn, unsigned int max);
+
+/*! \brief Number of messages waiting for replay */
+unsigned long kafka_spool_pending(void);
+
+void kafka_spool_get_stats(struct kafka_spool_stats *stats);
+
+#endif //ASTERISK_KAFKA_SPOOL_H
@@ -0,0 +1,220 @@
+/*! \file
+ *
+ * \brief Kafka timestamp formatting
+ *
+ * Formatted seconds are cached per thread, so a CDR with three
+ * timestamps in the same second costs one ast_localtime() call.
+ *
+ * \author Max Nesterov <braams@braams.ru>
+ *
+ */
+
+#define AST_MODULE_SELF_SYM __internal_res_kafka_self
+#define AST_MODULE "res_kafka"
+
+#include <asterisk.h>
+#include <asterisk/json.h>
+#include <asterisk/localtime.h>
+#include <asterisk/strings.h>
+#include <asterisk/threadstorage.h>
+#include <asterisk/utils.h>
+#include "res_kafka.h"
+
+#define TIMEFMT_CACHE_SIZE 4
+
+enum timefmt_mode {
+    /*! ast_strftime() in the configured zone */
+    TIMEFMT_STRFTIME,
+    /*! Seconds since the epoch */
+    TIMEFMT_EPOCH,
+    /*! Milliseconds since the epoch */
+    TIMEFMT_EPOCH_MS,
+    /*! 2006-01-02T15:04:05.000000Z */
+    TIMEFMT_ISO8601,
+};
+
+struct ast_kafka_timefmt {
+    enum timefmt_mode mode;
+    /*! Cache key, unique for the lifetime of the module */
+    unsigned int id;
+    /*! The format has no sub-second conversions, so the whole result can be cached */
+    int cacheable;
+    /*! AST_KAFKA_TIMEFMT_UNSET_NULL */
+    int unset_null;
+    char *zone;
+    char format[0];
+};
+
+struct timefmt_cache_entry {
+    unsigned int id;
+    time_t sec;
+    char text[AST_KAFKA_TIME_LEN];
+};
+
+struct timefmt_cache {
+    struct timefmt_cache_entry entries[TIMEFMT_CACHE_SIZE];
+    unsigned int next;
+};
+
+AST_THREADSTORAGE(timefmt_cache_buf);
+
+static volatile int timefmt_ids;
+
+/*! \brief Does an ast_strftime() format use the fractional seconds (%q, %1q .. %6q) */
+static int has_subsecond(const char *format) {
+    const char *p;
+
+    for (p = format; (p = strchr(p, '%')); ) {
+        p++;
+        if (*p >= '1' && *p <= '6') {
+            p++;
+        }
+        if (*p == 'q') {
+            return 1;
+        }
+        if (*p) {
+            p++;
+        }
+    }
+    return 0;
+}
+
+struct ast_kafka_timefmt *ast_kafka_timefmt_create(const char *format, const char *zone, unsigned int flags) {
+    struct ast_kafka_timefmt *fmt;
+
+    format = S_OR(format, AST_KAFKA_DEFAULT_DATEFORMAT);
+    fmt = ast_calloc(1, sizeof(*fmt) + strlen(format) + 1);
+    if (!fmt) {
+        return NULL;
+    }
+    strcpy(fmt->format, format); /* Safe */
+    fmt->id = ast_atomic_fetchadd_int(&timefmt_ids, 1) + 1;
+    fmt->unset_null = (flags & AST_KAFKA_TIMEFMT_UNSET_NULL) != 0;
+
+    if (!strcasecmp(format, "epoch")) {
+        fmt->mode = TIMEFMT_EPOCH;
+    } else if (!strcasecmp(format, "epoch_ms")) {
+        fmt->mode = TIMEFMT_EPOCH_MS;
+    } else if (!strcasecmp(format, "iso8601")) {
+        fmt->mode = TIMEFMT_ISO8601;
+    } else {
+        fmt->mode = TIMEFMT_STRFTIME;
+        fmt->cacheable = !has_subsecond(format);
+        fmt->zone = ast_strlen_zero(zone) ? NULL : ast_strdup(zone);
+    }
+    return fmt;
+}
+
+void ast_kafka_timefmt_destroy(struct ast_kafka_timefmt *fmt) {
+    if (!fmt) {
+        return;
+    }
+    ast_free(fmt->zone);
+    ast_free(fmt);
+}
+
+int ast_kafka_timefmt_is_numeric(const struct ast_kafka_timefmt *fmt) {
+    return fmt->mode == TIMEFMT_EPOCH || fmt->mode == TIMEFMT_EPOCH_MS;
+}
+
+/*! \brief YYYY-MM-DDTHH:MM:SS in UTC, without the timezone database */
+static void format_utc(char *buf, size_t len, time_t t) {
+    /* Days to civil date, see http://howardhinnant.github.io/date_algorithms.html */
+    long long days = t / 86400;
+    long long secs = t % 86400;
+    long long z, era, doe, yoe, doy, mp, y, m, d;
+
+    if (secs < 0) {
+        secs += 86400;
+        days--;
+    }
+    z = days + 719468;
+    era = (z >= 0 ? z : z - 146096) / 146097;
+    doe = z - era * 146097;
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    y = yoe + era * 400;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+    d = doy - (153 * mp + 2) / 5 + 1;
+    m = mp < 10 ? mp + 3 : mp - 9;
+    y += (m <= 2);
+
+    snprintf(buf, len, "%04lld-%02lld-%02lldT%02lld:%02lld:%02lld",
+             y, m, d, secs / 3600, (secs / 60) % 60, secs % 60);
+}
+
+static void format_second(const struct ast_kafka_timefmt *fmt, const struct timeval *tv, char *buf, size_t len) {
+    struct ast_tm tm = {};
+
+    if (fmt->mode == TIMEFMT_ISO8601) {
+        format_utc(buf, len, tv->tv_sec);
+        return;
+    }
+    ast_localtime(tv, &tm, fmt->zone);
+    ast_strftime(buf, len, fmt->format, &tm);
+}
+
+/*!
+ * \brief The formatted second from the per-thread cache, formatting it on a miss
+ * \param scratch Used when there is no thread storage, AST_KAFKA_TIME_LEN bytes
+ */
+static const char *cached_second(const struct ast_kafka_timefmt *fmt, const struct timeval *tv, char *scratch) {
+    struct timefmt_cache *cache;
+    struct timefmt_cache_entry *entry;
+    unsigned int i;
+
+    cache = ast_threadstorage_get(&timefmt_cache_buf, sizeof(*cache));
+    if (!cache) {
+        format_second(fmt, tv, scratch, AST_KAFKA_TIME_LEN);
+        return scratch;
+    }
+    for (i = 0; i < TIMEFMT_CACHE_SIZE; i++) {
+        entry = &cache->entries[i];
+        if (entry->id == fmt->id && entry->sec == tv->tv_sec) {
+            return entry->text;
+        }
+    }
+    entry = &cache->entries[cache->next++ % TIMEFMT_CACHE_SIZE];
+    entry->id = fmt->id;
+    entry->sec = tv->tv_sec;
+    format_second(fmt, tv, entry->text, sizeof(entry->text));
+    return entry->text;
+}
+
+int ast_kafka_timefmt_format(const struct ast_kafka_timefmt *fmt, const struct timeval *tv, char *buf, size_t len) {
+    struct ast_tm tm = {};
+    char scratch[AST_KAFKA_TIME_LEN];
+
+    /* E.g. the answer time of an unanswered call, formatted as the epoch unless asked otherwise */
+    if (fmt->unset_null && !ast_kafka_timefmt_is_numeric(fmt) && ast_tvzero(*tv)) {
+        return -1;
+    }
+    switch (fmt->mode) {
+        case TIMEFMT_EPOCH:
+            return snprintf(buf, len, "%lld", (long long) tv->tv_sec);
+        case TIMEFMT_EPOCH_MS:
+            return snprintf(buf, len, "%lld", (long long) tv->tv_sec * 1000 + tv->tv_usec / 1000);
+        case TIMEFMT_ISO8601:
+            return snprintf(buf, len, "%s.%06ldZ", cached_second(fmt, tv, scratch), (long) tv->tv_usec);
+        case TIMEFMT_STRFTIME:
+            break;
+    }
+    if (!fmt->cacheable) {
+        ast_localtime(tv, &tm, fmt->zone);
+        return ast_strftime(buf, len, fmt->format, &tm);
+    }
+    ast_copy_string(buf, cached_second(fmt, tv, scratch), len);
+    return strlen(buf);
+}
+
+struct ast_json *ast_kafka_timefmt_json(const struct ast_kafka_timefmt *fmt, const struct timeval *tv) {
+    char value[AST_KAFKA_TIME_LEN];
+
+    if (ast_kafka_timefmt_format(fmt, tv, value, sizeof(value)) < 0) {
+        return ast_json_null();
+    }
+    if (ast_kafka_timefmt_is_numeric(fmt)) {
+        return ast_json_integer_create(strtoll(value, NULL, 10));
+    }
+    return ast_json_string_create(value);
+}
@@ -13,34 +13,732 @@
 #include <asterisk/module.h>
 #include <asterisk/config.h>
 #include <asterisk/cli.h>
+#include <asterisk/manager.h>
 #include <asterisk/json.h>
-#include <asterisk/sched.h>
+#include <asterisk/lock.h>
+#include <asterisk/linkedlists.h>
+#include <asterisk/astobj2.h>
+#include <asterisk/paths.h>
+#include <asterisk/utils.h>
 #include <librdkafka/rdkafka.h>
+#include <ctype.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include "res_kafka.h"
+#include "kafka_spool.h"
+#include "kafka_batch.h"
+#include "kafka_metrics.h"
+#include "kafka_consumer.h"
+#include "kafka_limit.h"
 
 
 #define CONF_FILE "res_kafka.conf"
 #define DEFAULT_KAFKA_BROKERS "127.0.0.1:9092"
+#define DEFAULT_STATISTICS_INTERVAL_MS "1000"
+#define TOPIC_SECTION_PREFIX "topic:"
+#define TOPIC_BUCKETS 31
+/*! \brief Metadata fetch of a topic before its first message, the poll thread waits for it */
+#define WARMUP_TIMEOUT_MS 1000
+#define SPOOL_SUBDIR "kafka"
+#define DEFAULT_SPOOL_SEGMENT_MB 16
+#define DEFAULT_SPOOL_MAX_MB 1024
+#define DEFAULT_REPLAY_RATE 1000
+#define REPLAY_INTERVAL_MS 100
+#define PROBE_TIMEOUT_MS 1000
+#define PURGE_TIMEOUT_MS 5000
+#define DEFAULT_OVERFLOW_TIMEOUT_MS 100
+#define DEFAULT_OVERFLOW_RING 1000
+#define DROP_REPORT_INTERVAL 10
+#define FAILURE_REPORT_INTERVAL 10
+/*! \brief Errors a failure report tells apart, the others are summed up */
+#define FAILURE_REPORT_ERRORS 8
+#define DEAD_LETTER_TOPIC_HEADER "dead_letter.topic"
+#define DEAD_LETTER_ERROR_HEADER "dead_letter.error"
+#define CLUSTER_SECTION_PREFIX "cluster:"
+#define CLUSTER_BUCKETS 7
+#define CONSUMER_SECTION_PREFIX "consumer:"
+#define DEFAULT_PRODUCERS 1
+#define MAX_PRODUCERS 64
+#define DELIVERY_ERRORS (RD_KAFKA_RESP_ERR_END_ALL - RD_KAFKA_RESP_ERR__BEGIN)
+/*! \brief Most requests in flight per broker connection that idempotence keeps in order */
+#define IDEMPOTENT_MAX_IN_FLIGHT "5"
+#define IDEMPOTENT_RETRIES "2147483647"
+#define REBUILD_TIMEOUT_MS 5000
 
 static const char name[] = "res_kafka";
 
-static const int poll_interval_ms = 1000;
+static const int poll_timeout_ms = 100;
 static char *kafka_brokers;
 
-rd_kafka_t *handle;         /* Producer instance handle */
-rd_kafka_conf_t *conf;  /* Temporary configuration object */
-char errstr[512];       /* librdkafka API error reporting buffer */
-static char *json_stats;
+/*! \brief [producer] section, the base configuration of every cluster, only kept while loading */
+static rd_kafka_conf_t *producer_conf;
 static int enabled;
-static struct ast_sched_context *sched;
+static volatile int poll_running;
+static char *preload_topics;
+/*! \brief Producer instances of the default cluster */
+static unsigned int default_producers;
+/*! \brief idempotent option of the [general] section, for the default cluster */
+static int default_idempotent;
+
+static int spool_enabled;
+static char *spool_directory;
+static unsigned int spool_segment_mb;
+static unsigned int spool_max_mb;
+/*! Spooled messages replayed per second */
+static unsigned int replay_rate;
+static pthread_t replay_thread = AST_PTHREADT_NULL;
+static volatile int replay_running;
+AST_MUTEX_DEFINE_STATIC(replay_lock);
+static ast_cond_t replay_cond;
+
+/*! \brief What to do with a message when the librdkafka queue is full */
+enum overflow_policy {
+    /*! Not configured, the default applies */
+    OVERFLOW_UNSET = 0,
+    /*! Drop the message */
+    OVERFLOW_DROP_NEWEST,
+    /*! Keep the message in a ring, dropping the oldest one of the ring when it is full */
+    OVERFLOW_DROP_OLDEST,
+    /*! Wait up to timeout_ms for room in the queue, then drop */
+    OVERFLOW_BLOCK,
+    /*! Write the message to the disk spool */
+    OVERFLOW_SPOOL,
+};
+
+static const char *overflow_names[] = {
+    [OVERFLOW_DROP_NEWEST] = "drop_newest",
+    [OVERFLOW_DROP_OLDEST] = "drop_oldest",
+    [OVERFLOW_BLOCK] = "block",
+    [OVERFLOW_SPOOL] = "spool",
+};
+
+struct overflow_config {
+    enum overflow_policy policy;
+    /*! block: longest wait for room in the queue */
+    unsigned int timeout_ms;
+    /*! drop_oldest: number of messages held while the queue is full */
+    unsigned int ring_size;
+};
+
+/*! \brief Overflow policy of the topics without their own, [general] section */
+static struct overflow_config default_overflow;
+
+/*! \brief Partitioner of a topic, the librdkafka ones are set through the topic options */
+enum partitioner {
+    /*! Not configured, the default applies */
+    PARTITIONER_UNSET = 0,
+    /*! A partitioner of librdkafka */
+    PARTITIONER_BUILTIN,
+    /*! Jump consistent hash of the key */
+    PARTITIONER_JUMP,
+};
+
+/*! \brief Partitioner of the topics without their own, [general] section */
+static enum partitioner default_partitioner;
+
+/*! \brief Rate limit and sampling of the topics without their own, [general] section */
+static struct kafka_limit_config default_limit;
+
+/*! \brief Dead letter topic of the topics without their own, [general] section */
+static char *default_dead_letter;
+
+/*! \brief Copy of a message held in the drop_oldest ring */
+struct ring_msg {
+    /*! Headers handed to librdkafka with the message */
+    rd_kafka_headers_t *headers;
+    size_t key_len;
+    size_t len;
+    /*! Key followed by the payload */
+    char data[0];
+};
+
+/*! \brief Failed deliveries of a topic with the same error since the last report */
+struct delivery_failures {
+    rd_kafka_resp_err_t err;
+    unsigned int count;
+};
+
+struct kafka_cluster;
+struct ast_kafka_topic;
+
+/*! \brief Topic handles left on a cluster when a reload moved the topic to a new one */
+struct moved_topic {
+    struct ast_kafka_topic *topic;
+    rd_kafka_topic_t **rkt;
+    AST_LIST_ENTRY(moved_topic) list;
+};
+
+/*! \brief Producer instance of a cluster, served by its own poll thread */
+struct kafka_producer {
+    rd_kafka_t *rk;
+    struct kafka_cluster *cluster;
+    /*! Position in the producers of the cluster and in the topic handles of a topic */
+    unsigned int index;
+    pthread_t poll_thread;
+    /*! Last librdkafka statistics, pretty printed */
+    char *json_stats;
+    ast_mutex_t stats_lock;
+    /*! Idempotent clusters: held to use rk and the topic handles, written when the instance is rebuilt */
+    ast_rwlock_t lock;
+    /*! A fatal idempotence error was raised, the poll thread rebuilds the instance */
+    volatile int fatal;
+};
+
+/*! \brief Cluster of the [general] and [producer] sections or of a [cluster:<name>] section */
+struct kafka_cluster {
+    char *brokers;
+    /*! Configuration of the producer instances until they are created */
+    rd_kafka_conf_t *conf;
+    /*! queue.buffering.max.messages of each producer */
+    int queue_max;
+    /*! The last delivery succeeded, cleared by failures and when all brokers are down */
+    volatile int up;
+    /*! Idempotent producers, the configuration is kept to rebuild them */
+    int idempotent;
+    /*! Producer instances rebuilt after fatal idempotence errors */
+    volatile int rebuilds;
+    /*! Fatal errors caused by gaps in the message sequence of a partition */
+    volatile int sequence_gaps;
+    unsigned int count;
+    struct kafka_producer *producers;
+    /*! Sections the cluster is built from, a reload keeps the cluster while they are unchanged */
+    char *signature;
+    /*! Replaced by a reload, the poll threads stop and the drain thread delivers what is left */
+    volatile int retired;
+    /*! Handles of the topics a reload moved away, released before the producer instances */
+    AST_LIST_HEAD_NOLOCK(, moved_topic) moved;
+    char name[0];
+};
+
+static struct ao2_container *clusters;
+/*! \brief Cluster of the topics without a cluster prefix */
+static struct kafka_cluster *default_cluster;
+
+AO2_STRING_FIELD_HASH_FN(kafka_cluster, name)
+AO2_STRING_FIELD_CMP_FN(kafka_cluster, name)
+
+/*! \brief Registered topic, caches the librdkafka topic handles */
+struct ast_kafka_topic {
+    /*! Held for reading to use cluster and rkt, a reload holds it for writing to move the topic */
+    ast_rwlock_t cluster_lock;
+    struct kafka_cluster *cluster;
+    /*! Topic handle of each producer of the cluster */
+    rd_kafka_topic_t **rkt;
+    /*! Name of the topic in the cluster */
+    const char *topic_name;
+    struct overflow_config overflow;
+    /*! drop_oldest: messages waiting for room in the queue, oldest first, guarded by the topic lock */
+    struct ring_msg **ring;
+    unsigned int ring_head;
+    unsigned int ring_count;
+    /*! Messages dropped because the queue was full */
+    volatile int dropped;
+    /*! Value of dropped when the drops were last logged */
+    int dropped_reported;
+    time_t last_report;
+    /*!
+     * Guards the failure report, not the topic lock: the poll thread reports
+     * failures while ring_drain() may hold the topic lock and enqueue
+     */
+    ast_mutex_t failures_lock;
+    /*! Failed deliveries by error since the last report */
+    struct delivery_failures failures[FAILURE_REPORT_ERRORS];
+    /*! Failed deliveries with an error which did not fit in failures */
+    unsigned int failures_other;
+    /*! Failed deliveries produced to the dead letter topic since the last report */
+    unsigned int dead_lettered;
+    time_t last_failure_report;
+    /*! Name of the topic messages which can never be delivered are produced to, NULL for none */
+    char *dead_letter;
+    /*! The dead letter topic, held so the poll thread never looks it up. Both guarded by the topic lock */
+    struct ast_kafka_topic *dead_letter_topic;
+    struct kafka_limit limit;
+    struct kafka_metrics metrics;
+    /*! Registry key, <cluster>:<topic> outside of the default cluster */
+    char name[0];
+};
+
+/*! \brief Messages in the rings of all topics */
+static volatile int ring_total;
+static volatile int total_dropped;
+/*! \brief Failed deliveries by error code, offset by RD_KAFKA_RESP_ERR__BEGIN */
+static uint64_t delivery_errors[DELIVERY_ERRORS];
+
+/*! \brief Signalled on delivery while producers wait for room in the queue */
+AST_MUTEX_DEFINE_STATIC(room_lock);
+static ast_cond_t room_cond;
+static volatile int room_waiters;
+/*! \brief Wakeups so far, guarded by room_lock, a producer waits only while it is unchanged */
+static unsigned int room_signals;
+
+static struct ao2_container *topics;
+
+AO2_STRING_FIELD_HASH_FN(ast_kafka_topic, name)
+AO2_STRING_FIELD_CMP_FN(ast_kafka_topic, name)
+
+/*! \brief Options of a [topic:<name>] section */
+struct topic_config {
+    /*! librdkafka topic options, applied over the [producer] defaults */
+    struct ast_variable *options;
+    struct overflow_config overflow;
+    enum partitioner partitioner;
+    struct kafka_limit_config limit;
+    /*! Dead letter topic, empty for none, NULL when not configured */
+    char *dead_letter;
+    char name[0];
+};
+
+static struct ao2_container *topic_configs;
+
+AO2_STRING_FIELD_HASH_FN(topic_config, name)
+AO2_STRING_FIELD_CMP_FN(topic_config, name)
+
+/*! \brief Delivery errors caused by the cluster being unreachable, worth a retry from the spool */
+static int is_spoolable_error(rd_kafka_resp_err_t err) {
+    switch (err) {
+        case RD_KAFKA_RESP_ERR__MSG_TIMED_OUT:
+        case RD_KAFKA_RESP_ERR__TIMED_OUT:
+        case RD_KAFKA_RESP_ERR__TRANSPORT:
+        case RD_KAFKA_RESP_ERR__ALL_BROKERS_DOWN:
+        case RD_KAFKA_RESP_ERR__PURGE_QUEUE:
+        case RD_KAFKA_RESP_ERR__PURGE_INFLIGHT:
+        case RD_KAFKA_RESP_ERR__FATAL:
+        case RD_KAFKA_RESP_ERR_REQUEST_TIMED_OUT:
+        case RD_KAFKA_RESP_ERR_LEADER_NOT_AVAILABLE:
+        case RD_KAFKA_RESP_ERR_NOT_LEADER_FOR_PARTITION:
+        case RD_KAFKA_RESP_ERR_NOT_ENOUGH_REPLICAS:
+        case RD_KAFKA_RESP_ERR_NOT_ENOUGH_REPLICAS_AFTER_APPEND:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/*! \brief Registry name of a topic, prefixed by the cluster outside of the default one */
+static const char *qualified_name(const struct kafka_cluster *cluster, const char *topic_name, char *buf, size_t size) {
+    if (cluster == default_cluster) {
+        return topic_name;
+    }
+    snprintf(buf, size, "%s:%s", cluster->name, topic_name);
+    return buf;
+}
+
+/*!
+ * \brief Serialize headers for the spool
+ *
+ * Each header is the length of its name, the name, the length of its value
+ * (UINT32_MAX for none) and the value, lengths in host order.
+ *
+ * \return ast_malloc()ed buffer, NULL when there are no headers
+ */
+static void *headers_pack(const rd_kafka_headers_t *headers, size_t *len) {
+    const char *header_name;
+    const void *value;
+    size_t size, i;
+    uint32_t n;
+    char *buf, *p;
+
+    *len = 0;
+    if (!headers || !rd_kafka_header_cnt(headers)) {
+        return NULL;
+    }
+    for (i = 0; !rd_kafka_header_get_all(headers, i, &header_name, &value, &size); i++) {
+        *len += 2 * sizeof(n) + strlen(header_name) + (value ? size : 0);
+    }
+    if (!(p = buf = ast_malloc(*len))) {
+        *len = 0;
+        return NULL;
+    }
+    for (i = 0; !rd_kafka_header_get_all(headers, i, &header_name, &value, &size); i++) {
+        n = strlen(header_name);
+        memcpy(p, &n, sizeof(n));
+        memcpy(p + sizeof(n), header_name, n);
+        p += sizeof(n) + n;
+        n = value ? size : UINT32_MAX;
+        memcpy(p, &n, sizeof(n));
+        p += sizeof(n);
+        if (value) {
+            memcpy(p, value, size);
+            p += size;
+        }
+    }
+    return buf;
+}
+
+/*! \brief Headers of a spooled message, NULL when there are none or they are damaged */
+static rd_kafka_headers_t *headers_unpack(const void *data, size_t len) {
+    const char *p = data, *end = p + len;
+    rd_kafka_headers_t *headers;
+    uint32_t name_len, value_len;
+
+    if (!data || !len) {
+        return NULL;
+    }
+    headers = rd_kafka_headers_new(8);
+    while (p < end) {
+        if (end - p < sizeof(name_len)) {
+            break;
+        }
+        memcpy(&name_len, p, sizeof(name_len));
+        p += sizeof(name_len);
+        if (end - p < (ptrdiff_t) name_len + (ptrdiff_t) sizeof(value_len)) {
+            break;
+        }
+        memcpy(&value_len, p + name_len, sizeof(value_len));
+        if (value_len != UINT32_MAX && end - p - name_len - sizeof(value_len) < value_len) {
+            break;
+        }
+        rd_kafka_header_add(headers, p, name_len, value_len == UINT32_MAX ? NULL : p + name_len + sizeof(value_len),
+                            value_len == UINT32_MAX ? 0 : value_len);
+        p += name_len + sizeof(value_len) + (value_len == UINT32_MAX ? 0 : value_len);
+    }
+    if (p != end) {
+        ast_log(LOG_WARNING, "Damaged headers of a spooled message are left out\n");
+        rd_kafka_headers_destroy(headers);
+        return NULL;
+    }
+    return headers;
+}
+
+/*! \brief Spool a message of a delivery report with its headers */
+static int spool_message(const struct kafka_cluster *cluster, const rd_kafka_message_t *rkmessage) {
+    rd_kafka_headers_t *headers = NULL;
+    char name_buf[512];
+    void *packed;
+    size_t packed_len;
+    int res;
+
+    /* The headers stay with the message */
+    rd_kafka_message_headers(rkmessage, &headers);
+    packed = headers_pack(headers, &packed_len);
+    res = kafka_spool_append(qualified_name(cluster, rd_kafka_topic_name(rkmessage->rkt), name_buf, sizeof(name_buf)),
+                             rkmessage->key, rkmessage->key_len, packed, packed_len, rkmessage->payload,
+                             rkmessage->len);
+    ast_free(packed);
+    return res;
+}
+
+/*! \brief Records of a message, those of a batch are in its records header */
+static unsigned int message_records(const rd_kafka_message_t *rkmessage) {
+    rd_kafka_headers_t *headers;
+    const void *value;
+    size_t size, i;
+    unsigned int records = 0;
+
+    if (rd_kafka_message_headers(rkmessage, &headers)
+        || rd_kafka_header_get_last(headers, AST_KAFKA_RECORDS_HEADER, &value, &size) || !value) {
+        return 1;
+    }
+    for (i = 0; i < size && isdigit(((const unsigned char *) value)[i]); i++) {
+        records = records * 10 + ((const char *) value)[i] - '0';
+    }
+    return records ? records : 1;
+}
+
+/*! \brief Count the delivery report of a message, the topic is the opaque of its topic handle */
+static void count_delivery(const rd_kafka_message_t *rkmessage) {
+    struct ast_kafka_topic *topic = rd_kafka_topic_opaque(rkmessage->rkt);
+    uintptr_t enqueued_us = (uintptr_t) rkmessage->_private;
+
+    if (rkmessage->err) {
+        if (rkmessage->err > RD_KAFKA_RESP_ERR__BEGIN && rkmessage->err < RD_KAFKA_RESP_ERR_END_ALL) {
+            kafka_metrics_add(delivery_errors[rkmessage->err - RD_KAFKA_RESP_ERR__BEGIN], 1);
+        }
+        if (topic) {
+            kafka_metrics_add(topic->metrics.failed, 1);
+        }
+        return;
+    }
+    if (!topic) {
+        return;
+    }
+    kafka_metrics_add(topic->metrics.delivered, 1);
+    kafka_metrics_add(topic->metrics.records, message_records(rkmessage));
+    kafka_metrics_add(topic->metrics.bytes, rkmessage->len);
+    /* Unsigned arithmetic, right even where the opaque cut the timestamp to 32 bits */
+    if (enqueued_us) {
+        kafka_histogram_record(&topic->metrics.latency, (uintptr_t) (kafka_metrics_now() - enqueued_us));
+    }
+}
+
+/*! \brief Hold the instance of an idempotent producer, so it is not rebuilt meanwhile */
+static void producer_lock(struct kafka_producer *producer) {
+    if (producer->cluster->idempotent) {
+        ast_rwlock_rdlock(&producer->lock);
+    }
+}
+
+/*! \brief Like producer_lock(), but fails instead of waiting for a rebuild */
+static int producer_trylock(struct kafka_producer *producer) {
+    return producer->cluster->idempotent ? ast_rwlock_tryrdlock(&producer->lock) : 0;
+}
+
+static void producer_unlock(struct kafka_producer *producer) {
+    if (producer->cluster->idempotent) {
+        ast_rwlock_unlock(&producer->lock);
+    }
+}
+
+/*!
+ * \brief Produce a message purged from a retired instance to its replacement
+ *
+ * Runs on the poll thread while it rebuilds the instance. The partition is
+ * kept, so the messages of a partition stay in order.
+ */
+static int producer_requeue(struct kafka_producer *producer, const rd_kafka_message_t *rkmessage) {
+    struct ast_kafka_topic *topic = rd_kafka_topic_opaque(rkmessage->rkt);
+    rd_kafka_headers_t *headers = NULL;
+    rd_kafka_resp_err_t err;
+
+    if (!topic) {
+        return -1;
+    }
+    /* A reload may have moved the topic to another cluster meanwhile */
+    ast_rwlock_rdlock(&topic->cluster_lock);
+    if (topic->cluster != producer->cluster) {
+        ast_rwlock_unlock(&topic->cluster_lock);
+        return -1;
+    }
+    /* The headers of the purged message are released with it */
+    if (!rd_kafka_message_headers(rkmessage, &headers)) {
+        headers = rd_kafka_headers_copy(headers);
+    }
+    producer_lock(producer);
+    err = rd_kafka_producev(
+            producer->rk,
+            RD_KAFKA_V_RKT(topic->rkt[producer->index]),
+            RD_KAFKA_V_PARTITION(rkmessage->partition),
+            /* The payload of the purged message is released by librdkafka */
+            RD_KAFKA_V_MSGFLAGS(RD_KAFKA_MSG_F_COPY),
+            RD_KAFKA_V_KEY(rkmessage->key, rkmessage->key_len),
+            RD_KAFKA_V_VALUE(rkmessage->payload, rkmessage->len),
+            RD_KAFKA_V_HEADERS(headers),
+            RD_KAFKA_V_OPAQUE(rkmessage->_private),
+            RD_KAFKA_V_END);
+    producer_unlock(producer);
+    ast_rwlock_unlock(&topic->cluster_lock);
+    if (err && headers) {
+        rd_kafka_headers_destroy(headers);
+    }
+    return err ? -1 : 0;
+}
+
+/*! \brief Errors a message fails with wherever it is produced again, e.g. message too large */
+static int is_permanent_error(rd_kafka_resp_err_t err) {
+    switch (err) {
+        case RD_KAFKA_RESP_ERR_MSG_SIZE_TOO_LARGE:
+        case RD_KAFKA_RESP_ERR_RECORD_LIST_TOO_LARGE:
+        case RD_KAFKA_RESP_ERR_INVALID_MSG:
+        case RD_KAFKA_RESP_ERR_INVALID_RECORD:
+        case RD_KAFKA_RESP_ERR_UNKNOWN_TOPIC_OR_PART:
+        case RD_KAFKA_RESP_ERR__UNKNOWN_TOPIC:
+        case RD_KAFKA_RESP_ERR__UNKNOWN_PARTITION:
+        case RD_KAFKA_RESP_ERR_INVALID_TOPIC_EXCEPTION:
+        case RD_KAFKA_RESP_ERR_TOPIC_AUTHORIZATION_FAILED:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/*!
+ * \brief Log the failed deliveries of a topic counted since its last summary
+ *
+ * \param force Log them even if the last summary is less than FAILURE_REPORT_INTERVAL seconds old
+ */
+static void failures_flush(struct ast_kafka_topic *topic, int force) {
+    struct delivery_failures failures[FAILURE_REPORT_ERRORS];
+    struct ast_str *summary;
+    time_t now = time(NULL);
+    unsigned int other, moved, total;
+    int i;
+
+    ast_mutex_lock(&topic->failures_lock);
+    if ((!topic->failures[0].count && !topic->failures_other)
+        || (!force && now - topic->last_failure_report < FAILURE_REPORT_INTERVAL)) {
+        ast_mutex_unlock(&topic->failures_lock);
+        return;
+    }
+    memcpy(failures, topic->failures, sizeof(failures));
+    other = topic->failures_other;
+    moved = topic->dead_lettered;
+    memset(topic->failures, 0, sizeof(topic->failures));
+    topic->failures_other = 0;
+    topic->dead_lettered = 0;
+    topic->last_failure_report = now;
+    ast_mutex_unlock(&topic->failures_lock);
+
+    summary = ast_str_create(128);
+    if (!summary) {
+        return;
+    }
+    total = other;
+    for (i = 0; i < ARRAY_LEN(failures) && failures[i].count; i++) {
+        ast_str_append(&summary, 0, "%s%s %u", i ? ", " : "", rd_kafka_err2name(failures[i].err), failures[i].count);
+        total += failures[i].count;
+    }
+    if (other) {
+        ast_str_append(&summary, 0, ", other %u", other);
+    }
+    if (moved) {
+        ast_str_append(&summary, 0, ", %u moved to the dead letter topic", moved);
+    }
+    ast_log(LOG_ERROR, "Delivery of %u message(s) to topic %s failed: %s\n", total, topic->name,
+            ast_str_buffer(summary));
+    ast_free(summary);
+}
+
+/*!
+ * \brief Log the due failure summary of a topic of the cluster in \a arg, or of every topic right away
+ *
+ * The poll threads call it once a second, so the tail of a burst is logged
+ * without waiting for the next failure.
+ */
+static int topic_failures_flush(void *obj, void *arg, int flags) {
+    struct ast_kafka_topic *topic = obj;
+
+    if (!arg || topic->cluster == arg) {
+        failures_flush(topic, !arg);
+    }
+    return 0;
+}
+
+/*!
+ * \brief Count a failed delivery, a summary by error is logged at most every FAILURE_REPORT_INTERVAL seconds
+ *
+ * A broker incident fails thousands of messages a second, a log line each
+ * would add to the load of the logger just then.
+ */
+static void report_failure(struct ast_kafka_topic *topic, rd_kafka_resp_err_t err, int dead_lettered) {
+    int i;
+
+    if (!topic) {
+        ast_log(LOG_ERROR, "Message delivery failed: %s\n", rd_kafka_err2str(err));
+        return;
+    }
+    ast_mutex_lock(&topic->failures_lock);
+    for (i = 0; i < ARRAY_LEN(topic->failures); i++) {
+        if (!topic->failures[i].count || topic->failures[i].err == err) {
+            topic->failures[i].err = err;
+            topic->failures[i].count++;
+            break;
+        }
+    }
+    if (i == ARRAY_LEN(topic->failures)) {
+        topic->failures_other++;
+    }
+    topic->dead_lettered += dead_lettered;
+    ast_mutex_unlock(&topic->failures_lock);
+    failures_flush(topic, 0);
+}
+
+static rd_kafka_resp_err_t topic_enqueue(struct ast_kafka_topic *topic, const void *key, size_t key_len,
+                                         rd_kafka_headers_t **headers, void *payload, size_t len, int msgflags,
+                                         uint64_t enqueued_us);
+static void report_drop(struct ast_kafka_topic *topic);
+
+/*!
+ * \brief Produce a message which can never be delivered to the dead letter topic of its topic
+ *
+ * The original topic and the error go into headers. Runs on the poll
+ * thread, so the message is dropped rather than waited for when the queue of
+ * the dead letter topic is full.
+ */
+static int dead_letter_message(struct ast_kafka_topic *topic, const rd_kafka_message_t *rkmessage) {
+    struct ast_kafka_topic *dead_letter;
+    rd_kafka_headers_t *headers = NULL;
+    rd_kafka_resp_err_t err;
+    const void *value;
+    size_t size;
+
+    if (!topic) {
+        return -1;
+    }
+    /* A reload may replace it */
+    ao2_lock(topic);
+    dead_letter = ao2_bump(topic->dead_letter_topic);
+    ao2_unlock(topic);
+    if (!dead_letter) {
+        return -1;
+    }
+    if (!rd_kafka_message_headers(rkmessage, &headers)) {
+        /* Not once more when a dead letter could not be delivered either */
+        if (!rd_kafka_header_get_last(headers, DEAD_LETTER_ERROR_HEADER, &value, &size)) {
+            ao2_ref(dead_letter, -1);
+            return -1;
+        }
+        headers = rd_kafka_headers_copy(headers);
+    } else {
+        headers = rd_kafka_headers_new(2);
+    }
+    if (!headers) {
+        ao2_ref(dead_letter, -1);
+        return -1;
+    }
+    rd_kafka_header_add(headers, DEAD_LETTER_TOPIC_HEADER, -1, topic->name, -1);
+    rd_kafka_header_add(headers, DEAD_LETTER_ERROR_HEADER, -1, rd_kafka_err2name(rkmessage->err), -1);
+    err = topic_enqueue(dead_letter, rkmessage->key, rkmessage->key_len, &headers, rkmessage->payload, rkmessage->len,
+                        RD_KAFKA_MSG_F_COPY, kafka_metrics_now());
+    if (err == RD_KAFKA_RESP_ERR__QUEUE_FULL) {
+        report_drop(dead_letter);
+    } else if (err) {
+        ast_log(LOG_ERROR, "Failed to produce to dead letter topic %s: %s\n", dead_letter->name,
+                rd_kafka_err2str(err));
+    }
+    if (headers) {
+        rd_kafka_headers_destroy(headers);
+    }
+    ao2_ref(dead_letter, -1);
+    return err ? -1 : 0;
+}
+
+/*! \brief Wake up the producers waiting for room in the queue */
+static void room_signal(void) {
+    ast_mutex_lock(&room_lock);
+    room_signals++;
+    ast_cond_broadcast(&room_cond);
+    ast_mutex_unlock(&room_lock);
+}
 
 static void dr_msg_cb(rd_kafka_t *rk, const rd_kafka_message_t *rkmessage, void *opaque) {
-    if (rkmessage->err)
-        ast_log(LOG_ERROR, "Message delivery failed: %s\n", rd_kafka_err2str(rkmessage->err));
-    else
-        ast_log(LOG_DEBUG, "Message delivered (%zd bytes, partition %d)\n", rkmessage->len, rkmessage->partition);
+    struct kafka_producer *producer = opaque;
+    struct kafka_cluster *cluster = producer->cluster;
+    struct ast_kafka_topic *topic;
+
+    /* Undelivered messages of a retired instance, see producer_rebuild(). The
+     * producers waiting for room are woken up once the rebuild is done. */
+    if (rk != producer->rk) {
+        if (rkmessage->err && !producer_requeue(producer, rkmessage)) {
+            return;
+        }
+        count_delivery(rkmessage);
+        if (rkmessage->err && !(kafka_spool_enabled() && !spool_message(cluster, rkmessage))) {
+            report_failure(rd_kafka_topic_opaque(rkmessage->rkt), rkmessage->err, 0);
+        }
+        return;
+    }
+
+    /* Deliveries are counted in the metrics of the topic, not logged one by one */
+    count_delivery(rkmessage);
+    if (!rkmessage->err) {
+        cluster->up = 1;
+    } else if (is_permanent_error(rkmessage->err)) {
+        topic = rd_kafka_topic_opaque(rkmessage->rkt);
+        report_failure(topic, rkmessage->err, !dead_letter_message(topic, rkmessage));
+    } else if (kafka_spool_enabled() && is_spoolable_error(rkmessage->err) && !spool_message(cluster, rkmessage)) {
+        if (cluster->up) {
+            cluster->up = 0;
+            ast_log(LOG_WARNING, "Message delivery to cluster %s failed: %s, spooling undelivered messages\n",
+                    cluster->name, rd_kafka_err2str(rkmessage->err));
+        }
+    } else {
+        report_failure(rd_kafka_topic_opaque(rkmessage->rkt), rkmessage->err, 0);
+    }
     /* The rkmessage is destroyed automatically by librdkafka */
+
+    if (room_waiters) {
+        room_signal();
+    }
 }
 
 static void log_cb(const rd_kafka_t *rk, int level, const char *fac, const char *buf) {
@@ -48,149 +746,1726 @@ static void log_cb(const rd_kafka_t *rk, int level, const char *fac, const char
 }
 
 static void error_cb(rd_kafka_t *rk, int err, const char *reason, void *opaque) {
+    struct kafka_producer *producer = opaque;
+    struct kafka_cluster *cluster = producer->cluster;
+    char errstr[512];
+
+    if (err == RD_KAFKA_RESP_ERR__ALL_BROKERS_DOWN) {
+        cluster->up = 0;
+    }
+    /* Only idempotent producers raise fatal errors, the instance cannot produce any more */
+    if (err == RD_KAFKA_RESP_ERR__FATAL && rk == producer->rk) {
+        err = rd_kafka_fatal_error(rk, errstr, sizeof(errstr));
+        if (err == RD_KAFKA_RESP_ERR__GAPLESS_GUARANTEE || err == RD_KAFKA_RESP_ERR_OUT_OF_ORDER_SEQUENCE_NUMBER) {
+            ast_atomic_fetchadd_int(&cluster->sequence_gaps, 1);
+            ast_log(LOG_ERROR, "Sequence gap on producer %u of cluster %s (%d so far): %s: %s\n", producer->index,
+                    cluster->name, cluster->sequence_gaps, rd_kafka_err2name(err), errstr);
+        } else {
+            ast_log(LOG_ERROR, "Fatal error on producer %u of cluster %s: %s: %s\n", producer->index, cluster->name,
+                    rd_kafka_err2name(err), errstr);
+        }
+        producer->fatal = 1;
+        return;
+    }
     ast_log(LOG_ERROR, "%s: %s: %s\n", rk ? rd_kafka_name(rk) : NULL, rd_kafka_err2str(err), reason);
 }
 
 static int stats_cb(rd_kafka_t *rk, char *json, size_t json_len, void *opaque) {
 //    ast_log(LOG_NOTICE, "%s\n%s\n", rk ? rd_kafka_name(rk) : NULL, json);
+    struct kafka_producer *producer = opaque;
     struct ast_json *body;
+    char *stats;
+
     body = ast_json_load_buf(json, json_len, NULL);
-    json_stats = ast_json_dump_string_format(body, AST_JSON_PRETTY);
+    stats = ast_json_dump_string_format(body, AST_JSON_PRETTY);
     ast_json_unref(body);
+    ast_mutex_lock(&producer->stats_lock);
+    ast_json_free(producer->json_stats);
+    producer->json_stats = stats;
+    ast_mutex_unlock(&producer->stats_lock);
+    return 0;
+}
+
+static void ring_msg_free(struct ring_msg *msg) {
+    if (msg->headers) {
+        rd_kafka_headers_destroy(msg->headers);
+    }
+    ast_free(msg);
+}
+
+/*! \brief Release the topic handles of a topic on the producers of a cluster */
+static void topic_handles_destroy(rd_kafka_topic_t **rkt, unsigned int count) {
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+        if (rkt[i]) {
+            rd_kafka_topic_destroy(rkt[i]);
+        }
+    }
+    ast_free(rkt);
+}
+
+static void topic_destructor(void *obj) {
+    struct ast_kafka_topic *topic = obj;
+
+    for (; topic->ring_count; topic->ring_count--) {
+        ring_msg_free(topic->ring[topic->ring_head]);
+        topic->ring_head = (topic->ring_head + 1) % topic->overflow.ring_size;
+        ast_atomic_fetchadd_int(&ring_total, -1);
+    }
+    ast_free(topic->ring);
+    if (topic->rkt) {
+        topic_handles_destroy(topic->rkt, topic->cluster->count);
+    }
+    /* Producer instances outlive their topic handles */
+    ao2_cleanup(topic->cluster);
+    ast_rwlock_destroy(&topic->cluster_lock);
+    ast_mutex_destroy(&topic->failures_lock);
+    ast_free(topic->dead_letter);
+    ao2_cleanup(topic->dead_letter_topic);
+}
+
+/*! \brief Fill the unset fields of \a cfg from \a defaults */
+static void overflow_merge(struct overflow_config *cfg, const struct overflow_config *defaults) {
+    if (cfg->policy == OVERFLOW_UNSET) {
+        cfg->policy = defaults->policy;
+    }
+    if (!cfg->timeout_ms) {
+        cfg->timeout_ms = defaults->timeout_ms;
+    }
+    if (!cfg->ring_size) {
+        cfg->ring_size = defaults->ring_size;
+    }
+}
+
+/*! \brief FNV-1a 64 bit hash */
+static uint64_t fnv1a_64(const unsigned char *data, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+
+    while (len--) {
+        hash ^= *data++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/*!
+ * \brief Jump consistent hash, Lamping and Veach
+ *
+ * Growing the topic from n to n + 1 partitions moves only 1/(n + 1) of the keys.
+ */
+static int32_t jump_consistent_hash(uint64_t key, int32_t buckets) {
+    int64_t b = -1;
+    int64_t j = 0;
+
+    while (j < buckets) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (b + 1) * ((double) (1LL << 31) / (double) ((key >> 33) + 1));
+    }
+    return b;
+}
+
+static int32_t jump_partitioner(const rd_kafka_topic_t *rkt, const void *key, size_t key_len, int32_t partition_cnt,
+                                void *rkt_opaque, void *msg_opaque) {
+    if (!key || !key_len) {
+        return rd_kafka_msg_partitioner_random(rkt, key, key_len, partition_cnt, rkt_opaque, msg_opaque);
+    }
+    return jump_consistent_hash(fnv1a_64(key, key_len), partition_cnt);
+}
+
+/*! \brief Topic configuration, the [producer] defaults with the options of the [topic:<name>] section */
+static rd_kafka_topic_conf_t *topic_conf_build(const struct topic_config *tcfg, rd_kafka_t *rk) {
+    rd_kafka_topic_conf_t *tconf;
+    struct ast_variable *v;
+    enum partitioner partitioner = default_partitioner;
+    char errstr[512];
+
+    tconf = rd_kafka_default_topic_conf_dup(rk);
+    if (!tconf) {
+        return NULL;
+    }
+    if (tcfg) {
+        /* Validated at load */
+        for (v = tcfg->options; v; v = v->next) {
+            rd_kafka_topic_conf_set(tconf, v->name, v->value, errstr, sizeof(errstr));
+        }
+        if (tcfg->partitioner != PARTITIONER_UNSET) {
+            partitioner = tcfg->partitioner;
+        }
+    }
+    if (partitioner == PARTITIONER_JUMP) {
+        rd_kafka_topic_conf_set_partitioner_cb(tconf, jump_partitioner);
+    }
+    return tconf;
+}
+
+/*! \brief Topic handle of a producer instance */
+static rd_kafka_topic_t *topic_handle_new(struct ast_kafka_topic *topic, const struct topic_config *tcfg,
+                                          struct kafka_producer *producer) {
+    rd_kafka_t *rk = producer->rk;
+    rd_kafka_topic_conf_t *tconf;
+    rd_kafka_topic_t *rkt = NULL;
+    char errstr[512];
+
+    /* rd_kafka_topic_new() takes ownership of the topic conf */
+    tconf = topic_conf_build(tcfg, rk);
+    if (tconf) {
+        /* Idempotence needs every replica, whatever the [topic:<name>] section says */
+        if (producer->cluster->idempotent) {
+            rd_kafka_topic_conf_set(tconf, "acks", "all", errstr, sizeof(errstr));
+        }
+        /* Delivery reports are counted on the topic, the registry keeps it alive until the producers are flushed */
+        rd_kafka_topic_conf_set_opaque(tconf, topic);
+        rkt = rd_kafka_topic_new(rk, topic->topic_name, tconf);
+    }
+    if (!rkt) {
+        ast_log(LOG_ERROR, "Failed to create topic %s: %s\n", topic->name, rd_kafka_err2str(rd_kafka_last_error()));
+    }
+    return rkt;
+}
+
+/*! \brief Topic handles of a topic on every producer of a cluster */
+static rd_kafka_topic_t **topic_handles_new(struct ast_kafka_topic *topic, struct kafka_cluster *cluster,
+                                            const struct topic_config *tcfg) {
+    struct kafka_producer *producer;
+    rd_kafka_topic_t **rkt;
+    unsigned int i;
+
+    rkt = ast_calloc(cluster->count, sizeof(*rkt));
+    if (!rkt) {
+        return NULL;
+    }
+    for (i = 0; i < cluster->count; i++) {
+        producer = &cluster->producers[i];
+        producer_lock(producer);
+        rkt[i] = topic_handle_new(topic, tcfg, producer);
+        producer_unlock(producer);
+        if (!rkt[i]) {
+            topic_handles_destroy(rkt, cluster->count);
+            return NULL;
+        }
+    }
+    return rkt;
+}
+
+/*! \brief Apply the topic options a reload changes in place, those of the [general] section fill in */
+static void topic_options_apply(struct ast_kafka_topic *topic, const struct topic_config *tcfg) {
+    struct kafka_limit_config limit = {0};
+    const char *dead_letter = default_dead_letter;
+    char *old;
+
+    if (tcfg) {
+        limit = tcfg->limit;
+        if (tcfg->dead_letter) {
+            dead_letter = tcfg->dead_letter;
+        }
+    }
+    kafka_limit_merge(&limit, &default_limit);
+    kafka_limit_set(&topic->limit, &limit);
+
+    ao2_lock(topic);
+    old = topic->dead_letter;
+    topic->dead_letter = ast_strlen_zero(dead_letter) ? NULL : ast_strdup(dead_letter);
+    ao2_unlock(topic);
+    ast_free(old);
+}
+
+/*!
+ * \brief Hold the dead letter topic named by the options of a topic
+ *
+ * Looks it up in the registry, so it is called without the registry or the
+ * topic lock. A topic is not its own dead letter topic.
+ */
+static void topic_dead_letter_resolve(struct ast_kafka_topic *topic) {
+    struct ast_kafka_topic *dead_letter = NULL, *old;
+    char *name = NULL;
+
+    ao2_lock(topic);
+    if (topic->dead_letter) {
+        name = ast_strdupa(topic->dead_letter);
+    }
+    ao2_unlock(topic);
+    if (name && (dead_letter = ast_kafka_topic_get(name)) == topic) {
+        ao2_ref(dead_letter, -1);
+        dead_letter = NULL;
+    }
+
+    ao2_lock(topic);
+    old = topic->dead_letter_topic;
+    topic->dead_letter_topic = dead_letter;
+    ao2_unlock(topic);
+    ao2_cleanup(old);
+}
+
+/*! \brief Resolve the dead letter topics of the registered topics again after a reload */
+static void dead_letters_resolve(void) {
+    struct ao2_iterator it;
+    struct ast_kafka_topic *topic;
+
+    /* The iterator holds the registry lock for one step only, the lookups may register topics */
+    it = ao2_iterator_init(topics, 0);
+    while ((topic = ao2_iterator_next(&it))) {
+        topic_dead_letter_resolve(topic);
+        ao2_ref(topic, -1);
+    }
+    ao2_iterator_destroy(&it);
+}
+
+/*! \brief Drop the held dead letter topics, which may refer to each other, before the registry goes */
+static int topic_dead_letter_release(void *obj, void *arg, int flags) {
+    struct ast_kafka_topic *topic = obj;
+    struct ast_kafka_topic *old;
+
+    ao2_lock(topic);
+    old = topic->dead_letter_topic;
+    topic->dead_letter_topic = NULL;
+    ao2_unlock(topic);
+    ao2_cleanup(old);
     return 0;
 }
 
-static int do_poll(const void *unused) {
-    rd_kafka_poll(handle, 0);
-    return poll_interval_ms;
+/*! \brief Create the topic handles of every producer of the cluster */
+static int topic_create_handles(struct ast_kafka_topic *topic) {
+    struct topic_config *tcfg;
+
+    tcfg = ao2_find(topic_configs, topic->topic_name, OBJ_SEARCH_KEY);
+    if (tcfg) {
+        topic->overflow = tcfg->overflow;
+    }
+    topic_options_apply(topic, tcfg);
+    topic->rkt = topic_handles_new(topic, topic->cluster, tcfg);
+    ao2_cleanup(tcfg);
+    return topic->rkt ? 0 : -1;
+}
+
+static struct ast_kafka_topic *topic_alloc(const char *topic_name) {
+    struct ast_kafka_topic *topic;
+    char *cluster_name;
+    char *sep;
+
+    /* The lock guards the drop_oldest ring and the drop reports */
+    topic = ao2_alloc_options(sizeof(*topic) + strlen(topic_name) + 1, topic_destructor, AO2_ALLOC_OPT_LOCK_MUTEX);
+    if (!topic) {
+        return NULL;
+    }
+    ast_rwlock_init(&topic->cluster_lock);
+    ast_mutex_init(&topic->failures_lock);
+    strcpy(topic->name, topic_name); /* Safe */
+    topic->topic_name = topic->name;
+    cluster_name = ast_strdupa(topic_name);
+    sep = strchr(cluster_name, ':');
+    if (sep) {
+        *sep = '\0';
+        topic->topic_name = topic->name + (sep - cluster_name) + 1;
+        topic->cluster = ao2_find(clusters, cluster_name, OBJ_SEARCH_KEY);
+    } else {
+        topic->cluster = ao2_bump(default_cluster);
+    }
+    if (!topic->cluster) {
+        ast_log(LOG_ERROR, "Unknown cluster '%s' of topic %s\n", cluster_name, topic->topic_name);
+        ao2_ref(topic, -1);
+        return NULL;
+    }
+    if (ast_strlen_zero(topic->topic_name) || topic_create_handles(topic)) {
+        ao2_ref(topic, -1);
+        return NULL;
+    }
+    overflow_merge(&topic->overflow, &default_overflow);
+    if (topic->overflow.policy == OVERFLOW_SPOOL && !kafka_spool_enabled()) {
+        ast_log(LOG_WARNING, "Spool is disabled, messages for topic %s are dropped when the queue is full\n", topic_name);
+    }
+    if (topic->overflow.policy == OVERFLOW_DROP_OLDEST
+        && !(topic->ring = ast_calloc(topic->overflow.ring_size, sizeof(*topic->ring)))) {
+        ao2_ref(topic, -1);
+        return NULL;
+    }
+    return topic;
+}
+
+struct ast_kafka_topic *ast_kafka_topic_get(const char *topic_name) {
+    struct ast_kafka_topic *topic;
+    int created = 0;
+
+    if (!enabled || ast_strlen_zero(topic_name)) {
+        return NULL;
+    }
+    /* default:<topic> and <topic> are the same topic */
+    if (!strncasecmp(topic_name, AST_KAFKA_DEFAULT_CLUSTER ":", strlen(AST_KAFKA_DEFAULT_CLUSTER ":"))) {
+        topic_name += strlen(AST_KAFKA_DEFAULT_CLUSTER ":");
+    }
+    topic = ao2_find(topics, topic_name, OBJ_SEARCH_KEY);
+    if (topic) {
+        return topic;
+    }
+
+    ao2_lock(topics);
+    topic = ao2_find(topics, topic_name, OBJ_SEARCH_KEY | OBJ_NOLOCK);
+    if (!topic) {
+        topic = topic_alloc(topic_name);
+        if (topic) {
+            ao2_link_flags(topics, topic, OBJ_NOLOCK);
+            ast_debug(1, "Registered topic %s\n", topic_name);
+            created = 1;
+        }
+    }
+    ao2_unlock(topics);
+    /* Its failures are counted but not dead lettered until then */
+    if (created) {
+        topic_dead_letter_resolve(topic);
+    }
+    return topic;
+}
+
+struct ast_kafka_topic *ast_kafka_cluster_topic_get(const char *cluster_name, const char *topic_name) {
+    char *name;
+
+    if (ast_strlen_zero(cluster_name) || ast_strlen_zero(topic_name)) {
+        return ast_kafka_topic_get(topic_name);
+    }
+    name = ast_alloca(strlen(cluster_name) + strlen(topic_name) + 2);
+    sprintf(name, "%s:%s", cluster_name, topic_name); /* Safe */
+    return ast_kafka_topic_get(name);
+}
+
+const char *ast_kafka_topic_name(const struct ast_kafka_topic *topic) {
+    return topic->name;
+}
+
+/*!
+ * \brief Fetch the metadata of the topics of the cluster of a producer before their first message
+ *
+ * The registry is walked with an iterator, so it is not locked while a broker
+ * answers, and delivery reports are served between two topics. The warmup
+ * stops at the first topic without an answer, the brokers are likely down
+ * then and the first message of each topic fetches the metadata anyway.
+ */
+static void producer_warmup(struct kafka_producer *producer) {
+    struct ao2_iterator it;
+    struct ast_kafka_topic *topic;
+    const struct rd_kafka_metadata *metadata;
+    rd_kafka_resp_err_t err = RD_KAFKA_RESP_ERR_NO_ERROR;
+
+    it = ao2_iterator_init(topics, 0);
+    while (!err && poll_running && (topic = ao2_iterator_next(&it))) {
+        /* A reload may move the topic meanwhile */
+        ast_rwlock_rdlock(&topic->cluster_lock);
+        if (topic->cluster == producer->cluster) {
+            err = rd_kafka_metadata(producer->rk, 0, topic->rkt[producer->index], &metadata, WARMUP_TIMEOUT_MS);
+            if (err) {
+                ast_log(LOG_WARNING, "Unable to fetch metadata for topic %s: %s\n", topic->name,
+                        rd_kafka_err2str(err));
+            } else {
+                rd_kafka_metadata_destroy(metadata);
+                ast_debug(1, "Fetched metadata for topic %s\n", topic->name);
+            }
+        }
+        ast_rwlock_unlock(&topic->cluster_lock);
+        ao2_ref(topic, -1);
+        rd_kafka_poll(producer->rk, 0);
+    }
+    ao2_iterator_destroy(&it);
+}
+
+/*! \brief Register the topics named in a backend config */
+static void preload_backend_topic(const char *filename) {
+    struct ast_flags config_flags = {0};
+    struct ast_config *cfg;
+    struct ast_variable *v;
+    const char *value;
+    const char *cluster_name;
+
+    cfg = ast_config_load(filename, config_flags);
+    if (!cfg || cfg == CONFIG_STATUS_FILEINVALID) {
+        return;
+    }
+    cluster_name = ast_variable_retrieve(cfg, "general", "cluster");
+    value = ast_variable_retrieve(cfg, "general", "topic");
+    if (!ast_strlen_zero(value)) {
+        ao2_cleanup(ast_kafka_cluster_topic_get(cluster_name, value));
+    }
+    /* Per event type topics of cel_kafka */
+    for (v = ast_variable_browse(cfg, "topics"); v; v = v->next) {
+        if (!ast_strlen_zero(v->value)) {
+            ao2_cleanup(ast_kafka_cluster_topic_get(cluster_name, v->value));
+        }
+    }
+    ast_config_destroy(cfg);
+}
+
+static int preload_configured_topic(void *obj, void *arg, int flags) {
+    struct topic_config *tcfg = obj;
+    ao2_cleanup(ast_kafka_topic_get(tcfg->name));
+    return 0;
+}
+
+static void preload(void) {
+    char *list, *topic_name;
+
+    preload_backend_topic("cdr_kafka.conf");
+    preload_backend_topic("cel_kafka.conf");
+    ao2_callback(topic_configs, OBJ_NODATA, preload_configured_topic, NULL);
+
+    if (ast_strlen_zero(preload_topics)) {
+        return;
+    }
+    list = ast_strdupa(preload_topics);
+    while ((topic_name = ast_strsep(&list, ',', AST_STRSEP_STRIP))) {
+        if (!ast_strlen_zero(topic_name)) {
+            ao2_cleanup(ast_kafka_topic_get(topic_name));
+        }
+    }
+}
+
+static int ring_drain(void *obj, void *arg, int flags);
+
+/*! \brief Old topic handles of a producer instance being rebuilt, in the order of the topics container */
+struct retired_handles {
+    struct kafka_producer *producer;
+    rd_kafka_topic_t **rkt;
+    int count;
+    /*! Handles put back after a failed rebuild */
+    int restored;
+    int failed;
+};
+
+/*! \brief Give a topic a handle on the new instance of the producer, the old one is retired */
+static int topic_handle_swap(void *obj, void *arg, int flags) {
+    struct ast_kafka_topic *topic = obj;
+    struct retired_handles *retired = arg;
+    struct kafka_producer *producer = retired->producer;
+    struct topic_config *tcfg;
+    rd_kafka_topic_t *rkt;
+
+    if (topic->cluster != producer->cluster) {
+        return 0;
+    }
+    tcfg = ao2_find(topic_configs, topic->topic_name, OBJ_SEARCH_KEY);
+    rkt = topic_handle_new(topic, tcfg, producer);
+    ao2_cleanup(tcfg);
+    if (!rkt) {
+        retired->failed = 1;
+        return CMP_STOP;
+    }
+    retired->rkt[retired->count++] = topic->rkt[producer->index];
+    topic->rkt[producer->index] = rkt;
+    return 0;
+}
+
+/*! \brief Put the retired handle of a topic back after a failed rebuild */
+static int topic_handle_restore(void *obj, void *arg, int flags) {
+    struct ast_kafka_topic *topic = obj;
+    struct retired_handles *retired = arg;
+    struct kafka_producer *producer = retired->producer;
+
+    if (topic->cluster != producer->cluster) {
+        return 0;
+    }
+    if (retired->restored == retired->count) {
+        return CMP_STOP;
+    }
+    rd_kafka_topic_destroy(topic->rkt[producer->index]);
+    topic->rkt[producer->index] = retired->rkt[retired->restored++];
+    return 0;
+}
+
+/*!
+ * \brief Replace a producer instance that raised a fatal error
+ *
+ * The new instance takes the topic handles first. The queued and in-flight
+ * messages of the old one are then purged, and dr_msg_cb() produces them
+ * again on the new instance, on the same partitions and in the same order.
+ * The purge runs without locks, as dr_msg_cb() may spool. Producing threads
+ * see the fatal flag until the purge is done and apply the overflow policy,
+ * so new messages do not overtake the purged ones.
+ *
+ * \retval 0 on success
+ * \retval -1 the old instance is kept, the poll thread tries again later
+ */
+static int producer_rebuild(struct kafka_producer *producer) {
+    struct kafka_cluster *cluster = producer->cluster;
+    struct retired_handles retired = {.producer = producer};
+    rd_kafka_conf_t *pconf;
+    rd_kafka_t *rk, *retired_rk;
+    char errstr[512];
+    struct timeval start;
+    int i;
+
+    pconf = rd_kafka_conf_dup(cluster->conf);
+    rd_kafka_conf_set_opaque(pconf, producer);
+    rk = rd_kafka_new(RD_KAFKA_PRODUCER, pconf, errstr, sizeof(errstr));
+    if (!rk) {
+        ast_log(LOG_ERROR, "Failed to rebuild producer %u of cluster %s: %s\n", producer->index, cluster->name, errstr);
+        rd_kafka_conf_destroy(pconf);
+        return -1;
+    }
+
+    /* No topic comes or goes during the swap */
+    ao2_lock(topics);
+    ast_rwlock_wrlock(&producer->lock);
+    retired.rkt = ast_calloc(MAX(ao2_container_count(topics), 1), sizeof(*retired.rkt));
+    if (!retired.rkt) {
+        ast_rwlock_unlock(&producer->lock);
+        ao2_unlock(topics);
+        rd_kafka_destroy(rk);
+        return -1;
+    }
+    retired_rk = producer->rk;
+    producer->rk = rk;
+    ao2_callback(topics, OBJ_NODATA | OBJ_NOLOCK, topic_handle_swap, &retired);
+    if (retired.failed) {
+        producer->rk = retired_rk;
+        ao2_callback(topics, OBJ_NODATA | OBJ_NOLOCK, topic_handle_restore, &retired);
+        ast_rwlock_unlock(&producer->lock);
+        ao2_unlock(topics);
+        ast_free(retired.rkt);
+        rd_kafka_destroy(rk);
+        return -1;
+    }
+    ast_rwlock_unlock(&producer->lock);
+    ao2_unlock(topics);
+
+    /* The undelivered messages of the old instance move to the new one */
+    rd_kafka_purge(retired_rk, RD_KAFKA_PURGE_F_QUEUE | RD_KAFKA_PURGE_F_INFLIGHT);
+    start = ast_tvnow();
+    while (rd_kafka_outq_len(retired_rk) > 0 && ast_tvdiff_ms(ast_tvnow(), start) < REBUILD_TIMEOUT_MS) {
+        rd_kafka_poll(retired_rk, poll_timeout_ms);
+    }
+    if (rd_kafka_outq_len(retired_rk) > 0) {
+        ast_log(LOG_WARNING, "%d message(s) of producer %u of cluster %s lost in the rebuild\n",
+                rd_kafka_outq_len(retired_rk), producer->index, cluster->name);
+    }
+    for (i = 0; i < retired.count; i++) {
+        rd_kafka_topic_destroy(retired.rkt[i]);
+    }
+    producer->fatal = 0;
+
+    ast_free(retired.rkt);
+    rd_kafka_destroy(retired_rk);
+    ast_atomic_fetchadd_int(&cluster->rebuilds, 1);
+    ast_log(LOG_NOTICE, "Rebuilt producer %u of cluster %s after a fatal error, %d rebuild(s) so far\n",
+            producer->index, cluster->name, cluster->rebuilds);
+
+    /* Producers waiting for room may go on */
+    room_signal();
+    return 0;
+}
+
+/*!
+ * \brief Poll thread
+ *
+ * Serves delivery reports and the other librdkafka callbacks as soon as
+ * they are ready, so producing threads never run them.
+ */
+static void *do_poll(void *data) {
+    struct kafka_producer *producer = data;
+    time_t last_flush = 0, now;
+
+    /* Fetch the metadata of the preloaded topics before the first message */
+    producer_warmup(producer);
+
+    while (poll_running && !producer->cluster->retired) {
+        /* A failed rebuild is tried again after the next poll */
+        if (producer->fatal) {
+            producer_rebuild(producer);
+        }
+        rd_kafka_poll(producer->rk, poll_timeout_ms);
+        /* The first producer of a cluster moves the rings of its topics */
+        if (ring_total && !producer->index) {
+            ao2_callback(topics, OBJ_NODATA, ring_drain, producer->cluster);
+        }
+        /* And logs the failure summaries of its topics which are due */
+        now = time(NULL);
+        if (!producer->index && now != last_flush) {
+            last_flush = now;
+            ao2_callback(topics, OBJ_NODATA, topic_failures_flush, producer->cluster);
+        }
+    }
+    return NULL;
+}
+
+/*! \brief Create the producer instances of a cluster */
+static int cluster_connect(void *obj, void *arg, int flags) {
+    struct kafka_cluster *cluster = obj;
+    rd_kafka_conf_t *pconf;
+    char errstr[512];
+    unsigned int i;
+
+    rd_kafka_conf_set_log_cb(cluster->conf, log_cb);
+    rd_kafka_conf_set_dr_msg_cb(cluster->conf, dr_msg_cb);
+    rd_kafka_conf_set_error_cb(cluster->conf, error_cb);
+    rd_kafka_conf_set_stats_cb(cluster->conf, stats_cb);
+
+    for (i = 0; i < cluster->count; i++) {
+        pconf = rd_kafka_conf_dup(cluster->conf);
+        /* The producer is the opaque of its callbacks */
+        rd_kafka_conf_set_opaque(pconf, &cluster->producers[i]);
+        /*
+         * Create producer instance.
+         *
+         * NOTE: rd_kafka_new() takes ownership of the conf object
+         *       and the application must not reference it again after
+         *       this call.
+         */
+        cluster->producers[i].rk = rd_kafka_new(RD_KAFKA_PRODUCER, pconf, errstr, sizeof(errstr));
+        if (!cluster->producers[i].rk) {
+            ast_log(LOG_ERROR, "Failed to create producer %u of cluster %s: %s\n", i, cluster->name, errstr);
+            rd_kafka_conf_destroy(pconf);
+            *(int *) arg = -1;
+            return CMP_STOP;
+        }
+    }
+    /* Idempotent producers are rebuilt from it after fatal errors */
+    if (!cluster->idempotent) {
+        rd_kafka_conf_destroy(cluster->conf);
+        cluster->conf = NULL;
+    }
+    ast_log(LOG_NOTICE, "Using kafka brokers %s for cluster %s, %u producer(s)\n", cluster->brokers, cluster->name,
+            cluster->count);
+    return 0;
+}
+
+/*!
+ * \brief Producer instance of a message
+ *
+ * Messages with the same key go through the same producer and stay in order,
+ * the others are spread over the producers by the calling thread.
+ */
+static struct kafka_producer *pick_producer(const struct kafka_cluster *cluster, const void *key, size_t key_len) {
+    if (cluster->count == 1) {
+        return &cluster->producers[0];
+    }
+    if (key && key_len) {
+        return &cluster->producers[fnv1a_64(key, key_len) % cluster->count];
+    }
+    return &cluster->producers[(unsigned int) ast_get_tid() % cluster->count];
+}
+
+/*! \brief Messages waiting for delivery in all producers of a cluster */
+static int cluster_outq_len(struct kafka_cluster *cluster) {
+    unsigned int i;
+    int len = 0;
+
+    for (i = 0; i < cluster->count; i++) {
+        producer_lock(&cluster->producers[i]);
+        if (cluster->producers[i].rk) {
+            len += rd_kafka_outq_len(cluster->producers[i].rk);
+        }
+        producer_unlock(&cluster->producers[i]);
+    }
+    return len;
+}
+
+/*!
+ * \param headers Taken over by librdkafka and set to NULL once the message is enqueued
+ * \param enqueued_us kafka_metrics_now() when the message was produced, 0 to leave it out of the latency
+ */
+static rd_kafka_resp_err_t topic_enqueue(struct ast_kafka_topic *topic, const void *key, size_t key_len,
+                                         rd_kafka_headers_t **headers, void *payload, size_t len, int msgflags,
+                                         uint64_t enqueued_us) {
+    struct kafka_producer *producer;
+    rd_kafka_resp_err_t err;
+
+    /* A reload may move the topic to a new cluster, but not while the message is produced */
+    ast_rwlock_rdlock(&topic->cluster_lock);
+    producer = pick_producer(topic->cluster, key, key_len);
+    /* A rebuild is not waited for, the message takes the overflow policy as if the queue was full */
+    if (producer->fatal || producer_trylock(producer)) {
+        ast_rwlock_unlock(&topic->cluster_lock);
+        return RD_KAFKA_RESP_ERR__QUEUE_FULL;
+    }
+    err = rd_kafka_producev(
+            /* Producer handle */
+            producer->rk,
+            /* Cached topic handle, no lookup by name */
+            RD_KAFKA_V_RKT(topic->rkt[producer->index]),
+            /* Either hand the payload over or make a copy of it. */
+            RD_KAFKA_V_MSGFLAGS(msgflags),
+            /* Optional message key, NULL means no key */
+            RD_KAFKA_V_KEY(key, key ? key_len : 0),
+            /* Message value and length */
+            RD_KAFKA_V_VALUE(payload, len),
+            /* Optional headers, librdkafka owns them once the message is enqueued */
+            RD_KAFKA_V_HEADERS(headers ? *headers : NULL),
+            /* Per-Message opaque, provided in
+             * delivery report callback as
+             * msg_opaque. The enqueue timestamp
+             * for the latency histogram. */
+            RD_KAFKA_V_OPAQUE((void *) (uintptr_t) enqueued_us),
+            /* End sentinel */
+            RD_KAFKA_V_END);
+    producer_unlock(producer);
+    ast_rwlock_unlock(&topic->cluster_lock);
+    if (!err) {
+        kafka_metrics_add(topic->metrics.enqueued, 1);
+        if (headers) {
+            *headers = NULL;
+        }
+    } else if (err == RD_KAFKA_RESP_ERR__FATAL) {
+        /* The instance is being rebuilt, wait or spool as if the queue was full */
+        err = RD_KAFKA_RESP_ERR__QUEUE_FULL;
+    }
+    return err;
+}
+
+/*! \brief Count a message dropped because the queue was full, logged at most every DROP_REPORT_INTERVAL seconds */
+static void report_drop(struct ast_kafka_topic *topic) {
+    time_t now = time(NULL);
+    int dropped;
+
+    ast_atomic_fetchadd_int(&topic->dropped, 1);
+    ast_atomic_fetchadd_int(&total_dropped, 1);
+
+    ao2_lock(topic);
+    if (now - topic->last_report < DROP_REPORT_INTERVAL) {
+        ao2_unlock(topic);
+        return;
+    }
+    dropped = topic->dropped - topic->dropped_reported;
+    topic->dropped_reported = topic->dropped;
+    topic->last_report = now;
+    ao2_unlock(topic);
+    ast_log(LOG_WARNING, "Queue is full, %d message(s) for topic %s dropped (%s)\n", dropped, topic->name,
+            overflow_names[topic->overflow.policy]);
+}
+
+/*!
+ * \brief Keep a copy of the message in the ring of the topic, the oldest one is dropped when it is full
+ *
+ * The ring takes the headers over, if any.
+ */
+static void ring_push(struct ast_kafka_topic *topic, const void *key, size_t key_len, rd_kafka_headers_t **headers,
+                      const void *payload, size_t len) {
+    struct ring_msg *msg;
+    struct ring_msg *evicted = NULL;
+
+    if (!key) {
+        key_len = 0;
+    }
+    msg = ast_malloc(sizeof(*msg) + key_len + len);
+    if (!msg) {
+        report_drop(topic);
+        return;
+    }
+    msg->headers = NULL;
+    if (headers) {
+        msg->headers = *headers;
+        *headers = NULL;
+    }
+    msg->key_len = key_len;
+    msg->len = len;
+    memcpy(msg->data, key, key_len);
+    memcpy(msg->data + key_len, payload, len);
+
+    ao2_lock(topic);
+    if (topic->ring_count == topic->overflow.ring_size) {
+        evicted = topic->ring[topic->ring_head];
+        topic->ring_head = (topic->ring_head + 1) % topic->overflow.ring_size;
+        topic->ring_count--;
+    }
+    topic->ring[(topic->ring_head + topic->ring_count) % topic->overflow.ring_size] = msg;
+    topic->ring_count++;
+    ao2_unlock(topic);
+
+    if (evicted) {
+        ring_msg_free(evicted);
+        report_drop(topic);
+    } else {
+        ast_atomic_fetchadd_int(&ring_total, 1);
+    }
+}
+
+/*! \brief Move the ring of a topic of the cluster in \a arg, or of any cluster, to the queue while there is room */
+static int ring_drain(void *obj, void *arg, int flags) {
+    struct ast_kafka_topic *topic = obj;
+    struct ring_msg *msg;
+    rd_kafka_resp_err_t err;
+
+    if (arg && topic->cluster != arg) {
+        return 0;
+    }
+    ao2_lock(topic);
+    while (topic->ring_count) {
+        msg = topic->ring[topic->ring_head];
+        err = topic_enqueue(topic, msg->key_len ? msg->data : NULL, msg->key_len, &msg->headers,
+                            msg->data + msg->key_len, msg->len, RD_KAFKA_MSG_F_COPY, 0);
+        if (err == RD_KAFKA_RESP_ERR__QUEUE_FULL) {
+            break;
+        }
+        if (err) {
+            ast_log(LOG_ERROR, "Failed to produce to topic %s: %s\n", topic->name, rd_kafka_err2str(err));
+        }
+        ring_msg_free(msg);
+        topic->ring_head = (topic->ring_head + 1) % topic->overflow.ring_size;
+        topic->ring_count--;
+        ast_atomic_fetchadd_int(&ring_total, -1);
+    }
+    ao2_unlock(topic);
+    return 0;
+}
+
+/*! \brief Retry until the message fits in the queue or the timeout of the topic expires */
+static rd_kafka_resp_err_t enqueue_wait(struct ast_kafka_topic *topic, const void *key, size_t key_len,
+                                        rd_kafka_headers_t **headers, void *payload, size_t len, int msgflags,
+                                        uint64_t enqueued_us) {
+    struct timeval deadline = ast_tvadd(ast_tvnow(), ast_samp2tv(topic->overflow.timeout_ms, 1000));
+    struct timespec ts = {
+        .tv_sec = deadline.tv_sec,
+        .tv_nsec = deadline.tv_usec * 1000,
+    };
+    rd_kafka_resp_err_t err = RD_KAFKA_RESP_ERR__QUEUE_FULL;
+    unsigned int seen;
+
+    ast_atomic_fetchadd_int(&room_waiters, 1);
+    ast_mutex_lock(&room_lock);
+    seen = room_signals;
+    while (err == RD_KAFKA_RESP_ERR__QUEUE_FULL && ast_tvcmp(ast_tvnow(), deadline) < 0) {
+        /* Woken up by the next delivery report, or by one since the last try */
+        while (seen == room_signals && !ast_cond_timedwait(&room_cond, &room_lock, &ts)) {
+        }
+        seen = room_signals;
+        /* Not under room_lock, the waiting producers try in parallel */
+        ast_mutex_unlock(&room_lock);
+        err = topic_enqueue(topic, key, key_len, headers, payload, len, msgflags, enqueued_us);
+        ast_mutex_lock(&room_lock);
+    }
+    ast_mutex_unlock(&room_lock);
+    ast_atomic_fetchadd_int(&room_waiters, -1);
+    return err;
+}
+
+/*!
+ * \brief Apply the overflow policy of the topic to a message which did not fit in the queue
+ *
+ * \retval 1 the message is enqueued after all, librdkafka owns it as per \a msgflags
+ * \retval 0 a copy of the message is kept in the ring or the spool
+ * \retval -1 the message is dropped
+ */
+static int handle_overflow(struct ast_kafka_topic *topic, const void *key, size_t key_len,
+                           rd_kafka_headers_t **headers, void *payload, size_t len, int msgflags,
+                           uint64_t enqueued_us) {
+    void *packed;
+    size_t packed_len;
+    int res;
+
+    switch (topic->overflow.policy) {
+        case OVERFLOW_BLOCK:
+            if (!enqueue_wait(topic, key, key_len, headers, payload, len, msgflags, enqueued_us)) {
+                return 1;
+            }
+            break;
+        case OVERFLOW_DROP_OLDEST:
+            ring_push(topic, key, key_len, headers, payload, len);
+            return 0;
+        case OVERFLOW_SPOOL:
+            packed = headers_pack(headers ? *headers : NULL, &packed_len);
+            res = kafka_spool_append(topic->name, key, key ? key_len : 0, packed, packed_len, payload, len);
+            ast_free(packed);
+            if (!res) {
+                return 0;
+            }
+            break;
+        default:
+            break;
+    }
+    report_drop(topic);
+    return -1;
+}
+
+/*! \brief Headers of a message, NULL when there are none */
+static rd_kafka_headers_t *headers_build(const struct ast_kafka_header *headers, size_t header_count) {
+    rd_kafka_headers_t *hdrs;
+    size_t i;
+
+    if (!header_count) {
+        return NULL;
+    }
+    hdrs = rd_kafka_headers_new(header_count);
+    for (i = 0; i < header_count; i++) {
+        rd_kafka_header_add(hdrs, headers[i].name, -1, headers[i].value, headers[i].value ? headers[i].len : 0);
+    }
+    return hdrs;
+}
+
+/*! \brief Produce a message, headers left to the caller are set to NULL when they are handed over */
+static int topic_produce(struct ast_kafka_topic *topic, const void *key, size_t key_len, rd_kafka_headers_t **headers,
+                         void *payload, size_t len, int flags) {
+    rd_kafka_resp_err_t err;
+    int msgflags = RD_KAFKA_MSG_F_COPY;
+    uint64_t now = kafka_metrics_now();
+    int res;
+
+    if (!enabled) {
+        if (flags & AST_KAFKA_F_FREE) {
+            ast_free(payload);
+        }
+        return -1;
+    }
+#ifndef __AST_DEBUG_MALLOC
+    /* Without MALLOC_DEBUG ast_malloc() is plain malloc(), so librdkafka
+     * can release the buffer itself and no copy is made at all. */
+    if (flags & AST_KAFKA_F_FREE) {
+        msgflags = RD_KAFKA_MSG_F_FREE;
+    }
+#endif
+    if (topic->ring_count) {
+        /* Messages held by drop_oldest go first, the poll thread moves them to the queue */
+        err = RD_KAFKA_RESP_ERR__QUEUE_FULL;
+    } else {
+        err = topic_enqueue(topic, key, key_len, headers, payload, len, msgflags, now);
+    }
+    if (err == RD_KAFKA_RESP_ERR__QUEUE_FULL) {
+        res = handle_overflow(topic, key, key_len, headers, payload, len, msgflags, now);
+        if (res <= 0) {
+            if (flags & AST_KAFKA_F_FREE) {
+                ast_free(payload);
+            }
+            return res;
+        }
+        err = RD_KAFKA_RESP_ERR_NO_ERROR;
+    }
+    if (err) {
+        /*
+         * Failed to *enqueue* message for producing.
+         * librdkafka does not take ownership of the payload in that case.
+         */
+        ast_log(LOG_ERROR, "Failed to produce to topic %s: %s\n", topic->name, rd_kafka_err2str(err));
+        if (flags & AST_KAFKA_F_FREE) {
+            ast_free(payload);
+        }
+        return -1;
+    }
+    ast_log(LOG_DEBUG, "Enqueued message (%zu bytes) for topic %s\n", len, topic->name);
+    if (msgflags != RD_KAFKA_MSG_F_FREE && (flags & AST_KAFKA_F_FREE)) {
+        ast_free(payload);
+    }
+    return 0;
+}
+
+int ast_kafka_topic_produce(struct ast_kafka_topic *topic, const void *key, size_t key_len, void *payload, size_t len, int flags) {
+    return topic_produce(topic, key, key_len, NULL, payload, len, flags);
+}
+
+int ast_kafka_topic_admit(struct ast_kafka_topic *topic, const char *sample_key, enum ast_kafka_priority priority) {
+    if (priority == AST_KAFKA_PRIORITY_CRITICAL) {
+        return 0;
+    }
+    switch (kafka_limit_check(&topic->limit, sample_key, sample_key ? strlen(sample_key) : 0,
+                              priority == AST_KAFKA_PRIORITY_LOW)) {
+        case KAFKA_LIMIT_THROTTLED:
+            kafka_metrics_add(topic->metrics.throttled, 1);
+            return -1;
+        case KAFKA_LIMIT_SAMPLED:
+            kafka_metrics_add(topic->metrics.sampled, 1);
+            return -1;
+        default:
+            return 0;
+    }
+}
+
+int ast_kafka_topic_produce_headers(struct ast_kafka_topic *topic, const void *key, size_t key_len,
+                                    const struct ast_kafka_header *headers, size_t header_count,
+                                    void *payload, size_t len, int flags) {
+    rd_kafka_headers_t *hdrs = headers_build(headers, header_count);
+    int res;
+
+    res = topic_produce(topic, key, key_len, hdrs ? &hdrs : NULL, payload, len, flags);
+    if (hdrs) {
+        rd_kafka_headers_destroy(hdrs);
+    }
+    return res;
+}
+
+int ast_kafka_produce_buf(const char *topic_name, const void *key, size_t key_len, void *payload, size_t len, int flags) {
+    struct ast_kafka_topic *topic;
+    int res;
+
+    topic = ast_kafka_topic_get(topic_name);
+    if (!topic) {
+        if (flags & AST_KAFKA_F_FREE) {
+            ast_free(payload);
+        }
+        return -1;
+    }
+    res = ast_kafka_topic_produce(topic, key, key_len, payload, len, flags);
+    ao2_ref(topic, -1);
+    return res;
+}
+
+static int queue_info_add(void *obj, void *arg, int flags) {
+    struct kafka_cluster *cluster = obj;
+    struct ast_kafka_queue_info *info = arg;
+
+    info->depth += cluster_outq_len(cluster);
+    info->max += cluster->queue_max * cluster->count;
+    return 0;
+}
+
+void ast_kafka_queue_get_info(struct ast_kafka_queue_info *info) {
+    info->depth = 0;
+    info->max = 0;
+    info->dropped = total_dropped;
+    if (enabled && clusters) {
+        ao2_callback(clusters, OBJ_NODATA, queue_info_add, info);
+    }
+}
+
+int ast_kafka_produce(const char *topic, const char *buffer) {
+    return ast_kafka_produce_buf(topic, NULL, 0, (void *) buffer, strlen(buffer), AST_KAFKA_F_COPY);
+}
+
+static int start_poll_thread(void *obj, void *arg, int flags) {
+    struct kafka_cluster *cluster = obj;
+    struct kafka_producer *producer;
+    unsigned int i;
+
+    for (i = 0; i < cluster->count; i++) {
+        producer = &cluster->producers[i];
+        if (producer->poll_thread != AST_PTHREADT_NULL) {
+            continue; /* already started */
+        }
+        if (ast_pthread_create_background(&producer->poll_thread, NULL, do_poll, producer)) {
+            ast_log(LOG_ERROR, "Unable to start poll thread of cluster %s\n", cluster->name);
+            producer->poll_thread = AST_PTHREADT_NULL;
+            *(int *) arg = -1;
+            return CMP_STOP;
+        }
+    }
+    return 0;
+}
+
+static int stop_poll_thread(void *obj, void *arg, int flags) {
+    struct kafka_cluster *cluster = obj;
+    unsigned int i;
+
+    for (i = 0; i < cluster->count; i++) {
+        if (cluster->producers[i].poll_thread != AST_PTHREADT_NULL) {
+            pthread_join(cluster->producers[i].poll_thread, NULL);
+            cluster->producers[i].poll_thread = AST_PTHREADT_NULL;
+        }
+    }
+    return 0;
+}
+
+static void stop_poll_threads(void) {
+    poll_running = 0;
+    ao2_callback(clusters, OBJ_NODATA, stop_poll_thread, NULL);
+    ast_log(LOG_NOTICE, "Poll threads stopped\n");
+}
+
+/*! \brief One poll thread per producer instance */
+static int start_poll_threads(void) {
+    int res = 0;
+
+    poll_running = 1;
+    ao2_callback(clusters, OBJ_NODATA, start_poll_thread, &res);
+    if (res) {
+        stop_poll_threads();
+        return -1;
+    }
+    ast_log(LOG_NOTICE, "Poll threads started\n");
+    return 0;
+}
+
+static int replay_message(const char *topic_name, const void *key, size_t key_len, const void *headers,
+                          size_t headers_len, const void *payload, size_t len) {
+    struct ast_kafka_topic *topic;
+    rd_kafka_headers_t *hdrs;
+    rd_kafka_resp_err_t err;
+    int backed_up;
+
+    topic = ast_kafka_topic_get(topic_name);
+    if (!topic) {
+        return -1;
+    }
+    /* Replay stops at the first message of a cluster which is down or backed up. A reload
+     * may move the topic to a new cluster and release the old one meanwhile. */
+    ast_rwlock_rdlock(&topic->cluster_lock);
+    backed_up = !topic->cluster->up || cluster_outq_len(topic->cluster) >= replay_rate;
+    ast_rwlock_unlock(&topic->cluster_lock);
+    if (backed_up) {
+        ao2_ref(topic, -1);
+        return -1;
+    }
+    /* Not spooled again on failure, the message simply stays in the spool */
+    hdrs = headers ? headers_unpack(headers, headers_len) : NULL;
+    err = topic_enqueue(topic, key, key_len, hdrs ? &hdrs : NULL, (void *) payload, len, RD_KAFKA_MSG_F_COPY, 0);
+    if (hdrs) {
+        rd_kafka_headers_destroy(hdrs);
+    }
+    ao2_ref(topic, -1);
+    return err ? -1 : 0;
+}
+
+/*! \brief Mark a cluster up when a broker answers, asks for the metadata of the known topics only */
+static int probe_cluster(void *obj, void *arg, int flags) {
+    struct kafka_cluster *cluster = obj;
+    const struct rd_kafka_metadata *metadata;
+    rd_kafka_resp_err_t err;
+
+    if (cluster->up) {
+        return 0;
+    }
+    producer_lock(&cluster->producers[0]);
+    err = rd_kafka_metadata(cluster->producers[0].rk, 0, NULL, &metadata, PROBE_TIMEOUT_MS);
+    producer_unlock(&cluster->producers[0]);
+    if (err) {
+        return 0;
+    }
+    rd_kafka_metadata_destroy(metadata);
+    ast_log(LOG_NOTICE, "Kafka cluster %s is reachable, replaying %lu spooled message(s)\n", cluster->name,
+            kafka_spool_pending());
+    cluster->up = 1;
+    return 0;
+}
+
+/*!
+ * \brief Replay thread
+ *
+ * Hands spooled messages back to librdkafka at replay_rate per second
+ * while the cluster is reachable and the queue is not backed up.
+ */
+static void *do_replay(void *unused) {
+    unsigned int batch = MAX(replay_rate * REPLAY_INTERVAL_MS / 1000, 1);
+    struct timespec ts;
+    struct timeval tv;
+
+    ast_mutex_lock(&replay_lock);
+    while (replay_running) {
+        tv = ast_tvadd(ast_tvnow(), ast_samp2tv(REPLAY_INTERVAL_MS, 1000));
+        ts.tv_sec = tv.tv_sec;
+        ts.tv_nsec = tv.tv_usec * 1000;
+        ast_cond_timedwait(&replay_cond, &replay_lock, &ts);
+        if (!replay_running || !kafka_spool_pending()) {
+            continue;
+        }
+        ast_mutex_unlock(&replay_lock);
+
+        ao2_callback(clusters, OBJ_NODATA, probe_cluster, NULL);
+        kafka_spool_replay(replay_message, batch);
+
+        ast_mutex_lock(&replay_lock);
+    }
+    ast_mutex_unlock(&replay_lock);
+    return NULL;
+}
+
+static int start_replay_thread(void) {
+    replay_running = 1;
+    ast_cond_init(&replay_cond, NULL);
+    if (ast_pthread_create_background(&replay_thread, NULL, do_replay, NULL)) {
+        ast_log(LOG_ERROR, "Unable to start spool replay thread\n");
+        replay_running = 0;
+        replay_thread = AST_PTHREADT_NULL;
+        ast_cond_destroy(&replay_cond);
+        return -1;
+    }
+    return 0;
+}
+
+static void stop_replay_thread(void) {
+    if (replay_thread == AST_PTHREADT_NULL) {
+        return;
+    }
+    ast_mutex_lock(&replay_lock);
+    replay_running = 0;
+    ast_cond_signal(&replay_cond);
+    ast_mutex_unlock(&replay_lock);
+    pthread_join(replay_thread, NULL);
+    replay_thread = AST_PTHREADT_NULL;
+    ast_cond_destroy(&replay_cond);
+}
+
+static int open_spool(void) {
+    struct kafka_spool_config config = {
+        .directory = spool_directory,
+        .segment_size = (size_t) spool_segment_mb * 1024 * 1024,
+        .max_size = (size_t) spool_max_mb * 1024 * 1024,
+    };
+
+    if (!spool_enabled) {
+        return 0;
+    }
+    if (kafka_spool_open(&config)) {
+        return -1;
+    }
+    ast_log(LOG_NOTICE, "Spooling undelivered messages to %s\n", spool_directory);
+    return 0;
+}
+
+static void topic_config_destructor(void *obj) {
+    struct topic_config *tcfg = obj;
+    ast_variables_destroy(tcfg->options);
+    ast_free(tcfg->dead_letter);
+}
+
+/*!
+ * \brief Parse the dead_letter option of the [general] or a [topic:<name>] section
+ *
+ * \retval 1 the option is consumed
+ * \retval 0 not the dead_letter option
+ * \retval -1 out of memory
+ */
+static int dead_letter_option(char **dead_letter, const struct ast_variable *v) {
+    if (strcasecmp(v->name, "dead_letter")) {
+        return 0;
+    }
+    ast_free(*dead_letter);
+    *dead_letter = ast_strdup(v->value);
+    return *dead_letter ? 1 : -1;
+}
+
+/*!
+ * \brief Parse the partitioner option of the [general] or a [topic:<name>] section
+ *
+ * Anything but jump is left to librdkafka, which validates the name.
+ *
+ * \retval 1 the jump partitioner, the option is consumed
+ * \retval 0 not the partitioner option or a librdkafka partitioner
+ */
+static int partitioner_option(enum partitioner *partitioner, const struct ast_variable *v) {
+    if (strcasecmp(v->name, "partitioner")) {
+        return 0;
+    }
+    *partitioner = strcasecmp(v->value, "jump") ? PARTITIONER_BUILTIN : PARTITIONER_JUMP;
+    return *partitioner == PARTITIONER_JUMP;
+}
+
+/*!
+ * \brief Parse an overflow option of the [general] or a [topic:<name>] section
+ *
+ * \retval 1 the option is an overflow one and is valid
+ * \retval 0 not an overflow option
+ * \retval -1 invalid value
+ */
+static int overflow_option(struct overflow_config *cfg, const struct ast_variable *v) {
+    unsigned int value;
+    int i;
+
+    if (!strcasecmp(v->name, "overflow")) {
+        for (i = OVERFLOW_DROP_NEWEST; i < ARRAY_LEN(overflow_names); i++) {
+            if (!strcasecmp(v->value, overflow_names[i])) {
+                cfg->policy = i;
+                return 1;
+            }
+        }
+        ast_log(LOG_ERROR, "Unknown overflow policy '%s', expected drop_newest, drop_oldest, block or spool\n", v->value);
+        return -1;
+    }
+    if (strcasecmp(v->name, "overflow_timeout") && strcasecmp(v->name, "overflow_ring")) {
+        return 0;
+    }
+    if (sscanf(v->value, "%30u", &value) != 1 || !value) {
+        ast_log(LOG_ERROR, "Invalid value '%s' of option '%s'\n", v->value, v->name);
+        return -1;
+    }
+    if (!strcasecmp(v->name, "overflow_timeout")) {
+        cfg->timeout_ms = value;
+    } else {
+        cfg->ring_size = value;
+    }
+    return 1;
+}
+
+/*! \brief Build and validate the librdkafka topic configuration of a [topic:<name>] section */
+static struct topic_config *topic_config_alloc(const char *topic_name, struct ast_variable *v) {
+    struct topic_config *tcfg;
+    struct ast_variable *option;
+    rd_kafka_topic_conf_t *tconf;
+    char errstr[512];
+    int res;
+
+    if (ast_strlen_zero(topic_name)) {
+        ast_log(LOG_ERROR, "Topic name is missing in section [%s]\n", TOPIC_SECTION_PREFIX);
+        return NULL;
+    }
+    tcfg = ao2_alloc_options(sizeof(*tcfg) + strlen(topic_name) + 1, topic_config_destructor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+    if (!tcfg) {
+        return NULL;
+    }
+    strcpy(tcfg->name, topic_name); /* Safe */
+    /* Validated against a scratch configuration, the options are applied per topic over the defaults */
+    tconf = rd_kafka_topic_conf_new();
+    for (; v; v = v->next) {
+        res = overflow_option(&tcfg->overflow, v);
+        if (!res) {
+            res = partitioner_option(&tcfg->partitioner, v);
+        }
+        if (!res) {
+            res = kafka_limit_option(&tcfg->limit, v);
+        }
+        if (!res) {
+            res = dead_letter_option(&tcfg->dead_letter, v);
+        }
+        if (res < 0) {
+            break;
+        }
+        if (res) {
+            continue;
+        }
+        if (rd_kafka_topic_conf_set(tconf, v->name, v->value, errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK) {
+            ast_log(LOG_ERROR, "Invalid option '%s' for topic %s: %s\n", v->name, topic_name, errstr);
+            res = -1;
+            break;
+        }
+        option = ast_variable_new(v->name, v->value, "");
+        if (!option) {
+            res = -1;
+            break;
+        }
+        ast_variable_list_append(&tcfg->options, option);
+    }
+    rd_kafka_topic_conf_destroy(tconf);
+    if (res < 0) {
+        ao2_ref(tcfg, -1);
+        return NULL;
+    }
+    return tcfg;
+}
+
+static int set_producer_option(const char *option, const char *value) {
+    char errstr[512];
+
+    if (rd_kafka_conf_set(producer_conf, option, value, errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK) {
+        ast_log(LOG_ERROR, "Invalid producer option '%s': %s\n", option, errstr);
+        return -1;
+    }
+    return 0;
+}
+
+/*! \brief Parse the number of producer instances of a cluster */
+static int producers_option(const struct ast_variable *v, unsigned int *count) {
+    if (sscanf(v->value, "%30u", count) != 1 || !*count || *count > MAX_PRODUCERS) {
+        ast_log(LOG_ERROR, "Invalid number of producers '%s', expected 1 to %d\n", v->value, MAX_PRODUCERS);
+        return -1;
+    }
+    return 0;
+}
+
+static void cluster_destructor(void *obj) {
+    struct kafka_cluster *cluster = obj;
+    struct moved_topic *moved;
+    unsigned int i;
+
+    while ((moved = AST_LIST_REMOVE_HEAD(&cluster->moved, list))) {
+        topic_handles_destroy(moved->rkt, cluster->count);
+        ao2_ref(moved->topic, -1);
+        ast_free(moved);
+    }
+    for (i = 0; cluster->producers && i < cluster->count; i++) {
+        /* Destroy the producer instance */
+        if (cluster->producers[i].rk) {
+            rd_kafka_destroy(cluster->producers[i].rk);
+        }
+        ast_json_free(cluster->producers[i].json_stats);
+        ast_mutex_destroy(&cluster->producers[i].stats_lock);
+        ast_rwlock_destroy(&cluster->producers[i].lock);
+    }
+    ast_free(cluster->producers);
+    if (cluster->conf) {
+        rd_kafka_conf_destroy(cluster->conf);
+    }
+    ast_free(cluster->brokers);
+    ast_free(cluster->signature);
+}
+
+/*!
+ * \brief Apply the options of a [cluster:<name>] section over the [producer] section
+ *
+ * brokers, producers and idempotent are ours, everything else goes to librdkafka as is.
+ */
+static int cluster_configure(struct kafka_cluster *cluster, const char *brokers, struct ast_variable *v) {
+    char errstr[512];
+    char value[512];
+    size_t size = sizeof(value);
+
+    for (; v; v = v->next) {
+        if (!strcasecmp(v->name, "producers")) {
+            if (producers_option(v, &cluster->count)) {
+                return -1;
+            }
+            continue;
+        }
+        if (!strcasecmp(v->name, "idempotent")) {
+            cluster->idempotent = ast_true(v->value);
+            continue;
+        }
+        if (rd_kafka_conf_set(cluster->conf, strcasecmp(v->name, "brokers") ? v->name : "bootstrap.servers", v->value,
+                              errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK) {
+            ast_log(LOG_ERROR, "Invalid option '%s' for cluster %s: %s\n", v->name, cluster->name, errstr);
+            return -1;
+        }
+    }
+
+    /* Set bootstrap broker(s) as a comma-separated list of
+     * host or host:port (default port 9092).
+     * librdkafka will use the bootstrap brokers to acquire the full
+     * set of brokers from the cluster.
+     * A bootstrap.servers value in the [producer] section takes precedence
+     * over the brokers of the [general] section. */
+    if (rd_kafka_conf_get(cluster->conf, "bootstrap.servers", value, &size) != RD_KAFKA_CONF_OK || ast_strlen_zero(value)) {
+        if (ast_strlen_zero(brokers)) {
+            ast_log(LOG_ERROR, "No brokers for cluster %s\n", cluster->name);
+            return -1;
+        }
+        if (rd_kafka_conf_set(cluster->conf, "bootstrap.servers", brokers, errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK) {
+            ast_log(LOG_ERROR, "Invalid brokers for cluster %s: %s\n", cluster->name, errstr);
+            return -1;
+        }
+        cluster->brokers = ast_strdup(brokers);
+    } else {
+        cluster->brokers = ast_strdup(value);
+    }
+    size = sizeof(value);
+    if (rd_kafka_conf_get(cluster->conf, "queue.buffering.max.messages", value, &size) == RD_KAFKA_CONF_OK) {
+        cluster->queue_max = atoi(value);
+    }
+    return 0;
+}
+
+/*! \brief Set a librdkafka option of an idempotent cluster, warn when it overrides the configuration */
+static int idempotent_option(struct kafka_cluster *cluster, const char *option, const char *value, int overridden) {
+    char errstr[512];
+
+    if (overridden) {
+        ast_log(LOG_WARNING, "Cluster %s is idempotent, %s is set to %s\n", cluster->name, option, value);
+    }
+    if (rd_kafka_conf_set(cluster->conf, option, value, errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK) {
+        ast_log(LOG_ERROR, "Unable to set %s for idempotent cluster %s: %s\n", option, cluster->name, errstr);
+        return -1;
+    }
+    return 0;
+}
+
+/*!
+ * \brief Enforce the producer settings that idempotence requires
+ *
+ * enable.idempotence=true in the [producer] section or in a [cluster:<name>]
+ * section makes the cluster idempotent too. A gap in the sequence of a
+ * partition is a fatal error, it is reported and the producer rebuilt.
+ */
+static int cluster_enforce_idempotence(struct kafka_cluster *cluster) {
+    char value[64];
+    size_t size = sizeof(value);
+    int res = 0;
+
+    if (rd_kafka_conf_get(cluster->conf, "enable.idempotence", value, &size) == RD_KAFKA_CONF_OK
+        && !strcasecmp(value, "true")) {
+        cluster->idempotent = 1;
+    }
+    if (!cluster->idempotent) {
+        return 0;
+    }
+    res |= idempotent_option(cluster, "enable.idempotence", "true", 0);
+    res |= idempotent_option(cluster, "enable.gapless.guarantee", "true", 0);
+    size = sizeof(value);
+    if (rd_kafka_conf_get(cluster->conf, "acks", value, &size) != RD_KAFKA_CONF_OK
+        || (strcasecmp(value, "all") && strcmp(value, "-1"))) {
+        res |= idempotent_option(cluster, "acks", "all", 1);
+    }
+    size = sizeof(value);
+    if (rd_kafka_conf_get(cluster->conf, "retries", value, &size) != RD_KAFKA_CONF_OK || atoi(value) <= 0) {
+        res |= idempotent_option(cluster, "retries", IDEMPOTENT_RETRIES, 1);
+    }
+    size = sizeof(value);
+    if (rd_kafka_conf_get(cluster->conf, "max.in.flight.requests.per.connection", value, &size) != RD_KAFKA_CONF_OK
+        || atoi(value) > atoi(IDEMPOTENT_MAX_IN_FLIGHT)) {
+        /* The default is far above, the deepest pipeline that keeps the order is used */
+        res |= idempotent_option(cluster, "max.in.flight.requests.per.connection", IDEMPOTENT_MAX_IN_FLIGHT, 0);
+    }
+    if (!res) {
+        ast_log(LOG_NOTICE, "Cluster %s is idempotent, acks=all and at most %s request(s) in flight\n",
+                cluster->name, IDEMPOTENT_MAX_IN_FLIGHT);
+    }
+    return res ? -1 : 0;
 }
 
-static int kafka_connect(void) {
-    conf = rd_kafka_conf_new();
-
-    rd_kafka_conf_set_log_cb(conf, log_cb);
-    rd_kafka_conf_set_dr_msg_cb(conf, dr_msg_cb);
-    rd_kafka_conf_set_error_cb(conf, error_cb);
-    rd_kafka_conf_set_stats_cb(conf, stats_cb);
+static struct kafka_cluster *cluster_alloc(const char *cluster_name, const char *brokers, unsigned int count,
+                                           int idempotent, struct ast_variable *v) {
+    struct kafka_cluster *cluster;
+    unsigned int i;
 
-    /* Set bootstrap broker(s) as a comma-separated list of
-     * host or host:port (default port 9092).
-     * librdkafka will use the bootstrap brokers to acquire the full
-     * set of brokers from the cluster. */
-    if (rd_kafka_conf_set(conf, "bootstrap.servers", kafka_brokers, errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK) {
-        ast_log(LOG_ERROR, "%s\n", errstr);
-        return 1;
+    if (ast_strlen_zero(cluster_name) || strchr(cluster_name, ':')) {
+        ast_log(LOG_ERROR, "Invalid cluster name '%s'\n", S_OR(cluster_name, ""));
+        return NULL;
     }
-    if (rd_kafka_conf_set(conf, "statistics.interval.ms", "1000", errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK) {
-        ast_log(LOG_ERROR, "%s\n", errstr);
-        return 1;
+    cluster = ao2_alloc_options(sizeof(*cluster) + strlen(cluster_name) + 1, cluster_destructor,
+                                AO2_ALLOC_OPT_LOCK_NOLOCK);
+    if (!cluster) {
+        return NULL;
     }
+    strcpy(cluster->name, cluster_name); /* Safe */
+    cluster->count = count;
+    cluster->idempotent = idempotent;
+    cluster->conf = rd_kafka_conf_dup(producer_conf);
+    if (cluster_configure(cluster, brokers, v) || cluster_enforce_idempotence(cluster)
+        || !(cluster->producers = ast_calloc(cluster->count, sizeof(*cluster->producers)))) {
+        ao2_ref(cluster, -1);
+        return NULL;
+    }
+    for (i = 0; i < cluster->count; i++) {
+        cluster->producers[i].cluster = cluster;
+        cluster->producers[i].index = i;
+        cluster->producers[i].poll_thread = AST_PTHREADT_NULL;
+        ast_mutex_init(&cluster->producers[i].stats_lock);
+        ast_rwlock_init(&cluster->producers[i].lock);
+    }
+    return cluster;
+}
 
-    ast_log(LOG_NOTICE, "rd_kafka_conf_set done\n");
-
+/*! \brief Clusters and topic options of a configuration, what a reload swaps in */
+struct kafka_config {
+    struct ao2_container *clusters;
+    /*! Cluster of the topics without a cluster prefix */
+    struct kafka_cluster *default_cluster;
+    struct ao2_container *topic_configs;
+    /*! Overflow policy of the topics without their own, [general] section */
+    struct overflow_config overflow;
+    /*! Partitioner of the topics without their own, [general] section */
+    enum partitioner partitioner;
+    /*! Rate limit and sampling of the topics without their own, [general] section */
+    struct kafka_limit_config limit;
+    /*! Dead letter topic of the topics without their own, [general] section */
+    char *dead_letter;
+};
 
-    /*
-     * Create producer instance.
-     *
-     * NOTE: rd_kafka_new() takes ownership of the conf object
-     *       and the application must not reference it again after
-     *       this call.
-     */
-    handle = rd_kafka_new(RD_KAFKA_PRODUCER, conf, errstr, sizeof(errstr));
-    if (!handle) {
-        ast_log(LOG_ERROR, "Failed to create new producer: %s\n", errstr);
-        return 1;
-    }
-    ast_log(LOG_NOTICE, "rd_kafka_new done\n");
-    return 0;
+static void kafka_config_cleanup(struct kafka_config *config) {
+    ast_free(config->dead_letter);
+    config->dead_letter = NULL;
+    ao2_cleanup(config->topic_configs);
+    config->topic_configs = NULL;
+    ao2_cleanup(config->default_cluster);
+    config->default_cluster = NULL;
+    ao2_cleanup(config->clusters);
+    config->clusters = NULL;
 }
 
-int ast_kafka_produce(const char *topic, const char *buffer) {
-    if (enabled) {
-        static char *buf;
-        buf = ast_strdup(buffer);
-        rd_kafka_resp_err_t err;
-        err = rd_kafka_producev(
-                /* Producer handle */
-                handle,
-                /* Topic name */
-                RD_KAFKA_V_TOPIC(topic),
-                /* Make a copy of the payload. */
-                RD_KAFKA_V_MSGFLAGS(RD_KAFKA_MSG_F_COPY),
-                /* Message value and length */
-                RD_KAFKA_V_VALUE(buf, strlen(buf)),
-                /* Per-Message opaque, provided in
-                 * delivery report callback as
-                 * msg_opaque. */
-                RD_KAFKA_V_OPAQUE(NULL),
-                /* End sentinel */
-                RD_KAFKA_V_END);
-        if (err) {
-            /*
-             * Failed to *enqueue* message for producing.
-             */
-            ast_log(LOG_ERROR, "Failed to produce to topic %s: %s\n", topic, rd_kafka_err2str(err));
-        } else {
-            ast_log(LOG_DEBUG, "Enqueued message (%zd bytes) for topic %s\n", strlen(buf), topic);
+/*! \brief Add the options of a section to the signature of the clusters built from it */
+static void signature_add(struct ast_str **signature, struct ast_config *cfg, const char *cat) {
+    struct ast_variable *v;
+
+    ast_str_append(signature, 0, "[%s]\n", cat);
+    for (v = ast_variable_browse(cfg, cat); v; v = v->next) {
+        /* The topics to preload, the rate limits and the dead letter topics change no cluster */
+        if (strcasecmp(v->name, "topics") && strcasecmp(v->name, "rate_limit") && strcasecmp(v->name, "rate_burst")
+            && strcasecmp(v->name, "sample") && strcasecmp(v->name, "dead_letter")) {
+            ast_str_append(signature, 0, "%s=%s\n", v->name, v->value);
         }
-        ast_free(buf);
-        /* A producer application should continually serve
-         * the delivery report queue by calling rd_kafka_poll()
-         * at frequent intervals.
-         * Either put the poll call in your main loop, or in a
-         * dedicated thread, or call it after every
-         * rd_kafka_produce() call.
-         * Just make sure that rd_kafka_poll() is still called
-         * during periods where you are not producing any messages
-         * to make sure previously produced messages have their
-         * delivery report callback served (and any other callbacks
-         * you register). */
-        rd_kafka_poll(handle, 0/*non-blocking*/);
     }
-    return 0;
 }
 
-static int start_sched(void) {
-    if (sched) {
-        return 0; /* already started */
-    }
-    if (!(sched = ast_sched_context_create())) {
-        ast_log(LOG_ERROR, "Failed to create scheduler context\n");
-        return -1;
-    }
+/*!
+ * \brief Build the default cluster and those of the [cluster:<name>] sections
+ *
+ * \param common Signature of the [general], [producer] and [topic:<name>] sections, every cluster depends on them
+ */
+static int load_clusters(struct ast_config *cfg, struct kafka_config *config, const char *common) {
+    struct kafka_cluster *cluster;
+    struct ast_str *signature;
+    const char *cluster_name;
+    char *cat = NULL;
 
-    if (ast_sched_start_thread(sched)) {
-        ast_sched_context_destroy(sched);
-        sched = NULL;
+    config->default_cluster = cluster_alloc(AST_KAFKA_DEFAULT_CLUSTER, kafka_brokers, default_producers,
+                                            default_idempotent, NULL);
+    if (!config->default_cluster || !(config->default_cluster->signature = ast_strdup(common))) {
         return -1;
     }
-    if (ast_sched_add_variable(sched, poll_interval_ms, do_poll, NULL, 1) < 0) {
-        ast_log(LOG_ERROR, "Unable to schedule \n");
-        ast_sched_context_destroy(sched);
-        sched = NULL;
-        return -1;
+    ao2_link(config->clusters, config->default_cluster);
+
+    while ((cat = ast_category_browse(cfg, cat))) {
+        if (strncasecmp(cat, CLUSTER_SECTION_PREFIX, strlen(CLUSTER_SECTION_PREFIX))) {
+            continue;
+        }
+        cluster_name = cat + strlen(CLUSTER_SECTION_PREFIX);
+        if (!strcasecmp(cluster_name, AST_KAFKA_DEFAULT_CLUSTER)) {
+            ast_log(LOG_ERROR, "The %s cluster is set in the [general] and [producer] sections\n",
+                    AST_KAFKA_DEFAULT_CLUSTER);
+            return -1;
+        }
+        /* Named clusters have no default brokers */
+        cluster = cluster_alloc(cluster_name, NULL, DEFAULT_PRODUCERS, 0, ast_variable_browse(cfg, cat));
+        if (!cluster) {
+            return -1;
+        }
+        signature = ast_str_create(strlen(common) + 256);
+        if (signature) {
+            ast_str_set(&signature, 0, "%s", common);
+            signature_add(&signature, cfg, cat);
+            cluster->signature = ast_strdup(ast_str_buffer(signature));
+            ast_free(signature);
+        }
+        if (!cluster->signature) {
+            ao2_ref(cluster, -1);
+            return -1;
+        }
+        ao2_link(config->clusters, cluster);
+        ao2_ref(cluster, -1);
     }
-    ast_log(LOG_NOTICE, "Poll task started\n");
     return 0;
 }
 
-static int stop_sched(void) {
-    if (sched) {
-        ast_sched_context_destroy(sched);
-        sched = NULL;
-        ast_log(LOG_NOTICE, "Poll task stopped\n");
+/*! \brief Add the consumers of the [consumer:<name>] sections, they take the brokers of their cluster */
+static int load_consumers(struct ast_config *cfg, struct kafka_config *config) {
+    struct kafka_cluster *cluster;
+    const char *cluster_name;
+    char *cat = NULL;
+    int res;
+
+    while ((cat = ast_category_browse(cfg, cat))) {
+        if (strncasecmp(cat, CONSUMER_SECTION_PREFIX, strlen(CONSUMER_SECTION_PREFIX))) {
+            continue;
+        }
+        cluster_name = ast_variable_retrieve(cfg, cat, "cluster");
+        if (ast_strlen_zero(cluster_name)) {
+            cluster = ao2_bump(config->default_cluster);
+        } else if (!(cluster = ao2_find(config->clusters, cluster_name, OBJ_SEARCH_KEY))) {
+            ast_log(LOG_ERROR, "Unknown cluster '%s' of [%s]\n", cluster_name, cat);
+            return -1;
+        }
+        res = kafka_consumer_add(cat + strlen(CONSUMER_SECTION_PREFIX), cluster->brokers,
+                                 ast_variable_browse(cfg, cat));
+        ao2_ref(cluster, -1);
+        if (res) {
+            return -1;
+        }
     }
+    return 0;
 }
 
+/*! \brief Parse a positive number of the [spool] section */
+static int spool_number(const struct ast_variable *v, unsigned int *result) {
+    if (sscanf(v->value, "%30u", result) != 1 || !*result) {
+        ast_log(LOG_ERROR, "Invalid value '%s' of spool option '%s'\n", v->value, v->name);
+        return -1;
+    }
+    return 0;
+}
 
-static int load_config() {
+/*!
+ * \brief Parse the config file into \a config, its containers are allocated here
+ *
+ * A reload leaves the [spool] and [consumer:<name>] sections alone, they
+ * take effect at load only.
+ *
+ * \retval 0 on success
+ * \retval 1 reload of an unchanged file, nothing is parsed
+ * \retval -1 on error
+ */
+static int load_config(struct kafka_config *config, int reload) {
     char *cat = NULL;
     struct ast_config *cfg;
     struct ast_variable *v;
-    struct ast_flags config_flags = {0};
+    struct ast_flags config_flags = {reload ? CONFIG_FLAG_FILEUNCHANGED : 0};
+    struct topic_config *tcfg;
+    struct ast_str *signature;
+    int res = 0;
 
     cfg = ast_config_load(CONF_FILE, config_flags);
 
+    if (cfg == CONFIG_STATUS_FILEUNCHANGED) {
+        return 1;
+    }
+
     if (cfg == CONFIG_STATUS_FILEINVALID) {
         ast_log(LOG_ERROR, "Config file '%s' could not be parsed\n", CONF_FILE);
         return -1;
@@ -200,24 +2475,145 @@ static int load_config() {
         ast_log(LOG_WARNING, "Failed to load configuration file '%s'\n", CONF_FILE);
         return -1;
     }
+    config->topic_configs = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, TOPIC_BUCKETS,
+                                                     topic_config_hash_fn, NULL, topic_config_cmp_fn);
+    config->clusters = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, CLUSTER_BUCKETS,
+                                                kafka_cluster_hash_fn, NULL, kafka_cluster_cmp_fn);
+    signature = ast_str_create(1024);
+    if (!config->topic_configs || !config->clusters || !signature) {
+        ast_config_destroy(cfg);
+        ast_free(signature);
+        kafka_config_cleanup(config);
+        return -1;
+    }
     enabled = 1;
     /* Bootstrap the default configuration */
+    ast_free(kafka_brokers);
     kafka_brokers = ast_strdup(DEFAULT_KAFKA_BROKERS);
+    ast_free(preload_topics);
+    preload_topics = NULL;
+    default_producers = DEFAULT_PRODUCERS;
+    default_idempotent = 0;
+    producer_conf = rd_kafka_conf_new();
+    set_producer_option("statistics.interval.ms", DEFAULT_STATISTICS_INTERVAL_MS);
+    if (!reload) {
+        spool_enabled = 0;
+        spool_segment_mb = DEFAULT_SPOOL_SEGMENT_MB;
+        spool_max_mb = DEFAULT_SPOOL_MAX_MB;
+        replay_rate = DEFAULT_REPLAY_RATE;
+        if (ast_asprintf(&spool_directory, "%s/%s", ast_config_AST_SPOOL_DIR, SPOOL_SUBDIR) < 0) {
+            spool_directory = NULL;
+        }
+    }
+    memset(&config->overflow, 0, sizeof(config->overflow));
+    config->partitioner = PARTITIONER_UNSET;
 
-    while ((cat = ast_category_browse(cfg, cat))) {
+    while (!res && (cat = ast_category_browse(cfg, cat))) {
         if (!strcasecmp(cat, "general")) {
+            signature_add(&signature, cfg, cat);
             v = ast_variable_browse(cfg, cat);
             while (v) {
                 if (!strcasecmp(v->name, "brokers") || !strcasecmp(v->name, "bootstrap.servers")) {
                     ast_free(kafka_brokers);
                     kafka_brokers = ast_strdup(v->value);
+                } else if (!strcasecmp(v->name, "topics")) {
+                    ast_free(preload_topics);
+                    preload_topics = ast_strdup(v->value);
+                } else if (!strcasecmp(v->name, "producers")) {
+                    res = producers_option(v, &default_producers);
+                } else if (!strcasecmp(v->name, "idempotent")) {
+                    default_idempotent = ast_true(v->value);
+                } else if (!strcasecmp(v->name, "partitioner")) {
+                    /* The librdkafka partitioners become the default of the topic configuration */
+                    if (!partitioner_option(&config->partitioner, v)) {
+                        res = set_producer_option("partitioner", v->value);
+                    }
+                } else if (overflow_option(&config->overflow, v) < 0 || kafka_limit_option(&config->limit, v) < 0
+                           || dead_letter_option(&config->dead_letter, v) < 0) {
+                    res = -1;
                 }
                 v = v->next;
             }
+        } else if (!strcasecmp(cat, "producer")) {
+            signature_add(&signature, cfg, cat);
+            /* Everything goes to librdkafka as is */
+            for (v = ast_variable_browse(cfg, cat); v && !res; v = v->next) {
+                res = set_producer_option(v->name, v->value);
+            }
+        } else if (!strcasecmp(cat, "spool")) {
+            /* The spool is opened at load only */
+            for (v = ast_variable_browse(cfg, cat); v && !res && !reload; v = v->next) {
+                if (!strcasecmp(v->name, "enabled")) {
+                    spool_enabled = ast_true(v->value);
+                } else if (!strcasecmp(v->name, "directory")) {
+                    ast_free(spool_directory);
+                    spool_directory = ast_strdup(v->value);
+                } else if (!strcasecmp(v->name, "segment_size")) {
+                    res = spool_number(v, &spool_segment_mb);
+                } else if (!strcasecmp(v->name, "max_size")) {
+                    res = spool_number(v, &spool_max_mb);
+                } else if (!strcasecmp(v->name, "replay_rate")) {
+                    res = spool_number(v, &replay_rate);
+                } else {
+                    ast_log(LOG_WARNING, "Unknown spool option '%s'\n", v->name);
+                }
+            }
+            if (!res && !reload && spool_max_mb < spool_segment_mb) {
+                ast_log(LOG_ERROR, "Spool max_size must not be less than segment_size\n");
+                res = -1;
+            }
+        } else if (!strncasecmp(cat, TOPIC_SECTION_PREFIX, strlen(TOPIC_SECTION_PREFIX))) {
+            signature_add(&signature, cfg, cat);
+            tcfg = topic_config_alloc(cat + strlen(TOPIC_SECTION_PREFIX), ast_variable_browse(cfg, cat));
+            if (!tcfg) {
+                res = -1;
+                break;
+            }
+            ao2_link(config->topic_configs, tcfg);
+            ao2_ref(tcfg, -1);
+        } else if (!strncasecmp(cat, CLUSTER_SECTION_PREFIX, strlen(CLUSTER_SECTION_PREFIX))) {
+            /* Built by load_clusters() once the [producer] section is known */
+        } else if (!strncasecmp(cat, CONSUMER_SECTION_PREFIX, strlen(CONSUMER_SECTION_PREFIX))) {
+            /* Built by load_consumers() once the clusters are known */
+        } else {
+            ast_log(LOG_WARNING, "Unknown section [%s] in %s\n", cat, CONF_FILE);
         }
     }
+    if (!res) {
+        res = load_clusters(cfg, config, ast_str_buffer(signature));
+    }
+    if (!res && !reload) {
+        res = load_consumers(cfg, config);
+    }
+    ast_config_destroy(cfg);
+    ast_free(signature);
+    /* Every cluster has its own copy */
+    rd_kafka_conf_destroy(producer_conf);
+    producer_conf = NULL;
+
+    if (!res && !reload && spool_enabled && ast_strlen_zero(spool_directory)) {
+        ast_log(LOG_ERROR, "Spool directory is not set\n");
+        res = -1;
+    }
+
+    if (config->overflow.policy == OVERFLOW_UNSET) {
+        config->overflow.policy = spool_enabled ? OVERFLOW_SPOOL : OVERFLOW_DROP_NEWEST;
+    }
+    if (!config->overflow.timeout_ms) {
+        config->overflow.timeout_ms = DEFAULT_OVERFLOW_TIMEOUT_MS;
+    }
+    if (!config->overflow.ring_size) {
+        config->overflow.ring_size = DEFAULT_OVERFLOW_RING;
+    }
 
-    ast_log(LOG_NOTICE, "Using kafka brokers %s\n", kafka_brokers);
+    if (res) {
+        ast_log(LOG_ERROR, "Invalid configuration in '%s'\n", CONF_FILE);
+        kafka_config_cleanup(config);
+        if (!reload) {
+            kafka_consumer_cleanup();
+        }
+        return -1;
+    }
     return 0;
 }
 
@@ -245,7 +2641,31 @@ static char *handle_cli_kafka_produce(struct ast_cli_entry *e, int cmd, struct a
 
 }
 
+static int cli_cluster_stats(void *obj, void *arg, int flags) {
+    struct kafka_cluster *cluster = obj;
+    struct kafka_producer *producer;
+    int fd = *(int *) arg;
+    unsigned int i;
+
+    ast_cli(fd, "cluster %s: %s, %s\n", cluster->name, cluster->brokers, cluster->up ? "up" : "down");
+    if (cluster->idempotent) {
+        ast_cli(fd, "idempotent: %d rebuild(s), %d sequence gap(s)\n", cluster->rebuilds, cluster->sequence_gaps);
+    }
+    for (i = 0; i < cluster->count; i++) {
+        producer = &cluster->producers[i];
+        producer_lock(producer);
+        ast_mutex_lock(&producer->stats_lock);
+        ast_cli(fd, "producer %u: %d message(s) queued%s\nstats: %s\n", i, rd_kafka_outq_len(producer->rk),
+                producer->fatal ? ", rebuilding" : "", S_OR(producer->json_stats, ""));
+        ast_mutex_unlock(&producer->stats_lock);
+        producer_unlock(producer);
+    }
+    return 0;
+}
+
 static char *handle_cli_kafka_stats(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
+    struct ast_kafka_queue_info info;
+
     switch (cmd) {
         case CLI_INIT:
             e->command = "kafka stats";
@@ -260,42 +2680,676 @@ static char *handle_cli_kafka_stats(struct ast_cli_entry *e, int cmd, struct ast
     if (a->argc > 2) {
         return CLI_SHOWUSAGE;
     }
-    rd_kafka_poll(handle, 0);
-    ast_cli(a->fd, "stats: %s\n", json_stats);
+    ast_kafka_queue_get_info(&info);
+    ast_cli(a->fd, "queue: %d of %d message(s), %u dropped\n", info.depth, info.max, info.dropped);
+    ao2_callback(clusters, OBJ_NODATA, cli_cluster_stats, (void *) &a->fd);
+
+    return CLI_SUCCESS;
+}
+
+static int cluster_is_down(void *obj, void *arg, int flags) {
+    struct kafka_cluster *cluster = obj;
+    return cluster->up ? 0 : CMP_MATCH;
+}
+
+static char *handle_cli_kafka_spool(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
+    struct kafka_spool_stats stats;
+    struct ao2_iterator *down;
+    struct kafka_cluster *cluster;
+
+    switch (cmd) {
+        case CLI_INIT:
+            e->command = "kafka spool";
+            e->usage =
+                    "Usage: kafka spool\n"
+                    "       Displays the state of the spool of undelivered messages.\n";
+            return NULL;
+        case CLI_GENERATE:
+            return NULL;
+    }
+
+    if (a->argc > 2) {
+        return CLI_SHOWUSAGE;
+    }
+    if (!kafka_spool_enabled()) {
+        ast_cli(a->fd, "Spool is disabled\n");
+        return CLI_SUCCESS;
+    }
+    kafka_spool_get_stats(&stats);
+    ast_cli(a->fd, "Directory: %s\n", spool_directory);
+    ast_cli(a->fd, "Segments:  %u (%zu of %zu MB)\n", stats.segments, stats.bytes / (1024 * 1024),
+            stats.max_size / (1024 * 1024));
+    ast_cli(a->fd, "Pending:   %lu\n", stats.pending);
+    ast_cli(a->fd, "Spooled:   %lu\n", stats.spooled);
+    ast_cli(a->fd, "Replayed:  %lu\n", stats.replayed);
+    ast_cli(a->fd, "Dropped:   %lu\n", stats.dropped);
+    ast_cli(a->fd, "Replay:    %u message(s) per second\n", replay_rate);
+    down = ao2_callback(clusters, OBJ_MULTIPLE, cluster_is_down, NULL);
+    if (down) {
+        while ((cluster = ao2_iterator_next(down))) {
+            ast_cli(a->fd, "Waiting:   cluster %s is down\n", cluster->name);
+            ao2_ref(cluster, -1);
+        }
+        ao2_iterator_destroy(down);
+    }
+
+    return CLI_SUCCESS;
+}
+
+/*! \brief Consistent copy of the counters of a topic */
+static void topic_metrics_snapshot(struct ast_kafka_topic *topic, struct kafka_metrics *metrics) {
+    memset(metrics, 0, sizeof(*metrics));
+    kafka_metrics_merge(metrics, &topic->metrics);
+}
+
+#define METRICS_HEADER "%-32s %10s %10s %10s %8s %8s %10s %10s %14s %9s %9s %9s %9s\n"
+#define METRICS_ROW "%-32.32s %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %8" PRIu64 " %8d %10" PRIu64 " %10" PRIu64 \
+    " %14" PRIu64 " %9.1f %9.1f %9.1f %9.1f\n"
+
+static void cli_metrics_row(int fd, const char *name, const struct kafka_metrics *metrics, int dropped) {
+    ast_cli(fd, METRICS_ROW, name, metrics->enqueued, metrics->delivered, metrics->records, metrics->failed, dropped,
+            metrics->throttled, metrics->sampled, metrics->bytes,
+            kafka_histogram_percentile(&metrics->latency, 50) / 1000.0,
+            kafka_histogram_percentile(&metrics->latency, 99) / 1000.0,
+            kafka_histogram_percentile(&metrics->latency, 99.9) / 1000.0,
+            metrics->latency.max_us / 1000.0);
+}
+
+static char *handle_cli_kafka_metrics(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
+    struct ao2_iterator it;
+    struct ast_kafka_topic *topic;
+    struct kafka_metrics metrics;
+    struct kafka_metrics total;
+    int total_topics = 0;
+    int i;
+
+    switch (cmd) {
+        case CLI_INIT:
+            e->command = "kafka metrics";
+            e->usage =
+                    "Usage: kafka metrics [<topic>]\n"
+                    "       Displays the message counters and the delivery latency of the topics,\n"
+                    "       from the produce call to the broker acknowledgement.\n";
+            return NULL;
+        case CLI_GENERATE:
+            return NULL;
+    }
+
+    if (a->argc > 3) {
+        return CLI_SHOWUSAGE;
+    }
+    memset(&total, 0, sizeof(total));
+    ast_cli(a->fd, METRICS_HEADER, "Topic", "Enqueued", "Delivered", "Records", "Failed", "Dropped", "Throttled",
+            "Sampled", "Bytes", "p50 ms", "p99 ms", "p99.9 ms", "Max ms");
+    it = ao2_iterator_init(topics, 0);
+    while ((topic = ao2_iterator_next(&it))) {
+        if (a->argc == 3 && strcmp(topic->name, a->argv[2])) {
+            ao2_ref(topic, -1);
+            continue;
+        }
+        topic_metrics_snapshot(topic, &metrics);
+        cli_metrics_row(a->fd, topic->name, &metrics, topic->dropped);
+        kafka_metrics_merge(&total, &metrics);
+        total_topics++;
+        ao2_ref(topic, -1);
+    }
+    ao2_iterator_destroy(&it);
+    if (total_topics > 1) {
+        cli_metrics_row(a->fd, "Total", &total, total_dropped);
+    }
+    if (a->argc == 3) {
+        return CLI_SUCCESS;
+    }
+    for (i = 0; i < DELIVERY_ERRORS; i++) {
+        if (delivery_errors[i]) {
+            ast_cli(a->fd, "Delivery error %s: %" PRIu64 "\n", rd_kafka_err2name(i + RD_KAFKA_RESP_ERR__BEGIN),
+                    delivery_errors[i]);
+        }
+    }
+    return CLI_SUCCESS;
+}
+
+/*! \brief AMI action KafkaMetrics, a KafkaMetrics event per topic, latencies in microseconds */
+static int manager_kafka_metrics(struct mansession *s, const struct message *m) {
+    const char *id = astman_get_header(m, "ActionID");
+    const char *topic_name = astman_get_header(m, "Topic");
+    char id_text[256] = "";
+    struct ao2_iterator it;
+    struct ast_kafka_topic *topic;
+    struct kafka_metrics metrics;
+    int count = 0;
+
+    if (!enabled) {
+        astman_send_error(s, m, "Kafka is not enabled");
+        return 0;
+    }
+    if (!ast_strlen_zero(id)) {
+        snprintf(id_text, sizeof(id_text), "ActionID: %s\r\n", id);
+    }
+    astman_send_listack(s, m, "Kafka metrics will follow", "start");
+    it = ao2_iterator_init(topics, 0);
+    while ((topic = ao2_iterator_next(&it))) {
+        if (ast_strlen_zero(topic_name) || !strcmp(topic->name, topic_name)) {
+            topic_metrics_snapshot(topic, &metrics);
+            astman_append(s,
+                          "Event: KafkaMetrics\r\n"
+                          "%s"
+                          "Topic: %s\r\n"
+                          "Enqueued: %" PRIu64 "\r\n"
+                          "Delivered: %" PRIu64 "\r\n"
+                          "Records: %" PRIu64 "\r\n"
+                          "Failed: %" PRIu64 "\r\n"
+                          "Dropped: %d\r\n"
+                          "Throttled: %" PRIu64 "\r\n"
+                          "Sampled: %" PRIu64 "\r\n"
+                          "Bytes: %" PRIu64 "\r\n"
+                          "LatencyP50: %" PRIu64 "\r\n"
+                          "LatencyP90: %" PRIu64 "\r\n"
+                          "LatencyP99: %" PRIu64 "\r\n"
+                          "LatencyP999: %" PRIu64 "\r\n"
+                          "LatencyMax: %" PRIu64 "\r\n"
+                          "\r\n",
+                          id_text, topic->name, metrics.enqueued, metrics.delivered, metrics.records, metrics.failed, topic->dropped,
+                          metrics.throttled, metrics.sampled, metrics.bytes,
+                          kafka_histogram_percentile(&metrics.latency, 50),
+                          kafka_histogram_percentile(&metrics.latency, 90),
+                          kafka_histogram_percentile(&metrics.latency, 99),
+                          kafka_histogram_percentile(&metrics.latency, 99.9),
+                          metrics.latency.max_us);
+            count++;
+        }
+        ao2_ref(topic, -1);
+    }
+    ao2_iterator_destroy(&it);
+    astman_send_list_complete_start(s, m, "KafkaMetricsComplete", count);
+    astman_send_list_complete_end(s);
+    return 0;
+}
+
+static char *handle_cli_kafka_consumers(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
+    switch (cmd) {
+        case CLI_INIT:
+            e->command = "kafka consumers";
+            e->usage =
+                    "Usage: kafka consumers\n"
+                    "       Displays the Kafka consumers and the messages they handled.\n";
+            return NULL;
+        case CLI_GENERATE:
+            return NULL;
+    }
 
+    if (a->argc > 2) {
+        return CLI_SHOWUSAGE;
+    }
+    kafka_consumer_cli(a->fd);
     return CLI_SUCCESS;
 }
 
 static struct ast_cli_entry cli_stats = AST_CLI_DEFINE(handle_cli_kafka_stats, "Display the Kafka stats");
+static struct ast_cli_entry cli_metrics = AST_CLI_DEFINE(handle_cli_kafka_metrics, "Display the Kafka producer metrics");
+static struct ast_cli_entry cli_spool = AST_CLI_DEFINE(handle_cli_kafka_spool, "Display the Kafka spool state");
 static struct ast_cli_entry cli_produce = AST_CLI_DEFINE(handle_cli_kafka_produce, "Publish the Kafka message");
+static struct ast_cli_entry cli_consumers = AST_CLI_DEFINE(handle_cli_kafka_consumers, "Display the Kafka consumers");
+
+static void cleanup_containers(void) {
+    if (topics) {
+        ao2_callback(topics, OBJ_NODATA, topic_dead_letter_release, NULL);
+    }
+    /* Topic handles must be released before the producer instances of their clusters */
+    ao2_cleanup(topics);
+    topics = NULL;
+    ao2_cleanup(topic_configs);
+    topic_configs = NULL;
+    ast_free(default_dead_letter);
+    default_dead_letter = NULL;
+    ao2_cleanup(default_cluster);
+    default_cluster = NULL;
+    ao2_cleanup(clusters);
+    clusters = NULL;
+}
+
+/*!
+ * \brief Deliver what is left in the queues of a cluster, spool the rest
+ *
+ * The poll threads of the cluster are stopped first, so no rebuild replaces an instance meanwhile.
+ */
+static int cluster_flush(void *obj, void *arg, int flags) {
+    struct kafka_cluster *cluster = obj;
+    rd_kafka_t *rk;
+    unsigned int i;
+
+    for (i = 0; i < cluster->count; i++) {
+        rk = cluster->producers[i].rk;
+        rd_kafka_flush(rk, 10 * 1000 /* wait for max 10 seconds */);
+        if (rd_kafka_outq_len(rk) > 0 && kafka_spool_enabled()) {
+            /* The purged messages fail with __PURGE_QUEUE or __PURGE_INFLIGHT and dr_msg_cb spools them */
+            ast_log(LOG_NOTICE, "Spooling %d undelivered message(s) of cluster %s\n", rd_kafka_outq_len(rk),
+                    cluster->name);
+            rd_kafka_purge(rk, RD_KAFKA_PURGE_F_QUEUE | RD_KAFKA_PURGE_F_INFLIGHT);
+            rd_kafka_flush(rk, PURGE_TIMEOUT_MS);
+        }
+        /* If the output queue is still not empty there is an issue
+         * with producing messages to the cluster. */
+        if (rd_kafka_outq_len(rk) > 0) {
+            ast_log(LOG_NOTICE, "%d message(s) to cluster %s were not delivered\n", rd_kafka_outq_len(rk),
+                    cluster->name);
+        }
+    }
+    return 0;
+}
+
+/*! \brief Drains the clusters replaced by the last reload */
+static pthread_t drain_thread = AST_PTHREADT_NULL;
+
+/*! \brief Deliver what a cluster replaced by a reload still holds, the producing threads use the new one */
+static int cluster_drain(void *obj, void *arg, int flags) {
+    struct kafka_cluster *cluster = obj;
+
+    cluster->retired = 1;
+    stop_poll_thread(cluster, NULL, 0);
+    cluster_flush(cluster, NULL, 0);
+    ast_log(LOG_NOTICE, "Cluster %s replaced by the reload is drained\n", cluster->name);
+    return 0;
+}
+
+static void *do_drain(void *data) {
+    struct ao2_container *retired = data;
+
+    ao2_callback(retired, OBJ_NODATA, cluster_drain, NULL);
+    /* The moved topic handles go before the producer instances, see cluster_destructor() */
+    ao2_ref(retired, -1);
+    return NULL;
+}
+
+static void join_drain_thread(void) {
+    if (drain_thread != AST_PTHREADT_NULL) {
+        pthread_join(drain_thread, NULL);
+        drain_thread = AST_PTHREADT_NULL;
+    }
+}
+
+/*!
+ * \brief Keep a running cluster in the new configuration while its sections are unchanged
+ *
+ * A cluster no longer configured is kept as well, its topics may still be in use.
+ */
+static int cluster_keep(void *obj, void *arg, int flags) {
+    struct kafka_cluster *current = obj;
+    struct kafka_config *config = arg;
+    struct kafka_cluster *cluster;
+
+    cluster = ao2_find(config->clusters, current->name, OBJ_SEARCH_KEY);
+    if (cluster && strcmp(cluster->signature, current->signature)) {
+        ao2_ref(cluster, -1);
+        return 0;
+    }
+    if (!cluster) {
+        ast_log(LOG_WARNING, "Cluster %s is no longer configured, it is kept until the module is loaded again\n",
+                current->name);
+    } else {
+        ao2_unlink(config->clusters, cluster);
+        if (cluster == config->default_cluster) {
+            ao2_ref(config->default_cluster, -1);
+            config->default_cluster = ao2_bump(current);
+        }
+        ao2_ref(cluster, -1);
+    }
+    ao2_link(config->clusters, current);
+    return 0;
+}
+
+/*! \brief Create the producer instances of a cluster new to the configuration, the kept ones have theirs */
+static int cluster_connect_new(void *obj, void *arg, int flags) {
+    struct kafka_cluster *cluster = obj;
+
+    return cluster->producers[0].rk ? 0 : cluster_connect(obj, arg, flags);
+}
+
+/*! \brief Stop the poll threads of a cluster new to a reload which is given up */
+static int cluster_discard_new(void *obj, void *arg, int flags) {
+    struct kafka_cluster *cluster = obj;
+    struct kafka_cluster *current;
+
+    current = ao2_find(clusters, cluster->name, OBJ_SEARCH_KEY);
+    if (current != cluster) {
+        cluster->retired = 1;
+        stop_poll_thread(cluster, NULL, 0);
+    }
+    ao2_cleanup(current);
+    return 0;
+}
+
+/*! \brief Clusters swapped by a reload, the topics to move are in the order of the topics container */
+struct cluster_swap {
+    /*! Clusters of the new configuration */
+    struct ao2_container *clusters;
+    /*! Running clusters replaced by the new ones */
+    struct ao2_container *retired;
+    /*! New cluster of each topic, NULL when the topic stays where it is */
+    struct kafka_cluster **to;
+    /*! Handles of each topic on its new cluster, the old ones once swapped */
+    struct moved_topic **moved;
+    int count;
+    int failed;
+};
+
+/*! \brief Create the handles of a topic on its new cluster, before anything is swapped */
+static int topic_move_prepare(void *obj, void *arg, int flags) {
+    struct ast_kafka_topic *topic = obj;
+    struct cluster_swap *swap = arg;
+    struct kafka_cluster *cluster;
+    struct moved_topic *moved;
+    struct topic_config *tcfg;
+    int i = swap->count++;
+
+    /* Only a reload writes the cluster of a topic, no lock to read it here */
+    cluster = ao2_find(swap->clusters, topic->cluster->name, OBJ_SEARCH_KEY);
+    if (!cluster || cluster == topic->cluster) {
+        ao2_cleanup(cluster);
+        return 0;
+    }
+    moved = ast_calloc(1, sizeof(*moved));
+    if (moved) {
+        tcfg = ao2_find(topic_configs, topic->topic_name, OBJ_SEARCH_KEY);
+        moved->rkt = topic_handles_new(topic, cluster, tcfg);
+        ao2_cleanup(tcfg);
+    }
+    if (!moved || !moved->rkt) {
+        ast_free(moved);
+        ao2_ref(cluster, -1);
+        swap->failed = 1;
+        return CMP_STOP;
+    }
+    moved->topic = ao2_bump(topic);
+    swap->to[i] = cluster;
+    swap->moved[i] = moved;
+    return 0;
+}
+
+/*!
+ * \brief Move a topic to its new cluster
+ *
+ * The producing threads wait for the pointer swap only. The old handles are
+ * left to the old cluster, they go when the drain thread is done with it.
+ */
+static int topic_move(void *obj, void *arg, int flags) {
+    struct ast_kafka_topic *topic = obj;
+    struct cluster_swap *swap = arg;
+    struct moved_topic *moved;
+    struct kafka_cluster *old;
+    rd_kafka_topic_t **rkt;
+    int i = swap->count++;
+
+    moved = swap->moved[i];
+    if (!moved) {
+        return 0;
+    }
+    ast_rwlock_wrlock(&topic->cluster_lock);
+    old = topic->cluster;
+    rkt = topic->rkt;
+    topic->cluster = swap->to[i];
+    topic->rkt = moved->rkt;
+    ast_rwlock_unlock(&topic->cluster_lock);
+
+    moved->rkt = rkt;
+    AST_LIST_INSERT_TAIL(&old->moved, moved, list);
+    /* The topic reference, the clusters container holds the old cluster until it is retired */
+    ao2_ref(old, -1);
+    swap->to[i] = NULL;
+    swap->moved[i] = NULL;
+    return 0;
+}
+
+/*! \brief The rate limits and dead letter topic of a registered topic change in place, the bucket is kept */
+static int topic_options_reload(void *obj, void *arg, int flags) {
+    struct ast_kafka_topic *topic = obj;
+    struct topic_config *tcfg;
+
+    tcfg = ao2_find(topic_configs, topic->topic_name, OBJ_SEARCH_KEY);
+    topic_options_apply(topic, tcfg);
+    ao2_cleanup(tcfg);
+    return 0;
+}
+
+/*! \brief Release what is left of the topic moves, all of them when the reload is given up */
+static void cluster_swap_cleanup(struct cluster_swap *swap, int total) {
+    int i;
+
+    for (i = 0; swap->to && swap->moved && i < total; i++) {
+        if (swap->moved[i]) {
+            topic_handles_destroy(swap->moved[i]->rkt, swap->to[i]->count);
+            ao2_ref(swap->moved[i]->topic, -1);
+            ast_free(swap->moved[i]);
+        }
+        ao2_cleanup(swap->to[i]);
+    }
+    ast_free(swap->moved);
+    ast_free(swap->to);
+    ao2_cleanup(swap->retired);
+}
+
+/*! \brief Move a running cluster which is not part of the new configuration to the retired ones */
+static int cluster_retire(void *obj, void *arg, int flags) {
+    struct kafka_cluster *current = obj;
+    struct cluster_swap *swap = arg;
+    struct kafka_cluster *cluster;
+
+    cluster = ao2_find(swap->clusters, current->name, OBJ_SEARCH_KEY);
+    ao2_cleanup(cluster);
+    if (cluster == current) {
+        return 0;
+    }
+    ao2_link(swap->retired, current);
+    return CMP_MATCH;
+}
+
+static int cluster_link_new(void *obj, void *arg, int flags) {
+    struct kafka_cluster *cluster = obj;
+    struct kafka_cluster *current;
+
+    current = ao2_find(clusters, cluster->name, OBJ_SEARCH_KEY);
+    if (!current) {
+        ao2_link(clusters, cluster);
+    }
+    ao2_cleanup(current);
+    return 0;
+}
+
+/*!
+ * \brief Swap in the clusters and topic options of the new configuration
+ *
+ * The clusters whose sections changed are built and started next to the
+ * running ones, then their topics are moved over, one pointer swap each.
+ * The replaced clusters are flushed by the drain thread, so neither the
+ * producing threads nor the reload wait for the old brokers.
+ */
+static int reload_module(void) {
+    struct kafka_config config = {0};
+    struct cluster_swap swap = {0};
+    struct ao2_container *old_topic_configs;
+    struct overflow_config old_overflow;
+    struct kafka_limit_config old_limit;
+    char *old_dead_letter;
+    enum partitioner old_partitioner;
+    struct kafka_cluster *old_default;
+    int total = 0;
+    int res;
+
+    res = load_config(&config, 1);
+    if (res) {
+        if (res < 0) {
+            ast_log(LOG_ERROR, "Keeping the running configuration of %s\n", name);
+        }
+        return res < 0 ? AST_MODULE_LOAD_DECLINE : AST_MODULE_LOAD_SUCCESS;
+    }
+    /* One drain thread at a time, the clusters replaced by the previous reload are drained first */
+    join_drain_thread();
+    ao2_callback(clusters, OBJ_NODATA, cluster_keep, &config);
+    res = 0;
+    ao2_callback(config.clusters, OBJ_NODATA, cluster_connect_new, &res);
+    if (!res) {
+        ao2_callback(config.clusters, OBJ_NODATA, start_poll_thread, &res);
+    }
+    swap.clusters = config.clusters;
+    swap.retired = ao2_container_alloc_list(AO2_ALLOC_OPT_LOCK_NOLOCK, 0, NULL, NULL);
+    if (!res && swap.retired) {
+        /* No topic is registered meanwhile, topic_alloc() reads the options swapped here */
+        ao2_lock(topics);
+        old_topic_configs = topic_configs;
+        old_overflow = default_overflow;
+        old_partitioner = default_partitioner;
+        old_limit = default_limit;
+        old_dead_letter = default_dead_letter;
+        topic_configs = config.topic_configs;
+        default_overflow = config.overflow;
+        default_partitioner = config.partitioner;
+        default_limit = config.limit;
+        default_dead_letter = config.dead_letter;
+
+        total = ao2_container_count(topics);
+        swap.to = ast_calloc(MAX(total, 1), sizeof(*swap.to));
+        swap.moved = ast_calloc(MAX(total, 1), sizeof(*swap.moved));
+        if (swap.to && swap.moved) {
+            ao2_callback(topics, OBJ_NODATA | OBJ_NOLOCK, topic_move_prepare, &swap);
+        }
+        if (!swap.to || !swap.moved || swap.failed) {
+            topic_configs = old_topic_configs;
+            default_overflow = old_overflow;
+            default_partitioner = old_partitioner;
+            default_limit = old_limit;
+            default_dead_letter = old_dead_letter;
+            res = -1;
+        } else {
+            swap.count = 0;
+            ao2_callback(topics, OBJ_NODATA | OBJ_NOLOCK, topic_move, &swap);
+            ao2_callback(topics, OBJ_NODATA | OBJ_NOLOCK, topic_options_reload, NULL);
+            ao2_callback(clusters, OBJ_NODATA | OBJ_MULTIPLE | OBJ_UNLINK, cluster_retire, &swap);
+            ao2_callback(config.clusters, OBJ_NODATA, cluster_link_new, NULL);
+            old_default = default_cluster;
+            default_cluster = config.default_cluster;
+            config.default_cluster = old_default;
+            config.topic_configs = old_topic_configs;
+            config.dead_letter = old_dead_letter;
+        }
+        ao2_unlock(topics);
+    }
+    if (res || !swap.retired) {
+        ao2_callback(config.clusters, OBJ_NODATA, cluster_discard_new, NULL);
+        cluster_swap_cleanup(&swap, total);
+        kafka_config_cleanup(&config);
+        ast_log(LOG_ERROR, "Keeping the running configuration of %s\n", name);
+        return AST_MODULE_LOAD_DECLINE;
+    }
+
+    ast_log(LOG_NOTICE, "Reloaded %s, %d cluster(s) replaced\n", name, ao2_container_count(swap.retired));
+    if (ao2_container_count(swap.retired)
+        && ast_pthread_create_background(&drain_thread, NULL, do_drain, ao2_bump(swap.retired))) {
+        ast_log(LOG_WARNING, "Unable to start the drain thread, draining the replaced clusters now\n");
+        drain_thread = AST_PTHREADT_NULL;
+        do_drain(swap.retired);
+    }
+    cluster_swap_cleanup(&swap, total);
+    /* The old topic options and default cluster reference */
+    kafka_config_cleanup(&config);
+    preload();
+    dead_letters_resolve();
+    /* What was counted under the old configuration */
+    ao2_callback(topics, OBJ_NODATA, topic_failures_flush, NULL);
+    return AST_MODULE_LOAD_SUCCESS;
+}
 
 static int load_module(void) {
-    if (load_config()) {
+    struct kafka_config config = {0};
+    int res = 0;
+
+    topics = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, TOPIC_BUCKETS,
+                                      ast_kafka_topic_hash_fn, NULL, ast_kafka_topic_cmp_fn);
+    if (!topics || kafka_consumer_init()) {
+        cleanup_containers();
+        kafka_consumer_cleanup();
+        return AST_MODULE_LOAD_DECLINE;
+    }
+    if (load_config(&config, 0)) {
+        cleanup_containers();
+        return AST_MODULE_LOAD_DECLINE;
+    }
+    clusters = config.clusters;
+    default_cluster = config.default_cluster;
+    topic_configs = config.topic_configs;
+    default_overflow = config.overflow;
+    default_partitioner = config.partitioner;
+    default_limit = config.limit;
+    default_dead_letter = config.dead_letter;
+    config.dead_letter = NULL;
+    /* Before the first topic, the overflow policies check for it */
+    if (open_spool()) {
+        kafka_consumer_cleanup();
+        cleanup_containers();
+        return AST_MODULE_LOAD_DECLINE;
+    }
+    ao2_callback(clusters, OBJ_NODATA, cluster_connect, &res);
+    if (res) {
+        kafka_consumer_cleanup();
+        kafka_spool_close();
+        cleanup_containers();
+        return AST_MODULE_LOAD_DECLINE;
+    }
+    ast_cond_init(&room_cond, NULL);
+    preload();
+    if (start_poll_threads() || (kafka_spool_enabled() && start_replay_thread()) || kafka_batch_start()
+        || kafka_consumer_start()) {
+        /* The consumers first, the dialplan they run may produce */
+        kafka_consumer_cleanup();
+        kafka_batch_stop();
+        stop_replay_thread();
+        stop_poll_threads();
+        kafka_spool_close();
+        cleanup_containers();
+        ast_cond_destroy(&room_cond);
         return AST_MODULE_LOAD_DECLINE;
     }
-    kafka_connect();
-    start_sched();
     ast_cli_register(&cli_stats);
     ast_cli_register(&cli_produce);
+    ast_cli_register(&cli_spool);
+    ast_cli_register(&cli_metrics);
+    ast_cli_register(&cli_consumers);
+    ast_manager_register("KafkaMetrics", EVENT_FLAG_SYSTEM | EVENT_FLAG_REPORTING, manager_kafka_metrics,
+                         "Show the Kafka producer metrics");
     return AST_MODULE_LOAD_SUCCESS;
 }
 
 static int unload_module(void) {
+    /* Before the topics go away */
+    ast_cli_unregister(&cli_stats);
+    ast_cli_unregister(&cli_produce);
+    ast_cli_unregister(&cli_spool);
+    ast_cli_unregister(&cli_metrics);
+    ast_cli_unregister(&cli_consumers);
+    ast_manager_unregister("KafkaMetrics");
 
+    /* The dialplan of the messages may still produce */
+    kafka_consumer_cleanup();
+    kafka_batch_stop();
+    stop_replay_thread();
+    /* Whatever the drop_oldest rings still hold and fits in the queue */
+    ao2_callback(topics, OBJ_NODATA, ring_drain, NULL);
+    join_drain_thread();
+    /* No rebuild may replace an instance under the flush, which serves the delivery reports itself */
+    stop_poll_threads();
     ast_log(LOG_NOTICE, "Flushing final messages...\n");
-    rd_kafka_flush(handle, 10 * 1000 /* wait for max 10 seconds */);
+    ao2_callback(clusters, OBJ_NODATA, cluster_flush, NULL);
     ast_log(LOG_NOTICE, "...done\n");
-    /* If the output queue is still not empty there is an issue
-     * with producing messages to the clusters. */
-    if (rd_kafka_outq_len(handle) > 0)
-        ast_log(LOG_NOTICE, "%d message(s) were not delivered\n", rd_kafka_outq_len(handle));
 
-    stop_sched();
+    ao2_callback(topics, OBJ_NODATA, topic_failures_flush, NULL);
+    kafka_spool_close();
     ast_free(kafka_brokers);
-    /* Destroy the producer instance */
-    rd_kafka_destroy(handle);
-    ast_cli_unregister(&cli_stats);
-    ast_cli_unregister(&cli_produce);
+    kafka_brokers = NULL;
+    ast_free(preload_topics);
+    preload_topics = NULL;
+    ast_free(spool_directory);
+    /* Destroys the producer instances after the topic handles */
+    cleanup_containers();
+    ast_cond_destroy(&room_cond);
     return 0;
 }
 
@@ -304,6 +3358,7 @@ AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_GLOBAL_SYMBOLS | AST_MODFLAG_LOAD_
     .support_level = AST_MODULE_SUPPORT_EXTENDED,
     .load = load_module,
     .unload = unload_module,
+    .reload = reload_module,
     .load_pri = AST_MODPRI_APP_DEPEND,
     .requires = "",
 );
\ No newline at end of file
@@ -5,6 +5,420 @@
 #ifndef ASTERISK_KAFKA_RES_KAFKA_H
 #define ASTERISK_KAFKA_RES_KAFKA_H
 
+#include <stddef.h>
+
+/*! \brief librdkafka makes its own copy of the payload, the caller keeps ownership */
+#define AST_KAFKA_F_COPY 0
+/*! \brief Ownership of an ast_malloc()ed payload is passed to res_kafka, even on failure */
+#define AST_KAFKA_F_FREE (1 << 0)
+
+/*! \brief Cluster of the [general] and [producer] sections of res_kafka.conf */
+#define AST_KAFKA_DEFAULT_CLUSTER "default"
+
+/*! \brief Cached topic handle, an ao2 object */
+struct ast_kafka_topic;
+
+/*!
+ * \brief Find or register a topic
+ *
+ * The librdkafka topic handles are created once and kept in the res_kafka
+ * registry, so producing through them needs no lookup by name.
+ *
+ * \param topic_name Topic of the default cluster, or <cluster>:<topic>
+ *
+ * \return ao2 reference, release with ao2_cleanup(), NULL on failure
+ */
+struct ast_kafka_topic *ast_kafka_topic_get(const char *topic_name);
+
+/*!
+ * \brief Find or register a topic of a named cluster
+ *
+ * \param cluster_name Name of a [cluster:<name>] section, NULL for the default cluster
+ */
+struct ast_kafka_topic *ast_kafka_cluster_topic_get(const char *cluster_name, const char *topic_name);
+
+/*! \brief Name of a registered topic, <cluster>:<topic> outside of the default cluster */
+const char *ast_kafka_topic_name(const struct ast_kafka_topic *topic);
+
+/*!
+ * \brief Produce a message of known length to a registered topic
+ *
+ * Same as ast_kafka_produce_buf() without the topic lookup.
+ */
+int ast_kafka_topic_produce(struct ast_kafka_topic *topic, const void *key, size_t key_len, void *payload, size_t len, int flags);
+
+/*! \brief Priority class of a producing module, the lower ones give way during floods */
+enum ast_kafka_priority {
+    /*! Never throttled nor sampled, billing records */
+    AST_KAFKA_PRIORITY_CRITICAL = 0,
+    /*! Subject to the rate limit and sampling of the topic, e.g. CEL */
+    AST_KAFKA_PRIORITY_NORMAL,
+    /*! Throttled first, it gets half of the burst of the topic only, e.g. dialplan messages */
+    AST_KAFKA_PRIORITY_LOW,
+};
+
+/*!
+ * \brief Apply the rate_limit and sample options of a topic to a message before it is built
+ *
+ * Called by the producing modules ahead of the encoding, so a message which
+ * is dropped costs no more than this call. The drops are counted in the
+ * throttled and sampled metrics of the topic.
+ *
+ * \param sample_key Key the sample is taken by, the linkedid keeps or drops
+ *        the messages of a call together. NULL to sample evenly.
+ *
+ * \retval 0 produce the message
+ * \retval -1 the message is dropped
+ */
+int ast_kafka_topic_admit(struct ast_kafka_topic *topic, const char *sample_key, enum ast_kafka_priority priority);
+
+/*! \brief Most headers of a message the backends and KafkaProduce() add */
+#define AST_KAFKA_MAX_HEADERS 16
+
+/*! \brief A Kafka message header, consumers can route on it without parsing the payload */
+struct ast_kafka_header {
+    const char *name;
+    /*! Not required to be NUL terminated, NULL for a header without a value */
+    const void *value;
+    size_t len;
+};
+
+/*!
+ * \brief Produce a message with headers to a registered topic
+ *
+ * The headers are copied, they stay with the message in the drop_oldest
+ * ring and in the spool.
+ */
+int ast_kafka_topic_produce_headers(struct ast_kafka_topic *topic, const void *key, size_t key_len,
+                                    const struct ast_kafka_header *headers, size_t header_count,
+                                    void *payload, size_t len, int flags);
+
+/*! \brief Header with the number of records of a batched message, in decimal */
+#define AST_KAFKA_RECORDS_HEADER "records"
+
+/*! \brief When the records of a batch are produced as one message */
+struct ast_kafka_batch_config {
+    /*! Records of a message, 0 turns batching off */
+    unsigned int records;
+    /*! Bytes of a message, a batch is produced before it would grow larger */
+    size_t bytes;
+    /*! How long the first record of a batch waits for the others */
+    unsigned int linger_ms;
+    /*!
+     * Batches by a hash of the record key, the message key of a batch is its
+     * number, so the records of a key stay in order on one partition.
+     * 0 or 1 for a single batch without a key.
+     */
+    unsigned int slots;
+    /*! Written between the records, '\n' for JSONEachRow, '\0' for none as the binary formats need */
+    char separator;
+};
+
+struct ast_kafka_batch;
+
+/*! \brief Defaults of the batch options, batching is off */
+void ast_kafka_batch_config_init(struct ast_kafka_batch_config *config);
+
+/*!
+ * \brief Set a batch_records, batch_bytes, batch_linger_ms or batch_slots option of a backend
+ *
+ * \retval 0 the option was set
+ * \retval 1 not a batch option
+ * \retval -1 invalid value
+ */
+int ast_kafka_batch_config_set(struct ast_kafka_batch_config *config, const char *name, const char *value);
+
+/*!
+ * \brief Batch the records of a backend into multi-record messages of a topic
+ *
+ * \param headers Headers of every message, they have to stay valid until the batch is destroyed
+ */
+struct ast_kafka_batch *ast_kafka_batch_create(struct ast_kafka_topic *topic,
+                                               const struct ast_kafka_batch_config *config,
+                                               const struct ast_kafka_header *headers, size_t header_count);
+
+/*!
+ * \brief Add a record, the batch is produced once it is full
+ *
+ * The record is copied. Records of the same key go to the same batch.
+ *
+ * \retval -1 the record could not be added and is lost
+ */
+int ast_kafka_batch_add(struct ast_kafka_batch *batch, const void *key, size_t key_len, const void *record,
+                        size_t len);
+
+/*! \brief Produce what the batch holds and destroy it */
+void ast_kafka_batch_destroy(struct ast_kafka_batch *batch);
+
+/*!
+ * \brief Produce a message of known length
+ *
+ * \param topic_name Topic name
+ * \param key Optional message key, may be NULL
+ * \param key_len Length of the key
+ * \param payload Message value, not required to be NUL terminated
+ * \param len Length of the payload
+ * \param flags AST_KAFKA_F_COPY or AST_KAFKA_F_FREE
+ *
+ * With AST_KAFKA_F_FREE the buffer (e.g. the result of ast_json_dump_string())
+ * is handed to librdkafka as is and released after delivery, so no copy is made.
+ *
+ * \retval 0 message enqueued, or kept by the overflow policy of the topic when the queue is full
+ * \retval -1 failure or dropped
+ */
+int ast_kafka_produce_buf(const char *topic_name, const void *key, size_t key_len, void *payload, size_t len, int flags);
+
+/*! \brief Produce a NUL terminated string, the buffer is copied */
 int ast_kafka_produce(const char *topic, const char *buffer);
 
+/*! \brief State of the librdkafka queues of all producers */
+struct ast_kafka_queue_info {
+    /*! Messages waiting for delivery */
+    int depth;
+    /*! Capacity of the queues, queue.buffering.max.messages of each producer */
+    int max;
+    /*! Messages dropped because the queue was full, since load */
+    unsigned int dropped;
+};
+
+/*! \brief Current queue depth, e.g. for call admission in the dialplan */
+void ast_kafka_queue_get_info(struct ast_kafka_queue_info *info);
+
+/*! \brief Message received by a [consumer:<name>] section of res_kafka.conf */
+struct ast_kafka_message {
+    /*! Name of the consumer */
+    const char *consumer;
+    const char *topic;
+    int partition;
+    long long offset;
+    /*! Message key, NULL when the message has none */
+    const void *key;
+    size_t key_len;
+    /*! Message value, not NUL terminated */
+    const void *payload;
+    size_t len;
+};
+
+/*!
+ * \brief Handler of the messages of the consumers with handler=<name>
+ *
+ * Called on the consume thread of the consumer, one message at a time and in
+ * order within a partition. The message is only valid during the call. The
+ * offset is committed once the handler returns, whatever the result, so a
+ * message which can never be handled does not hold up its partition.
+ *
+ * \retval 0 handled
+ * \retval -1 failed, the message is logged and counted
+ */
+typedef int (*ast_kafka_handler_fn)(const struct ast_kafka_message *message, void *data);
+
+/*!
+ * \brief Register a message handler
+ *
+ * Consumers wait with their messages uncommitted until their handler is registered.
+ *
+ * \retval -1 a handler of that name is registered already
+ */
+int ast_kafka_handler_register(const char *name, ast_kafka_handler_fn handler, void *data);
+
+/*! \brief Unregister a message handler, a call in progress is waited for */
+void ast_kafka_handler_unregister(const char *name);
+
+struct ast_str;
+struct ast_json;
+struct timeval;
+
+/*! \brief Default ast_strftime() format of timestamps */
+#define AST_KAFKA_DEFAULT_DATEFORMAT "%F %T"
+/*! \brief Buffer size for a formatted timestamp */
+#define AST_KAFKA_TIME_LEN 64
+
+/*! \brief Compiled timestamp format */
+struct ast_kafka_timefmt;
+
+/*! \brief Write an unset (zero) timestamp as null rather than formatting it as 1970-01-01 */
+#define AST_KAFKA_TIMEFMT_UNSET_NULL (1 << 0)
+
+/*!
+ * \brief Compile a timestamp format
+ *
+ * \param format ast_strftime() format or one of the built-in modes, which
+ *        skip the timezone database: 'epoch' (seconds), 'epoch_ms'
+ *        (milliseconds) and 'iso8601' (UTC with microseconds)
+ * \param zone Timezone for ast_strftime() formats, NULL for the local one
+ * \param flags AST_KAFKA_TIMEFMT_UNSET_NULL or 0
+ *
+ * \return the format, free with ast_kafka_timefmt_destroy()
+ */
+struct ast_kafka_timefmt *ast_kafka_timefmt_create(const char *format, const char *zone, unsigned int flags);
+
+void ast_kafka_timefmt_destroy(struct ast_kafka_timefmt *fmt);
+
+/*! \brief Whether the format produces a number (epoch modes) rather than a string */
+int ast_kafka_timefmt_is_numeric(const struct ast_kafka_timefmt *fmt);
+
+/*!
+ * \brief Format a timestamp
+ *
+ * The formatted second is cached per thread and format, so formatting
+ * several timestamps of the same second costs one ast_localtime() call.
+ *
+ * \return length of the result
+ * \retval -1 the timestamp is unset (zero), the format is not numeric and has AST_KAFKA_TIMEFMT_UNSET_NULL
+ */
+int ast_kafka_timefmt_format(const struct ast_kafka_timefmt *fmt, const struct timeval *tv, char *buf, size_t len);
+
+/*! \brief Formatted timestamp as an ast_json string, integer or null, see ast_kafka_timefmt_format() */
+struct ast_json *ast_kafka_timefmt_json(const struct ast_kafka_timefmt *fmt, const struct timeval *tv);
+
+/*!
+ * \brief Append a quoted and escaped JSON string
+ *
+ * The output is byte-for-byte the same as ast_json_dump_string() produces.
+ *
+ * \retval 0 success
+ * \retval -1 value is not valid UTF-8, nothing is appended
+ */
+int ast_kafka_json_append_string(struct ast_str **buf, const char *value);
+
+/*!
+ * \brief Append an escaped JSON string without the quotes, e.g. inside a string literal of a template
+ *
+ * \retval 0 success
+ * \retval -1 value is not valid UTF-8, nothing is appended
+ */
+int ast_kafka_json_append_escaped(struct ast_str **buf, const char *value);
+
+/*!
+ * \brief Append a string member to the JSON object being written to \a buf
+ *
+ * A separator is added unless the buffer ends with the opening brace.
+ * Invalid UTF-8 values leave the member out, as ast_json does.
+ */
+int ast_kafka_json_add_string(struct ast_str **buf, const char *name, const char *value);
+
+/*! \brief Append an integer member to the JSON object being written to \a buf */
+void ast_kafka_json_add_integer(struct ast_str **buf, const char *name, long long value);
+
+/*! \brief Append a timestamp member, null where ast_kafka_timefmt_format() fails */
+void ast_kafka_json_add_time(struct ast_str **buf, const char *name, const struct ast_kafka_timefmt *fmt, const struct timeval *tv);
+
+/*! \brief Member types of a record described by struct ast_kafka_field */
+enum ast_kafka_field_type {
+    /*! char array, String */
+    AST_KAFKA_FIELD_CHARS,
+    /*! const char pointer, String, NULL is written as an empty string */
+    AST_KAFKA_FIELD_STRING,
+    /*! long, Int32 */
+    AST_KAFKA_FIELD_LONG,
+    /*! int, Int32 */
+    AST_KAFKA_FIELD_INT,
+    /*! unsigned int, UInt32 */
+    AST_KAFKA_FIELD_UINT,
+    /*! struct timeval, DateTime */
+    AST_KAFKA_FIELD_TIME,
+    /*! struct varshead, String, the value of the variable of the field or an empty string */
+    AST_KAFKA_FIELD_VARIABLE,
+};
+
+/*! \brief Column of a record, a record type is described by a table of these */
+struct ast_kafka_field {
+    /*! Column name */
+    const char *name;
+    enum ast_kafka_field_type type;
+    /*! Offset of the member in the record structure */
+    size_t offset;
+    /*! AST_KAFKA_FIELD_VARIABLE: name of the variable */
+    const char *variable;
+};
+
+#define AST_KAFKA_FIELD(record_type, member, field_type) { .name = #member, .type = field_type, .offset = offsetof(record_type, member) }
+
+/*!
+ * \brief Find a column by name
+ *
+ * Case and underscores are ignored, so 'linkedid' finds the CEL linked_id column.
+ */
+const struct ast_kafka_field *ast_kafka_field_find(const struct ast_kafka_field *fields, size_t count, const char *name);
+
+/*!
+ * \brief Value of a column as text, e.g. for a message key
+ *
+ * String columns are returned in place, numbers are written to \a buf.
+ * Timestamps give the seconds since the epoch.
+ */
+const char *ast_kafka_field_text(const struct ast_kafka_field *field, const void *record, char *buf, size_t size);
+
+/*!
+ * \brief Parse a fields option of a backend into the columns to write, in order
+ *
+ * \param list Comma separated [<name>=]<source>, the source being a column of
+ *        \a fields, var:<name> for a variable of the record or * for all the
+ *        columns. The column is named after the source unless given.
+ * \param varshead_offset Offset of the struct varshead of the record
+ * \param result Set to the columns, release them with ast_kafka_fields_free()
+ *
+ * \return number of columns, -1 on an unknown column
+ */
+int ast_kafka_fields_parse(const char *list, const struct ast_kafka_field *fields, size_t count,
+                           size_t varshead_offset, struct ast_kafka_field **result);
+
+void ast_kafka_fields_free(struct ast_kafka_field *fields, size_t count);
+
+/*! \brief Header of the records of a backend, see ast_kafka_header_specs_parse() */
+struct ast_kafka_header_spec {
+    char *name;
+    /*! Column of the record */
+    const struct ast_kafka_field *field;
+    /*! var:<name>, looked up by the backend */
+    const char *variable;
+    /*! Same value for every record, e.g. the system name */
+    const char *value;
+};
+
+/*!
+ * \brief Parse a headers option of a backend
+ *
+ * \param list Comma separated [<header>=]<source>, the source being a column,
+ *        var:<name> for a variable or systemname. The header is named after
+ *        the source unless given.
+ * \param specs Array of AST_KAFKA_MAX_HEADERS specs
+ *
+ * \return number of specs, -1 on an unknown column or too many headers
+ */
+int ast_kafka_header_specs_parse(const char *list, const struct ast_kafka_field *fields, size_t count,
+                                 struct ast_kafka_header_spec *specs);
+
+void ast_kafka_header_specs_free(struct ast_kafka_header_spec *specs, int count);
+
+/*! \brief Message formats of the CDR and CEL backends */
+enum ast_kafka_format {
+    /*! JSON object per record, ClickHouse JSONEachRow */
+    AST_KAFKA_FORMAT_JSON,
+    /*! ClickHouse RowBinary */
+    AST_KAFKA_FORMAT_ROWBINARY,
+    /*! MessagePack values in column order, ClickHouse MsgPack */
+    AST_KAFKA_FORMAT_MSGPACK,
+    /*! Length delimited protobuf message, ClickHouse Protobuf */
+    AST_KAFKA_FORMAT_PROTOBUF,
+};
+
+/*! \return enum ast_kafka_format value, -1 for an unknown name */
+int ast_kafka_format_from_str(const char *name);
+
+const char *ast_kafka_format_name(enum ast_kafka_format format);
+
+/*!
+ * \brief Append a record to \a buf in the given format
+ *
+ * \param timefmt Timestamp format of the JSON format, binary formats
+ *        always write seconds since the epoch (0 when unset)
+ */
+int ast_kafka_encode_record(struct ast_str **buf, enum ast_kafka_format format, const struct ast_kafka_field *fields,
+                            size_t count, const void *record, const struct ast_kafka_timefmt *timefmt);
+
+/*! \brief Build the record as an ast_json object, same members as the JSON format */
+struct ast_json *ast_kafka_record_json(const struct ast_kafka_field *fields, size_t count,
+                                       const void *record, const struct ast_kafka_timefmt *timefmt);
+
 #endif //ASTERISK_KAFKA_RES_KAFKA_H
@@ -0,0 +1,804 @@
+/*! \file
+ *
+ * \brief Kafka Stasis event bridge
+ *
+ * Every section of res_kafka_stasis.conf named after a Stasis topic
+ * subscribes to it. The subscription callback only checks the message type,
+ * samples and puts a reference to the message in a bounded ring, so a busy
+ * topic never holds up the Stasis dispatch. The serializer thread takes the
+ * messages from the ring in batches, converts them to JSON (the ARI
+ * representation, the AMI event for types which have none), applies the
+ * channel filter and produces them.
+ *
+ * \author Max Nesterov <braams@braams.ru>
+ *
+ */
+
+#define AST_MODULE_SELF_SYM __internal_res_kafka_stasis_self
+#define AST_MODULE "res_kafka_stasis"
+
+#include <asterisk.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <regex.h>
+
+#include <asterisk/module.h>
+#include <asterisk/app.h>
+#include <asterisk/cli.h>
+#include <asterisk/config.h>
+#include <asterisk/devicestate.h>
+#include <asterisk/json.h>
+#include <asterisk/linkedlists.h>
+#include <asterisk/lock.h>
+#include <asterisk/manager.h>
+#include <asterisk/security_events.h>
+#include <asterisk/stasis.h>
+#include <asterisk/stasis_bridges.h>
+#include <asterisk/stasis_channels.h>
+#include <asterisk/stasis_endpoints.h>
+#include <asterisk/stasis_system.h>
+#include <asterisk/strings.h>
+#include <asterisk/threadstorage.h>
+#include <asterisk/utils.h>
+#include "res_kafka.h"
+
+#define DESCRIPTION "Kafka Stasis Event Bridge"
+#define DEFAULT_KAFKA_TOPIC "asterisk_events"
+#define DEFAULT_QUEUE_SIZE 10000
+#define DEFAULT_BATCH_SIZE 500
+#define BATCH_INTERVAL_MS 100
+#define EVENT_BUFFER_INIT_SIZE 2048
+#define KEY_LEN 256
+
+static const char conf_file[] = "res_kafka_stasis.conf";
+
+/*! \brief Stasis topics a section can be named after */
+static const struct stasis_source {
+    const char *name;
+    struct stasis_topic *(*topic)(void);
+} sources[] = {
+    { "channels", ast_channel_topic_all },
+    { "bridges", ast_bridge_topic_all },
+    { "queues", ast_queue_topic_all },
+    { "devices", ast_device_state_topic_all },
+    { "endpoints", ast_endpoint_topic_all },
+    { "system", ast_system_topic },
+    { "security", ast_security_topic },
+};
+
+/*! \brief Message type named in the types, exclude_types or sample options */
+struct type_rule {
+    /*! Resolved on the first message of the type */
+    struct stasis_message_type *type;
+    /*! Listed in types */
+    int listed;
+    int excluded;
+    /*! Produce 1 of every sample messages of the type, 0 to use the section rate */
+    unsigned int sample;
+    unsigned int counter;
+    AST_LIST_ENTRY(type_rule) list;
+    char name[0];
+};
+
+struct kafka_stasis_stats {
+    uint64_t received;
+    /*! Not in types or in exclude_types */
+    uint64_t filtered;
+    /*! Skipped by sampling */
+    uint64_t sampled;
+    /*! Ring was full */
+    uint64_t dropped;
+    /*! Neither ARI nor AMI representation, or the channel did not match */
+    uint64_t skipped;
+    uint64_t produced;
+};
+
+/*! \brief A [<stasis topic>] section */
+struct kafka_stasis_section {
+    const struct stasis_source *source;
+    struct stasis_subscription *sub;
+    struct ast_kafka_topic *topic;
+    char *topic_name;
+    /*! Dotted path of the member of the event which is the message key */
+    char *key;
+    /*! Only events of the channels matching it when set */
+    regex_t channel;
+    int has_channel;
+    /*! Some type is listed in types, the others are filtered */
+    int whitelist;
+    /*! Section wide sampling of the types without a rate of their own */
+    unsigned int sample;
+    unsigned int counter;
+    AST_LIST_HEAD_NOLOCK(, type_rule) rules;
+    struct kafka_stasis_stats stats;
+    AST_LIST_ENTRY(kafka_stasis_section) list;
+};
+
+/*! \brief Message waiting in the ring for the serializer */
+struct ring_entry {
+    struct stasis_message *message;
+    struct kafka_stasis_section *section;
+};
+
+static int enabled;
+static char *kafka_topic;
+/*! \brief Cluster of the topics, NULL for the default one */
+static char *cluster_name;
+static char *dateformat;
+static char *zone;
+static struct ast_kafka_timefmt *timefmt;
+static unsigned int queue_size;
+static unsigned int batch_size;
+
+static AST_LIST_HEAD_NOLOCK_STATIC(sections, kafka_stasis_section);
+
+AST_MUTEX_DEFINE_STATIC(ring_lock);
+static ast_cond_t ring_cond;
+static struct ring_entry *ring;
+static unsigned int ring_head;
+static unsigned int ring_count;
+static pthread_t serializer_thread = AST_PTHREADT_NULL;
+static int serializer_running;
+
+AST_THREADSTORAGE(event_buf);
+
+#define STAT_ADD(section, counter) __atomic_fetch_add(&(section)->stats.counter, 1, __ATOMIC_RELAXED)
+#define STAT_GET(section, counter) __atomic_load_n(&(section)->stats.counter, __ATOMIC_RELAXED)
+
+/*!
+ * \brief Whether a message of the type is to be produced
+ *
+ * Subscription callbacks of a section are serialized, so the counters need no lock.
+ */
+static int section_accepts(struct kafka_stasis_section *section, struct stasis_message_type *type) {
+    struct type_rule *rule;
+    const char *type_name = NULL;
+    unsigned int sample = section->sample;
+    unsigned int *counter = &section->counter;
+
+    AST_LIST_TRAVERSE(&section->rules, rule, list) {
+        if (!rule->type) {
+            if (!type_name) {
+                type_name = stasis_message_type_name(type);
+            }
+            if (strcasecmp(rule->name, type_name)) {
+                continue;
+            }
+            rule->type = type;
+        } else if (rule->type != type) {
+            continue;
+        }
+        break;
+    }
+    if (rule ? rule->excluded || (section->whitelist && !rule->listed) : section->whitelist) {
+        STAT_ADD(section, filtered);
+        return 0;
+    }
+    if (rule && rule->sample) {
+        sample = rule->sample;
+        counter = &rule->counter;
+    }
+    if (sample > 1 && (*counter)++ % sample) {
+        STAT_ADD(section, sampled);
+        return 0;
+    }
+    return 1;
+}
+
+static void stasis_kafka_cb(void *data, struct stasis_subscription *sub, struct stasis_message *message) {
+    struct kafka_stasis_section *section = data;
+    struct stasis_message_type *type = stasis_message_type(message);
+
+    if (type == stasis_subscription_change_type()) {
+        return;
+    }
+    STAT_ADD(section, received);
+    if (!section_accepts(section, type)) {
+        return;
+    }
+    ast_mutex_lock(&ring_lock);
+    if (ring_count == queue_size) {
+        ast_mutex_unlock(&ring_lock);
+        STAT_ADD(section, dropped);
+        return;
+    }
+    ring[(ring_head + ring_count) % queue_size].message = ao2_bump(message);
+    ring[(ring_head + ring_count) % queue_size].section = section;
+    /* The serializer wakes up on its own unless a batch is ready */
+    if (++ring_count == batch_size) {
+        ast_cond_signal(&ring_cond);
+    }
+    ast_mutex_unlock(&ring_lock);
+}
+
+/*! \brief AMI event as a JSON object of its headers */
+static struct ast_json *ami_to_json(struct stasis_message *message) {
+    struct ast_manager_event_blob *blob;
+    struct ast_json *event;
+    char *fields, *line, *value;
+
+    blob = stasis_message_to_ami(message);
+    if (!blob) {
+        return NULL;
+    }
+    event = ast_json_object_create();
+    if (!event) {
+        ao2_ref(blob, -1);
+        return NULL;
+    }
+    ast_json_object_set(event, "Event", ast_json_string_create(blob->manager_event));
+    fields = ast_strdupa(S_OR(blob->extra_fields, ""));
+    while ((line = strsep(&fields, "\r\n"))) {
+        value = strchr(line, ':');
+        if (!value) {
+            continue;
+        }
+        *value++ = '\0';
+        ast_json_object_set(event, line, ast_json_string_create(ast_skip_blanks(value)));
+    }
+    ao2_ref(blob, -1);
+    return event;
+}
+
+/*!
+ * \brief The event of a message
+ *
+ * Snapshots and device states have no representation of their own, ARI builds
+ * its events from them elsewhere, so they are written the way ARI writes them.
+ */
+static struct ast_json *message_to_json(struct stasis_message *message) {
+    struct stasis_message_type *type = stasis_message_type(message);
+    struct ast_device_state_message *device_state;
+    struct ast_json *event;
+
+    if (type == ast_channel_snapshot_type()) {
+        return ast_json_pack("{s: o}", "channel", ast_channel_snapshot_to_json(stasis_message_data(message), NULL));
+    }
+    if (type == ast_bridge_snapshot_type()) {
+        return ast_json_pack("{s: o}", "bridge", ast_bridge_snapshot_to_json(stasis_message_data(message), NULL));
+    }
+    if (type == ast_device_state_message_type()) {
+        device_state = stasis_message_data(message);
+        /* Each server publishes its state besides the aggregate one, which is all that is needed */
+        if (device_state->eid) {
+            return NULL;
+        }
+        return ast_json_pack("{s: {s: s, s: s}}", "device_state", "name", device_state->device,
+                             "state", ast_devstate_str(device_state->state));
+    }
+    event = stasis_message_to_json(message, NULL);
+    return event ? event : ami_to_json(message);
+}
+
+/*! \brief Member of an event by a dotted path, e.g. channel.name */
+static struct ast_json *event_member(struct ast_json *event, const char *path) {
+    char *copy = ast_strdupa(path);
+    char *name;
+
+    while (event && (name = strsep(&copy, "."))) {
+        event = ast_json_typeof(event) == AST_JSON_OBJECT ? ast_json_object_get(event, name) : NULL;
+    }
+    return event;
+}
+
+/*!
+ * \brief Text of a string or integer member, NULL for other types and empty strings
+ *
+ * Without \a buf only strings are taken.
+ */
+static const char *member_text(struct ast_json *member, char *buf, size_t size) {
+    const char *value;
+
+    if (!member) {
+        return NULL;
+    }
+    switch (ast_json_typeof(member)) {
+        case AST_JSON_STRING:
+            value = ast_json_string_get(member);
+            return ast_strlen_zero(value) ? NULL : value;
+        case AST_JSON_INTEGER:
+            if (!buf) {
+                return NULL;
+            }
+            snprintf(buf, size, "%jd", ast_json_integer_get(member));
+            return buf;
+        default:
+            return NULL;
+    }
+}
+
+/*! \brief Channel name of an ARI (channel.name) or AMI (Channel) event */
+static const char *event_channel(struct ast_json *event) {
+    const char *name = member_text(event_member(event, "channel.name"), NULL, 0);
+
+    return name ? name : member_text(ast_json_object_get(event, "Channel"), NULL, 0);
+}
+
+static void produce_message(struct stasis_message *message, struct kafka_stasis_section *section) {
+    struct ast_json *event;
+    struct ast_str *buf;
+    char *dumped;
+    const char *channel, *key = NULL;
+    char key_buf[KEY_LEN];
+
+    event = message_to_json(message);
+    if (!event) {
+        STAT_ADD(section, skipped);
+        return;
+    }
+    if (section->has_channel) {
+        channel = event_channel(event);
+        if (!channel || regexec(&section->channel, channel, 0, NULL, 0)) {
+            ast_json_unref(event);
+            STAT_ADD(section, skipped);
+            return;
+        }
+    }
+    if (section->key) {
+        key = member_text(event_member(event, section->key), key_buf, sizeof(key_buf));
+    }
+    /* Counted in the throttled and sampled metrics of the topic */
+    if (ast_kafka_topic_admit(section->topic, key, AST_KAFKA_PRIORITY_NORMAL)) {
+        ast_json_unref(event);
+        return;
+    }
+    dumped = ast_json_dump_string(event);
+    if (!dumped || !(buf = ast_str_thread_get(&event_buf, EVENT_BUFFER_INIT_SIZE))) {
+        ast_json_free(dumped);
+        ast_json_unref(event);
+        return;
+    }
+    ast_str_set(&buf, 0, "{");
+    ast_kafka_json_add_time(&buf, "timestamp", timefmt, stasis_message_timestamp(message));
+    ast_kafka_json_add_string(&buf, "stasis_topic", section->source->name);
+    ast_kafka_json_add_string(&buf, "type", stasis_message_type_name(stasis_message_type(message)));
+    ast_str_append(&buf, 0, ",\"event\":%s}", dumped);
+    /* The key points into the event */
+    ast_kafka_topic_produce(section->topic, key, key ? strlen(key) : 0, ast_str_buffer(buf), ast_str_strlen(buf),
+                            AST_KAFKA_F_COPY);
+    ast_json_free(dumped);
+    ast_json_unref(event);
+    STAT_ADD(section, produced);
+}
+
+/*!
+ * \brief Serializer thread
+ *
+ * Takes up to batch_size messages out of the ring at once, so the ring lock
+ * is taken once per batch and never held while serializing.
+ */
+static void *do_serialize(void *data) {
+    struct ring_entry *batch;
+    struct timeval tv;
+    struct timespec ts;
+    unsigned int count, i;
+
+    batch = ast_calloc(batch_size, sizeof(*batch));
+    if (!batch) {
+        return NULL;
+    }
+    ast_mutex_lock(&ring_lock);
+    while (serializer_running || ring_count) {
+        if (ring_count < batch_size && serializer_running) {
+            tv = ast_tvadd(ast_tvnow(), ast_samp2tv(BATCH_INTERVAL_MS, 1000));
+            ts.tv_sec = tv.tv_sec;
+            ts.tv_nsec = tv.tv_usec * 1000;
+            ast_cond_timedwait(&ring_cond, &ring_lock, &ts);
+        }
+        for (count = 0; count < batch_size && ring_count; count++, ring_count--) {
+            batch[count] = ring[ring_head];
+            ring_head = (ring_head + 1) % queue_size;
+        }
+        ast_mutex_unlock(&ring_lock);
+
+        for (i = 0; i < count; i++) {
+            produce_message(batch[i].message, batch[i].section);
+            ao2_ref(batch[i].message, -1);
+        }
+        ast_mutex_lock(&ring_lock);
+    }
+    ast_mutex_unlock(&ring_lock);
+    ast_free(batch);
+    return NULL;
+}
+
+static struct type_rule *section_rule(struct kafka_stasis_section *section, const char *type_name) {
+    struct type_rule *rule;
+
+    AST_LIST_TRAVERSE(&section->rules, rule, list) {
+        if (!strcasecmp(rule->name, type_name)) {
+            return rule;
+        }
+    }
+    rule = ast_calloc(1, sizeof(*rule) + strlen(type_name) + 1);
+    if (!rule) {
+        return NULL;
+    }
+    strcpy(rule->name, type_name); /* Safe */
+    AST_LIST_INSERT_TAIL(&section->rules, rule, list);
+    return rule;
+}
+
+/*! \brief Add the comma separated message types of types or exclude_types */
+static int parse_types(struct kafka_stasis_section *section, const char *value, int exclude) {
+    char *list = ast_strdupa(value);
+    char *type_name;
+    struct type_rule *rule;
+
+    while ((type_name = ast_strsep(&list, ',', AST_STRSEP_STRIP))) {
+        if (ast_strlen_zero(type_name)) {
+            continue;
+        }
+        if (!(rule = section_rule(section, type_name))) {
+            return -1;
+        }
+        if (exclude) {
+            rule->excluded = 1;
+        } else {
+            rule->listed = 1;
+            section->whitelist = 1;
+        }
+    }
+    return 0;
+}
+
+/*! \brief sample=<N> for the whole section or sample=<type>:<N> for one type */
+static int parse_sample(struct kafka_stasis_section *section, const char *value) {
+    char *type_name = ast_strdupa(value);
+    char *rate = strrchr(type_name, ':');
+    unsigned int *sample = &section->sample;
+    struct type_rule *rule;
+
+    if (rate) {
+        *rate++ = '\0';
+        if (!(rule = section_rule(section, ast_strip(type_name)))) {
+            return -1;
+        }
+        sample = &rule->sample;
+    } else {
+        rate = type_name;
+    }
+    if (sscanf(rate, "%30u", sample) != 1 || !*sample) {
+        ast_log(LOG_ERROR, "Invalid sample '%s' for [%s], expected [<type>:]<N> to produce 1 of N messages\n",
+                value, section->source->name);
+        return -1;
+    }
+    return 0;
+}
+
+static void section_destroy(struct kafka_stasis_section *section) {
+    struct type_rule *rule;
+
+    while ((rule = AST_LIST_REMOVE_HEAD(&section->rules, list))) {
+        ast_free(rule);
+    }
+    if (section->has_channel) {
+        regfree(&section->channel);
+    }
+    ao2_cleanup(section->topic);
+    ast_free(section->topic_name);
+    ast_free(section->key);
+    ast_free(section);
+}
+
+static struct kafka_stasis_section *section_alloc(const struct stasis_source *source, struct ast_variable *v) {
+    struct kafka_stasis_section *section;
+    char errbuf[256];
+    int res = 0, err;
+
+    section = ast_calloc(1, sizeof(*section));
+    if (!section) {
+        return NULL;
+    }
+    section->source = source;
+    for (; v && !res; v = v->next) {
+        if (!strcasecmp(v->name, "types")) {
+            res = parse_types(section, v->value, 0);
+        } else if (!strcasecmp(v->name, "exclude_types")) {
+            res = parse_types(section, v->value, 1);
+        } else if (!strcasecmp(v->name, "sample")) {
+            res = parse_sample(section, v->value);
+        } else if (!strcasecmp(v->name, "channel")) {
+            if (section->has_channel) {
+                regfree(&section->channel);
+                section->has_channel = 0;
+            }
+            err = regcomp(&section->channel, v->value, REG_EXTENDED | REG_NOSUB);
+            if (err) {
+                regerror(err, &section->channel, errbuf, sizeof(errbuf));
+                ast_log(LOG_ERROR, "Invalid channel pattern '%s' for [%s]: %s\n", v->value, source->name, errbuf);
+                res = -1;
+            } else {
+                section->has_channel = 1;
+            }
+        } else if (!strcasecmp(v->name, "topic")) {
+            ast_free(section->topic_name);
+            section->topic_name = ast_strdup(v->value);
+        } else if (!strcasecmp(v->name, "key")) {
+            ast_free(section->key);
+            section->key = ast_strlen_zero(v->value) || !strcasecmp(v->value, "none") ? NULL : ast_strdup(v->value);
+        } else {
+            ast_log(LOG_NOTICE, "Unknown option '%s' specified for [%s] of %s.\n", v->name, source->name,
+                    DESCRIPTION);
+        }
+    }
+    if (res) {
+        section_destroy(section);
+        return NULL;
+    }
+    return section;
+}
+
+static const struct stasis_source *find_source(const char *source_name) {
+    size_t i;
+
+    for (i = 0; i < ARRAY_LEN(sources); i++) {
+        if (!strcasecmp(sources[i].name, source_name)) {
+            return &sources[i];
+        }
+    }
+    return NULL;
+}
+
+static void free_sections(void) {
+    struct kafka_stasis_section *section;
+
+    while ((section = AST_LIST_REMOVE_HEAD(&sections, list))) {
+        section_destroy(section);
+    }
+}
+
+/*! \brief Parse a positive number of the [general] section */
+static int general_number(const struct ast_variable *v, unsigned int *result) {
+    if (sscanf(v->value, "%30u", result) != 1 || !*result) {
+        ast_log(LOG_ERROR, "Invalid value '%s' of option '%s' for %s\n", v->value, v->name, DESCRIPTION);
+        return -1;
+    }
+    return 0;
+}
+
+static int load_config(void) {
+    const char *cat = NULL;
+    struct ast_config *cfg;
+    struct ast_flags config_flags = {0};
+    struct ast_variable *v;
+    const struct stasis_source *source;
+    struct kafka_stasis_section *section;
+    int res = 0;
+
+    cfg = ast_config_load(conf_file, config_flags);
+
+    if (cfg == CONFIG_STATUS_FILEINVALID) {
+        ast_log(LOG_ERROR, "Config file '%s' could not be parsed\n", conf_file);
+        return -1;
+    } else if (!cfg) {
+        ast_log(LOG_WARNING, "Failed to load configuration file '%s'\n", conf_file);
+        return -1;
+    }
+
+    enabled = 0;
+    kafka_topic = ast_strdup(DEFAULT_KAFKA_TOPIC);
+    cluster_name = NULL;
+    dateformat = ast_strdup(AST_KAFKA_DEFAULT_DATEFORMAT);
+    zone = NULL;
+    queue_size = DEFAULT_QUEUE_SIZE;
+    batch_size = DEFAULT_BATCH_SIZE;
+
+    while (!res && (cat = ast_category_browse(cfg, cat))) {
+        if (!strcasecmp(cat, "general")) {
+            for (v = ast_variable_browse(cfg, cat); v && !res; v = v->next) {
+                if (!strcasecmp(v->name, "enabled")) {
+                    enabled = ast_true(v->value);
+                } else if (!strcasecmp(v->name, "topic")) {
+                    ast_free(kafka_topic);
+                    kafka_topic = ast_strdup(v->value);
+                } else if (!strcasecmp(v->name, "cluster")) {
+                    ast_free(cluster_name);
+                    cluster_name = ast_strdup(v->value);
+                } else if (!strcasecmp(v->name, "dateformat")) {
+                    ast_free(dateformat);
+                    dateformat = ast_strdup(v->value);
+                } else if (!strcasecmp(v->name, "timezone")) {
+                    ast_free(zone);
+                    zone = ast_strdup(v->value);
+                } else if (!strcasecmp(v->name, "queue_size")) {
+                    res = general_number(v, &queue_size);
+                } else if (!strcasecmp(v->name, "batch_size")) {
+                    res = general_number(v, &batch_size);
+                } else {
+                    ast_log(LOG_NOTICE, "Unknown option '%s' specified for %s.\n", v->name, DESCRIPTION);
+                }
+            }
+            continue;
+        }
+        source = find_source(cat);
+        if (!source) {
+            ast_log(LOG_WARNING, "Unknown Stasis topic [%s] in %s\n", cat, conf_file);
+            continue;
+        }
+        section = section_alloc(source, ast_variable_browse(cfg, cat));
+        if (!section) {
+            res = -1;
+            break;
+        }
+        AST_LIST_INSERT_TAIL(&sections, section, list);
+    }
+    ast_config_destroy(cfg);
+
+    if (!res && batch_size > queue_size) {
+        ast_log(LOG_ERROR, "batch_size must not be greater than queue_size for %s\n", DESCRIPTION);
+        res = -1;
+    }
+    if (!res && !(timefmt = ast_kafka_timefmt_create(dateformat, zone, 0))) {
+        res = -1;
+    }
+    if (res) {
+        free_sections();
+        return -1;
+    }
+
+    if (enabled) {
+        ast_log(LOG_NOTICE, "Using kafka topic %s\n", kafka_topic);
+    } else {
+        ast_log(LOG_NOTICE, "%s is not enabled\n", DESCRIPTION);
+    }
+    return 0;
+}
+
+/*! \brief Resolve the topic handles of the sections once */
+static int resolve_topics(void) {
+    struct kafka_stasis_section *section;
+    const char *topic_name;
+
+    AST_LIST_TRAVERSE(&sections, section, list) {
+        topic_name = S_OR(section->topic_name, kafka_topic);
+        if (!(section->topic = ast_kafka_cluster_topic_get(cluster_name, topic_name))) {
+            ast_log(LOG_ERROR, "Unable to register kafka topic %s\n", topic_name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void unsubscribe_sections(void) {
+    struct kafka_stasis_section *section;
+
+    AST_LIST_TRAVERSE(&sections, section, list) {
+        /* No callback runs after this */
+        section->sub = stasis_unsubscribe_and_join(section->sub);
+    }
+}
+
+static int subscribe_sections(void) {
+    struct kafka_stasis_section *section;
+
+    AST_LIST_TRAVERSE(&sections, section, list) {
+        section->sub = stasis_subscribe(section->source->topic(), stasis_kafka_cb, section);
+        if (!section->sub) {
+            ast_log(LOG_ERROR, "Unable to subscribe to Stasis topic %s\n", section->source->name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void stop_serializer(void) {
+    if (serializer_thread == AST_PTHREADT_NULL) {
+        return;
+    }
+    /* What is left in the ring is produced before the thread exits */
+    ast_mutex_lock(&ring_lock);
+    serializer_running = 0;
+    ast_cond_signal(&ring_cond);
+    ast_mutex_unlock(&ring_lock);
+    pthread_join(serializer_thread, NULL);
+    serializer_thread = AST_PTHREADT_NULL;
+}
+
+static int start_serializer(void) {
+    ring = ast_calloc(queue_size, sizeof(*ring));
+    if (!ring) {
+        return -1;
+    }
+    ring_head = 0;
+    ring_count = 0;
+    serializer_running = 1;
+    if (ast_pthread_create_background(&serializer_thread, NULL, do_serialize, NULL)) {
+        ast_log(LOG_ERROR, "Unable to start the serializer thread of %s\n", DESCRIPTION);
+        serializer_thread = AST_PTHREADT_NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static char *handle_cli_kafka_stasis(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
+    struct kafka_stasis_section *section;
+    unsigned int queued;
+
+    switch (cmd) {
+        case CLI_INIT:
+            e->command = "kafka stasis";
+            e->usage =
+                    "Usage: kafka stasis\n"
+                    "       Displays how many Stasis messages of each topic were produced to Kafka\n"
+                    "       and how many were filtered, sampled out or dropped.\n";
+            return NULL;
+        case CLI_GENERATE:
+            return NULL;
+    }
+
+    if (a->argc > 2) {
+        return CLI_SHOWUSAGE;
+    }
+    if (!enabled) {
+        ast_cli(a->fd, "%s is not enabled\n", DESCRIPTION);
+        return CLI_SUCCESS;
+    }
+    ast_mutex_lock(&ring_lock);
+    queued = ring_count;
+    ast_mutex_unlock(&ring_lock);
+    ast_cli(a->fd, "Queued: %u of %u\n", queued, queue_size);
+    ast_cli(a->fd, "%-10s %-24s %12s %12s %12s %12s %12s %12s\n", "Stasis", "Kafka topic", "Received", "Filtered",
+            "Sampled", "Dropped", "Skipped", "Produced");
+    AST_LIST_TRAVERSE(&sections, section, list) {
+        ast_cli(a->fd, "%-10s %-24s %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %12" PRIu64 "\n",
+                section->source->name, ast_kafka_topic_name(section->topic), STAT_GET(section, received),
+                STAT_GET(section, filtered), STAT_GET(section, sampled), STAT_GET(section, dropped),
+                STAT_GET(section, skipped), STAT_GET(section, produced));
+    }
+    return CLI_SUCCESS;
+}
+
+static struct ast_cli_entry cli_stasis = AST_CLI_DEFINE(handle_cli_kafka_stasis, "Display the Kafka Stasis bridge stats");
+
+static void cleanup(void) {
+    ast_free(ring);
+    ring = NULL;
+    free_sections();
+    ast_free(kafka_topic);
+    kafka_topic = NULL;
+    ast_free(cluster_name);
+    cluster_name = NULL;
+    ast_free(dateformat);
+    dateformat = NULL;
+    ast_free(zone);
+    zone = NULL;
+    ast_kafka_timefmt_destroy(timefmt);
+    timefmt = NULL;
+}
+
+static int load_module(void) {
+    if (load_config()) {
+        ast_log(LOG_WARNING, "%s is not activated.\n", DESCRIPTION);
+        cleanup();
+        return AST_MODULE_LOAD_DECLINE;
+    }
+    ast_cond_init(&ring_cond, NULL);
+    if (enabled && (resolve_topics() || start_serializer() || subscribe_sections())) {
+        unsubscribe_sections();
+        stop_serializer();
+        ast_cond_destroy(&ring_cond);
+        cleanup();
+        return AST_MODULE_LOAD_DECLINE;
+    }
+    ast_cli_register(&cli_stasis);
+    return AST_MODULE_LOAD_SUCCESS;
+}
+
+static int unload_module(void) {
+    ast_cli_unregister(&cli_stasis);
+    unsubscribe_sections();
+    stop_serializer();
+    ast_cond_destroy(&ring_cond);
+    cleanup();
+    return 0;
+}
+
+
+AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_LOAD_ORDER, DESCRIPTION,
+    .support_level = AST_MODULE_SUPPORT_EXTENDED,
+    .load = load_module,
+    .unload = unload_module,
+    .load_pri = AST_MODPRI_DEFAULT,
+    .requires = "res_kafka",
+);